@@ -0,0 +1,530 @@
+/*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*      http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#include "channel.h"
+#include "headers.h"
+#include "vassert.h"
+#include "vsys.h"
+#include "vlog.h"
+#include "ecRdt.h"
+#include "tunnel.h"
+#include "transmitter.h"
+
+extern struct rdt_enc_ops rdt_enc_ops;
+
+typedef struct channel_mngr{
+    struct vlock lock;
+    struct vlist channel_list;
+} channel_mngr_t;
+
+static channel_mngr_t channel_manager = {
+    .lock = VLOCK_INITIALIZER,
+    .channel_list = {&channel_manager.channel_list, &channel_manager.channel_list}
+};
+
+static struct rdt_channel* find_channel(int32_t sessionId, int32_t channelId);
+static int scheduler(void* argv);
+static int32_t serve_tunnel(struct rdt_channel* pchannel, struct rdt_tunnel* ptunnel, uint64_t* wake_ts);
+static void write_msg(struct rdt_channel* pchannel, int32_t bundle, const void* buf, int32_t len);
+static void flush_bundle(struct rdt_channel* pchannel);
+static void update_tunnels(struct rdt_channel* pchannel);
+static int32_t flush_acks(struct rdt_channel* pchannel);
+static int ack_timeout_handler(void* argv);
+
+/*
+ * Take a reference on the channel, creating it on first use.
+ */
+struct rdt_channel* get_channel(int32_t sessionId, int32_t channelId)
+{
+    struct rdt_channel* pchannel = NULL;
+
+    vlock_enter(&channel_manager.lock);
+    pchannel = find_channel(sessionId, channelId);
+    if(pchannel == NULL){
+        pchannel = (rdt_channel_t*)malloc(sizeof(rdt_channel_t));
+        if(pchannel == NULL){
+            vlock_leave(&channel_manager.lock);
+            return NULL;
+        }
+        memset(pchannel, 0, sizeof(rdt_channel_t));
+        vlist_init(&pchannel->list);
+        pchannel->sessionId = sessionId;
+        pchannel->channelId = channelId;
+        vbucket_init(&pchannel->bucket, 0, 0);
+        vlock_init(&pchannel->lock);
+        vcond_init(&pchannel->cond);
+        vlock_init(&pchannel->bundle_lock);
+        pchannel->bundle_max = RDT_BUNDLE_MAX_LEN;
+        vlock_init(&pchannel->ack_lock);
+        vtimer_init(&pchannel->ack_timer, &ack_timeout_handler, (void*)pchannel, 1);
+        vlist_init(&pchannel->tunnel_list);
+        vthread_init(&pchannel->scheduler, scheduler, pchannel);
+        pchannel->scheduler_run = 1;
+        vthread_start(&pchannel->scheduler);
+        vlist_add_tail(&channel_manager.channel_list, &pchannel->list);
+    }
+    pchannel->refs++;
+    vlock_leave(&channel_manager.lock);
+
+    return pchannel;
+}
+
+/*
+ * Drop a reference. A channel with a configured limit is kept so that the
+ * limit still applies to tunnels opened later.
+ */
+void put_channel(struct rdt_channel* pchannel)
+{
+    int ret_code = 0;
+    vassert(pchannel);
+
+    vlock_enter(&channel_manager.lock);
+    if((--pchannel->refs > 0) || (pchannel->bucket.rate != 0)){
+        vlock_leave(&channel_manager.lock);
+        return;
+    }
+    vlist_del(&pchannel->list);
+    vlock_leave(&channel_manager.lock);
+
+    vlock_enter(&pchannel->lock);
+    pchannel->scheduler_run = 0;
+    vcond_signal(&pchannel->cond);
+    vlock_leave(&pchannel->lock);
+    vthread_join(&pchannel->scheduler, &ret_code);
+
+    vlock_deinit(&pchannel->lock);
+    vcond_deinit(&pchannel->cond);
+    vlock_deinit(&pchannel->bundle_lock);
+    vtimer_deinit(&pchannel->ack_timer);
+    vlock_deinit(&pchannel->ack_lock);
+    vbucket_deinit(&pchannel->bucket);
+    free(pchannel);
+}
+
+/*
+ * Cap the total send rate (bytes/s) of all tunnels on a channel, 0 to
+ * remove the cap.
+ */
+int32_t channel_set_limit(int32_t sessionId, int32_t channelId, uint32_t rate, uint32_t burst)
+{
+    struct rdt_channel* pchannel = NULL;
+
+    pchannel = get_channel(sessionId, channelId);
+    retE((!pchannel), ECRDT_E_OOM);
+
+    vbucket_set(&pchannel->bucket, rate, burst);
+    put_channel(pchannel);
+
+    return 0;
+}
+
+/*
+ * Hand the data pkts of a tunnel over to the channel scheduler.
+ */
+void channel_add_tunnel(struct rdt_channel* pchannel, struct rdt_tunnel* ptunnel)
+{
+    vassert(pchannel);
+    vassert(ptunnel);
+
+    vlock_enter(&pchannel->lock);
+    ptunnel->deficit = 0;
+    vlist_add_tail(&pchannel->tunnel_list, &ptunnel->sched_list);
+    pchannel->ntunnels++;
+    pchannel->pending = 1;
+    vcond_signal(&pchannel->cond);
+    vlock_leave(&pchannel->lock);
+}
+
+/*
+ * The scheduler does not touch the tunnel any more once this returns.
+ */
+void channel_del_tunnel(struct rdt_channel* pchannel, struct rdt_tunnel* ptunnel)
+{
+    vassert(pchannel);
+    vassert(ptunnel);
+
+    vlock_enter(&pchannel->lock);
+    vlist_del(&ptunnel->sched_list);
+    pchannel->ntunnels--;
+    update_tunnels(pchannel);
+    vlock_leave(&pchannel->lock);
+}
+
+/*
+ * Path mtu or caps of a tunnel changed. Bundles share the path of all
+ * tunnels, so they are sized for the smallest pmtu among those bundling.
+ * Aggregated acks wait for as many tunnels as agreed on them.
+ */
+void channel_update_tunnel(struct rdt_channel* pchannel)
+{
+    vassert(pchannel);
+
+    vlock_enter(&pchannel->lock);
+    update_tunnels(pchannel);
+    vlock_leave(&pchannel->lock);
+}
+
+/*
+ * Called under lock. A bundle started larger than the new size goes out
+ * as it is.
+ */
+void update_tunnels(struct rdt_channel* pchannel)
+{
+    struct rdt_tunnel* ptunnel = NULL;
+    struct vlist* node = NULL;
+    int32_t len = RDT_BUNDLE_MAX_LEN;
+    int32_t nagg = 0;
+
+    __vlist_for_each(node, &pchannel->tunnel_list) {
+        ptunnel = vlist_entry(node, struct rdt_tunnel, sched_list);
+        if((ptunnel->caps & RDT_CAP_BUNDLE) && ((int32_t)ptunnel->pmtu < len)){
+            len = (int32_t)ptunnel->pmtu;
+        }
+        nagg += !!(ptunnel->caps & RDT_CAP_ACK_AGG);
+    }
+
+    vlock_enter(&pchannel->ack_lock);
+    pchannel->ack_tunnels = nagg;
+    vlock_leave(&pchannel->ack_lock);
+
+    vlock_enter(&pchannel->bundle_lock);
+    pchannel->bundle_max = len;
+    if(pchannel->bundle_len > len){
+        flush_bundle(pchannel);
+    }
+    vlock_leave(&pchannel->bundle_lock);
+}
+
+/*
+ * Some tunnel of the channel may have pkts ready to send.
+ */
+void channel_kick(void* argv)
+{
+    struct rdt_channel* pchannel = (struct rdt_channel*)argv;
+    vassert(pchannel);
+
+    vlock_enter(&pchannel->lock);
+    pchannel->pending = 1;
+    vcond_signal(&pchannel->cond);
+    vlock_leave(&pchannel->lock);
+}
+
+/*
+ * Write a msg of a tunnel, from the scheduler. Msgs of tunnels that agreed
+ * on bundles are collected and go out together when the round ends.
+ */
+void channel_write(struct rdt_channel* pchannel, struct rdt_tunnel* ptunnel, const void* buf, int32_t len)
+{
+    vassert(pchannel);
+    vassert(ptunnel);
+    vassert(buf);
+
+    write_msg(pchannel, !!(ptunnel->caps & RDT_CAP_BUNDLE), buf, len);
+}
+
+/*
+ * Put msg in the bundle if peer takes bundles, else send it at once.
+ */
+void write_msg(struct rdt_channel* pchannel, int32_t bundle, const void* buf, int32_t len)
+{
+    int32_t n = 0;
+
+    if(!bundle){
+        session_write(pchannel->sessionId, pchannel->channelId, buf, len);
+        return;
+    }
+
+    vlock_enter(&pchannel->bundle_lock);
+    if(pchannel->bundle_len > 0){
+        n = rdt_bundle_add(pchannel->bundle + pchannel->bundle_len,
+                           pchannel->bundle_max - pchannel->bundle_len, buf, len);
+        if(n == 0){
+            flush_bundle(pchannel);
+        }
+    }
+    if(pchannel->bundle_len == 0){
+        pchannel->bundle_len = rdt_bundle_init(pchannel->bundle);
+        n = rdt_bundle_add(pchannel->bundle + pchannel->bundle_len,
+                           pchannel->bundle_max - pchannel->bundle_len, buf, len);
+        if(n == 0){
+            //Too big for any bundle, what was before it has gone out already
+            pchannel->bundle_len = 0;
+            session_write(pchannel->sessionId, pchannel->channelId, buf, len);
+        }
+    }
+    if(n > 0){
+        pchannel->bundle_len += n;
+        pchannel->bundle_msgs++;
+    }
+    vlock_leave(&pchannel->bundle_lock);
+}
+
+/*
+ * Same as channel_write, from outside the scheduler. Scheduler is woken up
+ * to send the msg with whatever else is ready.
+ */
+void channel_post(struct rdt_channel* pchannel, struct rdt_tunnel* ptunnel, const void* buf, int32_t len)
+{
+    vassert(pchannel);
+    vassert(ptunnel);
+
+    channel_write(pchannel, ptunnel, buf, len);
+    if(ptunnel->caps & RDT_CAP_BUNDLE){
+        channel_kick(pchannel);
+    }
+}
+
+/*
+ * Send msgs collected so far, a lone one as it is. Called under bundle lock.
+ */
+void flush_bundle(struct rdt_channel* pchannel)
+{
+    int32_t off = RDT_BUNDLE_HDR_LEN;
+    int32_t len = 0;
+
+    if(pchannel->bundle_msgs == 1){
+        len = rdt_bundle_next(pchannel->bundle, pchannel->bundle_len, &off);
+        session_write(pchannel->sessionId, pchannel->channelId, pchannel->bundle + off, len);
+    } else if(pchannel->bundle_msgs > 1){
+        session_write(pchannel->sessionId, pchannel->channelId, pchannel->bundle, pchannel->bundle_len);
+    }
+    pchannel->bundle_len  = 0;
+    pchannel->bundle_msgs = 0;
+}
+
+/*
+ * Queue ack of a tunnel that agreed on aggregated acks. Acks of all such
+ * tunnels go out in one msg when the first has waited RDT_ACK_AGG_US, or
+ * as soon as every tunnel has one in. One reporting a gap goes out at once.
+ */
+void channel_ack(struct rdt_channel* pchannel, struct rdt_tunnel* ptunnel, uint64_t seq_ack, uint64_t seq_recv, uint32_t windowsz)
+{
+    struct rdt_ack_multi_msg* msg = &pchannel->acks;
+    int32_t kick = 0;
+    int32_t i = 0;
+
+    vassert(pchannel);
+    vassert(ptunnel);
+
+    vlock_enter(&pchannel->ack_lock);
+    //A newer ack of the same tunnel takes the place of the older one
+    for(i = 0; i < msg->nacks; i++){
+        if(msg->acks[i].teid == (uint16_t)ptunnel->peer_teid){
+            break;
+        }
+    }
+    if(i == RDT_ACK_MULTI_MAX){
+        kick |= flush_acks(pchannel);
+        i = 0;
+    }
+    if(msg->nacks == 0){
+        pchannel->acks_bundle = 1;
+    }
+    if(i == msg->nacks){
+        msg->nacks++;
+    }
+    //Bundled only if all tunnels it covers agreed on bundles
+    pchannel->acks_bundle &= !!(ptunnel->caps & RDT_CAP_BUNDLE);
+    msg->acks[i].teid     = (uint16_t)ptunnel->peer_teid;
+    msg->acks[i].seq_ack  = (uint32_t)seq_ack;
+    msg->acks[i].seq_recv = rdt_trunc_recv(seq_recv, seq_ack);
+    msg->acks[i].windowsz = windowsz;
+
+    if((seq_recv >= seq_ack) || (msg->nacks >= pchannel->ack_tunnels)){
+        kick |= flush_acks(pchannel);
+    } else if(msg->nacks == 1){
+        vtimer_restart(&pchannel->ack_timer, 0, RDT_ACK_AGG_US);
+    }
+    vlock_leave(&pchannel->ack_lock);
+
+    if(kick){
+        channel_kick(pchannel);
+    }
+}
+
+/*
+ * Send acks queued so far, called under ack lock. Returns 1 if they were
+ * put in the bundle, for the scheduler to be kicked once lock is left.
+ */
+int32_t flush_acks(struct rdt_channel* pchannel)
+{
+    char buf[RDT_ACK_MULTI_HDR_LEN + RDT_ACK_MULTI_MAX * RDT_ACK_MULTI_ENTRY_LEN];
+    int32_t len = 0;
+
+    if(pchannel->acks.nacks == 0){
+        return 0;
+    }
+    len = rdt_enc_ops.ack_multi((struct rdt_common_msg*)&pchannel->acks, buf, sizeof(buf));
+    write_msg(pchannel, pchannel->acks_bundle, buf, len);
+    pchannel->acks.nacks = 0;
+    return pchannel->acks_bundle;
+}
+
+int ack_timeout_handler(void* argv)
+{
+    struct rdt_channel* pchannel = (struct rdt_channel*)argv;
+    int32_t kick = 0;
+    vassert(pchannel);
+
+    vlock_enter(&pchannel->ack_lock);
+    kick = flush_acks(pchannel);
+    vlock_leave(&pchannel->ack_lock);
+
+    if(kick){
+        channel_kick(pchannel);
+    }
+    return 0;
+}
+
+struct rdt_channel* find_channel(int32_t sessionId, int32_t channelId)
+{
+    struct rdt_channel* pchannel = NULL;
+    struct vlist* node = NULL;
+
+    __vlist_for_each(node, &channel_manager.channel_list) {
+        pchannel = vlist_entry(node, struct rdt_channel, list);
+        if(pchannel->sessionId == sessionId && pchannel->channelId == channelId){
+            return pchannel;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Deficit round robin over tunnels of the channel. Each round a tunnel
+ * may send its weight worth of quantum, so a bulk tunnel only delays an
+ * interactive one by one quantum per other tunnel.
+ */
+int scheduler(void* argv)
+{
+    struct rdt_channel* pchannel = (struct rdt_channel*)argv;
+    struct rdt_tunnel* ptunnel = NULL;
+    struct vlist* node = NULL;
+    uint64_t wake_ts = 0;
+    uint64_t now = 0;
+    int64_t delay = 0;
+    int32_t sent = 0;
+
+    vassert(pchannel);
+
+    vlock_enter(&pchannel->lock);
+    while(pchannel->scheduler_run){
+        pchannel->pending = 0;
+        wake_ts = 0;
+        sent = 0;
+
+        delay = vbucket_delay(&pchannel->bucket);
+        if(delay > 0){
+            wake_ts = vtime_us() + delay;
+        } else {
+            __vlist_for_each(node, &pchannel->tunnel_list) {
+                ptunnel = vlist_entry(node, struct rdt_tunnel, sched_list);
+                sent += serve_tunnel(pchannel, ptunnel, &wake_ts);
+            }
+        }
+        vlock_enter(&pchannel->bundle_lock);
+        flush_bundle(pchannel);
+        vlock_leave(&pchannel->bundle_lock);
+        if(sent > 0 || pchannel->pending){
+            continue;
+        }
+
+        //Nothing could go out, wait for pkts or until pacing allows.
+        now = vtime_us();
+        if(wake_ts == 0){
+            vcond_mtimedwait(&pchannel->cond, &pchannel->lock, -1);
+        } else if(wake_ts > now + RDT_SCHED_SLEEP_US){
+            vcond_mtimedwait(&pchannel->cond, &pchannel->lock, (int)((wake_ts - now) / 1000));
+        } else if(wake_ts > now){
+            vlock_leave(&pchannel->lock);
+            vsleep_until_us(wake_ts);
+            vlock_enter(&pchannel->lock);
+        }
+    }
+    vlock_leave(&pchannel->lock);
+
+    return 0;
+}
+
+/*
+ * Send pkts of one tunnel until its deficit is used up, its queue is
+ * empty or pacing/rate limits hold it back. Time it can go on is kept
+ * in @wake_ts when it is the earliest one.
+ */
+int32_t serve_tunnel(struct rdt_channel* pchannel, struct rdt_tunnel* ptunnel, uint64_t* wake_ts)
+{
+    uint32_t quantum = ptunnel->opts.weight * RDT_SCHED_QUANTUM;
+    uint64_t send_ts = 0;
+    int32_t sent = 0;
+    int32_t len = 0;
+
+    send_ts = tunnel_next_send_ts(ptunnel);
+#if !defined(HAVE_SO_TXTIME)
+    if(send_ts > vtime_us()){
+        if((*wake_ts == 0) || (send_ts < *wake_ts)){
+            *wake_ts = send_ts;
+        }
+        return 0;
+    }
+#endif
+
+    //Quantum covers a datagram of path mtu at least
+    if(ptunnel->pmtu > RDT_SCHED_QUANTUM){
+        quantum = ptunnel->opts.weight * ptunnel->pmtu;
+    }
+
+    //Unused credit of a tunnel held back by pacing carries over one round only
+    if(ptunnel->deficit > (int32_t)quantum){
+        ptunnel->deficit = quantum;
+    }
+    ptunnel->deficit += quantum;
+    if(ptunnel->deficit <= 0){
+        //Still paying off a pkt larger than quantum, go on next round
+        send_ts = vtime_us();
+        if((*wake_ts == 0) || (send_ts < *wake_ts)){
+            *wake_ts = send_ts;
+        }
+        return 0;
+    }
+
+    while(ptunnel->deficit > 0){
+        len = tunnel_send_pkt(ptunnel, send_ts);
+        if(len <= 0){
+            //Nothing more to send, no credit kept for later
+            ptunnel->deficit = 0;
+            break;
+        }
+        ptunnel->deficit -= len;
+        vbucket_take(&pchannel->bucket, len);
+        sent++;
+
+        send_ts = tunnel_next_send_ts(ptunnel);
+        if(vbucket_delay(&pchannel->bucket) > 0){
+            break;
+        }
+#if !defined(HAVE_SO_TXTIME)
+        if(send_ts > vtime_us()){
+            if((*wake_ts == 0) || (send_ts < *wake_ts)){
+                *wake_ts = send_ts;
+            }
+            break;
+        }
+#endif
+    }
+
+    if(sent > 0){
+        tunnel_send_done(ptunnel);
+    }
+    return sent;
+}
@@ -0,0 +1,73 @@
+/*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*      http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#ifndef __ECRDT_CHANNEL_H__
+#define __ECRDT_CHANNEL_H__
+
+#include "vlist.h"
+#include "vsys.h"
+#include "vbucket.h"
+#include "codec.h"
+
+#define RDT_SCHED_QUANTUM 1500          //Bytes a tunnel of weight 1 may send per round
+#define RDT_SCHED_SLEEP_US 2000         //Waits shorter than this are slept precisely
+#define RDT_BUNDLE_MAX_LEN 1400         //Most bytes of a datagram bundling msgs of tunnels, less if pmtu is
+#define RDT_ACK_AGG_US 1000             //Longest an ack waits for those of other tunnels
+
+struct rdt_tunnel;
+
+/*
+ * State shared by all tunnels on the same session channel. Data pkts of
+ * all of them go out from one deficit round robin scheduler.
+ */
+typedef struct rdt_channel {
+    struct vlist list;
+    int32_t sessionId;
+    int32_t channelId;
+    int32_t refs;
+    struct vbucket bucket;          //Aggregate send rate limit of the channel
+
+    struct vlock lock;              //Guards tunnel_list and scheduling
+    struct vcond cond;
+    struct vlist tunnel_list;       //Tunnels served by scheduler
+    int32_t ntunnels;
+    struct vthread scheduler;
+    int8_t scheduler_run;
+    int8_t pending;                 //Some tunnel got pkts ready since last round
+
+    struct vlock bundle_lock;       //Guards bundle, written from any thread
+    char bundle[RDT_BUNDLE_MAX_LEN];//Msgs waiting to go out together at end of round
+    int32_t bundle_len;             //0 if no bundle is started
+    int32_t bundle_max;             //Bundle stays within, smallest pmtu of tunnels that bundle
+    int32_t bundle_msgs;
+
+    struct vlock ack_lock;          //Guards acks, written from any thread
+    struct vtimer ack_timer;        //Sends acks once the first waited long enough
+    struct rdt_ack_multi_msg acks;  //Latest ack of each tunnel, going out together
+    int8_t acks_bundle;             //Acks may go in the bundle
+    int32_t ack_tunnels;            //Tunnels that agreed on aggregated acks
+} rdt_channel_t;
+
+struct rdt_channel* get_channel(int32_t sessionId, int32_t channelId);
+void put_channel(struct rdt_channel* pchannel);
+int32_t channel_set_limit(int32_t sessionId, int32_t channelId, uint32_t rate, uint32_t burst);
+void channel_add_tunnel(struct rdt_channel* pchannel, struct rdt_tunnel* ptunnel);
+void channel_del_tunnel(struct rdt_channel* pchannel, struct rdt_tunnel* ptunnel);
+void channel_kick(void* pchannel);
+void channel_update_tunnel(struct rdt_channel* pchannel);
+void channel_write(struct rdt_channel* pchannel, struct rdt_tunnel* ptunnel, const void* buf, int32_t len);
+void channel_post(struct rdt_channel* pchannel, struct rdt_tunnel* ptunnel, const void* buf, int32_t len);
+void channel_ack(struct rdt_channel* pchannel, struct rdt_tunnel* ptunnel, uint64_t seq_ack, uint64_t seq_recv, uint32_t windowsz);
+
+#endif
@@ -15,31 +15,480 @@
 #include <arpa/inet.h>
 #include "codec.h"
 #include "vassert.h"
+#include "vcrc.h"
+#include "vlz.h"
+#include "vaead.h"
+
+static struct vlz_dict* rdt_dict = NULL;
+static uint32_t rdt_dict_id = 0;
+
+/*
+ * Layout of compact data header by its first byte, so decoding reads
+ * fields at known offsets instead of testing bits one by one.
+ */
+struct rdt_compact_fmt {
+    uint8_t valid;
+    uint8_t flags_len;      //0 or 1
+    uint8_t seq_len;        //1-4
+    uint8_t ack_len;        //0 or 8
+};
+
+#define RDT_CFMT(b) { \
+    (((b) & (RDT_DATA_CF_RSVD | RDT_DATA_CF_COMPACT | 0x01)) == RDT_DATA_CF_COMPACT), \
+    !!((b) & RDT_DATA_CF_FLAGS), \
+    (((b) >> RDT_DATA_CF_SEQ_SHIFT) & 0x03) + 1, \
+    ((b) & RDT_DATA_CF_ACK) ? 2 * sizeof(uint32_t) : 0 }
+#define RDT_CFMT4(b)  RDT_CFMT(b),  RDT_CFMT((b) + 1),   RDT_CFMT((b) + 2),   RDT_CFMT((b) + 3)
+#define RDT_CFMT16(b) RDT_CFMT4(b), RDT_CFMT4((b) + 4),  RDT_CFMT4((b) + 8),  RDT_CFMT4((b) + 12)
+#define RDT_CFMT64(b) RDT_CFMT16(b), RDT_CFMT16((b) + 16), RDT_CFMT16((b) + 32), RDT_CFMT16((b) + 48)
+
+static const struct rdt_compact_fmt rdt_compact_fmts[256] = {
+    RDT_CFMT64(0), RDT_CFMT64(64), RDT_CFMT64(128), RDT_CFMT64(192)
+};
+
+//Bytes of teid varint by top two bits of its first byte
+static const uint8_t rdt_varint_lens[4] = { 1, 1, 2, 3 };
+
+/*
+ * Data msg header as parsed from either format.
+ */
+struct rdt_data_hdr {
+    uint8_t  flags;
+    uint8_t  seq_len;       //Bytes of seq on wire, 4 for the full header
+    uint16_t teid;
+    uint32_t seq;           //As on wire, truncated if seq_len < 4
+    uint8_t  has_ack;
+    uint32_t seq_ack;
+    uint32_t windowsz;
+    uint16_t stream_id;
+    uint32_t stream_off;
+    int      len;           //Bytes before payload, pkt number included
+};
+
+static
+int _rdt_get_teid(const uint8_t* p, int avail, uint16_t* teid)
+{
+    int tl = rdt_varint_lens[p[0] >> 6];
+
+    if (avail < tl) {
+        return -1;
+    }
+    switch (tl) {
+    case 1:  *teid = p[0]; break;
+    case 2:  *teid = ((p[0] & 0x3f) << 8) | p[1]; break;
+    default: *teid = (p[1] << 8) | p[2]; break;
+    }
+    return tl;
+}
+
+static
+int _rdt_parse_data_hdr(const char* buf, int length, struct rdt_data_hdr* hdr)
+{
+    const struct rdt_compact_fmt* fmt = NULL;
+    const uint8_t* p = (const uint8_t*)buf;
+    int off = 0;
+    int tl = 0;
+    int i = 0;
+
+    if (length < 1) {
+        return -1;
+    }
+    if (p[0] == 0) {
+        if (length < RDT_DATA_HDR_LEN) {
+            return -1;
+        }
+        hdr->flags   = p[1];
+        hdr->teid    = ntohs(*(uint16_t*)(p + 2));
+        hdr->seq     = ntohl(*(uint32_t*)(p + 4));
+        hdr->seq_len = sizeof(uint32_t);
+        hdr->has_ack = 0;
+        off = RDT_DATA_HDR_LEN;
+    } else {
+        fmt = &rdt_compact_fmts[p[0]];
+        if (!fmt->valid || (length < 2 + fmt->flags_len + fmt->seq_len + fmt->ack_len)) {
+            return -1;
+        }
+        hdr->flags = p[1] & (uint8_t)-fmt->flags_len;
+        off = 1 + fmt->flags_len;
+        tl  = _rdt_get_teid(p + off, length - off - fmt->seq_len - fmt->ack_len, &hdr->teid);
+        if (tl < 0) {
+            return -1;
+        }
+        off += tl;
+        hdr->seq = 0;
+        for (i = 0; i < fmt->seq_len; i++) {
+            hdr->seq = (hdr->seq << 8) | p[off + i];
+        }
+        hdr->seq_len = fmt->seq_len;
+        off += fmt->seq_len;
+        hdr->has_ack = !!fmt->ack_len;
+        if (fmt->ack_len) {
+            hdr->seq_ack  = ntohl(*(uint32_t*)(p + off));
+            hdr->windowsz = ntohl(*(uint32_t*)(p + off + sizeof(uint32_t)));
+            off += fmt->ack_len;
+        }
+    }
+
+    hdr->stream_id  = 0;
+    hdr->stream_off = 0;
+    if (hdr->flags & RDT_DATA_F_STREAM) {
+        if (length < off + RDT_DATA_STREAM_HDR_LEN - RDT_DATA_HDR_LEN) {
+            return -1;
+        }
+        hdr->stream_id  = ntohs(*(uint16_t*)(p + off));
+        hdr->stream_off = ntohl(*(uint32_t*)(p + off + 2 * sizeof(uint16_t)));
+        off += RDT_DATA_STREAM_HDR_LEN - RDT_DATA_HDR_LEN;
+    }
+    off += (hdr->flags & RDT_DATA_F_SEAL) ? RDT_DATA_PN_LEN : 0;
+    if (length < off) {
+        return -1;
+    }
+    hdr->len = off;
+    return off;
+}
+
+static
+int _rdt_put_teid(uint8_t* p, uint16_t teid)
+{
+    if (teid < 0x80) {
+        p[0] = (uint8_t)teid;
+        return 1;
+    }
+    if (teid < 0x4000) {
+        p[0] = 0x80 | (uint8_t)(teid >> 8);
+        p[1] = (uint8_t)teid;
+        return 2;
+    }
+    p[0] = 0xc0;
+    p[1] = (uint8_t)(teid >> 8);
+    p[2] = (uint8_t)teid;
+    return 3;
+}
+
+/*
+ * Rewrite full header of an encoded data msg as a compact one ending at the
+ * same place. Returns bytes it shrank by, 0 if it would not be shorter. With
+ * @ack it grows instead, into RDT_DATA_ACK_ROOM bytes caller left before buf.
+ */
+static
+int _rdt_compact_data_hdr(char* buf, int length, uint32_t span, const struct rdt_data_ack_msg* ack)
+{
+    uint8_t pre[RDT_DATA_HDR_LEN + RDT_DATA_ACK_ROOM];
+    uint8_t flags = 0;
+    uint16_t teid = 0;
+    uint32_t seq  = 0;
+    int seq_len = 0;
+    int n = 0;
+    int i = 0;
+
+    flags = *(uint8_t*)(buf + sizeof(uint8_t));
+    teid  = ntohs(*(uint16_t*)(buf + sizeof(uint16_t)));
+    seq   = ntohl(*(uint32_t*)(buf + sizeof(uint32_t)));
+    seq_len = rdt_seq_bytes(span);
+
+    pre[n++] = RDT_DATA_CF_COMPACT | (uint8_t)((seq_len - 1) << RDT_DATA_CF_SEQ_SHIFT) |
+               (flags ? RDT_DATA_CF_FLAGS : 0) | (ack ? RDT_DATA_CF_ACK : 0);
+    if (flags) {
+        pre[n++] = flags;
+    }
+    n += _rdt_put_teid(pre + n, teid);
+    for (i = seq_len - 1; i >= 0; i--) {
+        pre[n++] = (uint8_t)(seq >> (8 * i));
+    }
+    if (ack) {
+        *(uint32_t*)(pre + n) = htonl((uint32_t)ack->seq_ack);
+        *(uint32_t*)(pre + n + sizeof(uint32_t)) = htonl(ack->windowsz);
+        n += 2 * sizeof(uint32_t);
+    } else if (n >= RDT_DATA_HDR_LEN) {
+        return 0;
+    }
+    memcpy(buf + RDT_DATA_HDR_LEN - n, pre, n);
+    return RDT_DATA_HDR_LEN - n;
+}
+
+/*
+ * Bytes of seq compact header carries. Seq is at most @span away from the
+ * reference of either end, and a quarter of the range is left as margin
+ * for late duplicates.
+ */
+int rdt_seq_bytes(uint32_t span)
+{
+    uint64_t need = (uint64_t)span * 8;
+
+    if (need <= 0x100) {
+        return 1;
+    }
+    if (need <= 0x10000) {
+        return 2;
+    }
+    if (need <= 0x1000000) {
+        return 3;
+    }
+    return 4;
+}
+
+/*
+ * Seq whose low @nbytes bytes are @trunc and which is nearest to @ref.
+ * Seqs are 64 bits and never wrap, wire carries at most the low 32 bits
+ * of them, so this is serial number arithmetic over the cut bits.
+ */
+uint64_t rdt_expand_seq(uint32_t trunc, int nbytes, uint64_t ref)
+{
+    uint64_t range = (uint64_t)1 << (8 * nbytes);
+    uint64_t d = 0;
+
+    vassert(nbytes > 0 && nbytes <= (int)sizeof(uint32_t));
+
+    d = (trunc - ref) & (range - 1);
+    if ((d >= range / 2) && (ref + d >= range)) {
+        return ref + d - range;
+    }
+    return ref + d;
+}
+
+/*
+ * Seq_recv of an ack as its 32 bits on wire. None goes as the seq just
+ * behind @seq_ack, which means nothing to the sender, as 0 would collide
+ * with a real seq at every 2^32.
+ */
+uint32_t rdt_trunc_recv(uint64_t seq_recv, uint64_t seq_ack)
+{
+    vassert(seq_ack > 0);
+    return (uint32_t)(seq_recv ? seq_recv : seq_ack - 1);
+}
+
+/*
+ * Back from rdt_trunc_recv, 0 for none. A seq behind the ack tells
+ * nothing either, and is how peers before this sent 0.
+ */
+uint64_t rdt_expand_recv(uint32_t trunc, uint64_t seq_ack)
+{
+    uint64_t seq = rdt_expand_seq(trunc, sizeof(uint32_t), seq_ack);
+
+    return (seq < seq_ack) ? 0 : seq;
+}
 
 static
 int _rdt_encode_data_msg(struct rdt_common_msg* cmsg, char* buf, int length)
 {
     struct rdt_data_msg* msg = (struct rdt_data_msg*)cmsg;
+    uint32_t crc = 0;
     int off = 0;
 
     vassert(msg);
     vassert(buf);
-    vassert(length >= (sizeof(*msg) - 4 - sizeof(void*)));
+    vassert(length >= rdt_data_hdr_len(msg->flags));
 
     *(uint8_t*) (buf + off) = 0;
     off += sizeof(uint8_t);
-    off += sizeof(uint8_t);//padx
+    *(uint8_t*) (buf + off) = msg->flags;
+    off += sizeof(uint8_t);
     *(uint16_t*)(buf + off) = htons(msg->rteid);
     off += sizeof(uint16_t);
 
-    *(uint32_t*)(buf + off) = htonl(msg->seq);
+    *(uint32_t*)(buf + off) = htonl((uint32_t)msg->seq);
     off += sizeof(uint32_t);
+    if (msg->flags & RDT_DATA_F_STREAM) {
+        *(uint16_t*)(buf + off) = htons(msg->stream_id);
+        off += sizeof(uint16_t);
+        off += sizeof(uint16_t);//reserved
+        *(uint32_t*)(buf + off) = htonl(msg->stream_off);
+        off += sizeof(uint32_t);
+    }
+    if (msg->flags & RDT_DATA_F_SEAL) {
+        //Pkt number and tag are filled in when sealed
+        vassert(length >= off + RDT_DATA_PN_LEN + RDT_DATA_TAG_LEN);
+        off += RDT_DATA_PN_LEN;
+        memcpy(buf + off, msg->data, length - off - RDT_DATA_TAG_LEN);
+        return length;
+    }
+    if (msg->flags & RDT_DATA_F_CRC) {
+        //Crc of payload only, header is added once seq is filled in
+        vassert(length >= off + RDT_DATA_CRC_LEN);
+        crc = vcrc32c_copy(0, buf + off, msg->data, length - off - RDT_DATA_CRC_LEN);
+        off += length - off - RDT_DATA_CRC_LEN;
+        *(uint32_t*)(buf + off) = htonl(crc);
+        off += RDT_DATA_CRC_LEN;
+        return off;
+    }
     memcpy(buf + off, msg->data, length - off);
     off += length - off;
 
     return off;
 }
 
+/*
+ * Fill in seq of an encoded data msg, done once it is sent first. With
+ * @span set the header is made compact too, keeping seq exact within
+ * @span of peer's reference, and carries @ack if given. Returns bytes
+ * header shrank by, negative if it grew into the headroom.
+ */
+int rdt_set_data_seq(char* buf, int length, uint64_t seq, uint32_t span, const struct rdt_data_ack_msg* ack)
+{
+    uint8_t flags = 0;
+    uint32_t crc = 0;
+    int hdr_len = 0;
+    int hoff = 0;
+
+    vassert(buf);
+    vassert(length >= sizeof(struct rdt_common_msg) + sizeof(uint32_t));
+
+    *(uint32_t*)(buf + sizeof(struct rdt_common_msg)) = htonl((uint32_t)seq);
+
+    flags = *(uint8_t*)(buf + sizeof(uint8_t));
+    hdr_len = rdt_data_hdr_len(flags);
+    if (span) {
+        hoff = _rdt_compact_data_hdr(buf, length, span, ack);
+    }
+    if (flags & RDT_DATA_F_CRC) {
+        vassert(length >= hdr_len + RDT_DATA_CRC_LEN);
+        crc = ntohl(*(uint32_t*)(buf + length - RDT_DATA_CRC_LEN));
+        crc = vcrc32c(crc, buf + hoff, hdr_len - hoff);
+        *(uint32_t*)(buf + length - RDT_DATA_CRC_LEN) = htonl(crc);
+    }
+    return hoff;
+}
+
+/*
+ * Payload length a data msg decodes to, -1 if it is malformed.
+ */
+int rdt_data_payload_len(const char* buf, int length)
+{
+    struct rdt_data_hdr hdr;
+    uint8_t flags = 0;
+    int off = 0;
+
+    vassert(buf);
+
+    if (_rdt_parse_data_hdr(buf, length, &hdr) < 0) {
+        return -1;
+    }
+    flags = hdr.flags;
+    off = hdr.len;
+    if (flags & RDT_DATA_F_LZ) {
+        if (length < off + (int)sizeof(uint16_t)) {
+            return -1;
+        }
+        return ntohs(*(uint16_t*)(buf + off));
+    }
+    length -= (flags & RDT_DATA_F_CRC) ? RDT_DATA_CRC_LEN : 0;
+    length -= (flags & RDT_DATA_F_SEAL) ? RDT_DATA_TAG_LEN : 0;
+    return (length >= off) ? length - off : -1;
+}
+
+/*
+ * Seal an encoded data msg in place with pkt number @pn, done once its seq
+ * is filled in. Header is authenticated, and raw length of a compressed
+ * payload too since it sizes the buffer decoding goes into.
+ */
+int rdt_seal_data(char* buf, int length, const uint8_t* key, uint64_t pn)
+{
+    struct rdt_data_hdr hdr;
+    uint8_t nonce[12];
+    uint8_t flags = 0;
+    int hdr_len = 0;
+    int aad_len = 0;
+
+    vassert(buf);
+    vassert(key);
+
+    hdr_len = _rdt_parse_data_hdr(buf, length, &hdr);
+    vassert(hdr_len > 0);
+    flags = hdr.flags;
+    vassert(flags & RDT_DATA_F_SEAL);
+    aad_len = hdr_len + ((flags & RDT_DATA_F_LZ) ? sizeof(uint16_t) : 0);
+    vassert(length >= aad_len + RDT_DATA_TAG_LEN);
+
+    *(uint32_t*)(buf + hdr_len - RDT_DATA_PN_LEN) = htonl((uint32_t)(pn >> 32));
+    *(uint32_t*)(buf + hdr_len - sizeof(uint32_t)) = htonl((uint32_t)pn);
+
+    vaead_nonce(nonce, pn);
+    vaead_seal(key, nonce, (uint8_t*)buf, aad_len, (uint8_t*)buf + aad_len, (uint8_t*)buf + aad_len,
+               length - aad_len - RDT_DATA_TAG_LEN, (uint8_t*)buf + length - RDT_DATA_TAG_LEN);
+    return 0;
+}
+
+/*
+ * Teid of tunnel a data msg is for, readable before the msg is opened.
+ */
+uint16_t rdt_data_teid(const char* buf, int length)
+{
+    struct rdt_data_hdr hdr;
+
+    vassert(buf);
+
+    if (_rdt_parse_data_hdr(buf, length, &hdr) < 0) {
+        return 0;
+    }
+    return hdr.teid;
+}
+
+/*
+ * Load the preset dictionary shared with peers, only once since msgs
+ * being decoded may refer to it.
+ */
+int rdt_set_lz_dict(const void* data, int len)
+{
+    struct vlz_dict* dict = NULL;
+
+    vassert(data);
+
+    if (rdt_dict) {
+        return -1;
+    }
+    dict = (struct vlz_dict*)malloc(sizeof(*dict));
+    if (!dict) {
+        return -1;
+    }
+    if (vlz_dict_init(dict, data, len) < 0) {
+        free(dict);
+        return -1;
+    }
+    rdt_dict_id = vcrc32c(0, data, len);
+    rdt_dict = dict;
+    return 0;
+}
+
+/*
+ * Id peers compare to tell they hold the same dictionary, 0 for none.
+ */
+uint32_t rdt_lz_dict_id(void)
+{
+    return rdt_dict ? (rdt_dict_id ? rdt_dict_id : 1) : 0;
+}
+
+/*
+ * Compress @src into a data msg payload of raw length and vlz block.
+ * Returns the payload length, or -1 if it would not fit in @cap.
+ */
+int rdt_lz_compress(uint8_t* dst, int cap, const void* src, int len, int use_dict)
+{
+    int zlen = 0;
+
+    vassert(dst);
+    vassert(src);
+
+    if ((len > 0xffff) || (cap <= (int)sizeof(uint16_t)) || (use_dict && !rdt_dict)) {
+        return -1;
+    }
+    zlen = vlz_compress(dst + sizeof(uint16_t), cap - sizeof(uint16_t), src, len,
+                        use_dict ? rdt_dict : NULL);
+    if (zlen < 0) {
+        return -1;
+    }
+    *(uint16_t*)dst = htons((uint16_t)len);
+    return zlen + sizeof(uint16_t);
+}
+
+/*
+ * Header length of a data msg with @flags.
+ */
+int rdt_data_hdr_len(uint8_t flags)
+{
+    return ((flags & RDT_DATA_F_STREAM) ? RDT_DATA_STREAM_HDR_LEN : RDT_DATA_HDR_LEN) +
+           ((flags & RDT_DATA_F_SEAL) ? RDT_DATA_PN_LEN : 0);
+}
+
 static
 int _rdt_encode_data_ack_msg(struct rdt_common_msg* cmsg, char* buf, int length)
 {
@@ -56,11 +505,48 @@ int _rdt_encode_data_ack_msg(struct rdt_common_msg* cmsg, char* buf, int length)
     *(uint16_t*)(buf + off) = htons(msg->rteid);
     off += sizeof(uint16_t);
 
-    *(uint32_t*)(buf + off) = htonl(msg->seq_ack);
+    *(uint32_t*)(buf + off) = htonl((uint32_t)msg->seq_ack);
     off += sizeof(uint32_t);
     *(uint32_t*)(buf + off) = htonl(msg->windowsz);
     off += sizeof(uint32_t);
+    *(uint32_t*)(buf + off) = htonl(rdt_trunc_recv(msg->seq_recv, msg->seq_ack));
+    off += sizeof(uint32_t);
+
+    return off;
+}
+
+/*
+ * Data ack in compact form:
+ *   type(1) | fmt(1) | teid(1-3) | seq_ack(1-4) | window(2) | seq_recv(1-4, if fmt 0x04)
+ * Seqs are cut as in compact data header, seq_recv expands near seq_ack.
+ */
+static
+int _rdt_encode_ack_compact_msg(struct rdt_common_msg* cmsg, char* buf, int length)
+{
+    struct rdt_data_ack_msg* msg = (struct rdt_data_ack_msg*)cmsg;
+    uint8_t* p = (uint8_t*)buf;
+    int seq_len = 0;
+    int off = 0;
+    int i = 0;
 
+    vassert(msg);
+    vassert(buf);
+    vassert(length >= 2 + 3 + 2 * sizeof(uint32_t) + sizeof(uint16_t));
+
+    seq_len = rdt_seq_bytes(msg->span);
+    p[off++] = (uint8_t)0x01 | (uint8_t)(CTRL_MSG_ACK_COMPACT << 1);
+    p[off++] = (uint8_t)(seq_len - 1) | (msg->seq_recv ? 0x04 : 0);
+    off += _rdt_put_teid(p + off, msg->rteid);
+    for (i = seq_len - 1; i >= 0; i--) {
+        p[off++] = (uint8_t)(msg->seq_ack >> (8 * i));
+    }
+    *(uint16_t*)(p + off) = htons((msg->windowsz > 0xffff) ? 0xffff : (uint16_t)msg->windowsz);
+    off += sizeof(uint16_t);
+    if (msg->seq_recv) {
+        for (i = seq_len - 1; i >= 0; i--) {
+            p[off++] = (uint8_t)(msg->seq_recv >> (8 * i));
+        }
+    }
     return off;
 }
 
@@ -102,6 +588,76 @@ int _rdt_encode_shutdown_msg(struct rdt_common_msg* cmsg, char* buf, int length)
     return off;
 }
 
+/*
+ * Params of handshake as tlvs, the ones left 0 are not sent.
+ */
+static
+int _rdt_encode_handshake_tlv(const struct rdt_handshake_tlv* tlv, char* buf, int length)
+{
+    int done = 0;
+    int off = 0;
+    int n = 0;
+
+    if (tlv->ack_delay) {
+        vassert(length >= off + 2 + (int)sizeof(uint16_t));
+        *(uint8_t*)(buf + off) = RDT_TLV_ACK_DELAY;
+        off += sizeof(uint8_t);
+        *(uint8_t*)(buf + off) = sizeof(uint16_t);
+        off += sizeof(uint8_t);
+        *(uint16_t*)(buf + off) = htons(tlv->ack_delay);
+        off += sizeof(uint16_t);
+    }
+    if (tlv->early_ack) {
+        vassert(length >= off + 2 + (int)sizeof(uint16_t));
+        *(uint8_t*)(buf + off) = RDT_TLV_EARLY_ACK;
+        off += sizeof(uint8_t);
+        *(uint8_t*)(buf + off) = sizeof(uint16_t);
+        off += sizeof(uint8_t);
+        *(uint16_t*)(buf + off) = htons(tlv->early_ack);
+        off += sizeof(uint16_t);
+    }
+    if (tlv->resumed) {
+        vassert(length >= off + 2 + (int)sizeof(uint8_t));
+        *(uint8_t*)(buf + off) = RDT_TLV_RESUMED;
+        off += sizeof(uint8_t);
+        *(uint8_t*)(buf + off) = sizeof(uint8_t);
+        off += sizeof(uint8_t);
+        *(uint8_t*)(buf + off) = tlv->resumed;
+        off += sizeof(uint8_t);
+    }
+    if (tlv->order) {
+        vassert(length >= off + 2 + (int)sizeof(uint8_t));
+        *(uint8_t*)(buf + off) = RDT_TLV_ORDER;
+        off += sizeof(uint8_t);
+        *(uint8_t*)(buf + off) = sizeof(uint8_t);
+        off += sizeof(uint8_t);
+        *(uint8_t*)(buf + off) = tlv->order;
+        off += sizeof(uint8_t);
+    }
+    if (tlv->ticket_len) {
+        vassert(tlv->ticket_len <= RDT_TICKET_MAX);
+        vassert(length >= off + 2 + tlv->ticket_len);
+        *(uint8_t*)(buf + off) = RDT_TLV_TICKET;
+        off += sizeof(uint8_t);
+        *(uint8_t*)(buf + off) = tlv->ticket_len;
+        off += sizeof(uint8_t);
+        memcpy(buf + off, tlv->ticket, tlv->ticket_len);
+        off += tlv->ticket_len;
+    }
+    //Last, as it is the bulk of it
+    for (done = 0; done < tlv->early_len; done += n) {
+        n = (tlv->early_len - done > 0xff) ? 0xff : tlv->early_len - done;
+        vassert(length >= off + 2 + n);
+        *(uint8_t*)(buf + off) = RDT_TLV_EARLY_DATA;
+        off += sizeof(uint8_t);
+        *(uint8_t*)(buf + off) = (uint8_t)n;
+        off += sizeof(uint8_t);
+        memcpy(buf + off, tlv->early + done, n);
+        off += n;
+    }
+    return off;
+}
+
 static
 int _rdt_encode_handshake_req_msg(struct rdt_common_msg* cmsg, char* buf, int length)
 {
@@ -110,13 +666,14 @@ int _rdt_encode_handshake_req_msg(struct rdt_common_msg* cmsg, char* buf, int le
 
     vassert(msg);
     vassert(buf);
-    vassert(length >= sizeof(*msg) + 4);
+    vassert(length >= sizeof(*msg) + 4 + RDT_HANDSHAKE_TLV_MAX);
 
     *(uint32_t*)(buf + off) = htonl(HANDSHAKE_REQ_MAGIC);
     off += sizeof(uint32_t);
     *(uint8_t*) (buf + off) = (uint8_t)0x01;
     off += sizeof(uint8_t);
-    off += sizeof(uint8_t);//padx
+    *(uint8_t*) (buf + off) = msg->wscale;
+    off += sizeof(uint8_t);
     *(uint16_t*)(buf + off) = 0;
     off += sizeof(uint16_t);
     *(uint16_t*)(buf + off) = htons((uint16_t)msg->version | 0x0 << 14);
@@ -126,12 +683,19 @@ int _rdt_encode_handshake_req_msg(struct rdt_common_msg* cmsg, char* buf, int le
 
     *(uint32_t*)(buf + off) = htonl(msg->seq);
     off += sizeof(uint32_t);
-    *(uint32_t*)(buf + off) = 0;
+    *(uint32_t*)(buf + off) = htonl(msg->caps);
     off += sizeof(uint32_t);
     *(uint32_t*)(buf + off) = htonl(msg->mtu);
     off += sizeof(uint32_t);
     *(uint32_t*)(buf + off) = htonl(msg->windowsz);
     off += sizeof(uint32_t);
+    *(uint32_t*)(buf + off) = htonl(msg->dict_id);
+    off += sizeof(uint32_t);
+    *(uint32_t*)(buf + off) = htonl(msg->key_id);
+    off += sizeof(uint32_t);
+    memcpy(buf + off, msg->nonce, RDT_NONCE_LEN);
+    off += RDT_NONCE_LEN;
+    off += _rdt_encode_handshake_tlv(&msg->tlv, buf + off, length - off);
 
     return off;
 }
@@ -144,11 +708,12 @@ int _rdt_encode_handshake_rsp_msg(struct rdt_common_msg* cmsg, char* buf, int le
 
     vassert(buf);
     vassert(msg);
-    vassert(length >= sizeof(*msg));
+    vassert(length >= sizeof(*msg) + RDT_HANDSHAKE_TLV_MAX);
 
     *(uint8_t*)(buf + off)  = (uint8_t)0x01;
     off += sizeof(uint8_t);
-    off += sizeof(uint8_t);//padx
+    *(uint8_t*) (buf + off) = msg->wscale;
+    off += sizeof(uint8_t);
     *(uint16_t*)(buf + off) = htons(msg->rteid);
     off += sizeof(uint16_t);
     *(uint16_t*)(buf + off) = htons((uint16_t)msg->version | (uint16_t)(0x01 << 14));
@@ -164,6 +729,15 @@ int _rdt_encode_handshake_rsp_msg(struct rdt_common_msg* cmsg, char* buf, int le
     off += sizeof(uint32_t);
     *(uint32_t*)(buf + off) = htonl(msg->windowsz);
     off += sizeof(uint32_t);
+    *(uint32_t*)(buf + off) = htonl(msg->caps);
+    off += sizeof(uint32_t);
+    *(uint32_t*)(buf + off) = htonl(msg->dict_id);
+    off += sizeof(uint32_t);
+    *(uint32_t*)(buf + off) = htonl(msg->key_id);
+    off += sizeof(uint32_t);
+    memcpy(buf + off, msg->nonce, RDT_NONCE_LEN);
+    off += RDT_NONCE_LEN;
+    off += _rdt_encode_handshake_tlv(&msg->tlv, buf + off, length - off);
 
     return off;
 }
@@ -195,6 +769,279 @@ int _rdt_encode_handshake_fin_msg(struct rdt_common_msg* cmsg, char* buf, int le
     return off;
 }
 
+static
+int _rdt_encode_data_nack_msg(struct rdt_common_msg* cmsg, char* buf, int length)
+{
+    struct rdt_data_nack_msg* msg = (struct rdt_data_nack_msg*)cmsg;
+    int off = 0;
+    int i = 0;
+
+    vassert(cmsg);
+    vassert(buf);
+    vassert(msg->nranges <= RDT_NACK_MAX_RANGES);
+    vassert(length >= 12 + msg->nranges * 2 * sizeof(uint32_t));
+
+    *(uint8_t*)(buf + off)  = (uint8_t)(0x01) | (uint8_t)(0x04 << 1);
+    off += sizeof(uint8_t);
+    off += sizeof(uint8_t);//padx
+    *(uint16_t*)(buf + off) = htons(msg->rteid);
+    off += sizeof(uint16_t);
+
+    *(uint32_t*)(buf + off) = htonl((uint32_t)msg->seq_ack);
+    off += sizeof(uint32_t);
+    *(uint16_t*)(buf + off) = htons(msg->nranges);
+    off += sizeof(uint16_t);
+    off += sizeof(uint16_t);//pad1
+
+    for (i = 0; i < msg->nranges; i++) {
+        *(uint32_t*)(buf + off) = htonl((uint32_t)msg->ranges[i].start);
+        off += sizeof(uint32_t);
+        *(uint32_t*)(buf + off) = htonl((uint32_t)msg->ranges[i].end);
+        off += sizeof(uint32_t);
+    }
+
+    return off;
+}
+
+static
+int _rdt_encode_stream_msg(struct rdt_common_msg* cmsg, char* buf, int length)
+{
+    struct rdt_stream_msg* msg = (struct rdt_stream_msg*)cmsg;
+    int off = 0;
+
+    vassert(cmsg);
+    vassert(buf);
+    vassert(length >= sizeof(*msg));
+
+    *(uint8_t*)(buf + off)  = (uint8_t)(0x01) | (uint8_t)(CTRL_MSG_STREAM << 1);
+    off += sizeof(uint8_t);
+    off += sizeof(uint8_t);//padx
+    *(uint16_t*)(buf + off) = htons(msg->rteid);
+    off += sizeof(uint16_t);
+
+    *(uint16_t*)(buf + off) = htons(msg->stream_id);
+    off += sizeof(uint16_t);
+    *(uint8_t*)(buf + off) = msg->stream_type;
+    off += sizeof(uint8_t);
+    off += sizeof(uint8_t);//pad1
+    *(uint32_t*)(buf + off) = htonl(msg->value);
+    off += sizeof(uint32_t);
+
+    return off;
+}
+
+static
+int _rdt_encode_fwd_skip_msg(struct rdt_common_msg* cmsg, char* buf, int length)
+{
+    struct rdt_fwd_skip_msg* msg = (struct rdt_fwd_skip_msg*)cmsg;
+    int off = 0;
+    int i = 0;
+
+    vassert(cmsg);
+    vassert(buf);
+    vassert(msg->nranges <= RDT_SKIP_MAX_RANGES);
+    vassert(length >= 8 + msg->nranges * 16);
+
+    *(uint8_t*)(buf + off)  = (uint8_t)(0x01) | (uint8_t)(CTRL_MSG_FWD_SKIP << 1);
+    off += sizeof(uint8_t);
+    off += sizeof(uint8_t);//padx
+    *(uint16_t*)(buf + off) = htons(msg->rteid);
+    off += sizeof(uint16_t);
+
+    *(uint16_t*)(buf + off) = htons(msg->nranges);
+    off += sizeof(uint16_t);
+    off += sizeof(uint16_t);//pad1
+
+    for (i = 0; i < msg->nranges; i++) {
+        *(uint32_t*)(buf + off) = htonl((uint32_t)msg->ranges[i].seq);
+        off += sizeof(uint32_t);
+        *(uint32_t*)(buf + off) = htonl(msg->ranges[i].len);
+        off += sizeof(uint32_t);
+        *(uint8_t*)(buf + off) = msg->ranges[i].flags;
+        off += sizeof(uint8_t);
+        *(uint8_t*)(buf + off) = 0;
+        off += sizeof(uint8_t);//pad
+        *(uint16_t*)(buf + off) = htons(msg->ranges[i].stream_id);
+        off += sizeof(uint16_t);
+        *(uint32_t*)(buf + off) = htonl(msg->ranges[i].stream_off);
+        off += sizeof(uint32_t);
+    }
+
+    return off;
+}
+
+int _rdt_encode_fec_msg(struct rdt_common_msg* cmsg, char* buf, int length)
+{
+    struct rdt_fec_msg* msg = (struct rdt_fec_msg*)cmsg;
+    int off = 0;
+    int i = 0;
+
+    vassert(cmsg);
+    vassert(buf);
+    vassert(msg->k > 0 && msg->k <= RDT_FEC_MAX_K);
+    vassert(length >= RDT_FEC_HDR_LEN + msg->k * 2 + msg->symlen);
+
+    *(uint8_t*)(buf + off)  = (uint8_t)(0x01) | (uint8_t)(CTRL_MSG_FEC << 1);
+    off += sizeof(uint8_t);
+    off += sizeof(uint8_t);//padx
+    *(uint16_t*)(buf + off) = htons(msg->rteid);
+    off += sizeof(uint16_t);
+
+    *(uint32_t*)(buf + off) = htonl((uint32_t)msg->base_seq);
+    off += sizeof(uint32_t);
+    *(uint8_t*)(buf + off) = msg->k;
+    off += sizeof(uint8_t);
+    *(uint8_t*)(buf + off) = msg->index;
+    off += sizeof(uint8_t);
+    *(uint16_t*)(buf + off) = htons(msg->symlen);
+    off += sizeof(uint16_t);
+
+    for (i = 0; i < msg->k; i++) {
+        *(uint16_t*)(buf + off) = htons(msg->plens[i]);
+        off += sizeof(uint16_t);
+    }
+    memcpy(buf + off, msg->symbol, msg->symlen);
+    off += msg->symlen;
+
+    return off;
+}
+
+static
+int _rdt_encode_ack_multi_msg(struct rdt_common_msg* cmsg, char* buf, int length)
+{
+    struct rdt_ack_multi_msg* msg = (struct rdt_ack_multi_msg*)cmsg;
+    int off = 0;
+    int i = 0;
+
+    vassert(cmsg);
+    vassert(buf);
+    vassert(msg->nacks <= RDT_ACK_MULTI_MAX);
+    vassert(length >= RDT_ACK_MULTI_HDR_LEN + msg->nacks * RDT_ACK_MULTI_ENTRY_LEN);
+
+    *(uint8_t*)(buf + off) = (uint8_t)(0x01) | (uint8_t)(CTRL_MSG_ACK_MULTI << 1);
+    off += sizeof(uint8_t);
+    *(uint8_t*)(buf + off) = msg->nacks;
+    off += sizeof(uint8_t);
+
+    for (i = 0; i < msg->nacks; i++) {
+        *(uint16_t*)(buf + off) = htons(msg->acks[i].teid);
+        off += sizeof(uint16_t);
+        *(uint32_t*)(buf + off) = htonl(msg->acks[i].seq_ack);
+        off += sizeof(uint32_t);
+        *(uint32_t*)(buf + off) = htonl(msg->acks[i].seq_recv);
+        off += sizeof(uint32_t);
+        *(uint32_t*)(buf + off) = htonl(msg->acks[i].windowsz);
+        off += sizeof(uint32_t);
+    }
+
+    return off;
+}
+
+/*
+ * Probe is padded to msg->size, so @length must hold that much.
+ */
+static
+int _rdt_encode_pmtu_probe_msg(struct rdt_common_msg* cmsg, char* buf, int length)
+{
+    struct rdt_pmtu_msg* msg = (struct rdt_pmtu_msg*)cmsg;
+    int off = 0;
+
+    vassert(cmsg);
+    vassert(buf);
+    vassert(msg->size >= RDT_PMTU_HDR_LEN);
+    vassert(length >= (int)msg->size);
+
+    *(uint8_t*)(buf + off)  = (uint8_t)(0x01) | (uint8_t)(CTRL_MSG_PMTU_PROBE << 1);
+    off += sizeof(uint8_t);
+    off += sizeof(uint8_t);//padx
+    *(uint16_t*)(buf + off) = htons(msg->rteid);
+    off += sizeof(uint16_t);
+
+    *(uint32_t*)(buf + off) = htonl(msg->probe_id);
+    off += sizeof(uint32_t);
+    *(uint32_t*)(buf + off) = htonl(msg->size);
+    off += sizeof(uint32_t);
+    memset(buf + off, 0, msg->size - off);
+
+    return msg->size;
+}
+
+static
+int _rdt_encode_pmtu_ack_msg(struct rdt_common_msg* cmsg, char* buf, int length)
+{
+    struct rdt_pmtu_msg* msg = (struct rdt_pmtu_msg*)cmsg;
+    int off = 0;
+
+    vassert(cmsg);
+    vassert(buf);
+    vassert(length >= RDT_PMTU_HDR_LEN);
+
+    *(uint8_t*)(buf + off)  = (uint8_t)(0x01) | (uint8_t)(CTRL_MSG_PMTU_ACK << 1);
+    off += sizeof(uint8_t);
+    off += sizeof(uint8_t);//padx
+    *(uint16_t*)(buf + off) = htons(msg->rteid);
+    off += sizeof(uint16_t);
+
+    *(uint32_t*)(buf + off) = htonl(msg->probe_id);
+    off += sizeof(uint32_t);
+    *(uint32_t*)(buf + off) = htonl(msg->size);
+    off += sizeof(uint32_t);
+
+    return off;
+}
+
+static
+int _rdt_encode_frag_msg(struct rdt_common_msg* cmsg, char* buf, int length)
+{
+    struct rdt_frag_msg* msg = (struct rdt_frag_msg*)cmsg;
+    int off = 0;
+
+    vassert(cmsg);
+    vassert(buf);
+    vassert(msg->len > 0 && msg->len <= RDT_FRAG_LEN);
+    vassert(length >= RDT_FRAG_HDR_LEN + msg->len);
+
+    *(uint8_t*)(buf + off)  = (uint8_t)(0x01) | (uint8_t)(CTRL_MSG_FRAG << 1);
+    off += sizeof(uint8_t);
+    off += sizeof(uint8_t);//padx
+    *(uint16_t*)(buf + off) = htons(msg->rteid);
+    off += sizeof(uint16_t);
+
+    *(uint32_t*)(buf + off) = htonl(msg->frag_id);
+    off += sizeof(uint32_t);
+    *(uint8_t*)(buf + off) = msg->index;
+    off += sizeof(uint8_t);
+    *(uint8_t*)(buf + off) = msg->count;
+    off += sizeof(uint8_t);
+    memcpy(buf + off, msg->data, msg->len);
+    off += msg->len;
+
+    return off;
+}
+
+static
+int _rdt_encode_ticket_msg(struct rdt_common_msg* cmsg, char* buf, int length)
+{
+    struct rdt_ticket_msg* msg = (struct rdt_ticket_msg*)cmsg;
+    int off = 0;
+
+    vassert(cmsg);
+    vassert(buf);
+    vassert(msg->len > 0 && msg->len <= RDT_TICKET_MAX);
+    vassert(length >= RDT_TICKET_HDR_LEN + msg->len);
+
+    *(uint8_t*)(buf + off)  = (uint8_t)(0x01) | (uint8_t)(CTRL_MSG_TICKET << 1);
+    off += sizeof(uint8_t);
+    off += sizeof(uint8_t);//padx
+    *(uint16_t*)(buf + off) = htons(msg->rteid);
+    off += sizeof(uint16_t);
+
+    memcpy(buf + off, msg->ticket, msg->len);
+    off += msg->len;
+
+    return off;
+}
+
 struct rdt_enc_ops rdt_enc_ops = {
     .data           = _rdt_encode_data_msg,
     .data_ack       = _rdt_encode_data_ack_msg,
@@ -202,27 +1049,144 @@ struct rdt_enc_ops rdt_enc_ops = {
     .shutdown       = _rdt_encode_shutdown_msg,
     .handshake_req  = _rdt_encode_handshake_req_msg,
     .handshake_rsp  = _rdt_encode_handshake_rsp_msg,
-    .handshake_fin  = _rdt_encode_handshake_fin_msg
+    .handshake_fin  = _rdt_encode_handshake_fin_msg,
+    .data_nack      = _rdt_encode_data_nack_msg,
+    .stream         = _rdt_encode_stream_msg,
+    .fwd_skip       = _rdt_encode_fwd_skip_msg,
+    .fec            = _rdt_encode_fec_msg,
+    .ack_compact    = _rdt_encode_ack_compact_msg,
+    .ack_multi      = _rdt_encode_ack_multi_msg,
+    .pmtu_probe     = _rdt_encode_pmtu_probe_msg,
+    .pmtu_ack       = _rdt_encode_pmtu_ack_msg,
+    .frag           = _rdt_encode_frag_msg,
+    .ticket         = _rdt_encode_ticket_msg
 };
 
 
+/*
+ * Check and decompress payload of a compressed data msg into msg->data,
+ * which holds rdt_data_payload_len() bytes.
+ */
+static
+int _rdt_decode_lz_payload(char* buf, int length, int off, struct rdt_data_msg* msg)
+{
+    uint32_t crc = 0;
+    int zlen = length - off;
+
+    if (msg->flags & RDT_DATA_F_CRC) {
+        zlen -= RDT_DATA_CRC_LEN;
+    }
+    if (zlen < (int)sizeof(uint16_t)) {
+        return -1;
+    }
+    if (msg->flags & RDT_DATA_F_CRC) {
+        crc = vcrc32c(0, buf + off, zlen);
+        crc = vcrc32c(crc, buf, off);
+        if (crc != ntohl(*(uint32_t*)(buf + length - RDT_DATA_CRC_LEN))) {
+            return -1;
+        }
+    }
+    if ((msg->flags & RDT_DATA_F_DICT) && !rdt_dict) {
+        return -1;
+    }
+
+    msg->len = ntohs(*(uint16_t*)(buf + off));
+    if (vlz_decompress(msg->data, msg->len, buf + off + sizeof(uint16_t), zlen - sizeof(uint16_t),
+                       (msg->flags & RDT_DATA_F_DICT) ? rdt_dict : NULL) != msg->len) {
+        return -1;
+    }
+    return length;
+}
+
+/*
+ * Open payload of a sealed data msg into msg->data, decompressing it too
+ * if it is compressed. Fails if it was not sealed with msg->key.
+ */
+static
+int _rdt_decode_sealed_payload(char* buf, int length, int off, struct rdt_data_msg* msg)
+{
+    const uint8_t* tag = (uint8_t*)buf + length - RDT_DATA_TAG_LEN;
+    uint8_t nonce[12];
+    uint8_t* plain = NULL;
+    uint64_t pn = 0;
+    int aad_len = 0;
+    int ret = 0;
+
+    if (!msg->key || (length < off + RDT_DATA_PN_LEN + RDT_DATA_TAG_LEN)) {
+        return -1;
+    }
+    pn  = (uint64_t)ntohl(*(uint32_t*)(buf + off)) << 32;
+    pn |= ntohl(*(uint32_t*)(buf + off + sizeof(uint32_t)));
+    off += RDT_DATA_PN_LEN;
+    aad_len = off + ((msg->flags & RDT_DATA_F_LZ) ? sizeof(uint16_t) : 0);
+    if (length < aad_len + RDT_DATA_TAG_LEN) {
+        return -1;
+    }
+    vaead_nonce(nonce, pn);
+
+    if (!(msg->flags & RDT_DATA_F_LZ)) {
+        msg->len = length - aad_len - RDT_DATA_TAG_LEN;
+        ret = vaead_open(msg->key, nonce, (uint8_t*)buf, aad_len, (uint8_t*)buf + aad_len,
+                         msg->data, msg->len, tag);
+        return (ret < 0) ? -1 : length;
+    }
+
+    //Opened aside, buf is what fec has cached
+    plain = (uint8_t*)malloc(length - RDT_DATA_TAG_LEN);
+    if (!plain) {
+        return -1;
+    }
+    memcpy(plain, buf, aad_len);
+    ret = vaead_open(msg->key, nonce, (uint8_t*)buf, aad_len, (uint8_t*)buf + aad_len,
+                     plain + aad_len, length - aad_len - RDT_DATA_TAG_LEN, tag);
+    if (ret >= 0) {
+        ret = _rdt_decode_lz_payload((char*)plain, length - RDT_DATA_TAG_LEN, off, msg);
+    }
+    free(plain);
+    return (ret < 0) ? -1 : length;
+}
+
 static
 int _rdt_decode_data_msg(char* buf, int length, struct rdt_common_msg* cmsg)
 {
     struct rdt_data_msg* msg = (struct rdt_data_msg*)cmsg;
+    struct rdt_data_hdr hdr;
+    uint32_t crc = 0;
     int off = 0;
 
     vassert(buf);
-    vassert(length >= (sizeof(*msg) - 4 - sizeof(void*)));
     vassert(msg);
 
-    off += sizeof(uint8_t);
-    off += sizeof(uint8_t);//padx
-    msg->rteid = ntohs(*(uint16_t*)(buf + off));
-    off += sizeof(uint16_t);
-
-    msg->seq = ntohl(*(uint32_t*)(buf + off));
-    off += sizeof(uint32_t);
+    off = _rdt_parse_data_hdr(buf, length, &hdr);
+    if (off < 0) {
+        return -1;
+    }
+    msg->flags = hdr.flags & ~RDT_DATA_F_SKIP;
+    msg->rteid = hdr.teid;
+    msg->seq   = rdt_expand_seq(hdr.seq, hdr.seq_len, msg->seq_ref);
+    msg->stream_id  = hdr.stream_id;
+    msg->stream_off = hdr.stream_off;
+    msg->has_ack  = hdr.has_ack;
+    msg->seq_ack  = hdr.has_ack ? rdt_expand_seq(hdr.seq_ack, sizeof(uint32_t), msg->ack_ref) : 0;
+    msg->windowsz = hdr.windowsz;
+    if (msg->flags & RDT_DATA_F_SEAL) {
+        return _rdt_decode_sealed_payload(buf, length, off - RDT_DATA_PN_LEN, msg);
+    }
+    if (msg->flags & RDT_DATA_F_LZ) {
+        return _rdt_decode_lz_payload(buf, length, off, msg);
+    }
+    if (msg->flags & RDT_DATA_F_CRC) {
+        if (length < off + RDT_DATA_CRC_LEN) {
+            return -1;
+        }
+        msg->len = length - off - RDT_DATA_CRC_LEN;
+        crc = vcrc32c_copy(0, msg->data, buf + off, msg->len);
+        crc = vcrc32c(crc, buf, off);
+        if (crc != ntohl(*(uint32_t*)(buf + length - RDT_DATA_CRC_LEN))) {
+            return -1;
+        }
+        return length;
+    }
     msg->len = length - off;
     memcpy(msg->data, buf + off, msg->len);
     off += length - off;
@@ -233,10 +1197,11 @@ static
 int _rdt_decode_data_ack_msg(char* buf, int length, struct rdt_common_msg* cmsg)
 {
     struct rdt_data_ack_msg* msg = (struct rdt_data_ack_msg*)cmsg;
+    uint32_t seq = 0;
     int off = 0;
 
     vassert(buf);
-    vassert(length >= sizeof(*msg));
+    vassert(length >= sizeof(struct rdt_common_msg) + 2 * sizeof(uint32_t));
     vassert(msg);
 
     off += sizeof(uint8_t);
@@ -244,14 +1209,161 @@ int _rdt_decode_data_ack_msg(char* buf, int length, struct rdt_common_msg* cmsg)
     msg->rteid = ntohs(*(uint16_t*)(buf + off));
     off += sizeof(uint16_t);
 
-    msg->seq_ack  = ntohl(*(uint32_t*)(buf + off));
+    msg->seq_ack  = rdt_expand_seq(ntohl(*(uint32_t*)(buf + off)), sizeof(uint32_t), msg->seq_ref);
     off += sizeof(uint32_t);
     msg->windowsz = ntohl(*(uint32_t*)(buf + off));
     off += sizeof(uint32_t);
 
+    //Not carried by earlier version
+    msg->seq_recv = 0;
+    if (length >= off + sizeof(uint32_t)) {
+        seq = ntohl(*(uint32_t*)(buf + off));
+        msg->seq_recv = rdt_expand_recv(seq, msg->seq_ack);
+        off += sizeof(uint32_t);
+    }
+
+    return off;
+}
+
+static
+int _rdt_decode_ack_compact_msg(char* buf, int length, struct rdt_common_msg* cmsg)
+{
+    struct rdt_data_ack_msg* msg = (struct rdt_data_ack_msg*)cmsg;
+    const uint8_t* p = (const uint8_t*)buf;
+    uint32_t seq = 0;
+    int seq_len = 0;
+    int has_recv = 0;
+    int off = 0;
+    int tl = 0;
+    int i = 0;
+
+    vassert(buf);
+    vassert(msg);
+
+    if (length < 3) {
+        return -1;
+    }
+    seq_len  = (p[1] & 0x03) + 1;
+    has_recv = !!(p[1] & 0x04);
+    off = 2;
+    tl = _rdt_get_teid(p + off, length - off, &msg->rteid);
+    if ((tl < 0) ||
+        (length < off + tl + seq_len * (1 + has_recv) + (int)sizeof(uint16_t))) {
+        return -1;
+    }
+    off += tl;
+
+    for (i = 0; i < seq_len; i++) {
+        seq = (seq << 8) | p[off++];
+    }
+    msg->seq_ack  = rdt_expand_seq(seq, seq_len, msg->seq_ref);
+    msg->windowsz = ntohs(*(uint16_t*)(p + off));
+    off += sizeof(uint16_t);
+
+    msg->seq_recv = 0;
+    if (has_recv) {
+        for (seq = 0, i = 0; i < seq_len; i++) {
+            seq = (seq << 8) | p[off++];
+        }
+        msg->seq_recv = rdt_expand_seq(seq, seq_len, msg->seq_ack);
+    }
     return off;
 }
 
+/*
+ * Teid a ctrl msg in full form is for, readable before seqs are expanded.
+ */
+uint16_t rdt_ctrl_teid(const char* buf, int length)
+{
+    vassert(buf);
+
+    if (length < (int)sizeof(struct rdt_common_msg)) {
+        return 0;
+    }
+    return ntohs(*(uint16_t*)(buf + sizeof(uint16_t)));
+}
+
+/*
+ * Teid an ack in compact form is for, readable before seqs are expanded.
+ */
+uint16_t rdt_ack_compact_teid(const char* buf, int length)
+{
+    uint16_t teid = 0;
+
+    vassert(buf);
+
+    if ((length < 3) || (_rdt_get_teid((const uint8_t*)buf + 2, length - 2, &teid) < 0)) {
+        return 0;
+    }
+    return teid;
+}
+
+/*
+ * Start a bundle in @buf, returning bytes taken.
+ */
+int rdt_bundle_init(char* buf)
+{
+    vassert(buf);
+
+    *(uint8_t*)buf = (uint8_t)((CTRL_MSG_BUNDLE << 1) | CTRL_MSG);
+    return RDT_BUNDLE_HDR_LEN;
+}
+
+/*
+ * Append a msg to bundle at @buf with @avail bytes left. Returns bytes
+ * appended, 0 if it does not fit.
+ */
+int rdt_bundle_add(char* buf, int avail, const void* msg, int len)
+{
+    int n = 0;
+
+    vassert(buf);
+    vassert(msg);
+    vassert(len > 0);
+
+    n = (len < 0x80) ? 1 : 2;
+    if ((len > RDT_BUNDLE_MSG_MAX) || (avail < n + len)) {
+        return 0;
+    }
+    if (n == 1) {
+        *(uint8_t*)buf = (uint8_t)len;
+    } else {
+        *(uint8_t*)buf = (uint8_t)(0x80 | (len >> 8));
+        *(uint8_t*)(buf + 1) = (uint8_t)len;
+    }
+    memcpy(buf + n, msg, len);
+    return n + len;
+}
+
+/*
+ * Step to next msg of bundle. @off is where its length starts, past the
+ * bundle header at first, and is moved to the msg itself. Returns length
+ * of msg, 0 at the end and -1 if bundle is malformed.
+ */
+int rdt_bundle_next(const char* buf, int length, int* off)
+{
+    const uint8_t* p = (const uint8_t*)buf;
+    int len = 0;
+    int n = 0;
+
+    vassert(buf);
+    vassert(off);
+
+    if (*off >= length) {
+        return 0;
+    }
+    n = (p[*off] & 0x80) ? 2 : 1;
+    if (*off + n > length) {
+        return -1;
+    }
+    len = (n == 1) ? p[*off] : ((p[*off] & 0x7f) << 8) | p[*off + 1];
+    if ((len == 0) || (*off + n + len > length)) {
+        return -1;
+    }
+    *off += n;
+    return len;
+}
+
 static
 int _rdt_decode_keepalive_msg(char* buf, int length, struct rdt_common_msg* cmsg)
 {
@@ -288,19 +1400,86 @@ int _rdt_decode_shutdown_msg(char* buf, int length, struct rdt_common_msg* cmsg)
     return off;
 }
 
+/*
+ * Read params of handshake up to @length. A block not well formed is
+ * dropped as a whole.
+ */
+static
+int _rdt_decode_handshake_tlv(char* buf, int length, struct rdt_handshake_tlv* tlv)
+{
+    uint8_t type = 0;
+    uint8_t len = 0;
+    int off = 0;
+
+    memset(tlv, 0, sizeof(*tlv));
+    while (off + 2 <= length) {
+        type = *(uint8_t*)(buf + off);
+        len  = *(uint8_t*)(buf + off + 1);
+        off += 2;
+        if (off + len > length) {
+            memset(tlv, 0, sizeof(*tlv));
+            return -1;
+        }
+        switch (type) {
+        case RDT_TLV_ACK_DELAY:
+            if (len >= sizeof(uint16_t)) {
+                tlv->ack_delay = ntohs(*(uint16_t*)(buf + off));
+            }
+            break;
+        case RDT_TLV_EARLY_ACK:
+            if (len >= sizeof(uint16_t)) {
+                tlv->early_ack = ntohs(*(uint16_t*)(buf + off));
+            }
+            break;
+        case RDT_TLV_EARLY_DATA:
+            if (tlv->early_len + len > RDT_EARLY_DATA_MAX) {
+                memset(tlv, 0, sizeof(*tlv));
+                return -1;
+            }
+            memcpy(tlv->early + tlv->early_len, buf + off, len);
+            tlv->early_len += len;
+            break;
+        case RDT_TLV_RESUMED:
+            if (len >= sizeof(uint8_t)) {
+                tlv->resumed = *(uint8_t*)(buf + off);
+            }
+            break;
+        case RDT_TLV_ORDER:
+            if (len >= sizeof(uint8_t)) {
+                tlv->order = *(uint8_t*)(buf + off);
+            }
+            break;
+        case RDT_TLV_TICKET:
+            //Too long to be ours, as if none was presented
+            if (len <= RDT_TICKET_MAX) {
+                memcpy(tlv->ticket, buf + off, len);
+                tlv->ticket_len = len;
+            }
+            break;
+        default:
+            //Newer than this end
+            break;
+        }
+        off += len;
+    }
+    return off;
+}
+
 static
 int _rdt_decode_handshake_req_msg(char* buf, int length, struct rdt_common_msg* cmsg)
 {
     struct rdt_handshake_req_msg* msg = (struct rdt_handshake_req_msg*)cmsg;
     int off = 0;
+    int n = 0;
 
     vassert(buf);
-    vassert(length >= sizeof(*msg));
+    vassert(length >= RDT_HANDSHAKE_REQ_MIN_LEN);
     vassert(msg);
 
     //off += sizeof(uint32_t); // for magic
     off += sizeof(uint8_t);
-    off += sizeof(uint8_t);//padx
+    msg->wscale = *(uint8_t*)(buf + off);
+    off += sizeof(uint8_t);
     off += sizeof(uint16_t);
 
     msg->version = ntohs(*(uint16_t*)(buf + off)) & 0x3f;
@@ -310,11 +1489,28 @@ int _rdt_decode_handshake_req_msg(char* buf, int length, struct rdt_common_msg*
 
     msg->seq = ntohl(*(uint32_t*)(buf + off));
     off += sizeof(uint32_t);
+    msg->caps = ntohl(*(uint32_t*)(buf + off));
     off += sizeof(uint32_t);
     msg->mtu = ntohl(*(uint32_t*)(buf + off));
     off += sizeof(uint32_t);
     msg->windowsz = ntohl(*(uint32_t*)(buf + off));
     off += sizeof(uint32_t);
+    msg->dict_id = 0;
+    if (length >= off + sizeof(uint32_t)) {
+        msg->dict_id = ntohl(*(uint32_t*)(buf + off));
+        off += sizeof(uint32_t);
+    }
+    msg->key_id = 0;
+    memset(msg->nonce, 0, RDT_NONCE_LEN);
+    memset(&msg->tlv, 0, sizeof(msg->tlv));
+    if (length >= off + sizeof(uint32_t) + RDT_NONCE_LEN) {
+        msg->key_id = ntohl(*(uint32_t*)(buf + off));
+        off += sizeof(uint32_t);
+        memcpy(msg->nonce, buf + off, RDT_NONCE_LEN);
+        off += RDT_NONCE_LEN;
+        n = _rdt_decode_handshake_tlv(buf + off, length - off, &msg->tlv);
+        off += (n > 0) ? n : 0;
+    }
 
     return off;
 }
@@ -324,13 +1520,15 @@ int _rdt_decode_handshake_rsp_msg(char* buf, int length, struct rdt_common_msg*
 {
     struct rdt_handshake_rsp_msg* msg = (struct rdt_handshake_rsp_msg*)cmsg;
     int off = 0;
+    int n = 0;
 
     vassert(buf);
-    vassert(length >= sizeof(*msg));
+    vassert(length >= RDT_HANDSHAKE_RSP_MIN_LEN);
     vassert(msg);
 
     off += sizeof(uint8_t);
-    off += sizeof(uint8_t);//padx
+    msg->wscale = *(uint8_t*)(buf + off);
+    off += sizeof(uint8_t);
     msg->rteid = ntohs(*(uint16_t*)(buf + off));
     off += sizeof(uint16_t);
 
@@ -347,6 +1545,25 @@ int _rdt_decode_handshake_rsp_msg(char* buf, int length, struct rdt_common_msg*
     off += sizeof(uint32_t);
     msg->windowsz = ntohl(*(uint32_t*)(buf + off));
     off += sizeof(uint32_t);
+    msg->caps = 0;
+    msg->dict_id = 0;
+    if (length >= off + 2 * sizeof(uint32_t)) {
+        msg->caps = ntohl(*(uint32_t*)(buf + off));
+        off += sizeof(uint32_t);
+        msg->dict_id = ntohl(*(uint32_t*)(buf + off));
+        off += sizeof(uint32_t);
+    }
+    msg->key_id = 0;
+    memset(msg->nonce, 0, RDT_NONCE_LEN);
+    memset(&msg->tlv, 0, sizeof(msg->tlv));
+    if (length >= off + sizeof(uint32_t) + RDT_NONCE_LEN) {
+        msg->key_id = ntohl(*(uint32_t*)(buf + off));
+        off += sizeof(uint32_t);
+        memcpy(msg->nonce, buf + off, RDT_NONCE_LEN);
+        off += RDT_NONCE_LEN;
+        n = _rdt_decode_handshake_tlv(buf + off, length - off, &msg->tlv);
+        off += (n > 0) ? n : 0;
+    }
 
     return off;
 }
@@ -378,6 +1595,276 @@ int _rdt_decode_handshake_fin_msg(char* buf, int length, struct rdt_common_msg*
     return off;
 }
 
+static
+int _rdt_decode_data_nack_msg(char* buf, int length, struct rdt_common_msg* cmsg)
+{
+    struct rdt_data_nack_msg* msg = (struct rdt_data_nack_msg*)cmsg;
+    int off = 0;
+    int i = 0;
+
+    vassert(buf);
+    vassert(length >= 12);
+    vassert(msg);
+
+    off += sizeof(uint8_t);
+    off += sizeof(uint8_t);//padx
+    msg->rteid = ntohs(*(uint16_t*)(buf + off));
+    off += sizeof(uint16_t);
+
+    msg->seq_ack = rdt_expand_seq(ntohl(*(uint32_t*)(buf + off)), sizeof(uint32_t), msg->seq_ref);
+    off += sizeof(uint32_t);
+    msg->nranges = ntohs(*(uint16_t*)(buf + off));
+    off += sizeof(uint16_t);
+    off += sizeof(uint16_t);//pad1
+
+    if (msg->nranges > RDT_NACK_MAX_RANGES) {
+        msg->nranges = RDT_NACK_MAX_RANGES;
+    }
+    if (msg->nranges > (length - off) / (2 * sizeof(uint32_t))) {
+        msg->nranges = (length - off) / (2 * sizeof(uint32_t));
+    }
+
+    for (i = 0; i < msg->nranges; i++) {
+        msg->ranges[i].start = rdt_expand_seq(ntohl(*(uint32_t*)(buf + off)), sizeof(uint32_t), msg->seq_ref);
+        off += sizeof(uint32_t);
+        msg->ranges[i].end = rdt_expand_seq(ntohl(*(uint32_t*)(buf + off)), sizeof(uint32_t), msg->seq_ref);
+        off += sizeof(uint32_t);
+    }
+
+    return off;
+}
+
+static
+int _rdt_decode_stream_msg(char* buf, int length, struct rdt_common_msg* cmsg)
+{
+    struct rdt_stream_msg* msg = (struct rdt_stream_msg*)cmsg;
+    int off = 0;
+
+    vassert(buf);
+    vassert(length >= sizeof(*msg));
+    vassert(msg);
+
+    off += sizeof(uint8_t);
+    off += sizeof(uint8_t);//padx
+    msg->rteid = ntohs(*(uint16_t*)(buf + off));
+    off += sizeof(uint16_t);
+
+    msg->stream_id = ntohs(*(uint16_t*)(buf + off));
+    off += sizeof(uint16_t);
+    msg->stream_type = *(uint8_t*)(buf + off);
+    off += sizeof(uint8_t);
+    off += sizeof(uint8_t);//pad1
+    msg->value = ntohl(*(uint32_t*)(buf + off));
+    off += sizeof(uint32_t);
+
+    return off;
+}
+
+static
+int _rdt_decode_fwd_skip_msg(char* buf, int length, struct rdt_common_msg* cmsg)
+{
+    struct rdt_fwd_skip_msg* msg = (struct rdt_fwd_skip_msg*)cmsg;
+    int off = 0;
+    int i = 0;
+
+    vassert(buf);
+    vassert(length >= 8);
+    vassert(msg);
+
+    off += sizeof(uint8_t);
+    off += sizeof(uint8_t);//padx
+    msg->rteid = ntohs(*(uint16_t*)(buf + off));
+    off += sizeof(uint16_t);
+
+    msg->nranges = ntohs(*(uint16_t*)(buf + off));
+    off += sizeof(uint16_t);
+    off += sizeof(uint16_t);//pad1
+
+    if (msg->nranges > RDT_SKIP_MAX_RANGES) {
+        msg->nranges = RDT_SKIP_MAX_RANGES;
+    }
+    if (msg->nranges > (length - off) / 16) {
+        msg->nranges = (length - off) / 16;
+    }
+
+    for (i = 0; i < msg->nranges; i++) {
+        msg->ranges[i].seq = rdt_expand_seq(ntohl(*(uint32_t*)(buf + off)), sizeof(uint32_t), msg->seq_ref);
+        off += sizeof(uint32_t);
+        msg->ranges[i].len = ntohl(*(uint32_t*)(buf + off));
+        off += sizeof(uint32_t);
+        msg->ranges[i].flags = *(uint8_t*)(buf + off) & RDT_DATA_F_STREAM;
+        off += sizeof(uint8_t);
+        off += sizeof(uint8_t);//pad
+        msg->ranges[i].stream_id = ntohs(*(uint16_t*)(buf + off));
+        off += sizeof(uint16_t);
+        msg->ranges[i].stream_off = ntohl(*(uint32_t*)(buf + off));
+        off += sizeof(uint32_t);
+    }
+
+    return off;
+}
+
+int _rdt_decode_fec_msg(char* buf, int length, struct rdt_common_msg* cmsg)
+{
+    struct rdt_fec_msg* msg = (struct rdt_fec_msg*)cmsg;
+    int off = 0;
+    int i = 0;
+
+    vassert(buf);
+    vassert(length >= RDT_FEC_HDR_LEN);
+    vassert(msg);
+
+    off += sizeof(uint8_t);
+    off += sizeof(uint8_t);//padx
+    msg->rteid = ntohs(*(uint16_t*)(buf + off));
+    off += sizeof(uint16_t);
+
+    msg->base_seq = rdt_expand_seq(ntohl(*(uint32_t*)(buf + off)), sizeof(uint32_t), msg->seq_ref);
+    off += sizeof(uint32_t);
+    msg->k = *(uint8_t*)(buf + off);
+    off += sizeof(uint8_t);
+    msg->index = *(uint8_t*)(buf + off);
+    off += sizeof(uint8_t);
+    msg->symlen = ntohs(*(uint16_t*)(buf + off));
+    off += sizeof(uint16_t);
+
+    if ((msg->k == 0) || (msg->k > RDT_FEC_MAX_K) || (msg->index >= RDT_FEC_MAX_R) ||
+        (length < off + msg->k * 2 + msg->symlen)) {
+        return -1;
+    }
+    for (i = 0; i < msg->k; i++) {
+        msg->plens[i] = ntohs(*(uint16_t*)(buf + off));
+        off += sizeof(uint16_t);
+    }
+    msg->symbol = (uint8_t*)(buf + off);
+    off += msg->symlen;
+
+    return off;
+}
+
+static
+int _rdt_decode_ack_multi_msg(char* buf, int length, struct rdt_common_msg* cmsg)
+{
+    struct rdt_ack_multi_msg* msg = (struct rdt_ack_multi_msg*)cmsg;
+    int off = 0;
+    int i = 0;
+
+    vassert(buf);
+    vassert(msg);
+
+    if (length < RDT_ACK_MULTI_HDR_LEN) {
+        return -1;
+    }
+    off += sizeof(uint8_t);
+    msg->nacks = *(uint8_t*)(buf + off);
+    off += sizeof(uint8_t);
+    if ((msg->nacks > RDT_ACK_MULTI_MAX) ||
+        (length < off + msg->nacks * RDT_ACK_MULTI_ENTRY_LEN)) {
+        return -1;
+    }
+
+    for (i = 0; i < msg->nacks; i++) {
+        msg->acks[i].teid = ntohs(*(uint16_t*)(buf + off));
+        off += sizeof(uint16_t);
+        msg->acks[i].seq_ack = ntohl(*(uint32_t*)(buf + off));
+        off += sizeof(uint32_t);
+        msg->acks[i].seq_recv = ntohl(*(uint32_t*)(buf + off));
+        off += sizeof(uint32_t);
+        msg->acks[i].windowsz = ntohl(*(uint32_t*)(buf + off));
+        off += sizeof(uint32_t);
+    }
+
+    return off;
+}
+
+/*
+ * Probe and its ack share the layout, padding of probe is left unread.
+ */
+static
+int _rdt_decode_pmtu_msg(char* buf, int length, struct rdt_common_msg* cmsg)
+{
+    struct rdt_pmtu_msg* msg = (struct rdt_pmtu_msg*)cmsg;
+    int off = 0;
+
+    vassert(buf);
+    vassert(msg);
+
+    if (length < RDT_PMTU_HDR_LEN) {
+        return -1;
+    }
+    off += sizeof(uint8_t);
+    off += sizeof(uint8_t);//padx
+    msg->rteid = ntohs(*(uint16_t*)(buf + off));
+    off += sizeof(uint16_t);
+
+    msg->probe_id = ntohl(*(uint32_t*)(buf + off));
+    off += sizeof(uint32_t);
+    msg->size = ntohl(*(uint32_t*)(buf + off));
+    off += sizeof(uint32_t);
+
+    return length;
+}
+
+/*
+ * Data of fragment is left in @buf, msg->data points to it.
+ */
+static
+int _rdt_decode_frag_msg(char* buf, int length, struct rdt_common_msg* cmsg)
+{
+    struct rdt_frag_msg* msg = (struct rdt_frag_msg*)cmsg;
+    int off = 0;
+
+    vassert(buf);
+    vassert(msg);
+
+    if (length <= RDT_FRAG_HDR_LEN || length > RDT_FRAG_HDR_LEN + RDT_FRAG_LEN) {
+        return -1;
+    }
+    off += sizeof(uint8_t);
+    off += sizeof(uint8_t);//padx
+    msg->rteid = ntohs(*(uint16_t*)(buf + off));
+    off += sizeof(uint16_t);
+
+    msg->frag_id = ntohl(*(uint32_t*)(buf + off));
+    off += sizeof(uint32_t);
+    msg->index = *(uint8_t*)(buf + off);
+    off += sizeof(uint8_t);
+    msg->count = *(uint8_t*)(buf + off);
+    off += sizeof(uint8_t);
+    if (!msg->count || msg->count > RDT_FRAG_MAX || msg->index >= msg->count) {
+        return -1;
+    }
+    msg->len  = length - off;
+    msg->data = (uint8_t*)buf + off;
+    //Only the last one may be short
+    if ((msg->index + 1 < msg->count) && (msg->len != RDT_FRAG_LEN)) {
+        return -1;
+    }
+    return length;
+}
+
+static
+int _rdt_decode_ticket_msg(char* buf, int length, struct rdt_common_msg* cmsg)
+{
+    struct rdt_ticket_msg* msg = (struct rdt_ticket_msg*)cmsg;
+    int off = 0;
+
+    vassert(buf);
+    vassert(msg);
+
+    if (length <= RDT_TICKET_HDR_LEN || length > RDT_TICKET_HDR_LEN + RDT_TICKET_MAX) {
+        return -1;
+    }
+    off += sizeof(uint8_t);
+    off += sizeof(uint8_t);//padx
+    msg->rteid = ntohs(*(uint16_t*)(buf + off));
+    off += sizeof(uint16_t);
+
+    msg->len = (uint8_t)(length - off);
+    memcpy(msg->ticket, buf + off, msg->len);
+    return length;
+}
+
 struct rdt_dec_ops rdt_dec_ops = {
     .data          = _rdt_decode_data_msg,
     .data_ack      = _rdt_decode_data_ack_msg,
@@ -385,6 +1872,15 @@ struct rdt_dec_ops rdt_dec_ops = {
     .shutdown      = _rdt_decode_shutdown_msg,
     .handshake_req = _rdt_decode_handshake_req_msg,
     .handshake_rsp = _rdt_decode_handshake_rsp_msg,
-    .handshake_fin = _rdt_decode_handshake_fin_msg
+    .handshake_fin = _rdt_decode_handshake_fin_msg,
+    .data_nack     = _rdt_decode_data_nack_msg,
+    .stream        = _rdt_decode_stream_msg,
+    .fwd_skip      = _rdt_decode_fwd_skip_msg,
+    .fec           = _rdt_decode_fec_msg,
+    .ack_compact   = _rdt_decode_ack_compact_msg,
+    .ack_multi     = _rdt_decode_ack_multi_msg,
+    .pmtu          = _rdt_decode_pmtu_msg,
+    .frag          = _rdt_decode_frag_msg,
+    .ticket        = _rdt_decode_ticket_msg
 };
 
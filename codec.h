@@ -27,6 +27,17 @@ enum {
     CTRL_MSG_KEEPALIVE = ((uint8_t)0x1),
     CTRL_MSG_ACK       = ((uint8_t)0x2),
     CTRL_MSG_SHUTDOWN  = ((uint8_t)0x3),
+    CTRL_MSG_NACK      = ((uint8_t)0x4),
+    CTRL_MSG_STREAM    = ((uint8_t)0x5),
+    CTRL_MSG_FWD_SKIP  = ((uint8_t)0x6),
+    CTRL_MSG_FEC       = ((uint8_t)0x7),
+    CTRL_MSG_ACK_COMPACT = ((uint8_t)0x8),
+    CTRL_MSG_BUNDLE    = ((uint8_t)0x9),
+    CTRL_MSG_ACK_MULTI = ((uint8_t)0xa),
+    CTRL_MSG_PMTU_PROBE = ((uint8_t)0xb),
+    CTRL_MSG_PMTU_ACK  = ((uint8_t)0xc),
+    CTRL_MSG_FRAG      = ((uint8_t)0xd),
+    CTRL_MSG_TICKET    = ((uint8_t)0xe),
     CTRL_MSG_BUTT
 };
 
@@ -39,6 +50,70 @@ enum {
 
 #define HANDSHAKE_REQ_MAGIC ((uint32_t)0xB532A79B)
 
+/* flags of data msg, carried in padx of header */
+#define RDT_DATA_F_STREAM   ((uint8_t)0x01)   //Stream id and offset follow seq
+#define RDT_DATA_F_FIN      ((uint8_t)0x02)   //Last pkt of stream, one pad byte of payload
+#define RDT_DATA_F_CRC      ((uint8_t)0x04)   //CRC32C trailer over payload then header
+#define RDT_DATA_F_LZ       ((uint8_t)0x08)   //Payload is its 2 bytes raw length then a vlz block
+#define RDT_DATA_F_DICT     ((uint8_t)0x10)   //vlz block refers back into the preset dictionary
+#define RDT_DATA_F_SEAL     ((uint8_t)0x20)   //Pkt number follows header, payload sealed with tag trailer
+#define RDT_DATA_F_SKIP     ((uint8_t)0x80)   //Placeholder in rxq for data peer gave up, never on wire
+
+/*
+ * Compact data header, used once RDT_CAP_COMPACT is agreed on:
+ *   fmt(1) | flags(1, if CF_FLAGS) | teid(1-3) | seq(1-4) | ack(8, if CF_ACK)
+ * followed by stream header and pkt number as in the full header. Teid is
+ * a prefix varint: 0xxxxxxx, 10xxxxxx xxxxxxxx, or 11000000 then 16 bits.
+ * Seq is cut to its low bytes, and expanded again to the nearest value to
+ * seq receiver expects.
+ */
+#define RDT_DATA_CF_COMPACT ((uint8_t)0x02)   //Marks compact header, full one starts with 0
+#define RDT_DATA_CF_SEQ_SHIFT 2               //Seq bytes minus one, 2 bits
+#define RDT_DATA_CF_ACK     ((uint8_t)0x10)   //Cumulative ack and window piggybacked
+#define RDT_DATA_CF_FLAGS   ((uint8_t)0x20)   //RDT_DATA_F_XXX byte follows, 0 if absent
+#define RDT_DATA_CF_RSVD    ((uint8_t)0xc0)
+
+#define RDT_DATA_HDR_LEN        8
+#define RDT_DATA_MIN_LEN        3       //Shortest compact header, fmt, teid and seq of a byte each
+#define RDT_DATA_STREAM_HDR_LEN 16
+#define RDT_DATA_CRC_LEN        4
+#define RDT_DATA_PN_LEN         8
+#define RDT_DATA_TAG_LEN        16
+#define RDT_DATA_ACK_ROOM       9       //Headroom of compact data msg, so a piggybacked ack always fits
+#define RDT_NONCE_LEN           8       //Handshake nonce each end picks
+#define RDT_HANDSHAKE_REQ_MIN_LEN 24    //Request of peers without dict id
+#define RDT_HANDSHAKE_RSP_MIN_LEN 24    //Response of peers without caps
+#define RDT_HANDSHAKE_TLV_MAX   32      //Room for params after fixed part of handshake
+#define RDT_LZ_MIN_LEN          64      //Shorter payloads are not worth compressing
+
+/* capabilities offered in handshake */
+#define RDT_CAP_CRC32C      ((uint32_t)0x01)  //Data msgs may carry RDT_DATA_F_CRC
+#define RDT_CAP_LZ          ((uint32_t)0x02)  //Data msgs may carry RDT_DATA_F_LZ
+#define RDT_CAP_LZ_DICT     ((uint32_t)0x04)  //Both hold the preset dictionary of dict_id
+#define RDT_CAP_AEAD        ((uint32_t)0x08)  //Both hold the pre-shared key of key_id, data msgs sealed
+#define RDT_CAP_COMPACT     ((uint32_t)0x10)  //Compact data header and CTRL_MSG_ACK_COMPACT
+#define RDT_CAP_BUNDLE      ((uint32_t)0x20)  //Msgs may come in CTRL_MSG_BUNDLE
+#define RDT_CAP_ACK_AGG     ((uint32_t)0x40)  //Acks may come in CTRL_MSG_ACK_MULTI
+#define RDT_CAP_PMTUD       ((uint32_t)0x80)  //CTRL_MSG_PMTU_PROBE is answered with CTRL_MSG_PMTU_ACK, CTRL_MSG_FRAG taken
+#define RDT_CAP_RESUME      ((uint32_t)0x100) //Responder sends CTRL_MSG_TICKET, handshake req may present one
+
+/*
+ * Bundle of msgs in one datagram:
+ *   type(1) | len(1-2) | msg | len(1-2) | msg ...
+ * Len is 0xxxxxxx, or 1xxxxxxx xxxxxxxx for msgs up to RDT_BUNDLE_MSG_MAX.
+ */
+#define RDT_BUNDLE_HDR_LEN  1
+#define RDT_BUNDLE_MSG_MAX  0x7fff
+
+#define RDT_MAX_STREAMS         256
+#define RDT_STREAM_INIT_CREDIT  (256 * 1024)  //Bytes a new stream may send before any grant
+
+enum {
+    RDT_STREAM_CREDIT  = ((uint8_t)0x0),  //Receiver grants sending up to offset
+    RDT_STREAM_BLOCKED = ((uint8_t)0x1),  //Sender ran out of credit at offset
+    RDT_STREAM_BUTT
+};
+
 #define RDT_MSG_HEADER \
     uint8_t type:1; \
     uint8_t ctrlId:7; \
@@ -46,7 +121,10 @@ enum {
     uint16_t rteid
 
 #define RDT_HANDSHAKE_MSG_HEADER \
-    RDT_MSG_HEADER; \
+    uint8_t type:1; \
+    uint8_t ctrlId:7; \
+    uint8_t wscale; /* window scale shift of sender */ \
+    uint16_t rteid; \
     uint16_t version:14; \
     uint16_t handshake_type:2; \
     uint16_t lteid \
@@ -57,7 +135,16 @@ struct rdt_common_msg {
 
 struct rdt_data_msg {
     RDT_MSG_HEADER;
-    uint32_t seq;
+    uint64_t seq;
+    uint8_t  flags;         //RDT_DATA_F_XXX
+    uint16_t stream_id;
+    uint32_t stream_off;    //Offset of payload in stream
+    const uint8_t* key;     //Key to open sealed msg with, set by caller of decode
+    uint64_t seq_ref;       //Truncated seq expands near it, set by caller of decode
+    uint64_t ack_ref;       //Same for piggybacked ack, which is in reverse seq space
+    uint8_t  has_ack;       //Piggybacked ack below is valid
+    uint64_t seq_ack;
+    uint32_t windowsz;
     int32_t len;
     void*  data;
 //    uint32_t data[1];
@@ -65,10 +152,97 @@ struct rdt_data_msg {
 
 struct rdt_data_ack_msg {
     RDT_MSG_HEADER;
-    uint32_t seq_ack;
+    uint64_t seq_ack;
+    uint32_t windowsz;
+    uint64_t seq_recv;  //Seq of the pkt triggering this ack, 0 if none
+    uint64_t seq_ref;   //Seqs expand near it on decode
+    uint32_t span;      //Compact: seqs may be this far from peer's reference on encode
+};
+
+/*
+ * Acks of several tunnels on a channel in one msg:
+ *   type(1) | nacks(1) | { teid(2) | seq_ack(4) | seq_recv(4) | window(4) } ...
+ */
+#define RDT_ACK_MULTI_MAX       16
+#define RDT_ACK_MULTI_HDR_LEN   2
+#define RDT_ACK_MULTI_ENTRY_LEN 14
+
+struct rdt_ack_entry {
+    uint16_t teid;          //Tunnel of the end receiving this ack
+    uint32_t seq_ack;       //As on wire, expanded by the tunnel it is for
+    uint32_t seq_recv;      //From rdt_trunc_recv
     uint32_t windowsz;
 };
 
+struct rdt_ack_multi_msg {
+    uint8_t type:1;
+    uint8_t ctrlId:7;
+    uint8_t nacks;
+    struct rdt_ack_entry acks[RDT_ACK_MULTI_MAX];
+};
+
+#define RDT_NACK_MAX_RANGES 16
+
+struct rdt_nack_range {
+    uint64_t start;
+    uint64_t end;
+};
+
+struct rdt_data_nack_msg {
+    RDT_MSG_HEADER;
+    uint64_t seq_ack;
+    uint64_t seq_ref;       //Seqs expand near it, set by caller of decode
+    uint16_t nranges;
+    uint16_t pad1;
+    struct rdt_nack_range ranges[RDT_NACK_MAX_RANGES];
+};
+
+#define RDT_FEC_MAX_K           32      //Most data pkts in one FEC block
+#define RDT_FEC_MAX_R           8       //Most repair pkts of one FEC block
+#define RDT_FEC_HDR_LEN         12
+#define RDT_SKIP_MAX_RANGES 16
+
+/* A data pkt sender gave up, receiver takes it as received without data */
+struct rdt_skip_range {
+    uint64_t seq;
+    uint32_t len;           //Seq space taken
+    uint8_t  flags;         //RDT_DATA_F_STREAM if it had stream header
+    uint16_t stream_id;
+    uint32_t stream_off;
+};
+
+struct rdt_fwd_skip_msg {
+    RDT_MSG_HEADER;
+    uint64_t seq_ref;       //Seqs expand near it, set by caller of decode
+    uint16_t nranges;
+    uint16_t pad1;
+    struct rdt_skip_range ranges[RDT_SKIP_MAX_RANGES];
+};
+
+/*
+ * Repair pkt of a block of k data pkts sent back to back. Data pkt i of
+ * block has seq base_seq + sum of plens before it. Symbol is the coded
+ * data msgs, each prefixed by its 2 bytes length and padded to symlen.
+ */
+struct rdt_fec_msg {
+    RDT_MSG_HEADER;
+    uint64_t base_seq;
+    uint64_t seq_ref;               //Base seq expands near it, set by caller of decode
+    uint8_t  k;
+    uint8_t  index;                 //Which repair of the block
+    uint16_t symlen;
+    uint16_t plens[RDT_FEC_MAX_K];  //Seq space each data pkt takes
+    uint8_t* symbol;
+};
+
+struct rdt_stream_msg {
+    RDT_MSG_HEADER;
+    uint16_t stream_id;
+    uint8_t  stream_type;   //RDT_STREAM_XXX
+    uint8_t  pad1;
+    uint32_t value;         //Granted or blocked offset
+};
+
 struct rdt_keepalive_msg {
     RDT_MSG_HEADER;
 };
@@ -77,12 +251,90 @@ struct rdt_shutdown_msg {
     RDT_MSG_HEADER;
 };
 
+/*
+ * Probe of path mtu, padded with zeros up to size, and its ack telling
+ * the size it arrived with:
+ *   type(1) | pad(1) | teid(2) | probe_id(4) | size(4) | zeros ...
+ */
+#define RDT_PMTU_HDR_LEN    12
+
+struct rdt_pmtu_msg {
+    RDT_MSG_HEADER;
+    uint32_t probe_id;
+    uint32_t size;
+};
+
+/*
+ * Piece of a data msg too big for path mtu, each but the last one carries
+ * RDT_FRAG_LEN bytes of it:
+ *   type(1) | pad(1) | teid(2) | frag_id(4) | index(1) | count(1) | data ...
+ */
+#define RDT_FRAG_HDR_LEN    10
+#define RDT_FRAG_LEN        1200    //Fits the smallest path mtu with room to spare
+#define RDT_FRAG_MAX        64
+
+struct rdt_frag_msg {
+    RDT_MSG_HEADER;
+    uint32_t frag_id;
+    uint8_t  index;
+    uint8_t  count;
+    int      len;
+    uint8_t* data;
+};
+
+/*
+ * Resumption ticket from responder, opaque to the end keeping it:
+ *   type(1) | pad(1) | teid(2) | ticket ...
+ */
+#define RDT_TICKET_HDR_LEN  4
+#define RDT_TICKET_LEN      48
+#define RDT_TICKET_MAX      64      //Longest ticket taken, for them to grow
+
+struct rdt_ticket_msg {
+    RDT_MSG_HEADER;
+    uint8_t len;
+    uint8_t ticket[RDT_TICKET_MAX];
+};
+
+/*
+ * Params after the fixed part of handshake req and rsp, each as
+ *   type(1) | len(1) | value(len)
+ * Older peers stop reading before them and types a peer does not know are
+ * skipped, so a new param needs neither a fixed field nor a new version.
+ */
+#define RDT_TLV_ACK_DELAY       1       //uint16_t, ms ack of in order data may be held back
+#define RDT_TLV_EARLY_DATA      2       //Bytes of first write, repeated as needed and joined up
+#define RDT_TLV_EARLY_ACK       3       //uint16_t, bytes of early data responder took
+#define RDT_TLV_TICKET          4       //Resumption ticket got from responder before
+#define RDT_TLV_RESUMED         5       //uint8_t, 1 if responder took the ticket
+#define RDT_TLV_ORDER           6       //uint8_t, RDT_ORDER_XXX sender delivers data in
+
+#define RDT_ORDER_IN            1       //Data goes up in order as bytes, writes may be split
+#define RDT_ORDER_NONE          2       //Each msg goes up on its own as it arrives
+
+#define RDT_EARLY_DATA_MAX      1024    //Keeps handshake req within the smallest path mtu
+
+struct rdt_handshake_tlv {
+    uint16_t ack_delay;     //RDT_TLV_ACK_DELAY, 0 if absent
+    uint16_t early_ack;     //RDT_TLV_EARLY_ACK, 0 if absent
+    uint16_t early_len;     //RDT_TLV_EARLY_DATA, 0 if absent
+    uint8_t  early[RDT_EARLY_DATA_MAX];
+    uint8_t  resumed;       //RDT_TLV_RESUMED, 0 if absent
+    uint8_t  order;         //RDT_TLV_ORDER, 0 if absent
+    uint8_t  ticket_len;    //RDT_TLV_TICKET, 0 if absent
+    uint8_t  ticket[RDT_TICKET_MAX];
+};
+
 struct rdt_handshake_req_msg {
     RDT_HANDSHAKE_MSG_HEADER;
     uint32_t seq;
-    uint32_t pad1;
+    uint32_t caps;          //RDT_CAP_XXX offered
     uint32_t mtu;
     uint32_t windowsz;
+    uint32_t dict_id;       //CRC32C of preset dictionary, absent from older peers
+    uint32_t key_id;        //Tells pre-shared key apart, absent from older peers
+    uint8_t  nonce[RDT_NONCE_LEN];
+    struct rdt_handshake_tlv tlv;
 };
 
 struct rdt_handshake_rsp_msg {
@@ -91,6 +343,11 @@ struct rdt_handshake_rsp_msg {
     uint32_t seq_ack;
     uint32_t mtu;
     uint32_t windowsz;
+    uint32_t caps;          //RDT_CAP_XXX agreed on, absent from older peers
+    uint32_t dict_id;
+    uint32_t key_id;        //Absent from older peers too
+    uint8_t  nonce[RDT_NONCE_LEN];
+    struct rdt_handshake_tlv tlv;
 };
 
 struct rdt_handshake_fin_msg {
@@ -107,6 +364,16 @@ struct rdt_enc_ops {
     int (*handshake_req)(struct rdt_common_msg*, char*, int);
     int (*handshake_rsp)(struct rdt_common_msg*, char*, int);
     int (*handshake_fin)(struct rdt_common_msg*, char*, int);
+    int (*data_nack)    (struct rdt_common_msg*, char*, int);
+    int (*stream)       (struct rdt_common_msg*, char*, int);
+    int (*fwd_skip)     (struct rdt_common_msg*, char*, int);
+    int (*fec)          (struct rdt_common_msg*, char*, int);
+    int (*ack_compact)  (struct rdt_common_msg*, char*, int);
+    int (*ack_multi)    (struct rdt_common_msg*, char*, int);
+    int (*pmtu_probe)   (struct rdt_common_msg*, char*, int);
+    int (*pmtu_ack)     (struct rdt_common_msg*, char*, int);
+    int (*frag)         (struct rdt_common_msg*, char*, int);
+    int (*ticket)       (struct rdt_common_msg*, char*, int);
 };
 
 struct rdt_dec_ops {
@@ -117,19 +384,62 @@ struct rdt_dec_ops {
     int (*handshake_req)(char*, int, struct rdt_common_msg*);
     int (*handshake_rsp)(char*, int, struct rdt_common_msg*);
     int (*handshake_fin)(char*, int, struct rdt_common_msg*);
+    int (*data_nack)    (char*, int, struct rdt_common_msg*);
+    int (*stream)       (char*, int, struct rdt_common_msg*);
+    int (*fwd_skip)     (char*, int, struct rdt_common_msg*);
+    int (*fec)          (char*, int, struct rdt_common_msg*);
+    int (*ack_compact)  (char*, int, struct rdt_common_msg*);
+    int (*ack_multi)    (char*, int, struct rdt_common_msg*);
+    int (*pmtu)         (char*, int, struct rdt_common_msg*);
+    int (*frag)         (char*, int, struct rdt_common_msg*);
+    int (*ticket)       (char*, int, struct rdt_common_msg*);
 };
 
 typedef struct data_encoded_pkt{
-    uint32_t seq;
+    uint64_t seq;
     uint32_t len;
+    uint32_t plen;      //Payload length
+    uint8_t  prio;      //Send lane
+    uint8_t  lost;      //Reported lost by peer, waiting for resend
+    uint8_t  resent;    //Sent more than once
+    uint8_t  sacked;    //Peer received it out of order
+    uint8_t  flags;     //RDT_DATA_F_XXX in header
+    uint8_t  compact;   //Header is made compact when sent first
+    uint8_t  hoff;      //Msg on wire starts at data + hoff, headroom left after header is done
+    uint32_t span;      //Seq span for compact header, set with seq
+    uint16_t stream_id;
+    uint32_t stream_off;
+    uint64_t deadline;  //Given up instead of sent after this time, 0 for never
+    uint64_t xmit_ts;   //Time of last transmission
     uint8_t* data;
 } data_encoded_pkt_t;
 
+int rdt_set_data_seq(char* buf, int length, uint64_t seq, uint32_t span, const struct rdt_data_ack_msg* ack);
+int rdt_data_payload_len(const char* buf, int length);
+int rdt_set_lz_dict(const void* data, int len);
+uint32_t rdt_lz_dict_id(void);
+int rdt_lz_compress(uint8_t* dst, int cap, const void* src, int len, int use_dict);
+int rdt_data_hdr_len(uint8_t flags);
+int rdt_seal_data(char* buf, int length, const uint8_t* key, uint64_t pn);
+uint16_t rdt_data_teid(const char* buf, int length);
+uint16_t rdt_ack_compact_teid(const char* buf, int length);
+int rdt_seq_bytes(uint32_t span);
+uint64_t rdt_expand_seq(uint32_t trunc, int nbytes, uint64_t ref);
+uint32_t rdt_trunc_recv(uint64_t seq_recv, uint64_t seq_ack);
+uint64_t rdt_expand_recv(uint32_t trunc, uint64_t seq_ack);
+uint16_t rdt_ctrl_teid(const char* buf, int length);
+int rdt_bundle_init(char* buf);
+int rdt_bundle_add(char* buf, int avail, const void* msg, int len);
+int rdt_bundle_next(const char* buf, int length, int* off);
+
 typedef struct data_pkt{
     struct vlist list;
-    uint32_t seq;
+    uint64_t seq;
     uint16_t teid;
     uint16_t len;
+    uint8_t  flags;     //RDT_DATA_F_XXX
+    uint16_t stream_id;
+    uint32_t stream_off;
     uint8_t* data;
 } data_pkt_t;
 
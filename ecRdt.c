@@ -16,6 +16,9 @@
 #include "tunnel.h"
 #include "receiver.h"
 #include "vassert.h"
+#include "vgf.h"
+#include "vcrc.h"
+#include "vaead.h"
 
 ecRdtInitializer g_rdtOpendCallback = {.onRdtOpened = NULL};
 uint8_t g_rdtInitialized = 0;
@@ -31,6 +34,9 @@ int ecRdtModuleInitialize(ecRdtInitializer* initializer)
     retE((g_rdtInitialized), ECRDT_E_ALREADY_STARTED);
 
     g_rdtOpendCallback.onRdtOpened = initializer->onRdtOpened;
+    vgf_init();
+    vcrc_init();
+    vaead_init();
     session_set_cb(on_session_data, 0);
     g_rdtInitialized = 1;
 
@@ -46,6 +52,7 @@ int ecRdtModuleDestroy(void)
 
     g_rdtOpendCallback.onRdtOpened = NULL;
     destroy_all_tunnel();
+    ticket_forget();
     g_rdtInitialized = 0;
     return 0;
 }
@@ -60,10 +67,9 @@ int ecRdtOpen(int sessionId, int channelId, ecRdtHandler* handler)
     retE((channelId <= 0), err);
     retE((!handler), err);
     retE((!handler->onClosed), err);
-    retE((!handler->onData), err);
     retE((!g_rdtInitialized), ECRDT_E_NOT_STARTED);
 
-    ret = create_tunnel(sessionId, channelId, handler, &tunnel);
+    ret = create_tunnel(sessionId, channelId, handler, NULL, 0, &tunnel);
     if (ret < 0) {
         vlogE("Create tunnel failed");
         return -1;
@@ -72,6 +78,43 @@ int ecRdtOpen(int sessionId, int channelId, ecRdtHandler* handler)
     return tunnel->teid;
 }
 
+int ecRdtOpenWithData(int sessionId, int channelId, ecRdtHandler* handler, const void* data, int length)
+{
+    int err = ECRDT_E_BAD_PARAM;
+    rdt_tunnel_t* tunnel = NULL;
+    int early_len = 0;
+    int ret = 0;
+
+    retE((sessionId <= 0), err);
+    retE((channelId <= 0), err);
+    retE((!handler), err);
+    retE((!handler->onClosed), err);
+    retE((!data), err);
+    retE((length <= 0), err);
+    retE((!g_rdtInitialized), ECRDT_E_NOT_STARTED);
+
+    //Too long to go in handshake req, all of it is written after
+    early_len = (length <= RDT_EARLY_DATA_MAX) ? length : 0;
+    ret = create_tunnel(sessionId, channelId, handler, early_len ? data : NULL, early_len, &tunnel);
+    if (ret < 0) {
+        vlogE("Create tunnel failed");
+        return -1;
+    }
+
+    if (early_len > 0 && !tunnel->early_data) {
+        //Peer took it with handshake
+        return tunnel->teid;
+    }
+    tunnel->early_data = NULL;
+    tunnel->early_len = 0;
+    ret = tunnel_send_data(tunnel, data, length, NULL);
+    if (ret < 0) {
+        destroy_tunnel(tunnel, 1);
+        return ret;
+    }
+    return tunnel->teid;
+}
+
 int ecRdtClose(int rdtId)
 {
     rdt_tunnel_t* tunnel = NULL;
@@ -105,7 +148,128 @@ int ecRdtWrite(int rdtId, const void* data, int length)
         return ECRDT_E_BAD_RDT_TUNNEL;
     }
 
-    return tunnel_send_data(tunnel, data, length);
+    return tunnel_send_data(tunnel, data, length, NULL);
+}
+
+int ecRdtWriteEx(int rdtId, const void* data, int length, const ecRdtWriteParams* params)
+{
+    int err = ECRDT_E_BAD_PARAM;
+    rdt_tunnel_t* tunnel = NULL;
+
+    retE((rdtId < 0), err);
+    retE((!data), err);
+    retE((length <= 0), err);
+    retE((params && (params->priority < 0 || params->priority >= ECRDT_PRIO_BUTT)), err);
+    retE((params && (params->streamId < 0 || params->streamId > 0xffff)), err);
+    retE((params && (params->ttl < 0)), err);
+    retE((!g_rdtInitialized), ECRDT_E_NOT_STARTED);
+
+    tunnel = get_tunnel(rdtId);
+    if (!tunnel) {
+        vlogE("No such tunnel exists");
+        return ECRDT_E_BAD_RDT_TUNNEL;
+    }
+
+    return tunnel_send_data(tunnel, data, length, params);
+}
+
+int ecRdtStreamOpen(int rdtId)
+{
+    rdt_tunnel_t* tunnel = NULL;
+
+    retE((rdtId <= 0), ECRDT_E_BAD_PARAM);
+    retE((!g_rdtInitialized), ECRDT_E_NOT_STARTED);
+
+    tunnel = get_tunnel(rdtId);
+    if (!tunnel) {
+        vlogE("No such tunnel exists");
+        return ECRDT_E_BAD_RDT_TUNNEL;
+    }
+
+    return tunnel_stream_open(tunnel);
+}
+
+int ecRdtStreamClose(int rdtId, int streamId)
+{
+    rdt_tunnel_t* tunnel = NULL;
+
+    retE((rdtId <= 0), ECRDT_E_BAD_PARAM);
+    retE((streamId <= 0 || streamId > 0xffff), ECRDT_E_BAD_PARAM);
+    retE((!g_rdtInitialized), ECRDT_E_NOT_STARTED);
+
+    tunnel = get_tunnel(rdtId);
+    if (!tunnel) {
+        vlogE("No such tunnel exists");
+        return ECRDT_E_BAD_RDT_TUNNEL;
+    }
+
+    return tunnel_stream_close(tunnel, streamId);
+}
+
+int ecRdtRead(int rdtId, void* buf, int length, int timeout)
+{
+    struct iovec iov;
+
+    retE((!buf), ECRDT_E_BAD_PARAM);
+    retE((length <= 0), ECRDT_E_BAD_PARAM);
+
+    iov.iov_base = buf;
+    iov.iov_len  = length;
+    return ecRdtReadv(rdtId, &iov, 1, timeout);
+}
+
+int ecRdtReadv(int rdtId, const struct iovec* iov, int iovcnt, int timeout)
+{
+    int err = ECRDT_E_BAD_PARAM;
+    rdt_tunnel_t* tunnel = NULL;
+
+    retE((rdtId < 0), err);
+    retE((!iov), err);
+    retE((iovcnt <= 0), err);
+    retE((!g_rdtInitialized), ECRDT_E_NOT_STARTED);
+
+    tunnel = get_tunnel(rdtId);
+    if (!tunnel) {
+        vlogE("No such tunnel exists");
+        return ECRDT_E_BAD_RDT_TUNNEL;
+    }
+
+    return tunnel_read_data(tunnel, iov, iovcnt, timeout);
+}
+
+int ecRdtSetOption(int rdtId, int option, const void* value, int length)
+{
+    int err = ECRDT_E_BAD_PARAM;
+    rdt_tunnel_t* tunnel = NULL;
+
+    retE((rdtId < 0), err);
+    retE((option <= 0 || option >= ECRDT_OPT_BUTT), err);
+    retE((!value), err);
+    retE((length <= 0), err);
+    retE((!g_rdtInitialized), ECRDT_E_NOT_STARTED);
+
+    if (rdtId == 0) {
+        return tunnel_set_option(NULL, option, value, length);
+    }
+
+    tunnel = get_tunnel(rdtId);
+    if (!tunnel) {
+        vlogE("No such tunnel exists");
+        return ECRDT_E_BAD_RDT_TUNNEL;
+    }
+
+    return tunnel_set_option(tunnel, option, value, length);
+}
+
+int ecRdtSetChannelLimit(int sessionId, int channelId, unsigned int rate, unsigned int burst)
+{
+    int err = ECRDT_E_BAD_PARAM;
+
+    retE((sessionId <= 0), err);
+    retE((channelId <= 0), err);
+    retE((!g_rdtInitialized), ECRDT_E_NOT_STARTED);
+
+    return channel_set_limit(sessionId, channelId, rate, burst);
 }
 
 int ecRdtGetInfo(int rdtId, ecRdtInfo* info)
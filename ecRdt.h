@@ -20,6 +20,7 @@ extern "C" {
 #endif
 
 #include <stdint.h>
+#include <sys/uio.h>
 
 #ifndef _ECERR
 #define _ECERR(e) ((uint32_t)e)
@@ -36,6 +37,46 @@ extern "C" {
 #define ECRDT_E_NETWORK             _ECERR(0x8000300A)
 #define ECRDT_E_UNKOWN              _ECERR(0x8000300B)
 #define ECRDT_E_NOT_IMPLEMENTED     _ECERR(0x8000300C)
+#define ECRDT_E_TIMEOUT             _ECERR(0x8000300D)
+
+/* options for ecRdtSetOption */
+enum {
+    ECRDT_OPT_RCVBUF_MAX = 1,   ///< uint32_t. Ceiling in bytes of auto-tuned receive buffer.
+    ECRDT_OPT_PACING_RATE,      ///< uint32_t. Bytes per second to pace sending at, 0 derives it from cwnd/rtt.
+    ECRDT_OPT_RATE_LIMIT,       ///< uint32_t. Sustained send rate cap in bytes per second, 0 for none.
+    ECRDT_OPT_RATE_BURST,       ///< uint32_t. Bytes allowed to go out above the rate cap at once, 0 for 100ms worth.
+    ECRDT_OPT_SNDBUF,           ///< uint32_t. Bytes queued for sending before ecRdtWrite blocks.
+    ECRDT_OPT_WEIGHT,           ///< uint32_t. 1-64, share of the channel a tunnel gets when tunnels compete.
+    ECRDT_OPT_UNORDERED,        ///< uint32_t. 1 to deliver each message (one write of peer) as soon as it arrives, set before the tunnel opens as peer is told in handshake.
+    ECRDT_OPT_FEC_BLOCK,        ///< uint32_t. 2-32, data pkts protected by one block of FEC repairs, 0 for no FEC.
+    ECRDT_OPT_FEC_REPAIR,       ///< uint32_t. 1-8, repair pkts sent per FEC block, each recovers one lost pkt.
+    ECRDT_OPT_CHECKSUM,         ///< uint32_t. 1 to CRC32C data msgs if peer agrees, set before the tunnel opens.
+    ECRDT_OPT_COMPRESS,         ///< uint32_t. 1 to compress data msgs if peer agrees, set before the tunnel opens.
+    ECRDT_OPT_COMPRESS_DICT,    ///< Bytes, up to 64KB. Preset dictionary for compression, rdtId 0 only and set once. Used with peers holding the same one.
+    ECRDT_OPT_COMPACT_HDR,      ///< uint32_t. 1 to send data and ack msgs with compact headers if peer agrees, set before the tunnel opens.
+    ECRDT_OPT_PSK,              ///< 32 bytes. Pre-shared key to encrypt and authenticate data msgs with, set before the tunnel opens. Peers without the same one fail to open.
+    ECRDT_OPT_ACK_DELAY,        ///< uint32_t. 0-100, ms an ack may be held back for data sent to peer to carry it, with compact headers only. 0 acks at once.
+    ECRDT_OPT_BUNDLE,           ///< uint32_t. 1 to send msgs of tunnels on the same channel ready at once in one datagram if peer agrees, set before the tunnel opens.
+    ECRDT_OPT_ACK_AGGREGATE,    ///< uint32_t. 1 to ack data of tunnels on the same channel in one msg if peer agrees, set before the tunnel opens.
+    ECRDT_OPT_PMTU_MAX,         ///< uint32_t. 1232-65000, largest udp payload to probe the path for if peer agrees, set before the tunnel opens. Probes need the session layer to send with don't fragment set. 0 for no probing, datagrams stay within 1500. Writes are split to fit only if peer agrees and does not set ECRDT_OPT_UNORDERED.
+    ECRDT_OPT_RESUME,           ///< uint32_t. 1 to take resumption tickets from peer and issue them to it if peer agrees, set before the tunnel opens. A tunnel reopened on the channel with one is ready after one msg each way and starts with the rtt and cwnd it had.
+    ECRDT_OPT_BUTT
+};
+
+/* priority classes for ecRdtWriteEx, lower value goes out first */
+enum {
+    ECRDT_PRIO_URGENT = 0,
+    ECRDT_PRIO_HIGH,
+    ECRDT_PRIO_NORMAL,          ///< Used by ecRdtWrite.
+    ECRDT_PRIO_BULK,
+    ECRDT_PRIO_BUTT
+};
+
+typedef struct ecRdtWriteParams {
+    int priority;               ///< ECRDT_PRIO_XXX.
+    int streamId;               ///< Stream from ecRdtStreamOpen(), 0 for the default stream.
+    int ttl;                    ///< Milliseconds the data is worth delivering, 0 to retransmit until delivered.
+} ecRdtWriteParams;
 
 typedef struct ecRdtInfo {
     int sessionId;
@@ -47,7 +88,8 @@ typedef struct ecRdtInfo {
 typedef struct ecRdtHandler {
     /**
      * @brief This callback will be invoked when data finished receiving for
-     *  specific rdt tunnel.
+     *  specific rdt tunnel. Leave it NULL to pull data with ecRdtRead() or
+     *  ecRdtReadv() instead.
      *
      * @param
      *      rdtId            [in] The ID of rdt tunnel.
@@ -69,6 +111,27 @@ typedef struct ecRdtHandler {
      *
      */
     void (*onClosed)(int rdtId, int status);
+
+    /**
+     * @brief This callback will be invoked when data finished receiving on
+     *  a stream other than the default one, if onData is set too. Data of a
+     *  stream comes in the order written, regardless of losses on other
+     *  streams. Leave it NULL to get data of all streams through onData or
+     *  ecRdtRead().
+     *
+     * @param
+     *      rdtId            [in] The ID of rdt tunnel.
+     * @param
+     *      streamId         [in] The ID of stream.
+     * @param
+     *      data             [in] buffer to received data, NULL once peer
+     *                            closed the stream.
+     * @param
+     *      length           [in] The length of received data, 0 once peer
+     *                            closed the stream.
+     *
+     */
+    void (*onStreamData)(int rdtId, int streamId, void* data, int length);
 } ecRdtHandler;
 
 typedef struct ecRdtInitializer {
@@ -122,6 +185,32 @@ int ecRdtModuleDestroy(void);
  */
 int ecRdtOpen(int sessionId, int channelId, ecRdtHandler* handler);
 
+/**
+ * @brief Open a ECRDT channel with its first write carried in handshake.
+ *
+ * Peer gets the data right after its onRdtOpened returns, so a request
+ * and its answer take one round trip along with the open. Data over 1024
+ * bytes, or on a tunnel with a pre-shared key, which early data would go
+ * around, is written as with ecRdtWrite once the tunnel is open.
+ *
+ * @param
+ *      sessionId         [in] The ID of the session for rdt tunnel to open
+ * @param
+ *      channelId         [in] The ID of channel used by rdt tunnel.
+ * @param
+ *      handler           [in] The event handler to rdt tunnel.
+ * @param
+ *      data              [in] The first data to write.
+ * @param
+ *      length            [in] The length of data.
+ *
+ * @return
+ *     Rdt tunnel ID if return value >= 0.
+ * @return
+ *     Error code if return value < 0.
+ */
+int ecRdtOpenWithData(int sessionId, int channelId, ecRdtHandler* handler, const void* data, int length);
+
 
 /**
  * @brief Close a ECRDT channel.
@@ -137,6 +226,10 @@ int ecRdtClose(int rtdId);
 /**
  * @brief Write data through a ECRDT channel.
  *
+ * @brief One write reaches an unordered peer (ECRDT_OPT_UNORDERED) as one
+ *  message. A peer reading in order gets the same bytes in order, but once
+ *  both ends agree on ECRDT_OPT_PMTU_MAX a write larger than the path mtu
+ *  may arrive split in several reads.
  *
  * @param
  *     rdtId               [in] The ID of the ECRDT tunnel to write data
@@ -152,6 +245,144 @@ int ecRdtClose(int rtdId);
  */
 int ecRdtWrite(int rdtId, const void* data, int length);
 
+/**
+ * @brief Write data through a ECRDT channel with extra parameters.
+ *
+ * @brief Data of a higher priority is sent before any queued data of lower
+ *  priority. Until a stream is opened, data is delivered in the order sent,
+ *  so urgent data overtakes data queued before. Data of a stream is always
+ *  delivered in the order written, give data a stream of its own to let it
+ *  overtake others. Writing to a stream blocks while peer grants no credit.
+ *  Data with a ttl is dropped once it expires unacked, and peer skips it.
+ *
+ * @param
+ *     rdtId               [in] The ID of the ECRDT tunnel to write data
+ * @param
+ *     data                [in] The buffer to data to write.
+ * @param
+ *     length              [in] The length of data to write.
+ * @param
+ *     params              [in] The parameters of this write, NULL for
+ *                              defaults same as ecRdtWrite.
+ *
+ * @return
+ *     Error code.
+ */
+int ecRdtWriteEx(int rdtId, const void* data, int length, const ecRdtWriteParams* params);
+
+/**
+ * @brief Open a stream inside a ECRDT tunnel.
+ *
+ * @brief A stream is ordered and flow controlled on its own, so a loss on
+ *  one stream does not hold up the others, while congestion control and
+ *  acks are shared by the tunnel. Peer learns the stream from its first
+ *  data, no round trip is taken. Peer must support streams.
+ *
+ * @param
+ *     rdtId               [in] The ID of the ECRDT tunnel.
+ *
+ * @return
+ *     Stream ID (> 0) to pass in ecRdtWriteParams if return value > 0.
+ * @return
+ *     Error code if return value < 0.
+ */
+int ecRdtStreamOpen(int rdtId);
+
+/**
+ * @brief Close a stream opened by ecRdtStreamOpen().
+ *
+ * @brief Data written before is still delivered, then peer is notified by
+ *  onStreamData with zero length.
+ *
+ * @param
+ *     rdtId               [in] The ID of the ECRDT tunnel.
+ * @param
+ *     streamId            [in] The ID of the stream to close.
+ *
+ * @return
+ *     Error code.
+ */
+int ecRdtStreamClose(int rdtId, int streamId);
+
+/**
+ * @brief Read data from a ECRDT channel opened without onData callback.
+ *
+ * @brief Data not read yet stays in the receive queue and shrinks the
+ *  window advertised to peer, so a slow reader throttles the sender.
+ *
+ * @param
+ *     rdtId               [in] The ID of the ECRDT tunnel to read data.
+ * @param
+ *     buf                 [out] The buffer to fill with received data.
+ * @param
+ *     length              [in] The length of buffer.
+ * @param
+ *     timeout             [in] Milliseconds to wait for data, 0 to return
+ *                              immediately, negative to wait forever.
+ *
+ * @return
+ *     The actual length of data read if read successfully.
+ * @return
+ *     Error code if return value < 0.
+ */
+int ecRdtRead(int rdtId, void* buf, int length, int timeout);
+
+/**
+ * @brief Scatter read version of ecRdtRead().
+ *
+ * @param
+ *     rdtId               [in] The ID of the ECRDT tunnel to read data.
+ * @param
+ *     iov                 [out] The buffers to fill with received data.
+ * @param
+ *     iovcnt              [in] The count of buffers.
+ * @param
+ *     timeout             [in] Milliseconds to wait for data, 0 to return
+ *                              immediately, negative to wait forever.
+ *
+ * @return
+ *     The actual length of data read if read successfully.
+ * @return
+ *     Error code if return value < 0.
+ */
+int ecRdtReadv(int rdtId, const struct iovec* iov, int iovcnt, int timeout);
+
+/**
+ * @brief Set option of a ECRDT channel.
+ *
+ * @param
+ *     rdtId               [in] The ID of the ECRDT tunnel to set option, or
+ *                              0 to set default for tunnels opened later.
+ * @param
+ *     option              [in] The option to set (ECRDT_OPT_XXX).
+ * @param
+ *     value               [in] The buffer to option value.
+ * @param
+ *     length              [in] The length of option value.
+ *
+ * @return
+ *     Error code.
+ */
+int ecRdtSetOption(int rdtId, int option, const void* value, int length);
+
+/**
+ * @brief Cap the total send rate of all ECRDT tunnels on a session channel.
+ *
+ * @param
+ *     sessionId           [in] The session ID.
+ * @param
+ *     channelId           [in] The channel ID.
+ * @param
+ *     rate                [in] Bytes per second, 0 to remove the cap.
+ * @param
+ *     burst               [in] Bytes allowed to go out above the cap at once,
+ *                              0 for 100ms worth of rate.
+ *
+ * @return
+ *     Error code.
+ */
+int ecRdtSetChannelLimit(int sessionId, int channelId, unsigned int rate, unsigned int burst);
+
 /**
  * @brief Get information of a ECRDT channel.
  *
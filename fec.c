@@ -0,0 +1,435 @@
+/*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*      http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include "headers.h"
+#include "vassert.h"
+#include "vgf.h"
+#include "fec.h"
+
+/*
+ * Systematic Reed-Solomon code with a Cauchy matrix: repair r of a block
+ * is the sum of data symbols i times 1/(x_r + y_i), x_r = MAX_K + r and
+ * y_i = i. Any set of k data and repair symbols then solves the block.
+ */
+static
+uint8_t fec_coef(int r, int i)
+{
+    return vgf_inv((uint8_t)((RDT_FEC_MAX_K + r) ^ i));
+}
+
+/*
+ * symbol ^= c * ([2 bytes len][data][zero padding])
+ */
+static
+void fec_add_symbol(uint8_t* symbol, const uint8_t* data, int len, uint8_t c)
+{
+    symbol[0] ^= vgf_mul(c, (uint8_t)(len >> 8));
+    symbol[1] ^= vgf_mul(c, (uint8_t)(len & 0xff));
+    vgf_mul_add(symbol + 2, data, c, len);
+}
+
+void fec_enc_init(struct rdt_fec_enc* enc)
+{
+    vassert(enc);
+
+    memset(enc, 0, sizeof(*enc));
+}
+
+void fec_enc_reset(struct rdt_fec_enc* enc)
+{
+    int i = 0;
+
+    vassert(enc);
+
+    for (i = 0; i < enc->n; i++) {
+        free(enc->srcs[i]);
+        enc->srcs[i] = NULL;
+    }
+    enc->n = 0;
+    enc->symlen = 0;
+}
+
+/*
+ * Add a data msg sent for the first time. It must take the seq space
+ * right after the previous one of block.
+ * Returns the number of data msgs in block, or -1 if it can't be added,
+ * in which case block is to be closed first.
+ */
+int fec_enc_add(struct rdt_fec_enc* enc, const void* data, int len, uint64_t seq, uint32_t plen)
+{
+    vassert(enc);
+    vassert(data);
+
+    if ((enc->n >= RDT_FEC_MAX_K) || (len + 2 > 0xffff) || (plen > 0xffff) ||
+        (enc->n && (seq != enc->end_seq))) {
+        return -1;
+    }
+
+    enc->srcs[enc->n] = (uint8_t*)malloc(len);
+    if (!enc->srcs[enc->n]) {
+        return -1;
+    }
+    memcpy(enc->srcs[enc->n], data, len);
+    if (enc->n == 0) {
+        enc->base_seq = seq;
+    }
+    enc->lens[enc->n]  = (uint16_t)len;
+    enc->plens[enc->n] = (uint16_t)plen;
+    enc->end_seq = seq + plen;
+    if (len + 2 > enc->symlen) {
+        enc->symlen = (uint16_t)(len + 2);
+    }
+    enc->n++;
+
+    return enc->n;
+}
+
+/*
+ * Make repair symbol @index of current block into @symbol of symlen bytes.
+ */
+void fec_enc_repair(struct rdt_fec_enc* enc, int index, uint8_t* symbol)
+{
+    int i = 0;
+
+    vassert(enc);
+    vassert(symbol);
+    vassert(index >= 0 && index < RDT_FEC_MAX_R);
+
+    memset(symbol, 0, enc->symlen);
+    for (i = 0; i < enc->n; i++) {
+        fec_add_symbol(symbol, enc->srcs[i], enc->lens[i], fec_coef(index, i));
+    }
+}
+
+struct rdt_fec_dec* fec_dec_create(void)
+{
+    struct rdt_fec_dec* dec = NULL;
+
+    dec = (struct rdt_fec_dec*)malloc(sizeof(*dec));
+    if (!dec) {
+        return NULL;
+    }
+    memset(dec, 0, sizeof(*dec));
+    vlock_init(&dec->lock);
+    return dec;
+}
+
+static
+void fec_free_block(struct rdt_fec_block* blk)
+{
+    int i = 0;
+
+    for (i = 0; i < blk->nrepairs; i++) {
+        free(blk->repairs[i]);
+        blk->repairs[i] = NULL;
+    }
+    blk->nrepairs = 0;
+    blk->k = 0;
+}
+
+void fec_dec_destroy(struct rdt_fec_dec* dec)
+{
+    int i = 0;
+
+    if (!dec) {
+        return;
+    }
+
+    for (i = 0; i < RDT_FEC_CACHE_SLOTS; i++) {
+        free(dec->slots[i].data);
+    }
+    for (i = 0; i < RDT_FEC_PENDING; i++) {
+        fec_free_block(&dec->blocks[i]);
+    }
+    vlock_deinit(&dec->lock);
+    free(dec);
+}
+
+static
+struct rdt_fec_slot* fec_slot(struct rdt_fec_dec* dec, uint64_t seq)
+{
+    return &dec->slots[((uint32_t)seq * 2654435761u) >> 24];
+}
+
+static
+struct rdt_fec_slot* fec_lookup(struct rdt_fec_dec* dec, uint64_t seq, uint16_t plen)
+{
+    struct rdt_fec_slot* slot = fec_slot(dec, seq);
+
+    if (slot->len && (slot->seq == seq) && (slot->plen == plen)) {
+        return slot;
+    }
+    return NULL;
+}
+
+/*
+ * Invert the n x n matrix m in place by Gauss-Jordan elimination.
+ */
+static
+int fec_invert(uint8_t m[RDT_FEC_MAX_R][RDT_FEC_MAX_R], int n)
+{
+    uint8_t inv[RDT_FEC_MAX_R][RDT_FEC_MAX_R];
+    uint8_t tmp = 0;
+    uint8_t c = 0;
+    int row = 0;
+    int col = 0;
+    int i = 0;
+
+    memset(inv, 0, sizeof(inv));
+    for (i = 0; i < n; i++) {
+        inv[i][i] = 1;
+    }
+
+    for (col = 0; col < n; col++) {
+        for (row = col; (row < n) && !m[row][col]; row++);
+        if (row == n) {
+            return -1;
+        }
+        if (row != col) {
+            for (i = 0; i < n; i++) {
+                tmp = m[row][i]; m[row][i] = m[col][i]; m[col][i] = tmp;
+                tmp = inv[row][i]; inv[row][i] = inv[col][i]; inv[col][i] = tmp;
+            }
+        }
+        c = vgf_inv(m[col][col]);
+        for (i = 0; i < n; i++) {
+            m[col][i] = vgf_mul(m[col][i], c);
+            inv[col][i] = vgf_mul(inv[col][i], c);
+        }
+        for (row = 0; row < n; row++) {
+            c = m[row][col];
+            if ((row == col) || !c) {
+                continue;
+            }
+            for (i = 0; i < n; i++) {
+                m[row][i] ^= vgf_mul(m[col][i], c);
+                inv[row][i] ^= vgf_mul(inv[col][i], c);
+            }
+        }
+    }
+    memcpy(m, inv, sizeof(inv));
+    return 0;
+}
+
+/*
+ * Rebuild the data msgs of block that are missing if enough repairs
+ * arrived. Block is freed once nothing is left to recover.
+ * Called with lock held.
+ */
+static
+int fec_try_block(struct rdt_fec_dec* dec, struct rdt_fec_block* blk, struct rdt_fec_out* out, int max)
+{
+    struct rdt_fec_slot* have[RDT_FEC_MAX_K];
+    uint8_t missing[RDT_FEC_MAX_R];
+    uint8_t m[RDT_FEC_MAX_R][RDT_FEC_MAX_R];
+    uint8_t* rhs[RDT_FEC_MAX_R];
+    uint8_t* sym = NULL;
+    uint64_t seq = blk->base_seq;
+    int nmissing = 0;
+    int n = 0;
+    int len = 0;
+    int i = 0;
+    int j = 0;
+
+    for (i = 0; i < blk->k; i++) {
+        have[i] = fec_lookup(dec, seq, blk->plens[i]);
+        if (!have[i]) {
+            if (nmissing >= blk->nrepairs) {
+                return 0;
+            }
+            missing[nmissing++] = (uint8_t)i;
+        }
+        seq += blk->plens[i];
+    }
+    if (nmissing == 0) {
+        fec_free_block(blk);
+        return 0;
+    }
+    if (nmissing > max) {
+        return 0;
+    }
+
+    //Take the data msgs present off the first nmissing repairs
+    for (j = 0; j < nmissing; j++) {
+        rhs[j] = blk->repairs[j];
+        for (i = 0; i < blk->k; i++) {
+            if (have[i]) {
+                fec_add_symbol(rhs[j], have[i]->data, have[i]->len, fec_coef(blk->index[j], i));
+            }
+        }
+        for (i = 0; i < nmissing; i++) {
+            m[j][i] = fec_coef(blk->index[j], missing[i]);
+        }
+    }
+    if (fec_invert(m, nmissing) < 0) {
+        fec_free_block(blk);
+        return 0;
+    }
+
+    sym = (uint8_t*)alloca(blk->symlen);
+    for (i = 0; i < nmissing; i++) {
+        memset(sym, 0, blk->symlen);
+        for (j = 0; j < nmissing; j++) {
+            vgf_mul_add(sym, rhs[j], m[i][j], blk->symlen);
+        }
+        len = (sym[0] << 8) | sym[1];
+        //Compact headers may be shorter than a full one, header decode checks the rest
+        if ((len < RDT_DATA_MIN_LEN) || (len > blk->symlen - 2)) {
+            continue;
+        }
+        out[n].data = (uint8_t*)malloc(len);
+        if (!out[n].data) {
+            continue;
+        }
+        memcpy(out[n].data, sym + 2, len);
+        out[n].len = len;
+        n++;
+    }
+    fec_free_block(blk);
+    return n;
+}
+
+/*
+ * Keep a copy of data msg from peer, and recover what its arrival
+ * makes recoverable.
+ */
+int fec_dec_add_data(struct rdt_fec_dec* dec, const void* data, int len, uint64_t seq, uint32_t plen,
+                     struct rdt_fec_out* out, int max)
+{
+    struct rdt_fec_slot* slot = NULL;
+    struct rdt_fec_block* blk = NULL;
+    uint64_t end = 0;
+    int n = 0;
+    int i = 0;
+    int j = 0;
+
+    vassert(dec);
+    vassert(data);
+    vassert(out);
+
+    if ((len + 2 > 0xffff) || (plen > 0xffff)) {
+        return 0;
+    }
+
+    vlock_enter(&dec->lock);
+    slot = fec_slot(dec, seq);
+    if (slot->cap < len) {
+        free(slot->data);
+        slot->len = 0;
+        slot->cap = 0;
+        slot->data = (uint8_t*)malloc(len);
+        if (!slot->data) {
+            vlock_leave(&dec->lock);
+            return 0;
+        }
+        slot->cap = (uint16_t)len;
+    }
+    memcpy(slot->data, data, len);
+    slot->seq  = seq;
+    slot->plen = (uint16_t)plen;
+    slot->len  = (uint16_t)len;
+
+    for (i = 0; i < RDT_FEC_PENDING; i++) {
+        blk = &dec->blocks[i];
+        if (!blk->k) {
+            continue;
+        }
+        for (j = 0, end = blk->base_seq; j < blk->k; j++) {
+            end += blk->plens[j];
+        }
+        if ((seq >= blk->base_seq) && (seq < end)) {
+            n += fec_try_block(dec, blk, out + n, max - n);
+        }
+    }
+    vlock_leave(&dec->lock);
+
+    return n;
+}
+
+/*
+ * Take a repair from peer, and recover what can be recovered with it.
+ */
+int fec_dec_add_repair(struct rdt_fec_dec* dec, const struct rdt_fec_msg* msg,
+                       struct rdt_fec_out* out, int max)
+{
+    struct rdt_fec_block* blk = NULL;
+    struct rdt_fec_block* oldest = NULL;
+    uint64_t end = 0;
+    int i = 0;
+    int n = 0;
+
+    vassert(dec);
+    vassert(msg);
+    vassert(out);
+
+    if ((msg->symlen <= 2) || (msg->k == 0) || (msg->k > RDT_FEC_MAX_K)) {
+        return 0;
+    }
+
+    vlock_enter(&dec->lock);
+    for (i = 0, end = msg->base_seq; i < msg->k; i++) {
+        end += msg->plens[i];
+    }
+    if (end > dec->covered_seq) {
+        dec->covered_seq = end;
+    }
+
+    for (i = 0; i < RDT_FEC_PENDING; i++) {
+        if (dec->blocks[i].k && (dec->blocks[i].base_seq == msg->base_seq)) {
+            blk = &dec->blocks[i];
+            break;
+        }
+        if (!oldest || !dec->blocks[i].k ||
+            (oldest->k && (dec->blocks[i].ts < oldest->ts))) {
+            oldest = &dec->blocks[i];
+        }
+    }
+    if (!blk) {
+        //Block not heard of, or already done with and this is a spare repair
+        blk = oldest;
+        fec_free_block(blk);
+        blk->base_seq = msg->base_seq;
+        blk->k = msg->k;
+        blk->symlen = msg->symlen;
+        blk->ts = vtime_us();
+        memcpy(blk->plens, msg->plens, msg->k * sizeof(uint16_t));
+    }
+    if ((blk->k != msg->k) || (blk->symlen != msg->symlen) ||
+        (blk->nrepairs >= RDT_FEC_MAX_R)) {
+        vlock_leave(&dec->lock);
+        return 0;
+    }
+    for (i = 0; i < blk->nrepairs; i++) {
+        if (blk->index[i] == msg->index) {
+            vlock_leave(&dec->lock);
+            return 0;
+        }
+    }
+
+    blk->repairs[blk->nrepairs] = (uint8_t*)malloc(msg->symlen);
+    if (!blk->repairs[blk->nrepairs]) {
+        vlock_leave(&dec->lock);
+        return 0;
+    }
+    memcpy(blk->repairs[blk->nrepairs], msg->symbol, msg->symlen);
+    blk->index[blk->nrepairs] = msg->index;
+    blk->nrepairs++;
+
+    n = fec_try_block(dec, blk, out, max);
+    vlock_leave(&dec->lock);
+
+    return n;
+}
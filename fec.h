@@ -0,0 +1,87 @@
+/*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*      http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#ifndef __RDT_FEC_H__
+#define __RDT_FEC_H__
+
+#include "codec.h"
+#include "vsys.h"
+
+#define RDT_FEC_CACHE_SLOTS 256     //Data msgs receiver keeps to recover others from
+#define RDT_FEC_PENDING     8       //Blocks waiting for more repairs or data
+
+/*
+ * Sending side. Data msgs are copied in as they first go out, block is
+ * closed with its repairs once full or when the txq runs dry.
+ */
+struct rdt_fec_enc {
+    uint64_t base_seq;
+    uint64_t end_seq;                   //Seq the next data msg of block must take
+    uint8_t  n;                         //Data msgs in block so far
+    uint16_t symlen;
+    uint16_t plens[RDT_FEC_MAX_K];
+    uint16_t lens[RDT_FEC_MAX_K];
+    uint8_t* srcs[RDT_FEC_MAX_K];
+};
+
+struct rdt_fec_slot {
+    uint64_t seq;
+    uint16_t plen;
+    uint16_t len;                       //0 for empty slot
+    uint16_t cap;
+    uint8_t* data;
+};
+
+struct rdt_fec_block {
+    uint64_t base_seq;
+    uint8_t  k;                         //0 for free block
+    uint8_t  nrepairs;
+    uint16_t symlen;
+    uint16_t plens[RDT_FEC_MAX_K];
+    uint8_t  index[RDT_FEC_MAX_R];
+    uint8_t* repairs[RDT_FEC_MAX_R];
+    uint64_t ts;
+};
+
+/*
+ * Receiving side, created on the first repair from peer.
+ */
+struct rdt_fec_dec {
+    struct vlock lock;
+    struct rdt_fec_slot slots[RDT_FEC_CACHE_SLOTS];
+    struct rdt_fec_block blocks[RDT_FEC_PENDING];
+    uint64_t covered_seq;               //End of the latest block a repair arrived for
+};
+
+/*
+ * Data msg rebuilt from repairs, to be freed by caller.
+ */
+struct rdt_fec_out {
+    uint8_t* data;
+    int len;
+};
+
+void fec_enc_init  (struct rdt_fec_enc* enc);
+void fec_enc_reset (struct rdt_fec_enc* enc);
+int  fec_enc_add   (struct rdt_fec_enc* enc, const void* data, int len, uint64_t seq, uint32_t plen);
+void fec_enc_repair(struct rdt_fec_enc* enc, int index, uint8_t* symbol);
+
+struct rdt_fec_dec* fec_dec_create(void);
+void fec_dec_destroy    (struct rdt_fec_dec* dec);
+int  fec_dec_add_data   (struct rdt_fec_dec* dec, const void* data, int len, uint64_t seq, uint32_t plen,
+                         struct rdt_fec_out* out, int max);
+int  fec_dec_add_repair (struct rdt_fec_dec* dec, const struct rdt_fec_msg* msg,
+                         struct rdt_fec_out* out, int max);
+
+#endif
@@ -24,7 +24,7 @@ extern struct rdt_enc_ops rdt_enc_ops;
 int32_t _handshake_request(struct rdt_tunnel* ptunnel)
 {
     struct rdt_handshake_req_msg msg;
-    char* buf = (char*)alloca(sizeof(msg) + 4);
+    char* buf = (char*)alloca(sizeof(msg) + 4 + RDT_HANDSHAKE_TLV_MAX);
     int len = 0;
 
     vassert(ptunnel);
@@ -37,13 +37,36 @@ int32_t _handshake_request(struct rdt_tunnel* ptunnel)
     msg.version = RDT_VERSION;
     msg.handshake_type = 0;
     msg.lteid   = ptunnel->teid;
-    msg.mtu     = RDT_MTU;
+    msg.mtu     = ptunnel->opts.pmtu_max ? ptunnel->opts.pmtu_max : RDT_MTU;
     msg.seq     = ptunnel->seq_num;
-    msg.windowsz = ptunnel->rxq.max_pkt_num;
+    msg.windowsz = ptunnel->rxq.get_window(&ptunnel->rxq);
+    msg.wscale  = ptunnel->wscale;
+    msg.caps    = tunnel_local_caps(ptunnel);
+    msg.dict_id = rdt_lz_dict_id();
+    msg.key_id  = tunnel_key_id(ptunnel);
+    memcpy(msg.nonce, ptunnel->nonce, RDT_NONCE_LEN);
+    //Holding acks back needs compact headers
+    msg.tlv.ack_delay = (msg.caps & RDT_CAP_COMPACT) ? ptunnel->opts.ack_delay : 0;
+    ptunnel->ack_delay = msg.tlv.ack_delay;
+    //Early data goes before keys exist, so never with a psk to seal it
+    if (ptunnel->early_data && !(msg.caps & RDT_CAP_AEAD)) {
+        msg.tlv.early_len = ptunnel->early_len;
+        memcpy(msg.tlv.early, ptunnel->early_data, ptunnel->early_len);
+    }
+    if (msg.caps & RDT_CAP_RESUME) {
+        msg.tlv.ticket_len = (uint8_t)ticket_find(ptunnel->sessionId, ptunnel->channelId,
+                                                  msg.tlv.ticket, &ptunnel->warm);
+        ptunnel->ticket_len = msg.tlv.ticket_len;
+    }
+    //Tells peer whether writes may be split up to fit path mtu
+    if (msg.caps & RDT_CAP_PMTUD) {
+        msg.tlv.order = ptunnel->opts.unordered ? RDT_ORDER_NONE : RDT_ORDER_IN;
+    }
 
-    memset(buf, 0, sizeof(msg) + 4);
-    len = rdt_enc_ops.handshake_req((struct rdt_common_msg*)&msg, buf, sizeof(msg) + 4);
+    memset(buf, 0, sizeof(msg) + 4 + RDT_HANDSHAKE_TLV_MAX);
+    len = rdt_enc_ops.handshake_req((struct rdt_common_msg*)&msg, buf, sizeof(msg) + 4 + RDT_HANDSHAKE_TLV_MAX);
     session_write(ptunnel->sessionId, ptunnel->channelId, (void*)buf, len);
+    ptunnel->handshake_ts = vtime_us();
 
     ptunnel->state = RDT_STATE_HANDSHAKE_REQ_SENT;
     vtimer_restart(&ptunnel->timer, (ptunnel->timeout_counter + 1) * RDT_HANDSHAKE_TIMEOUT, 0);
@@ -54,7 +77,7 @@ int32_t _handshake_request(struct rdt_tunnel* ptunnel)
 int32_t _handshake_response(struct rdt_tunnel* ptunnel)
 {
     struct rdt_handshake_rsp_msg msg;
-    char* buf = (char*)alloca(sizeof(msg));
+    char* buf = (char*)alloca(sizeof(msg) + RDT_HANDSHAKE_TLV_MAX);
     int len = 0;
 
     vassert(ptunnel);
@@ -69,13 +92,31 @@ int32_t _handshake_response(struct rdt_tunnel* ptunnel)
     msg.lteid  = ptunnel->teid;
     msg.seq = ptunnel->seq_num;
     msg.seq_ack = ptunnel->ctrl_ack_num;
-    msg.mtu = RDT_MTU;
-    msg.windowsz = ptunnel->rxq.max_pkt_num;
+    msg.mtu = ptunnel->opts.pmtu_max ? ptunnel->opts.pmtu_max : RDT_MTU;
+    msg.windowsz = ptunnel->rxq.get_window(&ptunnel->rxq);
+    msg.wscale = ptunnel->wscale;
+    msg.caps = ptunnel->caps;
+    msg.dict_id = rdt_lz_dict_id();
+    msg.key_id = tunnel_key_id(ptunnel);
+    memcpy(msg.nonce, ptunnel->nonce, RDT_NONCE_LEN);
+    memset(&msg.tlv, 0, sizeof(msg.tlv));
+    msg.tlv.ack_delay = (msg.caps & RDT_CAP_COMPACT) ? ptunnel->opts.ack_delay : 0;
+    msg.tlv.early_ack = ptunnel->early_len;
+    msg.tlv.resumed = (uint8_t)ptunnel->resumed;
+    if (msg.caps & RDT_CAP_PMTUD) {
+        msg.tlv.order = ptunnel->opts.unordered ? RDT_ORDER_NONE : RDT_ORDER_IN;
+    }
+    ptunnel->ack_delay = msg.tlv.ack_delay;
 
-    memset(buf, 0, sizeof(msg));
-    len = rdt_enc_ops.handshake_rsp((struct rdt_common_msg*)&msg, buf, sizeof(msg));
+    memset(buf, 0, sizeof(msg) + RDT_HANDSHAKE_TLV_MAX);
+    len = rdt_enc_ops.handshake_rsp((struct rdt_common_msg*)&msg, buf, sizeof(msg) + RDT_HANDSHAKE_TLV_MAX);
     session_write(ptunnel->sessionId, ptunnel->channelId, (void*)buf, len);
+    ptunnel->handshake_ts = vtime_us();
 
+    if (ptunnel->state == RDT_STATE_READY) {
+        //Sent again as req was, tunnel went ready on req already
+        return 0;
+    }
     ptunnel->state = RDT_STATE_HANDSHAKE_RESP_SENT;
     vtimer_restart(&ptunnel->timer, (ptunnel->timeout_counter + 1) * RDT_HANDSHAKE_TIMEOUT, 0);
 
@@ -109,6 +150,7 @@ int32_t _handshake_finish(struct rdt_tunnel* ptunnel)
     ptunnel->state = RDT_STATE_READY;
     vcond_signal(&ptunnel->cond);
     vtimer_restart(&ptunnel->timer, RDT_KEEPALIVE_TIMEOUT, 0);
+    tunnel_pmtu_start(ptunnel);
 
     return 0;
 }
@@ -120,69 +162,119 @@ int32_t _handshake_delayed_finish(struct rdt_tunnel* ptunnel)
     vlogI("rdt ops: handle handshake delayed finish (teid:%d)", ptunnel->teid);
 
     ptunnel->state = RDT_STATE_READY;
+    tunnel_pmtu_start(ptunnel);
 
     //Initiating rdt tunnel by peer
     handler = g_rdtOpendCallback.onRdtOpened(ptunnel->sessionId, ptunnel->channelId, ptunnel->teid);
-    if ((!handler) ||(!handler->onData) || (!handler->onClosed)) {
+    if ((!handler) || (!handler->onClosed)) {
         destroy_tunnel(ptunnel, 1);
         return -1;
     }
 
     ptunnel->handler.onData   = handler->onData;
     ptunnel->handler.onClosed = handler->onClosed;
+    ptunnel->handler.onStreamData = handler->onStreamData;
 
     vtimer_restart(&ptunnel->timer, RDT_KEEPALIVE_TIMEOUT, 0);
     return 0;
 }
 
-int32_t _transfer_send_data(struct rdt_tunnel* ptunnel, const void* data, int length)
+int32_t _transfer_send_data(struct rdt_tunnel* ptunnel, const void* data, int length, const ecRdtWriteParams* params, struct rdt_stream* stream)
 {
     data_encoded_pkt_t* encoded_pkt = NULL;
     struct rdt_data_msg msg;
+    const void* payload = data;
+    uint8_t* zbuf = NULL;
     char* buf = NULL;
-    int bufsz = sizeof(msg) + length - 4 - sizeof(void*);
+    uint8_t flags = 0;
+    int paylen = length;
+    int bufsz = 0;
+    int room = 0;
     int len = 0;
 
     vassert(ptunnel);
     vassert(data);
     vassert(length > 0);
 
-    buf = (char*)malloc(bufsz);
+    if (stream) {
+        flags = RDT_DATA_F_STREAM | (stream->fin ? RDT_DATA_F_FIN : 0);
+    }
+    if ((ptunnel->caps & RDT_CAP_LZ) && (length >= RDT_LZ_MIN_LEN)) {
+        //Keep it compressed only if it saves an eighth at least
+        zbuf = (uint8_t*)malloc(length);
+        if (zbuf) {
+            len = rdt_lz_compress(zbuf, length - length / 8, data, length,
+                                  !!(ptunnel->caps & RDT_CAP_LZ_DICT));
+        }
+        if (len > 0) {
+            flags |= RDT_DATA_F_LZ | ((ptunnel->caps & RDT_CAP_LZ_DICT) ? RDT_DATA_F_DICT : 0);
+            payload = zbuf;
+            paylen = len;
+        }
+    }
+    if (ptunnel->caps & RDT_CAP_AEAD) {
+        //Tag covers what crc would, crc is left out
+        flags |= RDT_DATA_F_SEAL;
+    } else if (ptunnel->caps & RDT_CAP_CRC32C) {
+        flags |= RDT_DATA_F_CRC;
+    }
+    bufsz = rdt_data_hdr_len(flags) + paylen;
+    bufsz += (flags & RDT_DATA_F_SEAL) ? RDT_DATA_TAG_LEN : 0;
+    bufsz += (flags & RDT_DATA_F_CRC) ? RDT_DATA_CRC_LEN : 0;
+    //Compact header may grow back over the headroom with an ack in it
+    room = (ptunnel->caps & RDT_CAP_COMPACT) ? RDT_DATA_ACK_ROOM : 0;
+    buf = (char*)malloc(room + bufsz);
     if (!buf) {
+        free(zbuf);
         return ECRDT_E_OOM;
     }
 
     encoded_pkt = (data_encoded_pkt_t*)malloc(sizeof(*encoded_pkt));
     if (!encoded_pkt) {
+        free(zbuf);
         free(buf);
         return ECRDT_E_OOM;
     }
 
     memset(&msg, 0, sizeof(msg));
     msg.type = DATA_MSG;
-
-    vlock_enter(&ptunnel->lock);
     msg.rteid = ptunnel->peer_teid;
-    msg.seq   = ptunnel->seq_num;
-    ptunnel->seq_num += length;
-    vlock_leave(&ptunnel->lock);
-    msg.len   = length;
-    msg.data  = (void*)data;
+    msg.seq   = 0;  //Assigned by txq when sent first
+    msg.flags = flags;
+    msg.stream_id  = stream ? stream->id : 0;
+    msg.stream_off = stream ? stream->off : 0;
+    msg.len   = paylen;
+    msg.data  = (void*)payload;
 
-    memset(buf, 0, bufsz);
-    len = rdt_enc_ops.data((struct rdt_common_msg*)&msg, buf, bufsz);
+    memset(buf, 0, room + bufsz);
+    len = rdt_enc_ops.data((struct rdt_common_msg*)&msg, buf + room, bufsz);
+    free(zbuf);
 
     encoded_pkt->data = (void*)buf;
-    encoded_pkt->len  = len;
-    encoded_pkt->seq  = msg.seq;
-
-    ptunnel->txq.push_pkt((void*)&ptunnel->txq, encoded_pkt);
-
+    encoded_pkt->len  = room + len;
+    encoded_pkt->plen = length;
+    encoded_pkt->seq  = 0;
+    encoded_pkt->prio = params ? params->priority : ECRDT_PRIO_NORMAL;
+    encoded_pkt->lost = 0;
+    encoded_pkt->resent = 0;
+    encoded_pkt->sacked = 0;
+    encoded_pkt->flags = msg.flags;
+    encoded_pkt->compact = !!(ptunnel->caps & RDT_CAP_COMPACT);
+    encoded_pkt->hoff = room;
+    encoded_pkt->span = 0;
+    encoded_pkt->stream_id = msg.stream_id;
+    encoded_pkt->stream_off = msg.stream_off;
+    encoded_pkt->deadline = (params && params->ttl > 0) ? vtime_us() + (uint64_t)params->ttl * 1000 : 0;
+    encoded_pkt->xmit_ts = 0;
+
+    if (ptunnel->txq.push_pkt((void*)&ptunnel->txq, encoded_pkt) < 0) {
+        return ECRDT_E_BAD_RDT_TUNNEL;
+    }
 
     return 0;
 }
 
-int32_t _transfer_send_data_ack(struct rdt_tunnel* ptunnel, uint32_t ack_num)
+int32_t _transfer_send_data_ack(struct rdt_tunnel* ptunnel, uint64_t ack_num, uint64_t recv_seq)
 {
     struct rdt_data_ack_msg msg;
     char* buf = (char*)alloca(sizeof(msg));
@@ -195,15 +287,238 @@ int32_t _transfer_send_data_ack(struct rdt_tunnel* ptunnel, uint32_t ack_num)
     msg.ctrlId = 0x02;
     msg.rteid  = ptunnel->peer_teid;
     msg.seq_ack = ack_num;
-    msg.windowsz = ptunnel->rxq.max_pkt_num - ptunnel->rxq.cur_pkt_num;
+    msg.seq_recv = recv_seq;
+    ptunnel->rxq.adv_window = ptunnel->rxq.get_window(&ptunnel->rxq);
+    msg.windowsz = ptunnel->rxq.adv_window >> ptunnel->wscale;
+    //Peer's last ack lags seq_ack by a window at most
+    msg.span = ptunnel->rxq.buf_size;
+    if (ptunnel->caps & RDT_CAP_ACK_AGG) {
+        channel_ack(ptunnel->channel, ptunnel, ack_num, recv_seq, msg.windowsz);
+        return 0;
+    }
+
+    memset(buf, 0, sizeof(msg));
+    if (ptunnel->caps & RDT_CAP_COMPACT) {
+        len = rdt_enc_ops.ack_compact((struct rdt_common_msg*)&msg, buf, sizeof(msg));
+    } else {
+        len = rdt_enc_ops.data_ack((struct rdt_common_msg*)&msg, buf, sizeof(msg));
+    }
+    channel_post(ptunnel->channel, ptunnel, buf, len);
+
+    return 0;
+}
+
+int32_t _transfer_send_data_nack(struct rdt_tunnel* ptunnel, struct rdt_nack_range* ranges, int nranges)
+{
+    struct rdt_data_nack_msg msg;
+    char* buf = (char*)alloca(sizeof(msg));
+    int len = 0;
+
+    vassert(ptunnel);
+    vassert(ranges);
+    vassert(nranges > 0 && nranges <= RDT_NACK_MAX_RANGES);
+
+    msg.type   = CTRL_MSG;
+    msg.ctrlId = CTRL_MSG_NACK;
+    msg.rteid  = ptunnel->peer_teid;
+    msg.seq_ack = ptunnel->rxq.expected_seq;
+    msg.nranges = nranges;
+    memcpy(msg.ranges, ranges, nranges * sizeof(*ranges));
 
     memset(buf, 0, sizeof(msg));
-    len = rdt_enc_ops.data_ack((struct rdt_common_msg*)&msg, buf, sizeof(msg));
+    len = rdt_enc_ops.data_nack((struct rdt_common_msg*)&msg, buf, sizeof(msg));
     session_write(ptunnel->sessionId, ptunnel->channelId, (void*)buf, len);
 
     return 0;
 }
 
+int32_t _transfer_send_stream_ctrl(struct rdt_tunnel* ptunnel, uint16_t stream_id, uint8_t type, uint32_t value)
+{
+    struct rdt_stream_msg msg;
+    char* buf = (char*)alloca(sizeof(msg));
+    int len = 0;
+
+    vassert(ptunnel);
+    vassert(type < RDT_STREAM_BUTT);
+
+    msg.type   = CTRL_MSG;
+    msg.ctrlId = CTRL_MSG_STREAM;
+    msg.rteid  = ptunnel->peer_teid;
+    msg.stream_id = stream_id;
+    msg.stream_type = type;
+    msg.value  = value;
+
+    memset(buf, 0, sizeof(msg));
+    len = rdt_enc_ops.stream((struct rdt_common_msg*)&msg, buf, sizeof(msg));
+    session_write(ptunnel->sessionId, ptunnel->channelId, (void*)buf, len);
+
+    return 0;
+}
+
+int32_t _transfer_send_fec(struct rdt_tunnel* ptunnel, struct rdt_fec_enc* enc, int32_t index)
+{
+    struct rdt_fec_msg msg;
+    char* buf = NULL;
+    int bufsz = 0;
+    int len = 0;
+
+    vassert(ptunnel);
+    vassert(enc);
+    vassert(enc->n > 0);
+
+    bufsz = RDT_FEC_HDR_LEN + enc->n * sizeof(uint16_t) + enc->symlen;
+    buf = (char*)malloc(bufsz + enc->symlen);
+    if (!buf) {
+        return ECRDT_E_OOM;
+    }
+
+    msg.type   = CTRL_MSG;
+    msg.ctrlId = CTRL_MSG_FEC;
+    msg.rteid  = ptunnel->peer_teid;
+    msg.base_seq = enc->base_seq;
+    msg.k      = enc->n;
+    msg.index  = (uint8_t)index;
+    msg.symlen = enc->symlen;
+    memcpy(msg.plens, enc->plens, enc->n * sizeof(uint16_t));
+    msg.symbol = (uint8_t*)buf + bufsz;
+    fec_enc_repair(enc, index, msg.symbol);
+
+    len = rdt_enc_ops.fec((struct rdt_common_msg*)&msg, buf, bufsz);
+    channel_write(ptunnel->channel, ptunnel, buf, len);
+    free(buf);
+
+    return len;
+}
+
+int32_t _transfer_send_fwd_skip(struct rdt_tunnel* ptunnel, struct rdt_skip_range* ranges, int nranges)
+{
+    struct rdt_fwd_skip_msg msg;
+    char* buf = (char*)alloca(sizeof(msg));
+    int len = 0;
+
+    vassert(ptunnel);
+    vassert(ranges);
+    vassert(nranges > 0 && nranges <= RDT_SKIP_MAX_RANGES);
+
+    msg.type   = CTRL_MSG;
+    msg.ctrlId = CTRL_MSG_FWD_SKIP;
+    msg.rteid  = ptunnel->peer_teid;
+    msg.nranges = nranges;
+    memcpy(msg.ranges, ranges, nranges * sizeof(*ranges));
+
+    memset(buf, 0, sizeof(msg));
+    len = rdt_enc_ops.fwd_skip((struct rdt_common_msg*)&msg, buf, sizeof(msg));
+    channel_write(ptunnel->channel, ptunnel, buf, len);
+
+    return 0;
+}
+
+/*
+ * Probe goes out alone, never in a bundle, so the datagram is of its size.
+ */
+int32_t _transfer_send_pmtu_probe(struct rdt_tunnel* ptunnel, uint32_t probe_id, uint32_t size)
+{
+    struct rdt_pmtu_msg msg;
+    char* buf = NULL;
+    int len = 0;
+
+    vassert(ptunnel);
+    vassert(size >= RDT_PMTU_HDR_LEN);
+
+    buf = (char*)malloc(size);
+    if (!buf) {
+        return ECRDT_E_OOM;
+    }
+
+    msg.type   = CTRL_MSG;
+    msg.ctrlId = CTRL_MSG_PMTU_PROBE;
+    msg.rteid  = ptunnel->peer_teid;
+    msg.probe_id = probe_id;
+    msg.size   = size;
+
+    len = rdt_enc_ops.pmtu_probe((struct rdt_common_msg*)&msg, buf, size);
+    //A probe fragmented on the way would pass for a size the path takes
+    session_write_dontfrag(ptunnel->sessionId, ptunnel->channelId, (void*)buf, len);
+    free(buf);
+
+    return 0;
+}
+
+int32_t _transfer_send_pmtu_ack(struct rdt_tunnel* ptunnel, uint32_t probe_id, uint32_t size)
+{
+    struct rdt_pmtu_msg msg;
+    char* buf = (char*)alloca(RDT_PMTU_HDR_LEN);
+    int len = 0;
+
+    vassert(ptunnel);
+
+    msg.type   = CTRL_MSG;
+    msg.ctrlId = CTRL_MSG_PMTU_ACK;
+    msg.rteid  = ptunnel->peer_teid;
+    msg.probe_id = probe_id;
+    msg.size   = size;
+
+    memset(buf, 0, RDT_PMTU_HDR_LEN);
+    len = rdt_enc_ops.pmtu_ack((struct rdt_common_msg*)&msg, buf, RDT_PMTU_HDR_LEN);
+    channel_post(ptunnel->channel, ptunnel, buf, len);
+
+    return 0;
+}
+
+/*
+ * Send a data msg too big for path mtu in pieces, each in a datagram of
+ * its own. Loss of any piece loses the msg, it is resent as a whole.
+ */
+int32_t _transfer_send_frags(struct rdt_tunnel* ptunnel, const void* buf, int32_t len)
+{
+    struct rdt_frag_msg msg;
+    char* frag = (char*)alloca(RDT_FRAG_HDR_LEN + RDT_FRAG_LEN);
+    int32_t off = 0;
+    int n = 0;
+
+    vassert(ptunnel);
+    vassert(buf);
+    vassert(len > 0 && len <= RDT_FRAG_LEN * RDT_FRAG_MAX);
+
+    msg.type    = CTRL_MSG;
+    msg.ctrlId  = CTRL_MSG_FRAG;
+    msg.rteid   = ptunnel->peer_teid;
+    msg.frag_id = ++ptunnel->frag_id;
+    msg.count   = (uint8_t)((len + RDT_FRAG_LEN - 1) / RDT_FRAG_LEN);
+
+    for (msg.index = 0; msg.index < msg.count; msg.index++) {
+        msg.len  = (len - off > RDT_FRAG_LEN) ? RDT_FRAG_LEN : len - off;
+        msg.data = (uint8_t*)buf + off;
+        n = rdt_enc_ops.frag((struct rdt_common_msg*)&msg, frag, RDT_FRAG_HDR_LEN + RDT_FRAG_LEN);
+        session_write(ptunnel->sessionId, ptunnel->channelId, (void*)frag, n);
+        off += msg.len;
+    }
+    return 0;
+}
+
+int32_t _transfer_send_ticket(struct rdt_tunnel* ptunnel, const uint8_t* ticket, int32_t len)
+{
+    struct rdt_ticket_msg msg;
+    char* buf = (char*)alloca(RDT_TICKET_HDR_LEN + RDT_TICKET_MAX);
+    int n = 0;
+
+    vassert(ptunnel);
+    vassert(ticket);
+    vassert(len > 0 && len <= RDT_TICKET_MAX);
+
+    msg.type   = CTRL_MSG;
+    msg.ctrlId = CTRL_MSG_TICKET;
+    msg.rteid  = ptunnel->peer_teid;
+    msg.len    = (uint8_t)len;
+    memcpy(msg.ticket, ticket, len);
+
+    memset(buf, 0, RDT_TICKET_HDR_LEN + RDT_TICKET_MAX);
+    n = rdt_enc_ops.ticket((struct rdt_common_msg*)&msg, buf, RDT_TICKET_HDR_LEN + RDT_TICKET_MAX);
+    channel_post(ptunnel->channel, ptunnel, buf, n);
+
+    return 0;
+}
+
 int32_t _transfer_send_data_fin(struct rdt_tunnel* ptunnel)
 {
     vassert(ptunnel != NULL);
@@ -225,7 +540,7 @@ int32_t _transfer_keepalive(struct rdt_tunnel* ptunnel)
 
     memset(buf, 0, sizeof(msg));
     len = rdt_enc_ops.keepalive((struct rdt_common_msg*)&msg, buf, sizeof(msg));
-    session_write(ptunnel->sessionId, ptunnel->channelId, (void*)buf, len);
+    channel_post(ptunnel->channel, ptunnel, buf, len);
 
     return 0;
 }
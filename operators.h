@@ -19,9 +19,17 @@ int32_t _handshake_response(struct rdt_tunnel* ptunnel);
 int32_t _handshake_finish(struct rdt_tunnel* ptunnel);
 int32_t _handshake_delayed_finish(struct rdt_tunnel* ptunnel);
 
-int32_t _transfer_send_data(struct rdt_tunnel* ptunnel, const void* data, int length);
-int32_t _transfer_send_data_ack(struct rdt_tunnel* ptunnel, uint32_t ack_num);
+int32_t _transfer_send_data(struct rdt_tunnel* ptunnel, const void* data, int length, const ecRdtWriteParams* params, struct rdt_stream* stream);
+int32_t _transfer_send_data_ack(struct rdt_tunnel* ptunnel, uint64_t ack_num, uint64_t recv_seq);
 int32_t _transfer_send_data_fin(struct rdt_tunnel* ptunnel);
+int32_t _transfer_send_data_nack(struct rdt_tunnel* ptunnel, struct rdt_nack_range* ranges, int nranges);
+int32_t _transfer_send_fec(struct rdt_tunnel* ptunnel, struct rdt_fec_enc* enc, int32_t index);
+int32_t _transfer_send_pmtu_probe(struct rdt_tunnel* ptunnel, uint32_t probe_id, uint32_t size);
+int32_t _transfer_send_pmtu_ack(struct rdt_tunnel* ptunnel, uint32_t probe_id, uint32_t size);
+int32_t _transfer_send_frags(struct rdt_tunnel* ptunnel, const void* buf, int32_t len);
+int32_t _transfer_send_ticket(struct rdt_tunnel* ptunnel, const uint8_t* ticket, int32_t len);
+int32_t _transfer_send_fwd_skip(struct rdt_tunnel* ptunnel, struct rdt_skip_range* ranges, int nranges);
+int32_t _transfer_send_stream_ctrl(struct rdt_tunnel* ptunnel, uint16_t stream_id, uint8_t type, uint32_t value);
 int32_t _transfer_keepalive(struct rdt_tunnel* ptunnel);
 int32_t _transfer_keepalive_recv(struct rdt_tunnel* rdt);
 
@@ -20,6 +20,60 @@
 typedef void(*HANDLER_PTR)(int, int, char*, int);
 extern struct rdt_dec_ops rdt_dec_ops;
 
+static void handle_data(int sessionId, int channelId, void *buf, int length);
+static void handle_bundle(int sessionId, int channelId, char *buf, int length);
+
+/*
+ * Hand early data over as the data at seq 1, data msgs of peer follow it.
+ * Called with lock held.
+ */
+static
+void handle_early_data(rdt_tunnel_t* ptunnel, const uint8_t* data, int length)
+{
+    data_pkt_t* pkt = NULL;
+
+    vassert(ptunnel);
+    vassert(data);
+    vassert(length > 0);
+
+    pkt = (data_pkt_t*)malloc(sizeof(*pkt) + length);
+    if (!pkt) {
+        vlogE("Failed to malloc data packet\n");
+        return;
+    }
+    memset(pkt, 0, sizeof(*pkt));
+    vlist_init(&pkt->list);
+    pkt->data = (uint8_t*)(pkt + 1);
+    memcpy(pkt->data, data, length);
+    pkt->seq = 1;
+    pkt->len = length;
+    pkt->teid = ptunnel->teid;
+
+    //rxq takes over pkt
+    ptunnel->rxq.arrange_pkt(&ptunnel->rxq, pkt);
+}
+
+/*
+ * Peer sends req again while its rsp is lost. Tunnel ready on req alone
+ * answers it, others are still resending rsp themselves.
+ */
+static
+void resend_fast_resp(int teid)
+{
+    rdt_tunnel_t* ptunnel = NULL;
+
+    ptunnel = get_tunnel(teid);
+    if (!ptunnel) {
+        return;
+    }
+
+    vlock_enter(&ptunnel->lock);
+    if ((ptunnel->state == RDT_STATE_READY) && ptunnel->fast_open) {
+        ptunnel->ops[ptunnel->state]->handshake_resp(ptunnel);
+    }
+    vlock_leave(&ptunnel->lock);
+}
+
 static
 void handle_handshake_req(int sessionId, int channelId, char* buf, int length)
 {
@@ -31,7 +85,7 @@ void handle_handshake_req(int sessionId, int channelId, char* buf, int length)
     vassert(channelId > 0);
     vassert(length > 0);
 
-    if (length < sizeof(msg)) {
+    if (length < RDT_HANDSHAKE_REQ_MIN_LEN) {
         vlogE("Receiver: invalid handshake_req msg");
         return;
     }
@@ -42,13 +96,15 @@ void handle_handshake_req(int sessionId, int channelId, char* buf, int length)
         return;
     }
 
-    if(check_peer_teid(sessionId, channelId, msg.lteid) == 1){
+    ret = check_peer_teid(sessionId, channelId, msg.lteid);
+    if(ret > 0){
         vlogD("sid(%d), cid(%d), peer_teid(%d) handshake req has been received, ignore this.",
               sessionId, channelId, msg.lteid);
+        resend_fast_resp(ret);
         return;
     }
 
-    ret = create_tunnel(sessionId, channelId, NULL, &ptunnel);
+    ret = create_tunnel(sessionId, channelId, NULL, NULL, 0, &ptunnel);
     if (ret < 0) {
         vlogE("RECEIVER:Create tunnel failed");
         return;
@@ -57,9 +113,35 @@ void handle_handshake_req(int sessionId, int channelId, char* buf, int length)
     vlock_enter(&ptunnel->lock);
     ptunnel->peer_teid = msg.lteid;
     ptunnel->peer_window_sz = msg.windowsz;
+    ptunnel->peer_wscale = (msg.wscale > RDT_MAX_WSCALE) ? RDT_MAX_WSCALE : msg.wscale;
+    ptunnel->txq.update_window(&ptunnel->txq, msg.windowsz);
     ptunnel->ctrl_ack_num = msg.seq + 1;
+    ptunnel->peer_mtu = msg.mtu;
+    ptunnel->caps = tunnel_agree_caps(ptunnel, msg.caps, msg.dict_id, msg.key_id);
+    tunnel_agree_params(ptunnel, &msg.tlv);
+    if (tunnel_derive_keys(ptunnel, msg.nonce) < 0) {
+        vlogE("RECEIVER:Peer(teid:%d) does not hold the same psk", msg.lteid);
+        vlock_leave(&ptunnel->lock);
+        destroy_tunnel(ptunnel, 0);
+        return;
+    }
 
+    //Early data is never sealed, so it is not taken on a sealed tunnel
+    ptunnel->early_len = (ptunnel->caps & RDT_CAP_AEAD) ? 0 : msg.tlv.early_len;
+    ptunnel->issue_tickets = !!(ptunnel->caps & RDT_CAP_RESUME);
+    tunnel_resume(ptunnel, &msg.tlv);
+    ptunnel->fast_open = (ptunnel->early_len > 0) || ptunnel->resumed;
     ptunnel->ops[ptunnel->state]->handshake_resp(ptunnel);
+    if (ptunnel->fast_open) {
+        //Ready without waiting for fin, the peer is as soon as rsp gets there
+        if (ptunnel->ops[ptunnel->state]->handshake_delayed_fin(ptunnel) < 0) {
+            //Refused and gone
+            return;
+        }
+    }
+    if (ptunnel->early_len > 0) {
+        handle_early_data(ptunnel, msg.tlv.early, msg.tlv.early_len);
+    }
     vlock_leave(&ptunnel->lock);
     return;
 }
@@ -74,7 +156,7 @@ void handle_handshake_resp(int sessionId, int channelId, char *buf, int length)
     vassert(channelId > 0);
     vassert(length > 0);
 
-    if (length < sizeof(msg)) {
+    if (length < RDT_HANDSHAKE_RSP_MIN_LEN) {
         vlogE("Receiver: invalid handshake_rsp msg");
         return;
     }
@@ -93,10 +175,24 @@ void handle_handshake_resp(int sessionId, int channelId, char *buf, int length)
     }
 
     ptunnel->timeout_counter = 0;
+    ptunnel->rxq.rtt_us = (uint32_t)(vtime_us() - ptunnel->handshake_ts);
     ptunnel->peer_teid = msg.lteid;
     ptunnel->peer_window_sz = msg.windowsz;
+    ptunnel->peer_wscale = (msg.wscale > RDT_MAX_WSCALE) ? RDT_MAX_WSCALE : msg.wscale;
+    ptunnel->txq.update_window(&ptunnel->txq, msg.windowsz);
     ptunnel->ctrl_ack_num = msg.seq + 1;
     ptunnel->seq_num++;
+    ptunnel->peer_mtu = msg.mtu;
+    ptunnel->caps = tunnel_agree_caps(ptunnel, msg.caps, msg.dict_id, msg.key_id);
+    tunnel_agree_params(ptunnel, &msg.tlv);
+    tunnel_early_acked(ptunnel, msg.tlv.early_ack);
+    tunnel_resume(ptunnel, &msg.tlv);
+    if (tunnel_derive_keys(ptunnel, msg.nonce) < 0) {
+        //Left to time out, as if peer never answered
+        vlogE("RECEIVER:Peer(teid:%d) does not hold the same psk", msg.lteid);
+        vlock_leave(&ptunnel->lock);
+        return;
+    }
 
     ptunnel->ops[ptunnel->state]->handshake_fin(ptunnel);
     vlock_leave(&ptunnel->lock);
@@ -126,12 +222,18 @@ void handle_handshake_fin(int sessionId, int channelId, char *buf, int length)
     }
 
     vlock_enter(&ptunnel->lock);
+    if((ptunnel->state == RDT_STATE_READY) && ptunnel->fast_open){
+        //Went ready on req alone, fin only tells rsp got there
+        ptunnel->rxq.rtt_us = (uint32_t)(vtime_us() - ptunnel->handshake_ts);
+        ptunnel->fast_open = 0;
+    }
     if(ptunnel->state != RDT_STATE_HANDSHAKE_RESP_SENT){
         vlock_leave(&ptunnel->lock);
         return;
     }
 
     ptunnel->timeout_counter = 0;
+    ptunnel->rxq.rtt_us = (uint32_t)(vtime_us() - ptunnel->handshake_ts);
     ptunnel->seq_num++;
     ptunnel->ops[ptunnel->state]->handshake_delayed_fin(ptunnel);
     vlock_leave(&ptunnel->lock);
@@ -226,6 +328,33 @@ void handle_shutdown(int sessionId, int channelId, char *buf, int length)
     return ;
 }
 
+static
+void on_data_ack(rdt_tunnel_t* ptunnel, struct rdt_data_ack_msg* msg)
+{
+    vlock_enter(&ptunnel->lock);
+    if(ptunnel->state != RDT_STATE_READY){
+        vlock_leave(&ptunnel->lock);
+        vlogE("RECEIVER:: Receive data ack on wrong state(%d)", ptunnel->state);
+        return;
+    }
+
+    if(ptunnel->data_sending == 1){
+        vtimer_restart(&ptunnel->timer, RDT_DATA_ACK_TIMEOUT, 0);
+    } else{
+        vtimer_restart(&ptunnel->timer, RDT_KEEPALIVE_TIMEOUT, 0);
+    }
+
+    ptunnel->timeout_counter = 0;
+    ptunnel->peer_window_sz  = msg->windowsz << ptunnel->peer_wscale;
+
+    vlock_leave(&ptunnel->lock);
+    ptunnel->txq.update_ack(&ptunnel->txq, msg->seq_ack, msg->seq_recv);
+    ptunnel->txq.update_window(&ptunnel->txq, ptunnel->peer_window_sz);
+    tunnel_ticket_refresh(ptunnel);
+
+    return ;
+}
+
 static
 void handle_data_ack(int sessionId, int channelId, char *buf, int length)
 {
@@ -236,32 +365,419 @@ void handle_data_ack(int sessionId, int channelId, char *buf, int length)
     vassert(channelId > 0);
     vassert(length > 0);
 
+    //Tunnel first, seqs expand near its last ack
+    ptunnel = get_tunnel(rdt_ctrl_teid(buf, length));
+    if (!ptunnel) {
+        vlogE("Receiver: teid(%d) not found", rdt_ctrl_teid(buf, length));
+        return;
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    msg.seq_ref = ptunnel->txq.last_ack;
     rdt_dec_ops.data_ack((char*)buf, length, (struct rdt_common_msg*)&msg);
+    on_data_ack(ptunnel, &msg);
+    return ;
+}
+
+static
+void handle_ack_compact(int sessionId, int channelId, char *buf, int length)
+{
+    struct rdt_data_ack_msg msg;
+    rdt_tunnel_t* ptunnel = NULL;
+
+    vassert(sessionId > 0);
+    vassert(channelId > 0);
+    vassert(length > 0);
+
+    //Tunnel first, seqs expand near its last ack
+    ptunnel = get_tunnel(rdt_ack_compact_teid(buf, length));
+    if (!ptunnel) {
+        vlogE("Receiver: teid(%d) not found", rdt_ack_compact_teid(buf, length));
+        return;
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    msg.seq_ref = ptunnel->txq.last_ack;
+    if (rdt_dec_ops.ack_compact((char*)buf, length, (struct rdt_common_msg*)&msg) < 0) {
+        vlogE("Receiver: invalid compact ack msg");
+        return;
+    }
+    on_data_ack(ptunnel, &msg);
+    return ;
+}
+
+/*
+ * Ack peer put in a data msg. Resends carry the ack of their first send,
+ * so only one moving last ack on counts, never as a duplicated ack.
+ */
+static
+void on_piggyback_ack(rdt_tunnel_t* ptunnel, struct rdt_data_msg* msg)
+{
+    struct rdt_data_ack_msg ack;
+
+    if(msg->seq_ack <= ptunnel->txq.last_ack){
+        return;
+    }
+    memset(&ack, 0, sizeof(ack));
+    ack.seq_ack  = msg->seq_ack;
+    ack.windowsz = msg->windowsz;
+    on_data_ack(ptunnel, &ack);
+}
+
+/*
+ * Acks of several tunnels, each goes to its own tunnel.
+ */
+static
+void handle_ack_multi(int sessionId, int channelId, char *buf, int length)
+{
+    struct rdt_ack_multi_msg msg;
+    struct rdt_data_ack_msg ack;
+    rdt_tunnel_t* ptunnel = NULL;
+    int i = 0;
+
+    vassert(sessionId > 0);
+    vassert(channelId > 0);
+    vassert(length > 0);
+
+    if (rdt_dec_ops.ack_multi((char*)buf, length, (struct rdt_common_msg*)&msg) < 0) {
+        vlogE("Receiver: invalid ack multi msg");
+        return;
+    }
+    for (i = 0; i < msg.nacks; i++) {
+        ptunnel = get_tunnel(msg.acks[i].teid);
+        if (!ptunnel) {
+            vlogE("Receiver: teid(%d) not found", msg.acks[i].teid);
+            continue;
+        }
+        memset(&ack, 0, sizeof(ack));
+        ack.rteid    = msg.acks[i].teid;
+        ack.seq_ack  = rdt_expand_seq(msg.acks[i].seq_ack, sizeof(uint32_t), ptunnel->txq.last_ack);
+        ack.seq_recv = rdt_expand_recv(msg.acks[i].seq_recv, ack.seq_ack);
+        ack.windowsz = msg.acks[i].windowsz;
+        on_data_ack(ptunnel, &ack);
+    }
+    return ;
+}
+
+/*
+ * Probe of path mtu got through, its size is what peer needs to know.
+ */
+static
+void handle_pmtu_probe(int sessionId, int channelId, char *buf, int length)
+{
+    struct rdt_pmtu_msg msg;
+    rdt_tunnel_t* ptunnel = NULL;
+
+    vassert(sessionId > 0);
+    vassert(channelId > 0);
+    vassert(length > 0);
+
+    if (rdt_dec_ops.pmtu((char*)buf, length, (struct rdt_common_msg*)&msg) < 0) {
+        vlogE("Receiver: invalid pmtu probe msg");
+        return;
+    }
+    ptunnel = get_tunnel(msg.rteid);
+    if (!ptunnel) {
+        vlogE("Receiver: teid(%d) not found", msg.rteid);
+        return;
+    }
+    if(ptunnel->state != RDT_STATE_READY){
+        vlogE("RECEIVER:: Receive pmtu probe on wrong state(%d)", ptunnel->state);
+        return;
+    }
+    ptunnel->ops[ptunnel->state]->send_pmtu_ack(ptunnel, msg.probe_id, (uint32_t)length);
+    return ;
+}
+
+static
+void handle_pmtu_ack(int sessionId, int channelId, char *buf, int length)
+{
+    struct rdt_pmtu_msg msg;
+    rdt_tunnel_t* ptunnel = NULL;
+
+    vassert(sessionId > 0);
+    vassert(channelId > 0);
+    vassert(length > 0);
+
+    if (rdt_dec_ops.pmtu((char*)buf, length, (struct rdt_common_msg*)&msg) < 0) {
+        vlogE("Receiver: invalid pmtu ack msg");
+        return;
+    }
     ptunnel = get_tunnel(msg.rteid);
     if (!ptunnel) {
         vlogE("Receiver: teid(%d) not found", msg.rteid);
         return;
     }
+    tunnel_pmtu_acked(ptunnel, msg.probe_id, msg.size);
+    return ;
+}
+
+/*
+ * Put data msg back together from its fragments. Only the latest one is
+ * kept, fragments of an earlier msg left unfinished are dropped with it.
+ */
+static
+void handle_frag(int sessionId, int channelId, char *buf, int length)
+{
+    struct rdt_frag_msg msg;
+    rdt_tunnel_t* ptunnel = NULL;
+    uint64_t all = 0;
+
+    vassert(sessionId > 0);
+    vassert(channelId > 0);
+    vassert(length > 0);
+
+    if (rdt_dec_ops.frag((char*)buf, length, (struct rdt_common_msg*)&msg) < 0) {
+        vlogE("Receiver: invalid frag msg");
+        return;
+    }
+    ptunnel = get_tunnel(msg.rteid);
+    if (!ptunnel) {
+        vlogE("Receiver: teid(%d) not found", msg.rteid);
+        return;
+    }
+    if (!ptunnel->frag_buf) {
+        ptunnel->frag_buf = (uint8_t*)malloc(RDT_FRAG_LEN * RDT_FRAG_MAX);
+        if (!ptunnel->frag_buf) {
+            vlogE("Failed to malloc frag buffer");
+            return;
+        }
+    }
+    if (msg.frag_id != ptunnel->frag_rx_id) {
+        ptunnel->frag_rx_id = msg.frag_id;
+        ptunnel->frag_have = 0;
+        ptunnel->frag_len = 0;
+    }
+    memcpy(ptunnel->frag_buf + msg.index * RDT_FRAG_LEN, msg.data, msg.len);
+    ptunnel->frag_have |= (uint64_t)1 << msg.index;
+    if (msg.index + 1 == msg.count) {
+        ptunnel->frag_len = msg.index * RDT_FRAG_LEN + msg.len;
+    }
+
+    all = (msg.count == RDT_FRAG_MAX) ? ~(uint64_t)0 : ((uint64_t)1 << msg.count) - 1;
+    if (ptunnel->frag_have == all) {
+        ptunnel->frag_have = 0;
+        handle_data(sessionId, channelId, ptunnel->frag_buf, ptunnel->frag_len);
+    }
+    return ;
+}
+
+/*
+ * Resumption ticket from the responding end, kept for a later open.
+ */
+static
+void handle_ticket(int sessionId, int channelId, char *buf, int length)
+{
+    struct rdt_ticket_msg msg;
+    rdt_tunnel_t* ptunnel = NULL;
+
+    vassert(sessionId > 0);
+    vassert(channelId > 0);
+    vassert(length > 0);
+
+    if (rdt_dec_ops.ticket((char*)buf, length, (struct rdt_common_msg*)&msg) < 0) {
+        vlogE("Receiver: invalid ticket msg");
+        return;
+    }
+    ptunnel = get_tunnel(msg.rteid);
+    if (!ptunnel) {
+        vlogE("Receiver: teid(%d) not found", msg.rteid);
+        return;
+    }
+    if(ptunnel->state != RDT_STATE_READY){
+        vlogE("RECEIVER:: Receive ticket on wrong state(%d)", ptunnel->state);
+        return;
+    }
+    tunnel_ticket_save(ptunnel, msg.ticket, msg.len);
+    return ;
+}
+
+static
+void handle_fwd_skip(int sessionId, int channelId, char *buf, int length)
+{
+    struct rdt_fwd_skip_msg msg;
+    rdt_tunnel_t* ptunnel = NULL;
+    uint64_t ack_seq = 0;
+    int i = 0;
+
+    vassert(sessionId > 0);
+    vassert(channelId > 0);
+    vassert(length > 0);
+
+    if (length < 8) {
+        vlogE("Receiver: invalid fwd skip msg");
+        return;
+    }
+
+    //Tunnel first, seqs expand near the one it expects
+    ptunnel = get_tunnel(rdt_ctrl_teid(buf, length));
+    if (!ptunnel) {
+        vlogE("Receiver: teid(%d) not found", rdt_ctrl_teid(buf, length));
+        return;
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    msg.seq_ref = ptunnel->rxq.expected_seq;
+    rdt_dec_ops.fwd_skip((char*)buf, length, (struct rdt_common_msg*)&msg);
 
-    vlock_enter(&ptunnel->lock);
     if(ptunnel->state != RDT_STATE_READY){
+        vlogE("RECEIVER:: Receive fwd skip on wrong state(%d)", ptunnel->state);
+        return;
+    }
+
+    ptunnel->timeout_counter = 0;
+    ack_seq = ptunnel->rxq.expected_seq;
+    for (i = 0; i < msg.nranges; i++) {
+        ack_seq = ptunnel->rxq.skip_range(&ptunnel->rxq, &msg.ranges[i]);
+    }
+    //Ack at once, so sender frees the abandoned pkts
+    ptunnel->ops[ptunnel->state]->send_data_ack(ptunnel, ack_seq, 0);
+    return ;
+}
+
+static
+void handle_fec(int sessionId, int channelId, char *buf, int length)
+{
+    struct rdt_fec_msg msg;
+    struct rdt_fec_out recovered[RDT_FEC_MAX_R];
+    rdt_tunnel_t* ptunnel = NULL;
+    int n = 0;
+    int i = 0;
+
+    vassert(sessionId > 0);
+    vassert(channelId > 0);
+    vassert(length > 0);
+
+    if (length < RDT_FEC_HDR_LEN) {
+        vlogE("Receiver: invalid fec msg");
+        return;
+    }
+
+    //Tunnel first, base seq expands near the one it expects
+    ptunnel = get_tunnel(rdt_ctrl_teid(buf, length));
+    if (!ptunnel) {
+        vlogE("Receiver: teid(%d) not found", rdt_ctrl_teid(buf, length));
+        return;
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    msg.seq_ref = ptunnel->rxq.expected_seq;
+    if (rdt_dec_ops.fec((char*)buf, length, (struct rdt_common_msg*)&msg) < 0) {
+        vlogE("Receiver: invalid fec msg");
+        return;
+    }
+
+    if(ptunnel->state != RDT_STATE_READY){
+        vlogE("RECEIVER:: Receive fec msg on wrong state(%d)", ptunnel->state);
+        return;
+    }
+
+    ptunnel->timeout_counter = 0;
+    if (!ptunnel->fec_dec) {
+        vlock_enter(&ptunnel->lock);
+        if (!ptunnel->fec_dec) {
+            ptunnel->fec_dec = fec_dec_create();
+        }
         vlock_leave(&ptunnel->lock);
-        vlogE("RECEIVER:: Receive data ack on wrong state(%d)", ptunnel->state);
+        if (!ptunnel->fec_dec) {
+            return;
+        }
+    }
+
+    n = fec_dec_add_repair(ptunnel->fec_dec, &msg, recovered, RDT_FEC_MAX_R);
+    for (i = 0; i < n; i++) {
+        handle_data(sessionId, channelId, recovered[i].data, recovered[i].len);
+        free(recovered[i].data);
+    }
+
+    //Gaps in blocks done with are left to retransmission now
+    vlock_enter(&ptunnel->rxq.lock);
+    ptunnel->rxq.fec_on = 1;
+    ptunnel->rxq.fec_seq = ptunnel->fec_dec->covered_seq;
+    vlock_leave(&ptunnel->rxq.lock);
+
+    tunnel_nack_gaps(ptunnel);
+    return ;
+}
+
+static
+void handle_data_nack(int sessionId, int channelId, char *buf, int length)
+{
+    struct rdt_data_nack_msg msg;
+    rdt_tunnel_t* ptunnel = NULL;
+
+    vassert(sessionId > 0);
+    vassert(channelId > 0);
+    vassert(length > 0);
+
+    if (length < 12) {
+        vlogE("Receiver: invalid data_nack msg");
         return;
     }
 
-    if(ptunnel->data_sending == 1){
-        vtimer_restart(&ptunnel->timer, RDT_DATA_ACK_TIMEOUT, 0);
-    } else{
-        vtimer_restart(&ptunnel->timer, RDT_KEEPALIVE_TIMEOUT, 0);
+    //Tunnel first, seqs expand near its last ack
+    ptunnel = get_tunnel(rdt_ctrl_teid(buf, length));
+    if (!ptunnel) {
+        vlogE("Receiver: teid(%d) not found", rdt_ctrl_teid(buf, length));
+        return;
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    msg.seq_ref = ptunnel->txq.last_ack;
+    rdt_dec_ops.data_nack((char*)buf, length, (struct rdt_common_msg*)&msg);
+
+    if(ptunnel->state != RDT_STATE_READY){
+        vlogE("RECEIVER:: Receive data nack on wrong state(%d)", ptunnel->state);
+        return;
     }
 
     ptunnel->timeout_counter = 0;
-    ptunnel->peer_window_sz  = msg.windowsz;
+    ptunnel->txq.update_ack(&ptunnel->txq, msg.seq_ack, 0);
+    ptunnel->txq.resend_ranges(&ptunnel->txq, msg.ranges, msg.nranges);
+    return ;
+}
 
-    vlock_leave(&ptunnel->lock);
-    ptunnel->txq.update_ack(&ptunnel->txq, msg.seq_ack);
+static
+void handle_stream_ctrl(int sessionId, int channelId, char *buf, int length)
+{
+    struct rdt_stream_msg msg;
+    rdt_tunnel_t* ptunnel = NULL;
+    uint32_t credit = 0;
 
+    vassert(sessionId > 0);
+    vassert(channelId > 0);
+    vassert(length > 0);
+
+    if (length < sizeof(msg)) {
+        vlogE("Receiver: invalid stream msg");
+        return;
+    }
+
+    rdt_dec_ops.stream((char*)buf, length, (struct rdt_common_msg*)&msg);
+    ptunnel = get_tunnel(msg.rteid);
+    if (!ptunnel) {
+        vlogE("Receiver: teid(%d) not found", msg.rteid);
+        return;
+    }
+
+    if(ptunnel->state != RDT_STATE_READY){
+        vlogE("RECEIVER:: Receive stream msg on wrong state(%d)", ptunnel->state);
+        return;
+    }
+
+    ptunnel->timeout_counter = 0;
+    switch (msg.stream_type) {
+    case RDT_STREAM_CREDIT:
+        tunnel_stream_credit(ptunnel, msg.stream_id, msg.value);
+        break;
+    case RDT_STREAM_BLOCKED:
+        credit = ptunnel->rxq.get_credit(&ptunnel->rxq, msg.stream_id);
+        ptunnel->ops[ptunnel->state]->send_stream_ctrl(ptunnel, msg.stream_id, RDT_STREAM_CREDIT, credit);
+        break;
+    default:
+        vlogE("Receiver: unknown stream msg type(%d)", msg.stream_type);
+        break;
+    }
     return ;
 }
 
@@ -271,22 +787,86 @@ HANDLER_PTR ctrl_msg_handlers[] = {
     handle_keepalive, // CTRL_MSG_KEEPALIVE
     handle_data_ack,  // CTRL_MSG_ACK
     handle_shutdown,  // CTRL_MSG_SHUTDOWN
+    handle_data_nack, // CTRL_MSG_NACK
+    handle_stream_ctrl, // CTRL_MSG_STREAM
+    handle_fwd_skip,  // CTRL_MSG_FWD_SKIP
+    handle_fec,       // CTRL_MSG_FEC
+    handle_ack_compact, // CTRL_MSG_ACK_COMPACT
+    handle_bundle,    // CTRL_MSG_BUNDLE
+    handle_ack_multi, // CTRL_MSG_ACK_MULTI
+    handle_pmtu_probe, // CTRL_MSG_PMTU_PROBE
+    handle_pmtu_ack,  // CTRL_MSG_PMTU_ACK
+    handle_frag,      // CTRL_MSG_FRAG
+    handle_ticket,    // CTRL_MSG_TICKET
 };
 
+/*
+ * Hand each msg of a bundle to its handler. Handshakes and bundles are
+ * never put in one.
+ */
+static
+void handle_bundle(int sessionId, int channelId, char *buf, int length)
+{
+    uint8_t ctrltype = 0;
+    int off = RDT_BUNDLE_HDR_LEN;
+    int len = 0;
+
+    vassert(sessionId > 0);
+    vassert(channelId > 0);
+    vassert(length > 0);
+
+    while ((len = rdt_bundle_next(buf, length, &off)) > 0) {
+        ctrltype = (uint8_t)(*(uint8_t*)(buf + off) >> 1);
+        if ((*(uint8_t*)(buf + off) & 0x01) == DATA_MSG) {
+            handle_data(sessionId, channelId, buf + off, len);
+        } else if ((len >= 4) && (ctrltype > CTRL_MSG_HANDSHAKE) &&
+                   (ctrltype != CTRL_MSG_BUNDLE) && (ctrltype < CTRL_MSG_BUTT)) {
+            ctrl_msg_handlers[ctrltype](sessionId, channelId, buf + off, len);
+        } else {
+            vlogE("Receiver: Unrecognized msg in bundle.");
+        }
+        off += len;
+    }
+    if (len < 0) {
+        vlogE("Receiver: invalid bundle msg");
+    }
+    return ;
+}
+
 static
 void handle_data(int sessionId, int channelId, void *buf, int length)
 {
     struct rdt_data_msg msg;
     rdt_tunnel_t* ptunnel = NULL;
     data_pkt_t* pkt = NULL;
-    int ret = 0;
-    uint32_t ack_seq = 0;
+    uint64_t ack_seq = 0;
+    struct rdt_fec_out recovered[RDT_FEC_MAX_R];
+    int plen = 0;
+    int n = 0;
+    int i = 0;
 
     vassert(sessionId > 0);
     vassert(channelId > 0);
     vassert(length > 0);
 
-    pkt = (data_pkt_t*)malloc(sizeof(*pkt) + length -8);
+    plen = rdt_data_payload_len(buf, length);
+    if (plen < 0) {
+        vlogE("Receiver: invalid data msg");
+        return;
+    }
+
+    //Tunnel first, its key and expected seq are needed to decode
+    ptunnel = get_tunnel(rdt_data_teid(buf, length));
+    if (!ptunnel) {
+        vlogE("Receiver:Teid(%d) not found", rdt_data_teid(buf, length));
+        return;
+    }
+    if(ptunnel->state != RDT_STATE_READY){
+        vlogE("Receive data on wrong state(%d)", ptunnel->state);
+        return;
+    }
+
+    pkt = (data_pkt_t*)malloc(sizeof(*pkt) + plen);
     if (!pkt) {
         vlogE("Failed to malloc data packet\n");
         return ;
@@ -297,31 +877,50 @@ void handle_data(int sessionId, int channelId, void *buf, int length)
 
     memset(&msg, 0, sizeof(msg));
     msg.data = pkt->data;
+    msg.key  = (ptunnel->caps & RDT_CAP_AEAD) ? ptunnel->rx_key : NULL;
+    msg.seq_ref = ptunnel->rxq.expected_seq;
+    msg.ack_ref = ptunnel->txq.last_ack;
 
-    rdt_dec_ops.data((char*)buf, length, (struct rdt_common_msg*)&msg);
-    pkt->seq = msg.seq;
-    pkt->len = msg.len;
-    pkt->teid = msg.rteid;
-
-    ptunnel = get_tunnel(msg.rteid);
-    if (!ptunnel) {
-        vlogE("Receiver:Teid(%d) not found", msg.rteid);
+    if (rdt_dec_ops.data((char*)buf, length, (struct rdt_common_msg*)&msg) < 0) {
+        vlogE("Receiver: invalid data msg");
         free(pkt);
         return;
     }
-    if(ptunnel->state != RDT_STATE_READY){
-        vlogE("Receive data on wrong state(%d)", ptunnel->state);
+    if (msg.key && !(msg.flags & RDT_DATA_F_SEAL)) {
+        vlogE("Receiver: unsealed data msg on sealed tunnel(%d)", ptunnel->teid);
         free(pkt);
         return;
     }
-    vtimer_restart(&ptunnel->timer, RDT_KEEPALIVE_TIMEOUT, 0);
-    ptunnel->timeout_counter = 0;
+    pkt->seq = msg.seq;
+    pkt->len = msg.len;
+    pkt->teid = msg.rteid;
+    pkt->flags = msg.flags;
+    pkt->stream_id = msg.stream_id;
+    pkt->stream_off = msg.stream_off;
+    if (!ptunnel->data_sending) {
+        //Leave resend timer of data in flight to peer alone
+        vtimer_restart(&ptunnel->timer, RDT_KEEPALIVE_TIMEOUT, 0);
+        ptunnel->timeout_counter = 0;
+    }
+    if (msg.has_ack) {
+        on_piggyback_ack(ptunnel, &msg);
+    }
+
+    if (ptunnel->fec_dec) {
+        n = fec_dec_add_data(ptunnel->fec_dec, buf, length, msg.seq, msg.len, recovered, RDT_FEC_MAX_R);
+    }
 
+    //rxq takes over pkt, even it is dropped as duplicated or out of window.
     ack_seq = ptunnel->rxq.arrange_pkt(&ptunnel->rxq, pkt);
-    ret = ptunnel->ops[ptunnel->state]->send_data_ack(ptunnel, ack_seq);
-    if (ret < 0) {
-        free(pkt);
+    tunnel_ack_data(ptunnel, ack_seq, msg.seq);
+    tunnel_ticket_refresh(ptunnel);
+
+    for (i = 0; i < n; i++) {
+        handle_data(sessionId, channelId, recovered[i].data, recovered[i].len);
+        free(recovered[i].data);
     }
+
+    tunnel_nack_gaps(ptunnel);
     return;
 }
 
@@ -342,9 +941,9 @@ void on_session_data(int sessionId, int channelId, char* buf, int length)
     ctrltype = (uint8_t)(*(uint8_t*)(buf + off) >> 1);
 
     if (msgtype == DATA_MSG) {
-        handle_data(sessionId, channelId, buf + off, length);
-    } else if ((ctrltype >= 0) && (ctrltype <= CTRL_MSG_SHUTDOWN)) {
-        ctrl_msg_handlers[ctrltype](sessionId, channelId, buf + off, length);
+        handle_data(sessionId, channelId, buf + off, length - off);
+    } else if ((ctrltype >= 0) && (ctrltype < CTRL_MSG_BUTT)) {
+        ctrl_msg_handlers[ctrltype](sessionId, channelId, buf + off, length - off);
     } else {
         vlogE("Receiver: Unrecognized msg.");
     }
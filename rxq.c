@@ -18,9 +18,15 @@
 #include "rxq.h"
 
 static struct vlist* find_position(rx_pkt_mngr_t* pkt_mngr, data_pkt_t* pkt);
-static uint32_t get_expected_req(rx_pkt_mngr_t* pkt_mngr, data_pkt_t* last_accepted_pkt);
+static struct vlist* find_stream_position(rx_stream_t* stream, data_pkt_t* pkt);
+static rx_stream_t* find_stream(rx_pkt_mngr_t* pkt_mngr, uint16_t id, int create);
+static int record_range(rx_pkt_mngr_t* pkt_mngr, uint64_t start, uint64_t end);
+static int seq_received(rx_pkt_mngr_t* pkt_mngr, uint64_t seq);
 static uint32_t commit_pkt(rx_pkt_mngr_t* pkt_mngr);
-static int next_pkt(struct vlist*, void*);
+static uint32_t commit_stream(rx_pkt_mngr_t* pkt_mngr, rx_stream_t* stream);
+static void consume_pkt(rx_pkt_mngr_t* pkt_mngr, data_pkt_t* pkt);
+static void free_pkt_list(struct vlist* list);
+static void tune_buf_size(rx_pkt_mngr_t* pkt_mngr, uint32_t len);
 
 void init_rxq(void* this)
 {
@@ -33,12 +39,31 @@ void init_rxq(void* this)
 
     vlock_init(&pkt_mngr->rx_lock);
     vcond_init(&pkt_mngr->rx_cond);
+    vcond_init(&pkt_mngr->read_cond);
     vlist_init(&pkt_mngr->pkt_list);
     vlist_init(&pkt_mngr->commit_list);
-
-    pkt_mngr->max_pkt_num = MAX_RXQ_LEN;
-    pkt_mngr->cur_pkt_num = 0;
+    vlist_init(&pkt_mngr->range_list);
+    vlist_init(&pkt_mngr->stream_list);
+
+    memset(&pkt_mngr->stream0, 0, sizeof(pkt_mngr->stream0));
+    vlist_init(&pkt_mngr->stream0.pkt_list);
+    vlist_add_tail(&pkt_mngr->stream_list, &pkt_mngr->stream0.list);
+    pkt_mngr->stream_num = 1;
+    pkt_mngr->credits_due = 0;
+
+    pkt_mngr->buf_size = RXQ_INIT_BUF_SIZE;
+    pkt_mngr->buf_limit = RXQ_MAX_BUF_SIZE;
+    pkt_mngr->cur_bytes = 0;
     pkt_mngr->expected_seq = 1;
+    pkt_mngr->read_off = 0;
+    pkt_mngr->adv_window = RXQ_INIT_BUF_SIZE;
+    pkt_mngr->unordered = 0;
+    pkt_mngr->fec_on = 0;
+    pkt_mngr->fec_seq = 0;
+
+    pkt_mngr->rtt_us = RXQ_DEFAULT_RTT_US;
+    pkt_mngr->tune_start = vtime_us();
+    pkt_mngr->tune_bytes = 0;
 }
 
 void deinit_rxq(void* this)
@@ -47,13 +72,36 @@ void deinit_rxq(void* this)
 
     vassert(this != NULL);
     rx_pkt_mngr_t* pkt_mngr = (rx_pkt_mngr_t*) this;
+    rx_stream_t* stream = NULL;
+    struct vlist* node = NULL;
+
+    while((node = vlist_pop_head(&pkt_mngr->range_list)) != NULL){
+        free(vlist_entry(node, rx_range_t, list));
+    }
+    while((node = vlist_pop_head(&pkt_mngr->stream_list)) != NULL){
+        stream = vlist_entry(node, rx_stream_t, list);
+        free_pkt_list(&stream->pkt_list);
+        if(stream != &pkt_mngr->stream0){
+            free(stream);
+        }
+    }
+    free_pkt_list(&pkt_mngr->pkt_list);
+    free_pkt_list(&pkt_mngr->commit_list);
 
     vlock_deinit(&pkt_mngr->lock);
     vlock_deinit(&pkt_mngr->rx_lock);
     vcond_deinit(&pkt_mngr->rx_cond);
+    vcond_deinit(&pkt_mngr->read_cond);
 }
 
-uint32_t arrange_pkt(void* this, data_pkt_t* pkt)
+/*
+ * Take in a data pkt. Seq ranges received are tracked for the whole tunnel
+ * to ack, while the pkt itself waits only for the holes of its own stream.
+ * Pkts without stream header wait for every hole before them, as before
+ * streams existed. In unordered mode pkts are committed at once, except
+ * a stream FIN which still waits for all data of its stream.
+ */
+uint64_t arrange_pkt(void* this, data_pkt_t* pkt)
 {
     vassert(this != NULL);
     vassert(pkt != NULL);
@@ -61,24 +109,78 @@ uint32_t arrange_pkt(void* this, data_pkt_t* pkt)
     //vlogD("RXQ:arrange_pkt (seq:%d)", pkt->seq);
 
     rx_pkt_mngr_t* pkt_mngr = (rx_pkt_mngr_t*) this;
+    rx_stream_t* stream = NULL;
+    struct vlist* node = NULL;
+    uint32_t committed = 0;
 
     if(pkt->seq < pkt_mngr->expected_seq){
+        free(pkt);
         return pkt_mngr->expected_seq;
     }
 
-    struct vlist* node = NULL;
-
     vlock_enter(&pkt_mngr->lock);
-    node = find_position(pkt_mngr, pkt);
-    if(node != NULL){
+    if((pkt_mngr->cur_bytes + pkt->len > pkt_mngr->buf_size) &&
+       (pkt->seq != pkt_mngr->expected_seq)) {
+        //Out of window. The expected one is always taken to fill the gap.
+        vlock_leave(&pkt_mngr->lock);
+        free(pkt);
+        return pkt_mngr->expected_seq;
+    }
+
+    if(pkt->flags & RDT_DATA_F_STREAM){
+        //A late copy must not open again a stream its FIN has closed
+        if(seq_received(pkt_mngr, pkt->seq)){
+            vlock_leave(&pkt_mngr->lock);
+            free(pkt);
+            return pkt_mngr->expected_seq;
+        }
+        stream = find_stream(pkt_mngr, pkt->stream_id, 1);
+        if(stream == NULL){
+            //Too many streams, leave it unacked for peer to resend
+            vlock_leave(&pkt_mngr->lock);
+            free(pkt);
+            return pkt_mngr->expected_seq;
+        }
+    }
+
+    if(pkt_mngr->unordered && !(pkt->flags & RDT_DATA_F_FIN)){
+        node = &pkt_mngr->commit_list;
+    } else if(stream != NULL){
+        node = find_stream_position(stream, pkt);
+    } else {
+        node = find_position(pkt_mngr, pkt);
+    }
+
+    if((node == NULL) ||
+       (record_range(pkt_mngr, pkt->seq, pkt->seq + pkt->len) < 0)){
+        vlock_leave(&pkt_mngr->lock);
+        free(pkt);
+        return pkt_mngr->expected_seq;
+    }
+
+    pkt_mngr->cur_bytes += pkt->len;
+    tune_buf_size(pkt_mngr, pkt->len);
+
+    if(node == &pkt_mngr->commit_list){
+        vlock_enter(&pkt_mngr->rx_lock);
         vlist_add_tail(node, &pkt->list);
-        //vlogE("req(%d) expected_seq(%u)", pkt->seq, pkt_mngr->expected_seq);
-        if(pkt->seq == pkt_mngr->expected_seq) {
-            pkt_mngr->expected_seq = get_expected_req(pkt_mngr, pkt);
-            commit_pkt(pkt_mngr);
-            vcond_signal(&pkt_mngr->rx_cond);
+        vlock_leave(&pkt_mngr->rx_lock);
+        committed++;
+        //Offsets are not followed, count bytes to tell when FIN is due
+        if(stream != NULL){
+            stream->next_off += pkt->len;
         }
-        pkt_mngr->cur_pkt_num++;
+    } else {
+        vlist_add_tail(node, &pkt->list);
+    }
+
+    if(stream != NULL){
+        committed += commit_stream(pkt_mngr, stream);
+    }
+    committed += commit_pkt(pkt_mngr);
+    if(committed > 0){
+        vcond_signal(&pkt_mngr->rx_cond);
+        vcond_signal(&pkt_mngr->read_cond);
     }
 
     vlock_leave(&pkt_mngr->lock);
@@ -105,7 +207,7 @@ struct vlist* find_position(rx_pkt_mngr_t* pkt_mngr, data_pkt_t* pkt)
     __vlist_for_each(node, &pkt_mngr->pkt_list) {
         member = vlist_entry(node, struct data_pkt, list);
         if (member->seq == pkt->seq) {
-            vlogD("The pkt with same req(%u) exists in RXQ. ignore this one!!", member->seq);
+            vlogD("The pkt with same req(%llu) exists in RXQ. ignore this one!!", (unsigned long long)member->seq);
             //The pkt with same req exists in RXQ. ignore this one.
             return NULL;
         } else if (member->seq > pkt->seq) {
@@ -119,6 +221,164 @@ struct vlist* find_position(rx_pkt_mngr_t* pkt_mngr, data_pkt_t* pkt)
     return &pkt_mngr->pkt_list;
 }
 
+struct vlist* find_stream_position(rx_stream_t* stream, data_pkt_t* pkt)
+{
+    vassert(stream != NULL);
+    vassert(pkt != NULL);
+
+    struct vlist*  node = NULL;
+    data_pkt_t* member = NULL;
+
+    if(pkt->stream_off < stream->next_off){
+        return NULL;
+    }
+
+    __vlist_for_each(node, &stream->pkt_list) {
+        member = vlist_entry(node, struct data_pkt, list);
+        if (member->stream_off == pkt->stream_off) {
+            return NULL;
+        } else if (member->stream_off > pkt->stream_off) {
+            return &member->list;
+        }
+    }
+
+    return &stream->pkt_list;
+}
+
+/*
+ * Called with lock held.
+ */
+rx_stream_t* find_stream(rx_pkt_mngr_t* pkt_mngr, uint16_t id, int create)
+{
+    vassert(pkt_mngr != NULL);
+
+    rx_stream_t* stream = NULL;
+    struct vlist* node = NULL;
+
+    __vlist_for_each(node, &pkt_mngr->stream_list) {
+        stream = vlist_entry(node, rx_stream_t, list);
+        if(stream->id == id){
+            return stream;
+        }
+    }
+
+    if(!create || (pkt_mngr->stream_num >= RDT_MAX_STREAMS)){
+        return NULL;
+    }
+
+    //Opened by peer with its first pkt
+    stream = (rx_stream_t*)malloc(sizeof(*stream));
+    if(stream == NULL){
+        return NULL;
+    }
+    memset(stream, 0, sizeof(*stream));
+    vlist_init(&stream->pkt_list);
+    stream->id = id;
+    stream->credit = RDT_STREAM_INIT_CREDIT;
+
+    vlist_add_tail(&pkt_mngr->stream_list, &stream->list);
+    pkt_mngr->stream_num++;
+    return stream;
+}
+
+/*
+ * Mark seq range [start, end) received, advancing expected_seq if it fills
+ * the first hole. Return -1 if it was received already. Called with lock held.
+ */
+int record_range(rx_pkt_mngr_t* pkt_mngr, uint64_t start, uint64_t end)
+{
+    vassert(pkt_mngr != NULL);
+
+    struct vlist* node = NULL;
+    rx_range_t* range = NULL;
+    rx_range_t* next = NULL;
+
+    if(start < pkt_mngr->expected_seq){
+        return -1;
+    }
+
+    if(start == pkt_mngr->expected_seq){
+        pkt_mngr->expected_seq = end;
+        while(!vlist_is_empty(&pkt_mngr->range_list)){
+            range = vlist_entry(pkt_mngr->range_list.next, rx_range_t, list);
+            if(range->start > pkt_mngr->expected_seq){
+                break;
+            }
+            pkt_mngr->expected_seq = range->end;
+            vlist_pop_head(&pkt_mngr->range_list);
+            free(range);
+        }
+        return 0;
+    }
+
+    __vlist_for_each(node, &pkt_mngr->range_list) {
+        range = vlist_entry(node, rx_range_t, list);
+        if((start >= range->start) && (start < range->end)){
+            return -1;
+        }
+        if(start == range->end){
+            range->end = end;
+            if(node->next != &pkt_mngr->range_list){
+                next = vlist_entry(node->next, rx_range_t, list);
+                if(next->start == range->end){
+                    range->end = next->end;
+                    vlist_del(&next->list);
+                    free(next);
+                }
+            }
+            return 0;
+        }
+        if(end == range->start){
+            //The hole before the range shrank, date it by this pkt
+            range->start = start;
+            range->ts = vtime_us();
+            range->nack_ts = 0;
+            return 0;
+        }
+        if(end < range->start){
+            break;
+        }
+    }
+
+    range = (rx_range_t*)malloc(sizeof(*range));
+    if(range == NULL){
+        return -1;
+    }
+    vlist_init(&range->list);
+    range->start = start;
+    range->end = end;
+    range->ts = vtime_us();
+    range->nack_ts = 0;
+    vlist_add_tail(node, &range->list);
+    return 0;
+}
+
+/*
+ * Tell if seq was received already, as record_range would reject it.
+ * Called with lock held.
+ */
+int seq_received(rx_pkt_mngr_t* pkt_mngr, uint64_t seq)
+{
+    vassert(pkt_mngr != NULL);
+
+    struct vlist* node = NULL;
+    rx_range_t* range = NULL;
+
+    if(seq < pkt_mngr->expected_seq){
+        return 1;
+    }
+    __vlist_for_each(node, &pkt_mngr->range_list) {
+        range = vlist_entry(node, rx_range_t, list);
+        if(seq < range->start){
+            break;
+        }
+        if(seq < range->end){
+            return 1;
+        }
+    }
+    return 0;
+}
+
 int32_t fetch_rxq_pkt(
 void* this, data_pkt_t** ppkt)
 {
@@ -147,86 +407,457 @@ void* this, data_pkt_t** ppkt)
     return ret;
 }
 
+void release_rxq_pkt(void* this, data_pkt_t* pkt)
+{
+    vassert(this != NULL);
+    vassert(pkt != NULL);
+
+    rx_pkt_mngr_t* pkt_mngr = (rx_pkt_mngr_t*) this;
+
+    vlock_enter(&pkt_mngr->lock);
+    consume_pkt(pkt_mngr, pkt);
+    vlock_leave(&pkt_mngr->lock);
+}
 
-int next_pkt(struct vlist* node, void* argv)
+int32_t read_rxq_data(void* this, const struct iovec* iov, int iovcnt)
 {
-    vassert(argv != NULL);
+    vassert(this != NULL);
+    vassert(iov != NULL);
 
-    data_pkt_t* pkt = (data_pkt_t*) argv;
-    data_pkt_t* pkt_in_list = vlist_entry(node, data_pkt_t, list);
-    if(pkt_in_list == NULL) {
-        return 0;
+    rx_pkt_mngr_t* pkt_mngr = (rx_pkt_mngr_t*) this;
+    struct vlist done_list;
+    struct vlist* node = NULL;
+    data_pkt_t* pkt = NULL;
+    int32_t total = 0;
+    size_t iov_off = 0;
+    size_t n = 0;
+    int i = 0;
+
+    vlist_init(&done_list);
+
+    vlock_enter(&pkt_mngr->rx_lock);
+    while(!vlist_is_empty(&pkt_mngr->commit_list) && (i < iovcnt)){
+        if(iov_off == iov[i].iov_len){
+            iov_off = 0;
+            i++;
+            continue;
+        }
+
+        pkt = vlist_entry(pkt_mngr->commit_list.next, data_pkt_t, list);
+        if(pkt->flags & RDT_DATA_F_FIN){
+            //End of stream carries no data
+            node = vlist_pop_head(&pkt_mngr->commit_list);
+            vlist_add_tail(&done_list, node);
+            continue;
+        }
+
+        n = pkt->len - pkt_mngr->read_off;
+        if(n > iov[i].iov_len - iov_off){
+            n = iov[i].iov_len - iov_off;
+        }
+
+        memcpy((uint8_t*)iov[i].iov_base + iov_off, pkt->data + pkt_mngr->read_off, n);
+        iov_off += n;
+        total += n;
+        pkt_mngr->read_off += n;
+
+        if(pkt_mngr->read_off == pkt->len){
+            node = vlist_pop_head(&pkt_mngr->commit_list);
+            vlist_add_tail(&done_list, node);
+            pkt_mngr->read_off = 0;
+        }
     }
+    vlock_leave(&pkt_mngr->rx_lock);
 
-    return (pkt_in_list->seq == pkt->seq + pkt->len);
+    vlock_enter(&pkt_mngr->lock);
+    __vlist_for_each(node, &done_list) {
+        consume_pkt(pkt_mngr, vlist_entry(node, data_pkt_t, list));
+    }
+    vlock_leave(&pkt_mngr->lock);
+
+    while((node = vlist_pop_head(&done_list)) != NULL){
+        free(vlist_entry(node, data_pkt_t, list));
+    }
+
+    return total;
 }
 
-uint32_t get_expected_req(rx_pkt_mngr_t* pkt_mngr, data_pkt_t* last_accepted_pkt)
+uint32_t get_rxq_window(void* this)
 {
-    //vlogD("RXQ:get_expected_req");
+    vassert(this != NULL);
 
-    vassert(pkt_mngr != NULL);
-    vassert(last_accepted_pkt != NULL);
+    rx_pkt_mngr_t* pkt_mngr = (rx_pkt_mngr_t*) this;
+    uint32_t window = 0;
 
-    struct vlist*  node = NULL;
+    vlock_enter(&pkt_mngr->lock);
+    if(pkt_mngr->cur_bytes < pkt_mngr->buf_size){
+        window = pkt_mngr->buf_size - pkt_mngr->cur_bytes;
+    }
+    vlock_leave(&pkt_mngr->lock);
+
+    return window;
+}
+
+/*
+ * Collect the holes in rxq which persist longer than reorder threshold and
+ * were not nacked in last round trip. A hole is dated by the arrival of the
+ * pkt right after it. Time until the next hole is due is kept in @wait_us,
+ * 0 if there is no hole, so holes get checked again with nothing arriving.
+ */
+int32_t collect_rxq_gaps(void* this, struct rdt_nack_range* ranges, int max, uint64_t* wait_us)
+{
+    vassert(this != NULL);
+    vassert(ranges != NULL);
+    vassert(wait_us != NULL);
+
+    rx_pkt_mngr_t* pkt_mngr = (rx_pkt_mngr_t*) this;
+    struct vlist* node = NULL;
+    rx_range_t* range = NULL;
+    uint64_t now = vtime_us();
+    uint32_t reorder_us = pkt_mngr->rtt_us / 4;
+    uint32_t renack_us = pkt_mngr->rtt_us;
+    uint64_t next_seq = 0;
+    uint64_t due = 0;
+    int n = 0;
+
+    if(reorder_us < RXQ_MIN_REORDER_US){
+        reorder_us = RXQ_MIN_REORDER_US;
+    }
+    //Before any rtt sample, not more often than reorder threshold
+    if(renack_us < reorder_us){
+        renack_us = reorder_us;
+    }
+
+    *wait_us = 0;
+    vlock_enter(&pkt_mngr->lock);
+    next_seq = pkt_mngr->expected_seq;
+    __vlist_for_each(node, &pkt_mngr->range_list) {
+        range = vlist_entry(node, rx_range_t, list);
+        if(pkt_mngr->fec_on && (range->start > pkt_mngr->fec_seq) &&
+           (now - range->ts < reorder_us + pkt_mngr->rtt_us)){
+            //Repairs of the block may still recover it, wait for them a while
+            due = range->ts + reorder_us + pkt_mngr->rtt_us;
+        } else if((n < max) && (now - range->ts >= reorder_us) &&
+                  (now - range->nack_ts >= renack_us)){
+            ranges[n].start = next_seq;
+            ranges[n].end   = range->start;
+            range->nack_ts = now;
+            n++;
+            due = now + renack_us;
+        } else if(now - range->ts < reorder_us){
+            due = range->ts + reorder_us;
+        } else {
+            due = range->nack_ts + renack_us;
+        }
+        due = (due > now) ? due - now : 1;
+        if((*wait_us == 0) || (due < *wait_us)){
+            *wait_us = due;
+        }
+        next_seq = range->end;
+    }
+    vlock_leave(&pkt_mngr->lock);
+
+    return n;
+}
+
+/*
+ * Peer gave up a pkt. Take its seq range as received, and leave a
+ * placeholder without data at its place in the stream so the data after
+ * it is not held up.
+ */
+uint64_t skip_rxq_range(void* this, const struct rdt_skip_range* range)
+{
+    vassert(this != NULL);
+    vassert(range != NULL);
+
+    rx_pkt_mngr_t* pkt_mngr = (rx_pkt_mngr_t*) this;
+    rx_stream_t* stream = NULL;
+    struct vlist* node = NULL;
     data_pkt_t* pkt = NULL;
+    uint32_t committed = 0;
 
-    if(vlist_is_empty(&pkt_mngr->pkt_list)){
-        return last_accepted_pkt->seq + last_accepted_pkt->len;
+    if((range->len == 0) || (range->len > 0xffff)){
+        return pkt_mngr->expected_seq;
+    }
+
+    pkt = (data_pkt_t*)malloc(sizeof(*pkt));
+    if(pkt == NULL){
+        return pkt_mngr->expected_seq;
     }
+    memset(pkt, 0, sizeof(*pkt));
+    vlist_init(&pkt->list);
+    pkt->seq = range->seq;
+    pkt->len = (uint16_t)range->len;
+    pkt->flags = (range->flags & RDT_DATA_F_STREAM) | RDT_DATA_F_SKIP;
+    pkt->stream_id = range->stream_id;
+    pkt->stream_off = range->stream_off;
 
-    pkt = last_accepted_pkt;
-    do{
-        node = vlist_find_node(&pkt_mngr->pkt_list, &next_pkt,(void*)pkt);
-        if(node == NULL) {
-            return pkt->seq + pkt->len;
+    vlock_enter(&pkt_mngr->lock);
+    if(pkt->flags & RDT_DATA_F_STREAM){
+        //A late copy must not open again a stream its FIN has closed
+        if(seq_received(pkt_mngr, pkt->seq)){
+            vlock_leave(&pkt_mngr->lock);
+            free(pkt);
+            return pkt_mngr->expected_seq;
+        }
+        stream = find_stream(pkt_mngr, pkt->stream_id, 1);
+        if(stream == NULL){
+            vlock_leave(&pkt_mngr->lock);
+            free(pkt);
+            return pkt_mngr->expected_seq;
         }
+    }
 
-        pkt = vlist_entry(node, data_pkt_t, list);
+    if(pkt_mngr->unordered){
+        //Nothing is held in order, only count the bytes for stream FIN
+        node = &pkt_mngr->commit_list;
+    } else if(stream != NULL){
+        node = find_stream_position(stream, pkt);
+    } else {
+        node = find_position(pkt_mngr, pkt);
+    }
 
-    } while(pkt != NULL);
+    if((node == NULL) ||
+       (record_range(pkt_mngr, pkt->seq, pkt->seq + pkt->len) < 0)){
+        vlock_leave(&pkt_mngr->lock);
+        free(pkt);
+        return pkt_mngr->expected_seq;
+    }
 
-    //TODO log
-    vlogE("RXQ:get_expected_req failed");
-    vassert(0);
+    //Skipped bytes still hold the buffer and stream credit until passed
+    pkt_mngr->cur_bytes += pkt->len;
+    if(node == &pkt_mngr->commit_list){
+        if(stream != NULL){
+            stream->next_off += pkt->len;
+        }
+        consume_pkt(pkt_mngr, pkt);
+        free(pkt);
+    } else {
+        vlist_add_tail(node, &pkt->list);
+    }
 
-    return 0;
+    if(stream != NULL){
+        committed += commit_stream(pkt_mngr, stream);
+    }
+    committed += commit_pkt(pkt_mngr);
+    if(committed > 0){
+        vcond_signal(&pkt_mngr->rx_cond);
+        vcond_signal(&pkt_mngr->read_cond);
+    }
+    vlock_leave(&pkt_mngr->lock);
+
+    return pkt_mngr->expected_seq;
+}
+
+/*
+ * Collect the stream credits granted since last call, to be sent to peer.
+ */
+int32_t collect_rxq_credits(void* this, struct rdt_stream_credit* credits, int max)
+{
+    vassert(this != NULL);
+    vassert(credits != NULL);
+
+    rx_pkt_mngr_t* pkt_mngr = (rx_pkt_mngr_t*) this;
+    struct vlist* node = NULL;
+    rx_stream_t* stream = NULL;
+    int n = 0;
+
+    vlock_enter(&pkt_mngr->lock);
+    if(pkt_mngr->credits_due == 0){
+        vlock_leave(&pkt_mngr->lock);
+        return 0;
+    }
+
+    __vlist_for_each(node, &pkt_mngr->stream_list) {
+        if(n >= max){
+            break;
+        }
+        stream = vlist_entry(node, rx_stream_t, list);
+        if(stream->credit_due){
+            credits[n].stream_id = stream->id;
+            credits[n].credit = stream->credit;
+            stream->credit_due = 0;
+            pkt_mngr->credits_due--;
+            n++;
+        }
+    }
+    vlock_leave(&pkt_mngr->lock);
+
+    return n;
 }
 
+/*
+ * Credit currently granted to stream, for a sender asking again.
+ */
+uint32_t get_rxq_credit(void* this, uint16_t stream_id)
+{
+    vassert(this != NULL);
+
+    rx_pkt_mngr_t* pkt_mngr = (rx_pkt_mngr_t*) this;
+    rx_stream_t* stream = NULL;
+    uint32_t credit = RDT_STREAM_INIT_CREDIT;
+
+    vlock_enter(&pkt_mngr->lock);
+    stream = find_stream(pkt_mngr, stream_id, 0);
+    if(stream != NULL){
+        credit = stream->credit;
+    }
+    vlock_leave(&pkt_mngr->lock);
+
+    return credit;
+}
+
+/*
+ * Move pkts without stream header to commit list once every hole before
+ * them is filled. They make up stream 0 along with stream 0 pkts carrying
+ * an offset, which peer sends after it started using streams.
+ */
 uint32_t commit_pkt(rx_pkt_mngr_t* pkt_mngr)
 {
     vassert(pkt_mngr != NULL);
 
-    struct vlist*   node = NULL;
     data_pkt_t*  pkt = NULL;
-    data_pkt_t*  next_pkt = NULL;
     uint32_t counter = 0;
 
-    while(1){
-        node = vlist_pop_head(&pkt_mngr->pkt_list);
-        if(node == NULL) {
-            vlogD("RXQ:vlist_pop_head NULL ");
+    while(!vlist_is_empty(&pkt_mngr->pkt_list)){
+        pkt = vlist_entry(pkt_mngr->pkt_list.next, data_pkt_t, list);
+        if(pkt->seq >= pkt_mngr->expected_seq){
+            //A hole before it
             break;
         }
 
+        vlist_pop_head(&pkt_mngr->pkt_list);
+        pkt->stream_off = pkt_mngr->stream0.next_off;
+        pkt_mngr->stream0.next_off += pkt->len;
+        if(pkt->flags & RDT_DATA_F_SKIP){
+            consume_pkt(pkt_mngr, pkt);
+            free(pkt);
+            continue;
+        }
+
         vlock_enter(&pkt_mngr->rx_lock);
-        vlist_add_tail(&pkt_mngr->commit_list, node);
+        vlist_add_tail(&pkt_mngr->commit_list, &pkt->list);
         vlock_leave(&pkt_mngr->rx_lock);
         counter++;
+    }
+
+    if(counter > 0){
+        counter += commit_stream(pkt_mngr, &pkt_mngr->stream0);
+    }
+    return counter;
+}
+
+/*
+ * Move pkts of stream to commit list as long as they are sequential.
+ */
+uint32_t commit_stream(rx_pkt_mngr_t* pkt_mngr, rx_stream_t* stream)
+{
+    vassert(pkt_mngr != NULL);
+    vassert(stream != NULL);
 
-        if(vlist_is_empty(&pkt_mngr->pkt_list)){
-            //No next pkt exists
+    data_pkt_t*  pkt = NULL;
+    uint32_t counter = 0;
+
+    while(!vlist_is_empty(&stream->pkt_list)){
+        pkt = vlist_entry(stream->pkt_list.next, data_pkt_t, list);
+        if(pkt->stream_off != stream->next_off){
             break;
         }
 
-        pkt = vlist_entry(node, data_pkt_t, list);
-        next_pkt = vlist_entry(pkt_mngr->pkt_list.next, data_pkt_t, list);
-        if(next_pkt->seq != pkt->seq + pkt->len){
-            //Next pkt is not sequential
-            break;
+        vlist_pop_head(&stream->pkt_list);
+        stream->next_off += pkt->len;
+        if(pkt->flags & RDT_DATA_F_SKIP){
+            consume_pkt(pkt_mngr, pkt);
+            free(pkt);
+            continue;
         }
+
+        vlock_enter(&pkt_mngr->rx_lock);
+        vlist_add_tail(&pkt_mngr->commit_list, &pkt->list);
+        vlock_leave(&pkt_mngr->rx_lock);
+        counter++;
     }
 
     return counter;
 }
 
+/*
+ * Application is done with pkt. Grant its stream more credit once half of
+ * the last grant was consumed, and drop the stream at its end.
+ * Called with lock held.
+ */
+void consume_pkt(rx_pkt_mngr_t* pkt_mngr, data_pkt_t* pkt)
+{
+    vassert(pkt_mngr != NULL);
+    vassert(pkt != NULL);
+
+    rx_stream_t* stream = NULL;
+
+    pkt_mngr->cur_bytes -= pkt->len;
+    if(!(pkt->flags & RDT_DATA_F_STREAM) || (pkt->stream_id == 0)){
+        return;
+    }
+
+    stream = find_stream(pkt_mngr, pkt->stream_id, 0);
+    if(stream == NULL){
+        return;
+    }
+
+    if(pkt->flags & RDT_DATA_F_FIN){
+        if(stream->credit_due){
+            pkt_mngr->credits_due--;
+        }
+        vlist_del(&stream->list);
+        free_pkt_list(&stream->pkt_list);
+        free(stream);
+        pkt_mngr->stream_num--;
+        return;
+    }
+
+    stream->consumed += pkt->len;
+    if(!stream->credit_due &&
+       (stream->credit - stream->consumed < RDT_STREAM_INIT_CREDIT / 2)){
+        stream->credit = stream->consumed + RDT_STREAM_INIT_CREDIT;
+        stream->credit_due = 1;
+        pkt_mngr->credits_due++;
+    }
+}
+
+void free_pkt_list(struct vlist* list)
+{
+    struct vlist* node = NULL;
+
+    while((node = vlist_pop_head(list)) != NULL){
+        free(vlist_entry(node, data_pkt_t, list));
+    }
+}
+
+/*
+ * Grow receive buffer to twice of the bytes received in one round trip,
+ * so the window never limits a sender running at the path's delivery rate.
+ * Called with lock held.
+ */
+void tune_buf_size(rx_pkt_mngr_t* pkt_mngr, uint32_t len)
+{
+    vassert(pkt_mngr != NULL);
+
+    uint64_t now = vtime_us();
+    uint64_t target = 0;
+
+    pkt_mngr->tune_bytes += len;
+    if(now - pkt_mngr->tune_start < pkt_mngr->rtt_us){
+        return;
+    }
+
+    target = (uint64_t)pkt_mngr->tune_bytes * 2;
+    if(target > pkt_mngr->buf_limit){
+        target = pkt_mngr->buf_limit;
+    }
+    if(target > pkt_mngr->buf_size){
+        //vlogD("RXQ:buf size %u -> %u", pkt_mngr->buf_size, (uint32_t)target);
+        pkt_mngr->buf_size = (uint32_t)target;
+    }
+
+    pkt_mngr->tune_start = now;
+    pkt_mngr->tune_bytes = 0;
+}
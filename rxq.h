@@ -15,32 +15,96 @@
 #ifndef __RXQ_H__
 #define __RXQ_H__
 
+#include <sys/uio.h>
 #include "codec.h"
 #include "vlist.h"
 #include "vsys.h"
 
-#define MAX_RXQ_LEN 255
+#define RXQ_INIT_BUF_SIZE   (256 * 1024)
+#define RXQ_MAX_BUF_SIZE    (16 * 1024 * 1024)
+#define RXQ_DEFAULT_RTT_US  100000
+#define RXQ_MIN_REORDER_US  1000
+
+/*
+ * Seq range received beyond the cumulative ack point.
+ */
+typedef struct rx_range {
+    struct vlist list;
+    uint64_t start;
+    uint64_t end;
+    uint64_t ts;                    //Arrival of first pkt in range, dates the gap before it
+    uint64_t nack_ts;               //Time the gap before this range was nacked
+} rx_range_t;
+
+/*
+ * Receive side of a stream, delivered in offset order independently of
+ * other streams.
+ */
+typedef struct rx_stream {
+    struct vlist list;
+    struct vlist pkt_list;          //Pkts waiting for a hole in the stream, sorted by offset
+    uint16_t id;
+    uint8_t  credit_due;            //Grant not sent to peer yet
+    uint32_t next_off;              //Offset expected next
+    uint32_t consumed;              //Bytes consumed by application
+    uint32_t credit;                //Offset granted to peer
+} rx_stream_t;
+
+struct rdt_stream_credit {
+    uint16_t stream_id;
+    uint32_t credit;
+};
 
 typedef struct rx_pkt_mngr{
     struct vlock lock;
     struct vlock rx_lock;
     struct vcond rx_cond;
-    struct vlist pkt_list;
+    struct vcond read_cond;         //Signaled on commit for pull-mode readers
+    struct vlist pkt_list;          //Pkts without stream header, delivered in seq order
     struct vlist commit_list;
+    struct vlist range_list;        //Seq ranges received beyond expected_seq
+    struct vlist stream_list;       //Streams, stream 0 always present
+    rx_stream_t stream0;            //Default stream, never closed
+    int32_t stream_num;
+    int32_t credits_due;            //Streams with grant pending
+
+    uint32_t buf_size;              //Receive buffer size in bytes, auto-tuned
+    uint32_t buf_limit;             //Ceiling of buf_size
+    uint32_t cur_bytes;             //Bytes held in rxq, not consumed by application yet
+    uint64_t expected_seq;
+    uint32_t read_off;              //Bytes of head pkt in commit list already read
+    uint32_t adv_window;            //Window(bytes) advertised to peer in last ack
+    uint8_t  unordered;             //Deliver pkts as they arrive, only track seq ranges
+    uint8_t  fec_on;                //Peer sends FEC repairs
+    uint64_t fec_seq;               //Repairs arrived for data below, gaps above wait for them
 
-    uint32_t max_pkt_num;
-    uint32_t cur_pkt_num;
-    uint32_t expected_seq;
+    uint32_t rtt_us;                //Round trip time measured in handshake
+    uint64_t tune_start;            //Start time of current auto-tuning round
+    uint32_t tune_bytes;            //Bytes received in current auto-tuning round
 
     void (*init)(void* this);
     void (*deinit)(void* this);
-    uint32_t (*arrange_pkt)(void* this, data_pkt_t* pkt);
+    uint64_t (*arrange_pkt)(void* this, data_pkt_t* pkt);
     int32_t (*fetch_pkt)(void* this, data_pkt_t** ppkt);
+    void (*release_pkt)(void* this, data_pkt_t* pkt);
+    int32_t (*read_data)(void* this, const struct iovec* iov, int iovcnt);
+    uint32_t (*get_window)(void* this);
+    int32_t (*collect_gaps)(void* this, struct rdt_nack_range* ranges, int max, uint64_t* wait_us);
+    int32_t (*collect_credits)(void* this, struct rdt_stream_credit* credits, int max);
+    uint32_t (*get_credit)(void* this, uint16_t stream_id);
+    uint64_t (*skip_range)(void* this, const struct rdt_skip_range* range);
 } rx_pkt_mngr_t;
 
 void init_rxq(void* this);
 void deinit_rxq(void* this);
-uint32_t arrange_pkt(void* this, data_pkt_t* pkt);
+uint64_t arrange_pkt(void* this, data_pkt_t* pkt);
 int32_t fetch_rxq_pkt(void* this, data_pkt_t** ppkt);
+void release_rxq_pkt(void* this, data_pkt_t* pkt);
+int32_t read_rxq_data(void* this, const struct iovec* iov, int iovcnt);
+uint32_t get_rxq_window(void* this);
+int32_t collect_rxq_gaps(void* this, struct rdt_nack_range* ranges, int max, uint64_t* wait_us);
+int32_t collect_rxq_credits(void* this, struct rdt_stream_credit* credits, int max);
+uint32_t get_rxq_credit(void* this, uint16_t stream_id);
+uint64_t skip_rxq_range(void* this, const struct rdt_skip_range* range);
 
 #endif
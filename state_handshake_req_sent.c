@@ -27,6 +27,14 @@ struct rdt_proto_ops state_handshake_req_sent_ops = {
     .send_data      = NULL,
     .send_data_ack  = NULL,
     .send_data_fin  = NULL,
+    .send_data_nack = NULL,
+    .send_stream_ctrl = NULL,
+    .send_fwd_skip = NULL,
+    .send_fec = NULL,
+    .send_pmtu_probe = NULL,
+    .send_pmtu_ack = NULL,
+    .send_frags = NULL,
+    .send_ticket = NULL,
 
     .shutdown       = _shutdown_tunnel,
     .shutdown_recv   = _shutdown_tunnel_recv,
@@ -18,13 +18,21 @@
 
 struct rdt_proto_ops state_ready_ops = {
     .handshake_req  = NULL,
-    .handshake_resp  = NULL,
+    .handshake_resp  = _handshake_response,
     .handshake_fin  = NULL,
     .handshake_delayed_fin = NULL,
 
     .send_data      = _transfer_send_data,
     .send_data_ack  = _transfer_send_data_ack,
     .send_data_fin  = _transfer_send_data_fin,
+    .send_data_nack = _transfer_send_data_nack,
+    .send_stream_ctrl = _transfer_send_stream_ctrl,
+    .send_fwd_skip = _transfer_send_fwd_skip,
+    .send_fec = _transfer_send_fec,
+    .send_pmtu_probe = _transfer_send_pmtu_probe,
+    .send_pmtu_ack = _transfer_send_pmtu_ack,
+    .send_frags = _transfer_send_frags,
+    .send_ticket = _transfer_send_ticket,
 
     .shutdown       = _shutdown_tunnel,
     .shutdown_recv   = _shutdown_tunnel_recv,
@@ -0,0 +1,262 @@
+/*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*      http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+/*
+ * Seqs are 64 bits and wire carries 32 of them at most. Checks that they
+ * come back whole across 2^32, on their own and in each ctrl msg that
+ * carries them, and that an ack without seq_recv stays one.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "headers.h"
+#include "codec.h"
+
+#define WRAP ((uint64_t)1 << 32)
+
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            printf("%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+            failed++; \
+        } \
+    } while (0)
+
+extern struct rdt_enc_ops rdt_enc_ops;
+extern struct rdt_dec_ops rdt_dec_ops;
+
+static int failed = 0;
+
+static
+void test_expand_seq(void)
+{
+    static const uint64_t refs[] = { 0, 1, WRAP / 2, WRAP - 1, WRAP, WRAP + 1, 3 * WRAP - 7 };
+    static const int64_t offs[] = { 0, 1, -1, 100, -100, 0x7f, -0x80 };
+    uint64_t ref = 0;
+    uint64_t seq = 0;
+    int64_t d = 0;
+    int nbytes = 0;
+    int i = 0;
+    int j = 0;
+
+    for (nbytes = 1; nbytes <= 4; nbytes++) {
+        for (i = 0; i < (int)(sizeof(refs) / sizeof(refs[0])); i++) {
+            ref = refs[i];
+            for (j = 0; j < (int)(sizeof(offs) / sizeof(offs[0])); j++) {
+                d = offs[j];
+                if (((int64_t)ref + d < 0) || (d > 0x7f) || (d < -0x80)) {
+                    continue;
+                }
+                seq = ref + d;
+                CHECK(rdt_expand_seq((uint32_t)seq, nbytes, ref) == seq);
+            }
+        }
+    }
+    //Farthest a seq may be from ref with all 32 bits cut
+    CHECK(rdt_expand_seq((uint32_t)(WRAP + 0x7fffffff), 4, WRAP) == WRAP + 0x7fffffff);
+    CHECK(rdt_expand_seq((uint32_t)(WRAP - 0x80000000), 4, WRAP) == WRAP - 0x80000000);
+    //Never below 0
+    CHECK(rdt_expand_seq(0xffffffff, 4, 1) == 0xffffffff);
+}
+
+static
+void test_recv(void)
+{
+    CHECK(rdt_expand_recv(rdt_trunc_recv(WRAP, WRAP), WRAP) == WRAP);
+    CHECK(rdt_expand_recv(rdt_trunc_recv(WRAP, WRAP - 10), WRAP - 10) == WRAP);
+    CHECK(rdt_expand_recv(rdt_trunc_recv(2 * WRAP + 5, 2 * WRAP), 2 * WRAP) == 2 * WRAP + 5);
+    CHECK(rdt_expand_recv(rdt_trunc_recv(0, WRAP), WRAP) == 0);
+    CHECK(rdt_expand_recv(rdt_trunc_recv(0, WRAP + 1), WRAP + 1) == 0);
+    CHECK(rdt_expand_recv(rdt_trunc_recv(0, 1), 1) == 0);
+    //As sent by peers before
+    CHECK(rdt_expand_recv(0, 1) == 0);
+    CHECK(rdt_expand_recv(0, 1000) == 0);
+}
+
+static
+void test_data_ack(void)
+{
+    struct rdt_data_ack_msg msg;
+    struct rdt_data_ack_msg out;
+    char buf[64];
+    int len = 0;
+
+    //Pkt out of order right at 2^32, cut to 0 on wire
+    memset(&msg, 0, sizeof(msg));
+    msg.seq_ack  = WRAP - 10;
+    msg.seq_recv = WRAP;
+    msg.windowsz = 1000;
+    len = rdt_enc_ops.data_ack((struct rdt_common_msg*)&msg, buf, sizeof(buf));
+    memset(&out, 0, sizeof(out));
+    out.seq_ref = WRAP - 100;
+    CHECK(rdt_dec_ops.data_ack(buf, len, (struct rdt_common_msg*)&out) == len);
+    CHECK(out.seq_ack == WRAP - 10);
+    CHECK(out.seq_recv == WRAP);
+
+    //A dup behind the ack tells sender nothing
+    msg.seq_ack  = WRAP + 10;
+    msg.seq_recv = WRAP;
+    len = rdt_enc_ops.data_ack((struct rdt_common_msg*)&msg, buf, sizeof(buf));
+    memset(&out, 0, sizeof(out));
+    out.seq_ref = WRAP - 100;
+    CHECK(rdt_dec_ops.data_ack(buf, len, (struct rdt_common_msg*)&out) == len);
+    CHECK(out.seq_ack == WRAP + 10);
+    CHECK(out.seq_recv == 0);
+
+    msg.seq_ack  = WRAP;
+    msg.seq_recv = 0;
+    len = rdt_enc_ops.data_ack((struct rdt_common_msg*)&msg, buf, sizeof(buf));
+    memset(&out, 0, sizeof(out));
+    out.seq_ref = WRAP - 100;
+    CHECK(rdt_dec_ops.data_ack(buf, len, (struct rdt_common_msg*)&out) == len);
+    CHECK(out.seq_ack == WRAP);
+    CHECK(out.seq_recv == 0);
+
+    memset(&msg, 0, sizeof(msg));
+    msg.seq_ack  = WRAP + 3;
+    msg.seq_recv = WRAP + 1;
+    msg.span     = 1000;
+    len = rdt_enc_ops.ack_compact((struct rdt_common_msg*)&msg, buf, sizeof(buf));
+    memset(&out, 0, sizeof(out));
+    out.seq_ref = WRAP - 200;
+    CHECK(rdt_dec_ops.ack_compact(buf, len, (struct rdt_common_msg*)&out) == len);
+    CHECK(out.seq_ack == WRAP + 3);
+    CHECK(out.seq_recv == WRAP + 1);
+}
+
+static
+void test_ack_multi(void)
+{
+    struct rdt_ack_multi_msg msg;
+    struct rdt_ack_multi_msg out;
+    char buf[RDT_ACK_MULTI_HDR_LEN + RDT_ACK_MULTI_MAX * RDT_ACK_MULTI_ENTRY_LEN];
+    int len = 0;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.nacks = 2;
+    msg.acks[0].seq_ack  = (uint32_t)(WRAP + 8);
+    msg.acks[0].seq_recv = rdt_trunc_recv(WRAP, WRAP + 8);
+    msg.acks[1].seq_ack  = (uint32_t)WRAP;
+    msg.acks[1].seq_recv = rdt_trunc_recv(0, WRAP);
+    len = rdt_enc_ops.ack_multi((struct rdt_common_msg*)&msg, buf, sizeof(buf));
+    memset(&out, 0, sizeof(out));
+    CHECK(rdt_dec_ops.ack_multi(buf, len, (struct rdt_common_msg*)&out) == len);
+    CHECK(out.nacks == 2);
+    //Taken as receiver does, near the last ack of the tunnel
+    CHECK(rdt_expand_seq(out.acks[0].seq_ack, sizeof(uint32_t), WRAP - 50) == WRAP + 8);
+    CHECK(rdt_expand_recv(out.acks[0].seq_recv, WRAP + 8) == 0);
+    CHECK(rdt_expand_seq(out.acks[1].seq_ack, sizeof(uint32_t), WRAP - 50) == WRAP);
+    CHECK(rdt_expand_recv(out.acks[1].seq_recv, WRAP) == 0);
+
+    msg.acks[0].seq_recv = rdt_trunc_recv(WRAP + 20, WRAP + 8);
+    len = rdt_enc_ops.ack_multi((struct rdt_common_msg*)&msg, buf, sizeof(buf));
+    CHECK(rdt_dec_ops.ack_multi(buf, len, (struct rdt_common_msg*)&out) == len);
+    CHECK(rdt_expand_recv(out.acks[0].seq_recv, WRAP + 8) == WRAP + 20);
+}
+
+static
+void test_nack(void)
+{
+    struct rdt_data_nack_msg msg;
+    struct rdt_data_nack_msg out;
+    char buf[12 + RDT_NACK_MAX_RANGES * 8];
+    int len = 0;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.seq_ack = WRAP - 30;
+    msg.nranges = 2;
+    msg.ranges[0].start = WRAP - 20;
+    msg.ranges[0].end   = WRAP;
+    msg.ranges[1].start = WRAP + 40;
+    msg.ranges[1].end   = WRAP + 90;
+    len = rdt_enc_ops.data_nack((struct rdt_common_msg*)&msg, buf, sizeof(buf));
+    memset(&out, 0, sizeof(out));
+    out.seq_ref = WRAP - 60;
+    CHECK(rdt_dec_ops.data_nack(buf, len, (struct rdt_common_msg*)&out) == len);
+    CHECK(out.seq_ack == WRAP - 30);
+    CHECK(out.nranges == 2);
+    CHECK(out.ranges[0].start == WRAP - 20);
+    CHECK(out.ranges[0].end == WRAP);
+    CHECK(out.ranges[1].start == WRAP + 40);
+    CHECK(out.ranges[1].end == WRAP + 90);
+}
+
+static
+void test_fwd_skip(void)
+{
+    struct rdt_fwd_skip_msg msg;
+    struct rdt_fwd_skip_msg out;
+    char buf[8 + RDT_SKIP_MAX_RANGES * 16];
+    int len = 0;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.nranges = 2;
+    msg.ranges[0].seq = WRAP - 4;
+    msg.ranges[0].len = 8;
+    msg.ranges[1].seq = WRAP + 100;
+    msg.ranges[1].len = 50;
+    msg.ranges[1].flags = RDT_DATA_F_STREAM;
+    msg.ranges[1].stream_id = 3;
+    msg.ranges[1].stream_off = 0xfffffff0;
+    len = rdt_enc_ops.fwd_skip((struct rdt_common_msg*)&msg, buf, sizeof(buf));
+    memset(&out, 0, sizeof(out));
+    out.seq_ref = WRAP - 10;
+    CHECK(rdt_dec_ops.fwd_skip(buf, len, (struct rdt_common_msg*)&out) == len);
+    CHECK(out.nranges == 2);
+    CHECK(out.ranges[0].seq == WRAP - 4);
+    CHECK(out.ranges[1].seq == WRAP + 100);
+    CHECK(out.ranges[1].flags == RDT_DATA_F_STREAM);
+    CHECK(out.ranges[1].stream_id == 3);
+    CHECK(out.ranges[1].stream_off == 0xfffffff0);
+}
+
+static
+void test_fec(void)
+{
+    struct rdt_fec_msg msg;
+    struct rdt_fec_msg out;
+    uint8_t symbol[16];
+    char buf[RDT_FEC_HDR_LEN + 2 * 2 + sizeof(symbol)];
+    int len = 0;
+
+    memset(symbol, 0x5a, sizeof(symbol));
+    memset(&msg, 0, sizeof(msg));
+    msg.base_seq = WRAP - 1;
+    msg.k = 2;
+    msg.symlen = sizeof(symbol);
+    msg.plens[0] = 1;
+    msg.plens[1] = 7;
+    msg.symbol = symbol;
+    len = rdt_enc_ops.fec((struct rdt_common_msg*)&msg, buf, sizeof(buf));
+    memset(&out, 0, sizeof(out));
+    out.seq_ref = WRAP + 20;
+    CHECK(rdt_dec_ops.fec(buf, len, (struct rdt_common_msg*)&out) == len);
+    CHECK(out.base_seq == WRAP - 1);
+    CHECK(out.k == 2);
+    CHECK(out.plens[1] == 7);
+    CHECK(!memcmp(out.symbol, symbol, sizeof(symbol)));
+}
+
+int main(void)
+{
+    test_expand_seq();
+    test_recv();
+    test_data_ack();
+    test_ack_multi();
+    test_nack();
+    test_fwd_skip();
+    test_fec();
+
+    printf("seq_test: %s\n", failed ? "FAILED" : "ok");
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,217 @@
+/*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*      http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include "headers.h"
+#include "vassert.h"
+#include "vaead.h"
+#include "ticket.h"
+
+/*
+ * Ticket on the wire, body sealed under pn as nonce:
+ *   pn(8) | issued(4) | caps(4) | srtt(4) | min_rtt(4) | cwnd(4) | ssthresh(4) | tag(16)
+ */
+#define TICKET_BODY_LEN 24
+
+struct ticket_entry {
+    int sid;
+    int cid;
+    uint32_t saved;                     //Seconds, 0 for free entry
+    uint8_t len;
+    uint8_t ticket[RDT_TICKET_MAX];
+    struct rdt_ticket_state own;
+};
+
+static struct vlock ticket_lock = VLOCK_INITIALIZER;
+static uint8_t ticket_key[VAEAD_KEY_LEN];
+static uint64_t ticket_pn = 0;          //0 until key is made
+static struct ticket_entry ticket_cache[RDT_TICKET_CACHE];
+
+static
+uint32_t ticket_now(void)
+{
+    //Never 0, which marks free entries
+    return (uint32_t)(vtime_us() / 1000000) + 1;
+}
+
+/*
+ * Seal @st into @ticket, returns its length or -1.
+ */
+int ticket_issue(const struct rdt_ticket_state* st, uint8_t* ticket, int len)
+{
+    uint8_t body[TICKET_BODY_LEN];
+    uint8_t nonce[12];
+    uint64_t pn = 0;
+    int off = 0;
+
+    vassert(st);
+    vassert(ticket);
+    vassert(len >= RDT_TICKET_LEN);
+
+    vlock_enter(&ticket_lock);
+    if (!ticket_pn) {
+        //Key lives as long as the process, tickets of an earlier run fail
+        if (vaead_random(ticket_key, sizeof(ticket_key)) < 0) {
+            vlock_leave(&ticket_lock);
+            return -1;
+        }
+        ticket_pn = 1;
+    }
+    pn = ticket_pn++;
+    vlock_leave(&ticket_lock);
+
+    *(uint32_t*)(body + off) = htonl(ticket_now());
+    off += sizeof(uint32_t);
+    *(uint32_t*)(body + off) = htonl(st->caps);
+    off += sizeof(uint32_t);
+    *(uint32_t*)(body + off) = htonl(st->srtt_us);
+    off += sizeof(uint32_t);
+    *(uint32_t*)(body + off) = htonl(st->min_rtt_us);
+    off += sizeof(uint32_t);
+    *(uint32_t*)(body + off) = htonl(st->cwnd);
+    off += sizeof(uint32_t);
+    *(uint32_t*)(body + off) = htonl(st->ssthresh);
+    off += sizeof(uint32_t);
+
+    *(uint32_t*)ticket = htonl((uint32_t)(pn >> 32));
+    *(uint32_t*)(ticket + 4) = htonl((uint32_t)pn);
+    vaead_nonce(nonce, pn);
+    vaead_seal(ticket_key, nonce, NULL, 0, body, ticket + 8, TICKET_BODY_LEN, ticket + 8 + TICKET_BODY_LEN);
+    return RDT_TICKET_LEN;
+}
+
+/*
+ * Open a ticket peer presented, 0 if it is one of ours and still good.
+ */
+int ticket_check(const uint8_t* ticket, int len, struct rdt_ticket_state* st)
+{
+    uint8_t body[TICKET_BODY_LEN];
+    uint8_t nonce[12];
+    uint32_t issued = 0;
+    uint64_t pn = 0;
+    int off = 0;
+
+    vassert(ticket);
+    vassert(st);
+
+    if (len != RDT_TICKET_LEN) {
+        return -1;
+    }
+    vlock_enter(&ticket_lock);
+    if (!ticket_pn) {
+        //Never issued one
+        vlock_leave(&ticket_lock);
+        return -1;
+    }
+    vlock_leave(&ticket_lock);
+
+    pn = ((uint64_t)ntohl(*(uint32_t*)ticket) << 32) | ntohl(*(uint32_t*)(ticket + 4));
+    vaead_nonce(nonce, pn);
+    if (vaead_open(ticket_key, nonce, NULL, 0, ticket + 8, body, TICKET_BODY_LEN, ticket + 8 + TICKET_BODY_LEN) < 0) {
+        return -1;
+    }
+
+    issued = ntohl(*(uint32_t*)(body + off));
+    off += sizeof(uint32_t);
+    if (ticket_now() - issued > RDT_TICKET_LIFETIME_S) {
+        return -1;
+    }
+    st->caps = ntohl(*(uint32_t*)(body + off));
+    off += sizeof(uint32_t);
+    st->srtt_us = ntohl(*(uint32_t*)(body + off));
+    off += sizeof(uint32_t);
+    st->min_rtt_us = ntohl(*(uint32_t*)(body + off));
+    off += sizeof(uint32_t);
+    st->cwnd = ntohl(*(uint32_t*)(body + off));
+    off += sizeof(uint32_t);
+    st->ssthresh = ntohl(*(uint32_t*)(body + off));
+    off += sizeof(uint32_t);
+    return 0;
+}
+
+/*
+ * Keep the latest ticket of a channel along with state of this end. The
+ * oldest entry makes room for a new channel.
+ */
+void ticket_save(int sid, int cid, const uint8_t* ticket, int len, const struct rdt_ticket_state* own)
+{
+    struct ticket_entry* entry = NULL;
+    int i = 0;
+
+    vassert(ticket);
+    vassert(own);
+
+    if (len <= 0 || len > RDT_TICKET_MAX) {
+        return;
+    }
+
+    vlock_enter(&ticket_lock);
+    for (i = 0; i < RDT_TICKET_CACHE; i++) {
+        if (ticket_cache[i].saved && ticket_cache[i].sid == sid && ticket_cache[i].cid == cid) {
+            entry = &ticket_cache[i];
+            break;
+        }
+        if (!entry || ticket_cache[i].saved < entry->saved) {
+            entry = &ticket_cache[i];
+        }
+    }
+    entry->sid = sid;
+    entry->cid = cid;
+    entry->saved = ticket_now();
+    entry->len = (uint8_t)len;
+    memcpy(entry->ticket, ticket, len);
+    entry->own = *own;
+    vlock_leave(&ticket_lock);
+}
+
+/*
+ * Ticket kept for the channel, returns its length or 0 if there is none
+ * or it is too old for responder to take.
+ */
+int ticket_find(int sid, int cid, uint8_t* ticket, struct rdt_ticket_state* own)
+{
+    struct ticket_entry* entry = NULL;
+    int len = 0;
+    int i = 0;
+
+    vassert(ticket);
+    vassert(own);
+
+    vlock_enter(&ticket_lock);
+    for (i = 0; i < RDT_TICKET_CACHE; i++) {
+        entry = &ticket_cache[i];
+        if (!entry->saved || entry->sid != sid || entry->cid != cid) {
+            continue;
+        }
+        if (ticket_now() - entry->saved >= RDT_TICKET_LIFETIME_S) {
+            entry->saved = 0;
+            break;
+        }
+        len = entry->len;
+        memcpy(ticket, entry->ticket, len);
+        *own = entry->own;
+        break;
+    }
+    vlock_leave(&ticket_lock);
+    return len;
+}
+
+void ticket_forget(void)
+{
+    vlock_enter(&ticket_lock);
+    memset(ticket_cache, 0, sizeof(ticket_cache));
+    vlock_leave(&ticket_lock);
+}
@@ -0,0 +1,44 @@
+/*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*      http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#ifndef __RDT_TICKET_H__
+#define __RDT_TICKET_H__
+
+#include "codec.h"
+#include "vsys.h"
+
+#define RDT_TICKET_LIFETIME_S   600     //Tickets older than this are turned down
+#define RDT_TICKET_REFRESH_MS   200     //Responder sends a new one at most this often while in use
+#define RDT_TICKET_CACHE        16      //Channels opening end keeps a ticket for
+
+/*
+ * What a resumption ticket carries. Responder seals it with a key only
+ * it holds, so it is opaque to peer and taken only as issued. Opening end
+ * keeps the same for its own side next to the ticket.
+ */
+struct rdt_ticket_state {
+    uint32_t caps;                      //Agreed on, ticket is good for the same ones only
+    uint32_t srtt_us;
+    uint32_t min_rtt_us;
+    uint32_t cwnd;
+    uint32_t ssthresh;
+};
+
+int  ticket_issue (const struct rdt_ticket_state* st, uint8_t* ticket, int len);
+int  ticket_check (const uint8_t* ticket, int len, struct rdt_ticket_state* st);
+void ticket_save  (int sid, int cid, const uint8_t* ticket, int len, const struct rdt_ticket_state* own);
+int  ticket_find  (int sid, int cid, uint8_t* ticket, struct rdt_ticket_state* own);
+void ticket_forget(void);
+
+#endif
@@ -17,4 +17,11 @@
 int session_write(int sessionId, int channelId, const void* buf, int length)
 {
     //return ecSessionWrite(sessionId, channelId, buf, length);
+    return length;
+}
+
+int session_write_dontfrag(int sessionId, int channelId, const void* buf, int length)
+{
+    //return ecSessionWriteDontFrag(sessionId, channelId, buf, length);
+    return length;
 }
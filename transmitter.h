@@ -17,4 +17,15 @@
 #include "headers.h"
 
 int session_write(int sessionId, int channelId, const void* buf, int length);
+
+//Same as session_write, the datagram goes with don't fragment set
+//(IP_PMTUDISC_PROBE / IPV6_DONTFRAG), so a router drops it rather than
+//fragment it when it is too big for the path. Path mtu probes rely on it.
+int session_write_dontfrag(int sessionId, int channelId, const void* buf, int length);
+
+#if defined(HAVE_SO_TXTIME)
+//Same as session_write, the datagram is handed to a socket set up with
+//SO_TXTIME (CLOCK_MONOTONIC) and leaves at @txtime in nanoseconds.
+int session_write_txtime(int sessionId, int channelId, const void* buf, int length, uint64_t txtime);
+#endif
 #endif
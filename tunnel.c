@@ -17,11 +17,13 @@
 #include "vassert.h"
 #include "vsys.h"
 #include "vlist.h"
+#include "vlz.h"
 #include "transmitter.h"
 #include "receiver.h"
 
 #define PORT_FORWARDING_MAGIC  ((uint32_t)0xA29BF88E)
 #define PORT_FORWARDING_MSG_LENGTH 12
+#define STREAM_CREDITS_PER_ROUND 16
 
 extern struct rdt_proto_ops state_ready_ops;
 extern struct rdt_proto_ops state_closed_ops;
@@ -53,14 +55,45 @@ static tunnel_mngr_t tunnel_manager = {
     .cur_tunnel_num = 0
 };
 
+static struct rdt_options default_opts = {
+    .rcvbuf_max = RXQ_MAX_BUF_SIZE,
+    .pacing_rate = 0,
+    .rate_limit = 0,
+    .rate_burst = 0,
+    .sndbuf = TXQ_DEFAULT_SNDBUF,
+    .weight = 1,
+    .unordered = 0,
+    .fec_block = 0,
+    .fec_repair = 1,
+    .checksum = 0,
+    .compress = 0
+};
+
 static int add_tunnel(struct rdt_tunnel* ptunnel, int*);
 static int del_tunnel(struct rdt_tunnel* ptunnel);
 static uint16_t generate_local_teid();
 static int timeout_handler(void*);
+static int probe_timeout_handler(void*);
+static void arm_probe_timer(struct rdt_tunnel* ptunnel, int32_t usecs);
+static int ack_timeout_handler(void*);
+static int nack_timeout_handler(void*);
+static int take_held_ack(struct rdt_tunnel* ptunnel, struct rdt_data_ack_msg* ack);
+static int pmtu_timeout_handler(void*);
+static uint32_t pmtu_next(struct rdt_tunnel* ptunnel);
+static void pmtu_blackhole(struct rdt_tunnel* ptunnel);
 static int rx_data_dispatcher(void* argv);
-static int tx_data_dispatcher(void* argv);
-
-int create_tunnel(int sessionId, int channelId, ecRdtHandler* handler, struct rdt_tunnel** tunnel)
+static void rx_window_update(struct rdt_tunnel* ptunnel);
+static void rx_stream_update(struct rdt_tunnel* ptunnel);
+static struct rdt_stream* find_stream(struct rdt_tunnel* ptunnel, int32_t stream_id);
+static void free_streams(struct rdt_tunnel* ptunnel);
+static void leave_stream(struct rdt_tunnel* ptunnel);
+static void leave_read(struct rdt_tunnel* ptunnel);
+static uint8_t get_wscale(uint32_t bufsz);
+static void fec_add(struct rdt_tunnel* ptunnel, data_encoded_pkt_t* pkt);
+static void fec_flush(struct rdt_tunnel* ptunnel);
+static void ticket_state(struct rdt_tunnel* ptunnel, struct rdt_ticket_state* st);
+
+int create_tunnel(int sessionId, int channelId, ecRdtHandler* handler, const void* early, int early_len, struct rdt_tunnel** tunnel)
 {
     struct rdt_tunnel* ptunnel = NULL;
     int first_tunnel = 0;
@@ -69,6 +102,7 @@ int create_tunnel(int sessionId, int channelId, ecRdtHandler* handler, struct rd
     vassert(sessionId > 0);
     vassert(channelId > 0);
     vassert(handler || !handler);
+    vassert(!early_len || (early && handler && early_len <= RDT_EARLY_DATA_MAX));
     vassert(tunnel);
 
     vlogD("TUNNEL:create_tunnel session(%d) channel(%d)", sessionId, channelId);
@@ -77,6 +111,13 @@ int create_tunnel(int sessionId, int channelId, ecRdtHandler* handler, struct rd
     retE((!ptunnel), ECRDT_E_OOM);
     memset(ptunnel, 0, sizeof(rdt_tunnel_t));
 
+    //Keys with a psk come from it, a nonce repeated across tunnels would repeat them
+    if(vaead_random(ptunnel->nonce, RDT_NONCE_LEN) < 0){
+        vlogE("TUNNEL:Failed to read random nonce");
+        free(ptunnel);
+        return ECRDT_E_UNKOWN;
+    }
+
     vlist_init(&ptunnel->list);
     ptunnel->state = RDT_STATE_CLOSED;
     ptunnel->sessionId = sessionId;
@@ -84,11 +125,18 @@ int create_tunnel(int sessionId, int channelId, ecRdtHandler* handler, struct rd
     ptunnel->teid = generate_local_teid();
     vlogD("TUNNEL:teid(%d)", ptunnel->teid);
 
+    ptunnel->channel = get_channel(sessionId, channelId);
+    if (!ptunnel->channel) {
+        free(ptunnel);
+        return ECRDT_E_OOM;
+    }
+
     ret = add_tunnel(ptunnel, &first_tunnel);
     if (ret < 0) {
         vlogE("TUNNEL:There are %d tunnels have been created on session(%d) channel(%d). Reach the limitation!!",
             MAX_TUNNEL_NUM_PER_CHANNEL,
             ptunnel->sessionId, ptunnel->channelId);
+        put_channel(ptunnel->channel);
         free(ptunnel);
         return ECRDT_E_EXCEED_LIMIT;
     }
@@ -99,10 +147,18 @@ int create_tunnel(int sessionId, int channelId, ecRdtHandler* handler, struct rd
     }
 
     vtimer_init(&ptunnel->timer, &timeout_handler,(void*)ptunnel, 1);
+    vtimer_init(&ptunnel->probe_timer, &probe_timeout_handler,(void*)ptunnel, 1);
+    vtimer_init(&ptunnel->ack_timer, &ack_timeout_handler,(void*)ptunnel, 1);
+    vtimer_init(&ptunnel->nack_timer, &nack_timeout_handler,(void*)ptunnel, 1);
+    vtimer_init(&ptunnel->pmtu_timer, &pmtu_timeout_handler,(void*)ptunnel, 1);
     vlock_init(&ptunnel->lock);
     vcond_init(&ptunnel->cond);
-    vthread_init(&ptunnel->tx_data_dispatcher, tx_data_dispatcher, ptunnel);
     vthread_init(&ptunnel->rx_data_dispatcher, rx_data_dispatcher, ptunnel);
+    vlock_init(&ptunnel->stream_lock);
+    vcond_init(&ptunnel->stream_cond);
+    vlist_init(&ptunnel->stream_list);
+    vlist_init(&ptunnel->stream0.list);
+    ptunnel->next_stream_id = handler ? 1 : 2;
 
     ptunnel->seq_num = 0;
     ptunnel->ctrl_ack_num = -1;
@@ -112,6 +168,16 @@ int create_tunnel(int sessionId, int channelId, ecRdtHandler* handler, struct rd
     ptunnel->rx_bytes = 0;
     ptunnel->fwd_data2upper = 0;
     ptunnel->on_upper_data = NULL;
+    ptunnel->caps = 0;
+    ptunnel->ack_delay = 0;
+    ptunnel->peer_ack_delay = 0;
+    ptunnel->tx_pn = 0;
+    ptunnel->peer_mtu = RDT_MTU;
+    ptunnel->pmtu = RDT_MTU;
+
+    vlock_enter(&tunnel_manager.lock);
+    ptunnel->opts = default_opts;
+    vlock_leave(&tunnel_manager.lock);
 
     ptunnel->ops[RDT_STATE_CLOSED] = &state_closed_ops;
     ptunnel->ops[RDT_STATE_HANDSHAKE_REQ_SENT] = &state_handshake_req_sent_ops;
@@ -126,24 +192,60 @@ int create_tunnel(int sessionId, int channelId, ecRdtHandler* handler, struct rd
         ptunnel->txq.fetch_pkt = &fetch_txq_pkt;
         ptunnel->txq.update_ack = &update_ack;
         ptunnel->txq.trigger_resend = &trigger_resend;
+        ptunnel->txq.update_window = &update_window;
+        ptunnel->txq.update_mss = &update_mss;
+        ptunnel->txq.resend_ranges = &resend_ranges;
+        ptunnel->txq.probe_tail = &probe_tail;
+        ptunnel->txq.pacing_delay = &pacing_delay;
+        ptunnel->txq.collect_skips = &collect_skips;
+        ptunnel->txq.unsent_pkts = &unsent_pkts;
+        ptunnel->txq.close = &close_txq;
 
         ptunnel->txq.init(&ptunnel->txq);
+        ptunnel->txq.pacing_rate = ptunnel->opts.pacing_rate;
+        ptunnel->txq.sndbuf = ptunnel->opts.sndbuf;
+        ptunnel->txq.on_ready = &channel_kick;
+        ptunnel->txq.ready_cookie = ptunnel->channel;
     }
 
+    vbucket_init(&ptunnel->bucket, ptunnel->opts.rate_limit, ptunnel->opts.rate_burst);
+    fec_enc_init(&ptunnel->fec_enc);
+    ptunnel->fec_dec = NULL;
+    ptunnel->frag_id = 0;
+    ptunnel->frag_buf = NULL;
+    ptunnel->frag_rx_id = 0;
+    ptunnel->frag_have = 0;
+
     //Init rxq
     {
         ptunnel->rxq.init = &init_rxq;
         ptunnel->rxq.deinit = &deinit_rxq;
         ptunnel->rxq.arrange_pkt = &arrange_pkt;
         ptunnel->rxq.fetch_pkt = &fetch_rxq_pkt;
+        ptunnel->rxq.release_pkt = &release_rxq_pkt;
+        ptunnel->rxq.read_data = &read_rxq_data;
+        ptunnel->rxq.get_window = &get_rxq_window;
+        ptunnel->rxq.collect_gaps = &collect_rxq_gaps;
+        ptunnel->rxq.collect_credits = &collect_rxq_credits;
+        ptunnel->rxq.get_credit = &get_rxq_credit;
+        ptunnel->rxq.skip_range = &skip_rxq_range;
 
         ptunnel->rxq.init(&ptunnel->rxq);
+        ptunnel->rxq.unordered = !!ptunnel->opts.unordered;
+        ptunnel->rxq.buf_limit = ptunnel->opts.rcvbuf_max;
+        if (ptunnel->rxq.buf_size > ptunnel->rxq.buf_limit) {
+            ptunnel->rxq.buf_size = ptunnel->rxq.buf_limit;
+        }
+        ptunnel->wscale = get_wscale(ptunnel->rxq.buf_limit);
     }
 
     if(handler != NULL){
         //Initiating rdt tunnel
         ptunnel->handler.onData   = handler->onData;
         ptunnel->handler.onClosed = handler->onClosed;
+        ptunnel->handler.onStreamData = handler->onStreamData;
+        ptunnel->early_data = (const uint8_t*)early;
+        ptunnel->early_len = (uint16_t)early_len;
         ptunnel->ops[ptunnel->state]->handshake_req(ptunnel);
 
         vlock_enter(&ptunnel->lock);
@@ -160,19 +262,29 @@ int create_tunnel(int sessionId, int channelId, ecRdtHandler* handler, struct rd
             }
 
             vtimer_deinit(&ptunnel->timer);
+            vtimer_deinit(&ptunnel->probe_timer);
+            vtimer_deinit(&ptunnel->ack_timer);
+            vtimer_deinit(&ptunnel->nack_timer);
+            vtimer_deinit(&ptunnel->pmtu_timer);
             vlock_deinit(&ptunnel->lock);
             vcond_deinit(&ptunnel->cond);
+            vlock_deinit(&ptunnel->stream_lock);
+            vcond_deinit(&ptunnel->stream_cond);
+            vbucket_deinit(&ptunnel->bucket);
+            put_channel(ptunnel->channel);
 
             ptunnel->rxq.deinit(&ptunnel->rxq);
             ptunnel->txq.deinit(&ptunnel->txq);
+            fec_enc_reset(&ptunnel->fec_enc);
+            fec_dec_destroy(ptunnel->fec_dec);
+            free(ptunnel->frag_buf);
 
             free(ptunnel);
             return -1;
         }
     }
 
-    ptunnel->tx_dispatcher_run = 1;
-    vthread_start(&ptunnel->tx_data_dispatcher);
+    channel_add_tunnel(ptunnel->channel, ptunnel);
 
     ptunnel->rx_dispatcher_run = 1;
     vthread_start(&ptunnel->rx_data_dispatcher);
@@ -205,21 +317,43 @@ void destroy_tunnel(struct rdt_tunnel* ptunnel, int send_shutdown)
     vlock_enter(&ptunnel->rxq.rx_lock);
     ptunnel->rx_dispatcher_run = 0;
     vcond_signal(&ptunnel->rxq.rx_cond);
+    vcond_broadcast(&ptunnel->rxq.read_cond);
+    //Readers woken up may still be sending window updates, wait them out
+    while(ptunnel->readers > 0){
+        vcond_mtimedwait(&ptunnel->rxq.read_cond, &ptunnel->rxq.rx_lock, -1);
+    }
     vlock_leave(&ptunnel->rxq.rx_lock);
     vthread_join(&ptunnel->rx_data_dispatcher, &ret_code);
 
-    vlock_enter(&ptunnel->txq.tx_lock);
-    ptunnel->tx_dispatcher_run = 0;
-    vcond_signal(&ptunnel->txq.tx_cond);
-    vlock_leave(&ptunnel->txq.tx_lock);
-    vthread_join(&ptunnel->tx_data_dispatcher, &ret_code);
+    ptunnel->txq.close(&ptunnel->txq);
+    channel_del_tunnel(ptunnel->channel, ptunnel);
+
+    vlock_enter(&ptunnel->stream_lock);
+    free_streams(ptunnel);
+    vcond_broadcast(&ptunnel->stream_cond);
+    //Writers still in find their stream gone, wait them out before freeing
+    while(ptunnel->stream_writers > 0){
+        vcond_mtimedwait(&ptunnel->stream_cond, &ptunnel->stream_lock, -1);
+    }
+    vlock_leave(&ptunnel->stream_lock);
 
     vtimer_deinit(&ptunnel->timer);
+    vtimer_deinit(&ptunnel->probe_timer);
+    vtimer_deinit(&ptunnel->ack_timer);
+    vtimer_deinit(&ptunnel->nack_timer);
+    vtimer_deinit(&ptunnel->pmtu_timer);
     vlock_deinit(&ptunnel->lock);
     vcond_deinit(&ptunnel->cond);
+    vlock_deinit(&ptunnel->stream_lock);
+    vcond_deinit(&ptunnel->stream_cond);
+    vbucket_deinit(&ptunnel->bucket);
+    put_channel(ptunnel->channel);
 
     ptunnel->rxq.deinit(&ptunnel->rxq);
     ptunnel->txq.deinit(&ptunnel->txq);
+    fec_enc_reset(&ptunnel->fec_enc);
+    fec_dec_destroy(ptunnel->fec_dec);
+    free(ptunnel->frag_buf);
 
     free(ptunnel);
     return;
@@ -248,6 +382,9 @@ struct rdt_tunnel* get_tunnel(int teid)
     return (found ? ptunnel : NULL);
 }
 
+/*
+ * Teid of tunnel peer opened from its @teid, 0 if there is none.
+ */
 int check_peer_teid(int sid, int cid, int teid)
 {
     struct rdt_tunnel* ptunnel = NULL;
@@ -266,7 +403,7 @@ int check_peer_teid(int sid, int cid, int teid)
         if (ptunnel->sessionId == sid &&
             ptunnel->channelId == cid &&
             ptunnel->peer_teid == teid) {
-            found = 1;
+            found = ptunnel->teid;
             break;
         }
     }
@@ -371,6 +508,9 @@ int timeout_handler(void* argv)
                 destroy_tunnel(ptunnel, 1);
                 return 0;
             }
+            if(ptunnel->timeout_counter == RDT_PMTU_BLACKHOLE_TIMEOUTS){
+                pmtu_blackhole(ptunnel);
+            }
 
             if(ptunnel->txq.trigger_resend(&ptunnel->txq) != 0){
                 //No data need to be resend. Start keepalive.
@@ -397,6 +537,305 @@ int timeout_handler(void* argv)
     return 0;
 }
 
+void arm_probe_timer(struct rdt_tunnel* ptunnel, int32_t usecs)
+{
+    vassert(ptunnel);
+
+    if(usecs < TXQ_MIN_PROBE_TIMEOUT_US){
+        usecs = TXQ_MIN_PROBE_TIMEOUT_US;
+    }
+    vtimer_restart(&ptunnel->probe_timer, usecs / 1000000, usecs % 1000000);
+}
+
+int probe_timeout_handler(void* argv)
+{
+    rdt_tunnel_t* ptunnel = (rdt_tunnel_t*)argv;
+    int32_t left = 0;
+    vassert(ptunnel);
+
+    if(ptunnel->state != RDT_STATE_READY){
+        return 0;
+    }
+
+    left = ptunnel->txq.probe_tail(&ptunnel->txq);
+    if(left > 0){
+        //Acks kept the tail moving, check again when it is due
+        arm_probe_timer(ptunnel, left);
+    }
+    return 0;
+}
+
+/*
+ * Ack data rxq just took in. With ack delay on and compact headers agreed,
+ * ack of in order pkts is held back a little for data going to peer to
+ * carry it. Out of order pkts are acked at once to report the gap.
+ */
+void tunnel_ack_data(struct rdt_tunnel* ptunnel, uint64_t ack_seq, uint64_t recv_seq)
+{
+    uint32_t delay = 0;
+
+    vassert(ptunnel);
+
+    //Never longer than peer was told in handshake
+    delay = ptunnel->opts.ack_delay;
+    if(delay > ptunnel->ack_delay){
+        delay = ptunnel->ack_delay;
+    }
+    vlock_enter(&ptunnel->lock);
+    ptunnel->ack_seq  = ack_seq;
+    ptunnel->ack_recv = recv_seq;
+    if(delay && (ptunnel->caps & RDT_CAP_COMPACT) && (recv_seq < ack_seq) &&
+       (ptunnel->ack_held + 1 < RDT_ACK_HOLD_PKTS)){
+        if(ptunnel->ack_held++ == 0){
+            vtimer_restart(&ptunnel->ack_timer, delay / 1000, (delay % 1000) * 1000);
+        }
+        vlock_leave(&ptunnel->lock);
+        return;
+    }
+    ptunnel->ack_held = 0;
+    vlock_leave(&ptunnel->lock);
+
+    ptunnel->ops[ptunnel->state]->send_data_ack(ptunnel, ack_seq, recv_seq);
+}
+
+int ack_timeout_handler(void* argv)
+{
+    rdt_tunnel_t* ptunnel = (rdt_tunnel_t*)argv;
+    uint64_t ack_seq = 0;
+    uint64_t recv_seq = 0;
+    vassert(ptunnel);
+
+    //No data went out to carry the ack in time
+    vlock_enter(&ptunnel->lock);
+    if(!ptunnel->ack_held || (ptunnel->state != RDT_STATE_READY)){
+        vlock_leave(&ptunnel->lock);
+        return 0;
+    }
+    ptunnel->ack_held = 0;
+    ack_seq  = ptunnel->ack_seq;
+    recv_seq = ptunnel->ack_recv;
+    vlock_leave(&ptunnel->lock);
+
+    ptunnel->ops[ptunnel->state]->send_data_ack(ptunnel, ack_seq, recv_seq);
+    return 0;
+}
+
+/*
+ * Nack holes in rxq that waited long enough. The timer takes the next
+ * look, so a hole is nacked even if no pkt arrives after it, as after a
+ * loss at the end of a burst.
+ */
+void tunnel_nack_gaps(struct rdt_tunnel* ptunnel)
+{
+    struct rdt_nack_range ranges[RDT_NACK_MAX_RANGES];
+    uint64_t wait_us = 0;
+    int32_t nranges = 0;
+
+    vassert(ptunnel);
+
+    nranges = ptunnel->rxq.collect_gaps(&ptunnel->rxq, ranges, RDT_NACK_MAX_RANGES, &wait_us);
+    if(nranges > 0){
+        ptunnel->ops[ptunnel->state]->send_data_nack(ptunnel, ranges, nranges);
+    }
+    if(wait_us > 0){
+        vtimer_restart(&ptunnel->nack_timer, wait_us / 1000000, wait_us % 1000000);
+    }
+}
+
+int nack_timeout_handler(void* argv)
+{
+    rdt_tunnel_t* ptunnel = (rdt_tunnel_t*)argv;
+    vassert(ptunnel);
+
+    if(ptunnel->state != RDT_STATE_READY){
+        return 0;
+    }
+    tunnel_nack_gaps(ptunnel);
+    return 0;
+}
+
+/*
+ * Take the ack held back for a data pkt going out to carry it.
+ * Returns 0 if there is none.
+ */
+int take_held_ack(struct rdt_tunnel* ptunnel, struct rdt_data_ack_msg* ack)
+{
+    if(!ptunnel->ack_held){
+        return 0;
+    }
+    vlock_enter(&ptunnel->lock);
+    if(!ptunnel->ack_held){
+        vlock_leave(&ptunnel->lock);
+        return 0;
+    }
+    ptunnel->ack_held = 0;
+    ack->seq_ack = ptunnel->ack_seq;
+    vlock_leave(&ptunnel->lock);
+    //Ack timer is left to fire, finding nothing held
+
+    ptunnel->rxq.adv_window = ptunnel->rxq.get_window(&ptunnel->rxq);
+    ack->windowsz = ptunnel->rxq.adv_window >> ptunnel->wscale;
+    return 1;
+}
+
+/*
+ * Most payload a data msg may carry to fit in a datagram of path mtu,
+ * leaving room for the largest header, sealing and a piggybacked ack.
+ * FEC repairs carry a whole data msg behind their own header, so they
+ * get room too.
+ */
+int32_t tunnel_max_payload(struct rdt_tunnel* ptunnel)
+{
+    int32_t room = 0;
+
+    vassert(ptunnel);
+
+    room = rdt_data_hdr_len(RDT_DATA_F_STREAM | RDT_DATA_F_SEAL) + RDT_DATA_TAG_LEN + RDT_DATA_ACK_ROOM;
+    if(ptunnel->opts.fec_block){
+        room += RDT_FEC_HDR_LEN + RDT_FEC_MAX_K * sizeof(uint16_t) + sizeof(uint16_t);
+    }
+    return (int32_t)ptunnel->pmtu - room;
+}
+
+/*
+ * Tunnel is ready. With probing agreed on, datagrams start from the base
+ * size and the search for a larger one begins, else they stay within
+ * RDT_MTU. Called with lock held.
+ */
+void tunnel_pmtu_start(struct rdt_tunnel* ptunnel)
+{
+    vassert(ptunnel);
+
+    ptunnel->pmtu_probe = 0;
+    ptunnel->pmtu_tries = 0;
+    if(!(ptunnel->caps & RDT_CAP_PMTUD)){
+        //Caps are known now, bundles and aggregated acks go by them
+        channel_update_tunnel(ptunnel->channel);
+        return;
+    }
+    ptunnel->pmtu = RDT_BASE_MTU;
+    channel_update_tunnel(ptunnel->channel);
+    ptunnel->txq.update_mss(&ptunnel->txq, tunnel_max_payload(ptunnel));
+    vtimer_restart(&ptunnel->pmtu_timer, 0, 1000);
+}
+
+/*
+ * Peer got a probe. Size it came with is confirmed, and a larger one is
+ * searched for next.
+ */
+void tunnel_pmtu_acked(struct rdt_tunnel* ptunnel, uint32_t probe_id, uint32_t size)
+{
+    vassert(ptunnel);
+
+    vlock_enter(&ptunnel->lock);
+    //Any probe of the size counts, an earlier one may be acked late
+    if(!ptunnel->pmtu_probe || (size != ptunnel->pmtu_probe) ||
+       (probe_id > ptunnel->pmtu_probe_id)){
+        vlock_leave(&ptunnel->lock);
+        return;
+    }
+    ptunnel->pmtu = size;
+    ptunnel->pmtu_probe = 0;
+    ptunnel->pmtu_tries = 0;
+    vlock_leave(&ptunnel->lock);
+
+    vlogI("TUNNEL:path mtu(%u) confirmed (teid:%d)", size, ptunnel->teid);
+    channel_update_tunnel(ptunnel->channel);
+    ptunnel->txq.update_mss(&ptunnel->txq, tunnel_max_payload(ptunnel));
+    vtimer_restart(&ptunnel->pmtu_timer, 0, 1000);
+}
+
+/*
+ * Next size to probe above the confirmed one, 0 if the search is done.
+ * Sizes go up by the usual link mtus, 1500 of most paths, 9000 of jumbo
+ * frames and near 64KB of loopback, and stop at what both ends allow.
+ * Like pmtu itself they are udp payload, headers of a link mtu taken off.
+ */
+uint32_t pmtu_next(struct rdt_tunnel* ptunnel)
+{
+    static const uint32_t sizes[] = { 1500 - RDT_IP_UDP_OVERHEAD, 4096, 9000 - RDT_IP_UDP_OVERHEAD,
+                                      16384, 32768, RDT_MAX_MTU };
+    uint32_t limit = ptunnel->opts.pmtu_max;
+    uint32_t size = 0;
+    int i = 0;
+
+    if(ptunnel->peer_mtu < limit){
+        limit = ptunnel->peer_mtu;
+    }
+    for(i = 0; i < (int)(sizeof(sizes) / sizeof(sizes[0])); i++){
+        if(sizes[i] > ptunnel->pmtu){
+            size = (sizes[i] < limit) ? sizes[i] : limit;
+            break;
+        }
+    }
+    return (size > ptunnel->pmtu) ? size : 0;
+}
+
+int pmtu_timeout_handler(void* argv)
+{
+    rdt_tunnel_t* ptunnel = (rdt_tunnel_t*)argv;
+    uint32_t probe_id = 0;
+    uint32_t size = 0;
+    int32_t usecs = 0;
+    vassert(ptunnel);
+
+    vlock_enter(&ptunnel->lock);
+    if((ptunnel->state != RDT_STATE_READY) || !(ptunnel->caps & RDT_CAP_PMTUD)){
+        vlock_leave(&ptunnel->lock);
+        return 0;
+    }
+    if(ptunnel->pmtu_probe && (ptunnel->pmtu_tries >= RDT_PMTU_PROBES)){
+        //Lost every time, too big for the path. Try again much later.
+        vlogD("TUNNEL:path mtu probe(%u) lost (teid:%d)", ptunnel->pmtu_probe, ptunnel->teid);
+        ptunnel->pmtu_probe = 0;
+    } else if(!ptunnel->pmtu_probe){
+        ptunnel->pmtu_probe = pmtu_next(ptunnel);
+        ptunnel->pmtu_tries = 0;
+    }
+    if(!ptunnel->pmtu_probe){
+        vlock_leave(&ptunnel->lock);
+        vtimer_restart(&ptunnel->pmtu_timer, RDT_PMTU_RAISE_TIMEOUT, 0);
+        return 0;
+    }
+    ptunnel->pmtu_tries++;
+    probe_id = ++ptunnel->pmtu_probe_id;
+    size = ptunnel->pmtu_probe;
+    vlock_leave(&ptunnel->lock);
+
+    ptunnel->ops[RDT_STATE_READY]->send_pmtu_probe(ptunnel, probe_id, size);
+
+    //Ack is due in a round trip
+    usecs = 2 * (ptunnel->txq.srtt_us ? ptunnel->txq.srtt_us : ptunnel->rxq.rtt_us);
+    if(usecs < TXQ_MIN_PROBE_TIMEOUT_US){
+        usecs = TXQ_MIN_PROBE_TIMEOUT_US;
+    }
+    vtimer_restart(&ptunnel->pmtu_timer, usecs / 1000000, usecs % 1000000);
+    return 0;
+}
+
+/*
+ * Data is not getting through any more, path may have shrunk. New data
+ * goes in base size datagrams, and the search starts over shortly. Pkts
+ * made larger before go out in fragments.
+ */
+void pmtu_blackhole(struct rdt_tunnel* ptunnel)
+{
+    vlock_enter(&ptunnel->lock);
+    if(!(ptunnel->caps & RDT_CAP_PMTUD) || (ptunnel->pmtu <= RDT_BASE_MTU)){
+        vlock_leave(&ptunnel->lock);
+        return;
+    }
+    ptunnel->pmtu = RDT_BASE_MTU;
+    ptunnel->pmtu_probe = 0;
+    ptunnel->pmtu_tries = 0;
+    vlock_leave(&ptunnel->lock);
+
+    vlogI("TUNNEL:path mtu back to base (teid:%d)", ptunnel->teid);
+    channel_update_tunnel(ptunnel->channel);
+    ptunnel->txq.update_mss(&ptunnel->txq, tunnel_max_payload(ptunnel));
+    vtimer_restart(&ptunnel->pmtu_timer, RDT_DATA_ACK_TIMEOUT, 0);
+}
+
 void destroy_all_tunnel()
 {
     struct rdt_tunnel* tunnel = NULL;
@@ -419,8 +858,18 @@ void destroy_all_tunnel()
     return;
 }
 
-int tunnel_send_data(struct rdt_tunnel* ptunnel, const void* data, int len)
+int tunnel_send_data(struct rdt_tunnel* ptunnel, const void* data, int len, const ecRdtWriteParams* params)
 {
+    struct rdt_stream* stream = NULL;
+    struct rdt_stream pos;
+    int32_t stream_id = params ? params->streamId : 0;
+    int8_t with_off = 0;
+    int8_t timedout = 0;
+    int32_t seg = 0;
+    int32_t done = 0;
+    int32_t n = 0;
+    int32_t ret = 0;
+
     vassert(ptunnel != NULL);
     vassert(data != NULL);
     vassert(len > 0);
@@ -430,7 +879,797 @@ int tunnel_send_data(struct rdt_tunnel* ptunnel, const void* data, int len)
         return -1;
     }
 
-    return ptunnel->ops[ptunnel->state]->send_data(ptunnel, data, len);
+    //One writer at a time per stream, so a failed one can take its range back
+    vlock_enter(&ptunnel->stream_lock);
+    ptunnel->stream_writers++;
+    stream = find_stream(ptunnel, stream_id);
+    while(stream && !stream->fin && (ptunnel->state == RDT_STATE_READY) &&
+          (stream->busy || ((stream->id != 0) && ((int32_t)(stream->off - stream->credit) >= 0)))){
+        timedout = (vcond_mtimedwait(&ptunnel->stream_cond, &ptunnel->stream_lock,
+                                     RDT_STREAM_BLOCKED_MS) == ETIMEDOUT);
+        //Closed meanwhile?
+        stream = find_stream(ptunnel, stream_id);
+        if(!stream){
+            break;
+        }
+        if(timedout && !stream->busy && (stream->id != 0)){
+            //Grant from peer may be lost, ask again
+            ptunnel->ops[RDT_STATE_READY]->send_stream_ctrl(ptunnel, stream->id, RDT_STREAM_BLOCKED, stream->off);
+        }
+    }
+    if(!stream || stream->fin){
+        leave_stream(ptunnel);
+        return ECRDT_E_BAD_PARAM;
+    }
+    if(ptunnel->state != RDT_STATE_READY){
+        leave_stream(ptunnel);
+        return -1;
+    }
+
+    //Reserve the range and send out of lock, as pushing to txq may block.
+    pos = *stream;
+    stream->off += len;
+    stream->busy = 1;
+    with_off = (stream_id != 0) || ptunnel->streams_on;
+    vlock_leave(&ptunnel->stream_lock);
+
+    //Split to fit datagrams of path mtu only where peer said it reads in
+    //order, elsewhere a write stays one msg and is fragmented if too big.
+    seg = (ptunnel->peer_order == RDT_ORDER_IN) ? tunnel_max_payload(ptunnel) : len;
+    for(done = 0; done < len; done += n){
+        n = (len - done > seg) ? seg : len - done;
+        ret = ptunnel->ops[ptunnel->state]->send_data(ptunnel, (const uint8_t*)data + done, n, params,
+                                                     with_off ? &pos : NULL);
+        if(ret < 0){
+            break;
+        }
+        pos.off += n;
+    }
+
+    vlock_enter(&ptunnel->stream_lock);
+    stream = find_stream(ptunnel, stream_id);
+    if(stream){
+        if(ret < 0){
+            //Peer would wait for good at the offset of what is not queued
+            stream->off = pos.off;
+        }
+        stream->busy = 0;
+        vcond_broadcast(&ptunnel->stream_cond);
+    }
+    leave_stream(ptunnel);
+    return ret;
+}
+
+/*
+ * A writer is done with the tunnel, called with stream_lock held and
+ * leaves it. Tunnel may be waiting for the last one before freeing.
+ */
+void leave_stream(struct rdt_tunnel* ptunnel)
+{
+    if(--ptunnel->stream_writers == 0){
+        vcond_broadcast(&ptunnel->stream_cond);
+    }
+    vlock_leave(&ptunnel->stream_lock);
+}
+
+/*
+ * Open a stream locally, peer learns it from its first pkt.
+ */
+int32_t tunnel_stream_open(struct rdt_tunnel* ptunnel)
+{
+    struct rdt_stream* stream = NULL;
+    struct vlist* node = NULL;
+    int num = 0;
+
+    vassert(ptunnel != NULL);
+
+    if(ptunnel->state != RDT_STATE_READY) {
+        vlogE("Open stream on error state(%d)", ptunnel->state);
+        return ECRDT_E_BAD_RDT_TUNNEL;
+    }
+
+    stream = (struct rdt_stream*)malloc(sizeof(*stream));
+    retE((!stream), ECRDT_E_OOM);
+    memset(stream, 0, sizeof(*stream));
+    vlist_init(&stream->list);
+    stream->credit = RDT_STREAM_INIT_CREDIT;
+
+    vlock_enter(&ptunnel->stream_lock);
+    __vlist_for_each(node, &ptunnel->stream_list) {
+        num++;
+    }
+    //Stream 0 counts against peer's limit
+    if((num + 1 >= RDT_MAX_STREAMS) || (ptunnel->next_stream_id > 0xffff)){
+        vlock_leave(&ptunnel->stream_lock);
+        free(stream);
+        return ECRDT_E_EXCEED_LIMIT;
+    }
+    stream->id = (uint16_t)ptunnel->next_stream_id;
+    ptunnel->next_stream_id += 2;
+    ptunnel->streams_on = 1;
+    vlist_add_tail(&ptunnel->stream_list, &stream->list);
+    vlock_leave(&ptunnel->stream_lock);
+
+    return stream->id;
+}
+
+/*
+ * Close a stream with a FIN pkt after data written before. The FIN takes
+ * one pad byte so that it is acked and resent like data.
+ */
+int32_t tunnel_stream_close(struct rdt_tunnel* ptunnel, int32_t stream_id)
+{
+    struct rdt_stream* stream = NULL;
+    struct rdt_stream pos;
+    uint8_t pad = 0;
+    int32_t ret = 0;
+
+    vassert(ptunnel != NULL);
+
+    if(ptunnel->state != RDT_STATE_READY) {
+        vlogE("Close stream on error state(%d)", ptunnel->state);
+        return ECRDT_E_BAD_RDT_TUNNEL;
+    }
+
+    //FIN goes after the range a writer is queuing
+    vlock_enter(&ptunnel->stream_lock);
+    ptunnel->stream_writers++;
+    stream = (stream_id != 0) ? find_stream(ptunnel, stream_id) : NULL;
+    while(stream && !stream->fin && stream->busy && (ptunnel->state == RDT_STATE_READY)){
+        vcond_mtimedwait(&ptunnel->stream_cond, &ptunnel->stream_lock, RDT_STREAM_BLOCKED_MS);
+        stream = find_stream(ptunnel, stream_id);
+    }
+    if(!stream || stream->fin){
+        leave_stream(ptunnel);
+        return ECRDT_E_BAD_PARAM;
+    }
+    //Closing, writers blocked on it give up. It is kept until FIN is queued.
+    stream->fin = 1;
+    stream->busy = 1;
+    pos = *stream;
+    vcond_broadcast(&ptunnel->stream_cond);
+    vlock_leave(&ptunnel->stream_lock);
+
+    ret = ptunnel->ops[ptunnel->state]->send_data(ptunnel, &pad, sizeof(pad), NULL, &pos);
+
+    vlock_enter(&ptunnel->stream_lock);
+    stream = find_stream(ptunnel, stream_id);
+    if(stream && (ret < 0)){
+        //Left open so that closing can be tried again
+        stream->fin = 0;
+        stream->busy = 0;
+        vcond_broadcast(&ptunnel->stream_cond);
+    } else if(stream){
+        vlist_del(&stream->list);
+        free(stream);
+    }
+    leave_stream(ptunnel);
+    return ret;
+}
+
+/*
+ * Peer granted stream more credit.
+ */
+void tunnel_stream_credit(struct rdt_tunnel* ptunnel, uint16_t stream_id, uint32_t credit)
+{
+    struct rdt_stream* stream = NULL;
+
+    vassert(ptunnel != NULL);
+
+    vlock_enter(&ptunnel->stream_lock);
+    stream = find_stream(ptunnel, stream_id);
+    if(stream && ((int32_t)(credit - stream->credit) > 0)){
+        stream->credit = credit;
+        vcond_broadcast(&ptunnel->stream_cond);
+    }
+    vlock_leave(&ptunnel->stream_lock);
+}
+
+/*
+ * Called with stream_lock held.
+ */
+struct rdt_stream* find_stream(struct rdt_tunnel* ptunnel, int32_t stream_id)
+{
+    struct rdt_stream* stream = NULL;
+    struct vlist* node = NULL;
+
+    if(stream_id == 0){
+        return &ptunnel->stream0;
+    }
+
+    __vlist_for_each(node, &ptunnel->stream_list) {
+        stream = vlist_entry(node, struct rdt_stream, list);
+        if(stream->id == stream_id){
+            return stream;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Called with stream_lock held.
+ */
+void free_streams(struct rdt_tunnel* ptunnel)
+{
+    struct vlist* node = NULL;
+
+    while((node = vlist_pop_head(&ptunnel->stream_list)) != NULL){
+        free(vlist_entry(node, struct rdt_stream, list));
+    }
+}
+
+int tunnel_read_data(struct rdt_tunnel* ptunnel, const struct iovec* iov, int iovcnt, int timeout)
+{
+    int ret = 0;
+
+    vassert(ptunnel != NULL);
+    vassert(iov != NULL);
+    vassert(iovcnt > 0);
+
+    if(ptunnel->state != RDT_STATE_READY) {
+        vlogE("Read data on error state(%d)", ptunnel->state);
+        return -1;
+    }
+    if(ptunnel->handler.onData || ptunnel->fwd_data2upper) {
+        vlogE("Read data on tunnel(%d) with data callback", ptunnel->teid);
+        return ECRDT_E_BAD_PARAM;
+    }
+
+    vlock_enter(&ptunnel->rxq.rx_lock);
+    ptunnel->readers++;
+    while(vlist_is_empty(&ptunnel->rxq.commit_list) && ptunnel->rx_dispatcher_run){
+        if((timeout == 0) ||
+           (vcond_mtimedwait(&ptunnel->rxq.read_cond, &ptunnel->rxq.rx_lock, timeout) == ETIMEDOUT)){
+            break;
+        }
+    }
+    if(!ptunnel->rx_dispatcher_run){
+        //Woken up by destroy_tunnel, rxq goes away once all readers left
+        leave_read(ptunnel);
+        return ECRDT_E_BAD_RDT_TUNNEL;
+    }
+    vlock_leave(&ptunnel->rxq.rx_lock);
+
+    ret = ptunnel->rxq.read_data(&ptunnel->rxq, iov, iovcnt);
+    rx_stream_update(ptunnel);
+    if(ret > 0){
+        ptunnel->rx_bytes += ret;
+        rx_window_update(ptunnel);
+    }
+
+    vlock_enter(&ptunnel->rxq.rx_lock);
+    if(ret <= 0){
+        ret = ptunnel->rx_dispatcher_run ? ECRDT_E_TIMEOUT : ECRDT_E_BAD_RDT_TUNNEL;
+    }
+    leave_read(ptunnel);
+    return ret;
+}
+
+/*
+ * A reader is done with the tunnel, called with rx_lock held and leaves
+ * it. Tunnel may be waiting for the last one before freeing.
+ */
+void leave_read(struct rdt_tunnel* ptunnel)
+{
+    if((--ptunnel->readers == 0) && !ptunnel->rx_dispatcher_run){
+        vcond_broadcast(&ptunnel->rxq.read_cond);
+    }
+    vlock_leave(&ptunnel->rxq.rx_lock);
+}
+
+/*
+ * Tell peer the window reopened once application consumed enough data,
+ * otherwise a sender stalled on small window would wait for resend timeout.
+ */
+void rx_window_update(struct rdt_tunnel* ptunnel)
+{
+    uint32_t half = ptunnel->rxq.buf_size / 2;
+
+    if((ptunnel->state == RDT_STATE_READY) &&
+       (ptunnel->rxq.adv_window < half) &&
+       (ptunnel->rxq.get_window(&ptunnel->rxq) >= half)){
+        ptunnel->ops[ptunnel->state]->send_data_ack(ptunnel, ptunnel->rxq.expected_seq, 0);
+    }
+}
+
+/*
+ * Send credits granted to streams as application consumed their data.
+ */
+void rx_stream_update(struct rdt_tunnel* ptunnel)
+{
+    struct rdt_stream_credit credits[STREAM_CREDITS_PER_ROUND];
+    int n = 0;
+    int i = 0;
+
+    if(ptunnel->state != RDT_STATE_READY){
+        return;
+    }
+
+    n = ptunnel->rxq.collect_credits(&ptunnel->rxq, credits, STREAM_CREDITS_PER_ROUND);
+    for(i = 0; i < n; i++){
+        ptunnel->ops[ptunnel->state]->send_stream_ctrl(ptunnel, credits[i].stream_id,
+                                                        RDT_STREAM_CREDIT, credits[i].credit);
+    }
+}
+
+int32_t tunnel_set_option(struct rdt_tunnel* ptunnel, int option, const void* value, int length)
+{
+    struct rdt_options* opts = NULL;
+    uint32_t val = 0;
+
+    vassert(value != NULL);
+    vassert(length > 0);
+
+    opts = ptunnel ? &ptunnel->opts : &default_opts;
+
+    switch(option){
+    case ECRDT_OPT_RCVBUF_MAX:
+        retE((length != sizeof(uint32_t)), ECRDT_E_BAD_PARAM);
+        val = *(const uint32_t*)value;
+        retE((val < RDT_MTU), ECRDT_E_BAD_PARAM);
+
+        vlock_enter(&tunnel_manager.lock);
+        opts->rcvbuf_max = val;
+        vlock_leave(&tunnel_manager.lock);
+
+        if(ptunnel){
+            vlock_enter(&ptunnel->rxq.lock);
+            ptunnel->rxq.buf_limit = val;
+            if(ptunnel->rxq.buf_size > val){
+                ptunnel->rxq.buf_size = val;
+            }
+            vlock_leave(&ptunnel->rxq.lock);
+        }
+        break;
+    case ECRDT_OPT_PACING_RATE:
+        retE((length != sizeof(uint32_t)), ECRDT_E_BAD_PARAM);
+        val = *(const uint32_t*)value;
+
+        vlock_enter(&tunnel_manager.lock);
+        opts->pacing_rate = val;
+        vlock_leave(&tunnel_manager.lock);
+
+        if(ptunnel){
+            vlock_enter(&ptunnel->txq.lock);
+            ptunnel->txq.pacing_rate = val;
+            vlock_leave(&ptunnel->txq.lock);
+        }
+        break;
+    case ECRDT_OPT_RATE_LIMIT:
+    case ECRDT_OPT_RATE_BURST:
+        retE((length != sizeof(uint32_t)), ECRDT_E_BAD_PARAM);
+        val = *(const uint32_t*)value;
+
+        vlock_enter(&tunnel_manager.lock);
+        if(option == ECRDT_OPT_RATE_LIMIT){
+            opts->rate_limit = val;
+        } else {
+            opts->rate_burst = val;
+        }
+        vlock_leave(&tunnel_manager.lock);
+
+        if(ptunnel){
+            vbucket_set(&ptunnel->bucket, opts->rate_limit, opts->rate_burst);
+        }
+        break;
+    case ECRDT_OPT_SNDBUF:
+        retE((length != sizeof(uint32_t)), ECRDT_E_BAD_PARAM);
+        val = *(const uint32_t*)value;
+        retE((val < RDT_MTU), ECRDT_E_BAD_PARAM);
+
+        vlock_enter(&tunnel_manager.lock);
+        opts->sndbuf = val;
+        vlock_leave(&tunnel_manager.lock);
+
+        if(ptunnel){
+            vlock_enter(&ptunnel->txq.lock);
+            ptunnel->txq.sndbuf = val;
+            vcond_signal(&ptunnel->txq.push_cond);
+            vlock_leave(&ptunnel->txq.lock);
+        }
+        break;
+    case ECRDT_OPT_WEIGHT:
+        retE((length != sizeof(uint32_t)), ECRDT_E_BAD_PARAM);
+        val = *(const uint32_t*)value;
+        retE((val < 1 || val > RDT_MAX_WEIGHT), ECRDT_E_BAD_PARAM);
+
+        vlock_enter(&tunnel_manager.lock);
+        opts->weight = val;
+        vlock_leave(&tunnel_manager.lock);
+        break;
+    case ECRDT_OPT_UNORDERED:
+        retE((length != sizeof(uint32_t)), ECRDT_E_BAD_PARAM);
+        val = *(const uint32_t*)value;
+        retE((val > 1), ECRDT_E_BAD_PARAM);
+
+        vlock_enter(&tunnel_manager.lock);
+        opts->unordered = val;
+        vlock_leave(&tunnel_manager.lock);
+
+        if(ptunnel){
+            vlock_enter(&ptunnel->rxq.lock);
+            ptunnel->rxq.unordered = (uint8_t)val;
+            vlock_leave(&ptunnel->rxq.lock);
+        }
+        break;
+    case ECRDT_OPT_FEC_BLOCK:
+        retE((length != sizeof(uint32_t)), ECRDT_E_BAD_PARAM);
+        val = *(const uint32_t*)value;
+        retE((val == 1 || val > RDT_FEC_MAX_K), ECRDT_E_BAD_PARAM);
+
+        vlock_enter(&tunnel_manager.lock);
+        opts->fec_block = val;
+        vlock_leave(&tunnel_manager.lock);
+        break;
+    case ECRDT_OPT_FEC_REPAIR:
+        retE((length != sizeof(uint32_t)), ECRDT_E_BAD_PARAM);
+        val = *(const uint32_t*)value;
+        retE((val < 1 || val > RDT_FEC_MAX_R), ECRDT_E_BAD_PARAM);
+
+        vlock_enter(&tunnel_manager.lock);
+        opts->fec_repair = val;
+        vlock_leave(&tunnel_manager.lock);
+        break;
+    case ECRDT_OPT_CHECKSUM:
+        retE((length != sizeof(uint32_t)), ECRDT_E_BAD_PARAM);
+        val = *(const uint32_t*)value;
+        retE((val > 1), ECRDT_E_BAD_PARAM);
+
+        vlock_enter(&tunnel_manager.lock);
+        opts->checksum = val;
+        vlock_leave(&tunnel_manager.lock);
+        break;
+    case ECRDT_OPT_COMPRESS:
+        retE((length != sizeof(uint32_t)), ECRDT_E_BAD_PARAM);
+        val = *(const uint32_t*)value;
+        retE((val > 1), ECRDT_E_BAD_PARAM);
+
+        vlock_enter(&tunnel_manager.lock);
+        opts->compress = val;
+        vlock_leave(&tunnel_manager.lock);
+        break;
+    case ECRDT_OPT_COMPRESS_DICT:
+        //Shared by all tunnels, decoding may refer to it at any time
+        retE((ptunnel != NULL), ECRDT_E_BAD_PARAM);
+        retE((length > VLZ_MAX_DICT), ECRDT_E_BAD_PARAM);
+        retE((rdt_lz_dict_id() != 0), ECRDT_E_ALREADY_STARTED);
+        retE((rdt_set_lz_dict(value, length) < 0), ECRDT_E_OOM);
+        break;
+    case ECRDT_OPT_COMPACT_HDR:
+        retE((length != sizeof(uint32_t)), ECRDT_E_BAD_PARAM);
+        val = *(const uint32_t*)value;
+        retE((val > 1), ECRDT_E_BAD_PARAM);
+
+        vlock_enter(&tunnel_manager.lock);
+        opts->compact_hdr = val;
+        vlock_leave(&tunnel_manager.lock);
+        break;
+    case ECRDT_OPT_ACK_DELAY:
+        retE((length != sizeof(uint32_t)), ECRDT_E_BAD_PARAM);
+        val = *(const uint32_t*)value;
+        retE((val > RDT_MAX_ACK_DELAY_MS), ECRDT_E_BAD_PARAM);
+
+        vlock_enter(&tunnel_manager.lock);
+        opts->ack_delay = val;
+        vlock_leave(&tunnel_manager.lock);
+        break;
+    case ECRDT_OPT_BUNDLE:
+        retE((length != sizeof(uint32_t)), ECRDT_E_BAD_PARAM);
+        val = *(const uint32_t*)value;
+        retE((val > 1), ECRDT_E_BAD_PARAM);
+
+        vlock_enter(&tunnel_manager.lock);
+        opts->bundle = val;
+        vlock_leave(&tunnel_manager.lock);
+        break;
+    case ECRDT_OPT_RESUME:
+        retE((length != sizeof(uint32_t)), ECRDT_E_BAD_PARAM);
+        val = *(const uint32_t*)value;
+        retE((val > 1), ECRDT_E_BAD_PARAM);
+
+        vlock_enter(&tunnel_manager.lock);
+        opts->resume = val;
+        vlock_leave(&tunnel_manager.lock);
+        break;
+    case ECRDT_OPT_PMTU_MAX:
+        retE((length != sizeof(uint32_t)), ECRDT_E_BAD_PARAM);
+        val = *(const uint32_t*)value;
+        retE((val && (val < RDT_BASE_MTU || val > RDT_MAX_MTU)), ECRDT_E_BAD_PARAM);
+
+        vlock_enter(&tunnel_manager.lock);
+        opts->pmtu_max = val;
+        vlock_leave(&tunnel_manager.lock);
+        break;
+    case ECRDT_OPT_ACK_AGGREGATE:
+        retE((length != sizeof(uint32_t)), ECRDT_E_BAD_PARAM);
+        val = *(const uint32_t*)value;
+        retE((val > 1), ECRDT_E_BAD_PARAM);
+
+        vlock_enter(&tunnel_manager.lock);
+        opts->ack_aggregate = val;
+        vlock_leave(&tunnel_manager.lock);
+        break;
+    case ECRDT_OPT_PSK:
+        retE((length != VAEAD_KEY_LEN), ECRDT_E_BAD_PARAM);
+        retE((ptunnel && ptunnel->state != RDT_STATE_CLOSED), ECRDT_E_ALREADY_STARTED);
+
+        vlock_enter(&tunnel_manager.lock);
+        memcpy(opts->psk, value, VAEAD_KEY_LEN);
+        opts->psk_set = 1;
+        vlock_leave(&tunnel_manager.lock);
+        break;
+    default:
+        return ECRDT_E_NOT_IMPLEMENTED;
+    }
+
+    return 0;
+}
+
+/*
+ * Capabilities this end offers in handshake.
+ */
+uint32_t tunnel_local_caps(struct rdt_tunnel* ptunnel)
+{
+    uint32_t caps = 0;
+
+    vassert(ptunnel);
+
+    if(ptunnel->opts.checksum){
+        caps |= RDT_CAP_CRC32C;
+    }
+    if(ptunnel->opts.compress){
+        caps |= RDT_CAP_LZ;
+        if(rdt_lz_dict_id()){
+            caps |= RDT_CAP_LZ_DICT;
+        }
+    }
+    if(ptunnel->opts.compact_hdr){
+        caps |= RDT_CAP_COMPACT;
+    }
+    if(ptunnel->opts.psk_set){
+        caps |= RDT_CAP_AEAD;
+    }
+    if(ptunnel->opts.bundle){
+        caps |= RDT_CAP_BUNDLE;
+    }
+    if(ptunnel->opts.ack_aggregate){
+        caps |= RDT_CAP_ACK_AGG;
+    }
+    if(ptunnel->opts.pmtu_max){
+        caps |= RDT_CAP_PMTUD;
+    }
+    if(ptunnel->opts.resume){
+        caps |= RDT_CAP_RESUME;
+    }
+    return caps;
+}
+
+/*
+ * Capabilities both ends support, out of those peer offered.
+ */
+uint32_t tunnel_agree_caps(struct rdt_tunnel* ptunnel, uint32_t peer_caps, uint32_t peer_dict_id, uint32_t peer_key_id)
+{
+    uint32_t caps = 0;
+
+    vassert(ptunnel);
+
+    caps = peer_caps & tunnel_local_caps(ptunnel);
+    if(!(caps & RDT_CAP_LZ) || (peer_dict_id != rdt_lz_dict_id())){
+        caps &= ~RDT_CAP_LZ_DICT;
+    }
+    if(peer_key_id != tunnel_key_id(ptunnel)){
+        caps &= ~RDT_CAP_AEAD;
+    }
+    return caps;
+}
+
+/*
+ * Take params peer sent in handshake, once caps are agreed on. Those
+ * tied to a cap are dropped unless it is agreed on too.
+ */
+void tunnel_agree_params(struct rdt_tunnel* ptunnel, const struct rdt_handshake_tlv* tlv)
+{
+    vassert(ptunnel);
+    vassert(tlv);
+
+    ptunnel->peer_ack_delay = 0;
+    if(ptunnel->caps & RDT_CAP_COMPACT){
+        ptunnel->peer_ack_delay = (tlv->ack_delay > RDT_MAX_ACK_DELAY_MS) ? RDT_MAX_ACK_DELAY_MS : tlv->ack_delay;
+    }
+    ptunnel->txq.peer_ack_delay_us = (uint32_t)ptunnel->peer_ack_delay * 1000;
+    ptunnel->peer_order = (ptunnel->caps & RDT_CAP_PMTUD) ? tlv->order : 0;
+}
+
+/*
+ * Peer took @len bytes of early data at seq 1 already, data written next
+ * goes on after them. Called in handshake, before any data is queued.
+ */
+void tunnel_early_acked(struct rdt_tunnel* ptunnel, uint16_t len)
+{
+    vassert(ptunnel);
+
+    if(!ptunnel->early_data || (len != ptunnel->early_len)){
+        //Not taken or taken in part, opener sends it as normal data
+        return;
+    }
+
+    ptunnel->txq.last_ack += len;
+    ptunnel->txq.snd_nxt += len;
+    ptunnel->stream0.off += len;
+    ptunnel->tx_bytes += len;
+    ptunnel->early_data = NULL;
+    ptunnel->early_len = 0;
+}
+
+/*
+ * State of this end worth starting a later tunnel on the channel with.
+ */
+void ticket_state(struct rdt_tunnel* ptunnel, struct rdt_ticket_state* st)
+{
+    vassert(ptunnel);
+    vassert(st);
+
+    vlock_enter(&ptunnel->txq.lock);
+    st->caps = ptunnel->caps;
+    st->srtt_us = ptunnel->txq.srtt_us;
+    st->min_rtt_us = ptunnel->txq.min_rtt_us;
+    st->cwnd = ptunnel->txq.cwnd;
+    st->ssthresh = ptunnel->txq.ssthresh;
+    vlock_leave(&ptunnel->txq.lock);
+}
+
+/*
+ * Start from the state of a resumption ticket instead of from scratch.
+ * Responding end checks the ticket peer presented, opening end takes its
+ * own state kept with the ticket once peer tells it took the ticket.
+ * Called in handshake once caps are agreed on, before any data is queued.
+ */
+void tunnel_resume(struct rdt_tunnel* ptunnel, const struct rdt_handshake_tlv* tlv)
+{
+    struct rdt_ticket_state st;
+
+    vassert(ptunnel);
+    vassert(tlv);
+
+    ptunnel->resumed = 0;
+    if(!(ptunnel->caps & RDT_CAP_RESUME)){
+        return;
+    }
+    if(tlv->ticket_len){
+        if(ticket_check(tlv->ticket, tlv->ticket_len, &st) < 0){
+            vlogD("TUNNEL:Ticket of peer(teid:%d) not taken", ptunnel->peer_teid);
+            return;
+        }
+    } else if(tlv->resumed && ptunnel->ticket_len){
+        st = ptunnel->warm;
+    } else {
+        return;
+    }
+    //Issued for other params, the state may not hold for these
+    if(st.caps != ptunnel->caps){
+        return;
+    }
+
+    if(st.srtt_us > 0){
+        ptunnel->txq.srtt_us = st.srtt_us;
+        ptunnel->txq.rttvar_us = st.srtt_us / 2;
+        ptunnel->txq.min_rtt_us = st.min_rtt_us ? st.min_rtt_us : st.srtt_us;
+        ptunnel->rxq.rtt_us = st.srtt_us;
+    }
+    //Goes on from the window it had, growing as in congestion avoidance
+    if(st.cwnd > ptunnel->txq.cwnd){
+        ptunnel->txq.cwnd = st.cwnd;
+    }
+    ptunnel->txq.ssthresh = (st.ssthresh < ptunnel->txq.cwnd) ? st.ssthresh : ptunnel->txq.cwnd;
+    ptunnel->resumed = 1;
+}
+
+/*
+ * Send peer a new ticket with the state of this end now and then, on the
+ * responding end only.
+ */
+void tunnel_ticket_refresh(struct rdt_tunnel* ptunnel)
+{
+    struct rdt_ticket_state st;
+    uint8_t ticket[RDT_TICKET_MAX];
+    uint64_t now = vtime_us();
+    int len = 0;
+
+    vassert(ptunnel);
+
+    if(!ptunnel->issue_tickets || (ptunnel->state != RDT_STATE_READY)){
+        return;
+    }
+    if(ptunnel->ticket_ts && (now - ptunnel->ticket_ts < (uint64_t)RDT_TICKET_REFRESH_MS * 1000)){
+        return;
+    }
+    ptunnel->ticket_ts = now;
+
+    ticket_state(ptunnel, &st);
+    len = ticket_issue(&st, ticket, sizeof(ticket));
+    if(len < 0){
+        vlogE("TUNNEL:Failed to issue ticket");
+        return;
+    }
+    ptunnel->ops[ptunnel->state]->send_ticket(ptunnel, ticket, len);
+}
+
+/*
+ * Ticket from peer, kept for tunnels opened on the channel later along
+ * with the state of this end now.
+ */
+void tunnel_ticket_save(struct rdt_tunnel* ptunnel, const uint8_t* ticket, int32_t len)
+{
+    struct rdt_ticket_state st;
+
+    vassert(ptunnel);
+    vassert(ticket);
+
+    if(!(ptunnel->caps & RDT_CAP_RESUME) || ptunnel->issue_tickets){
+        return;
+    }
+    ticket_state(ptunnel, &st);
+    ticket_save(ptunnel->sessionId, ptunnel->channelId, ticket, len, &st);
+}
+
+/*
+ * Id peers compare to tell they hold the same psk, 0 for none. Derived
+ * from the psk so it tells nothing about it.
+ */
+uint32_t tunnel_key_id(struct rdt_tunnel* ptunnel)
+{
+    static const uint8_t label[16] = "rdt psk key id";
+    uint8_t out[VAEAD_KEY_LEN];
+    uint32_t id = 0;
+
+    vassert(ptunnel);
+
+    if(!ptunnel->opts.psk_set){
+        return 0;
+    }
+    vaead_hchacha(out, ptunnel->opts.psk, label);
+    memcpy(&id, out, sizeof(id));
+    return id ? id : 1;
+}
+
+/*
+ * Derive keys of both directions once caps are agreed on. Keys of data
+ * this end sends come from its nonce then peer's, so the two directions
+ * never share one. Fails if tunnel has a psk but is not to seal data.
+ */
+int32_t tunnel_derive_keys(struct rdt_tunnel* ptunnel, const uint8_t* peer_nonce)
+{
+    uint8_t in[2 * RDT_NONCE_LEN];
+
+    vassert(ptunnel);
+    vassert(peer_nonce);
+
+    if(!(ptunnel->caps & RDT_CAP_AEAD)){
+        return ptunnel->opts.psk_set ? -1 : 0;
+    }
+
+    memcpy(in, ptunnel->nonce, RDT_NONCE_LEN);
+    memcpy(in + RDT_NONCE_LEN, peer_nonce, RDT_NONCE_LEN);
+    vaead_hchacha(ptunnel->tx_key, ptunnel->opts.psk, in);
+
+    memcpy(in, peer_nonce, RDT_NONCE_LEN);
+    memcpy(in + RDT_NONCE_LEN, ptunnel->nonce, RDT_NONCE_LEN);
+    vaead_hchacha(ptunnel->rx_key, ptunnel->opts.psk, in);
+    ptunnel->tx_pn = 0;
+    return 0;
+}
+
+/*
+ * Smallest shift making the largest window fit in 16 bits.
+ */
+uint8_t get_wscale(uint32_t bufsz)
+{
+    uint8_t wscale = 0;
+
+    while((wscale < RDT_MAX_WSCALE) && ((bufsz >> wscale) > 0xffff)){
+        wscale++;
+    }
+    return wscale;
 }
 
 int rx_data_dispatcher(void* argv)
@@ -442,6 +1681,11 @@ int rx_data_dispatcher(void* argv)
     vassert(ptunnel);
 
     while(ptunnel->rx_dispatcher_run){
+        if(!ptunnel->handler.onData && !ptunnel->fwd_data2upper){
+            //Pull mode, data is left in rxq for tunnel_read_data.
+            do_fetch = 0;
+        }
+
         while(do_fetch){
             do_fetch = ptunnel->rxq.fetch_pkt(&ptunnel->rxq, &pkt);
             if (do_fetch < 0) { // no packets to fetch.
@@ -450,23 +1694,35 @@ int rx_data_dispatcher(void* argv)
             vassert(pkt);
             vassert(pkt->data);
 
-            if ((s_port_forwarding_cb != NULL) &&
-                (ptunnel->fwd_data2upper == 0) &&
-                (*(uint32_t*)pkt->data == PORT_FORWARDING_MAGIC) &&
-                (pkt->len == PORT_FORWARDING_MSG_LENGTH)) { // for upper layer.
-                ptunnel->fwd_data2upper = 1;
-                ptunnel->on_upper_data  = s_port_forwarding_cb;
-            }
-
-            if(ptunnel->fwd_data2upper){
-                ptunnel->on_upper_data(ptunnel->teid, (void*)pkt->data, pkt->len);
-            } else {
-                ptunnel->handler.onData(ptunnel->teid, (void*)pkt->data, pkt->len);
+            if ((pkt->stream_id != 0) && ptunnel->handler.onStreamData) {
+                if (pkt->flags & RDT_DATA_F_FIN) {
+                    ptunnel->handler.onStreamData(ptunnel->teid, pkt->stream_id, NULL, 0);
+                } else {
+                    ptunnel->handler.onStreamData(ptunnel->teid, pkt->stream_id, (void*)pkt->data, pkt->len);
+                    ptunnel->rx_bytes += pkt->len;
+                }
+            } else if (!(pkt->flags & RDT_DATA_F_FIN)) {
+                if ((s_port_forwarding_cb != NULL) &&
+                    (ptunnel->fwd_data2upper == 0) &&
+                    (*(uint32_t*)pkt->data == PORT_FORWARDING_MAGIC) &&
+                    (pkt->len == PORT_FORWARDING_MSG_LENGTH)) { // for upper layer.
+                    ptunnel->fwd_data2upper = 1;
+                    ptunnel->on_upper_data  = s_port_forwarding_cb;
+                }
+
+                if(ptunnel->fwd_data2upper){
+                    ptunnel->on_upper_data(ptunnel->teid, (void*)pkt->data, pkt->len);
+                } else {
+                    ptunnel->handler.onData(ptunnel->teid, (void*)pkt->data, pkt->len);
+                }
+                ptunnel->rx_bytes += pkt->len;
             }
 
-            ptunnel->rx_bytes += pkt->len;
+            ptunnel->rxq.release_pkt(&ptunnel->rxq, pkt);
            // free(pkt->data);
             free(pkt);
+            rx_window_update(ptunnel);
+            rx_stream_update(ptunnel);
         }
 
         if(ptunnel->rx_dispatcher_run) {
@@ -479,30 +1735,140 @@ int rx_data_dispatcher(void* argv)
     return 0;
 }
 
-int tx_data_dispatcher(void* argv)
+/*
+ * Earliest time next pkt may go out as pacing and the tunnel rate limit
+ * allow.
+ */
+uint64_t tunnel_next_send_ts(struct rdt_tunnel* ptunnel)
+{
+    uint64_t send_ts = 0;
+    int64_t delay = 0;
+
+    vassert(ptunnel);
+
+    ptunnel->txq.pacing_delay(&ptunnel->txq, &send_ts);
+    delay = vbucket_delay(&ptunnel->bucket);
+    if(delay > 0 && vtime_us() + delay > send_ts){
+        send_ts = vtime_us() + delay;
+    }
+    return send_ts;
+}
+
+/*
+ * Send next data pkt of tunnel on behalf of the channel scheduler.
+ * Return bytes sent, or 0 if nothing could be sent.
+ */
+int32_t tunnel_send_pkt(struct rdt_tunnel* ptunnel, uint64_t send_ts)
 {
-    rdt_tunnel_t* ptunnel = (rdt_tunnel_t*)argv;
     data_encoded_pkt_t* pkt = NULL;
+    struct rdt_skip_range skips[RDT_SKIP_MAX_RANGES];
+    struct rdt_data_ack_msg ack;
+    uint8_t* wire = NULL;
+    int32_t has_ack = 0;
+    int32_t wlen = 0;
+    int32_t nskips = 0;
+    int32_t ret = 0;
+
     vassert(ptunnel);
 
-    while(ptunnel->tx_dispatcher_run){
-        while(ptunnel->txq.fetch_pkt(&ptunnel->txq, &pkt)){
-            session_write(ptunnel->sessionId, ptunnel->channelId, (void*)pkt->data, pkt->len);
-            ptunnel->tx_bytes += pkt->len;
-            if(ptunnel->data_sending == 0){
-                ptunnel->data_sending = 1;
-                vtimer_restart(&ptunnel->timer, RDT_DATA_ACK_TIMEOUT, 0);
-            }
+    ret = ptunnel->txq.fetch_pkt(&ptunnel->txq, &pkt);
+
+    //Expired pkts met while fetching
+    nskips = ptunnel->txq.collect_skips(&ptunnel->txq, skips, RDT_SKIP_MAX_RANGES);
+    if((nskips > 0) && (ptunnel->state == RDT_STATE_READY)){
+        ptunnel->ops[ptunnel->state]->send_fwd_skip(ptunnel, skips, nskips);
+    }
+
+    if(!ret){
+        //Close a partial FEC block when data runs out, so the tail is covered too
+        if((ptunnel->fec_enc.n > 0) && (ptunnel->txq.unsent_pkts(&ptunnel->txq) == 0)){
+            fec_flush(ptunnel);
         }
+        return 0;
+    }
+    if(!pkt->resent){
+        //Header is done at first send, a compact one takes the ack held back
+        has_ack = pkt->span && take_held_ack(ptunnel, &ack);
+        pkt->hoff = (uint8_t)(pkt->hoff + rdt_set_data_seq((char*)pkt->data + pkt->hoff, pkt->len - pkt->hoff,
+                                                          pkt->seq, pkt->span, has_ack ? &ack : NULL));
+    }
+    wire = pkt->data + pkt->hoff;
+    wlen = pkt->len - pkt->hoff;
+    if((pkt->flags & RDT_DATA_F_SEAL) && !pkt->resent){
+        //Sealed once with seq in place, resends go out as they are
+        rdt_seal_data((char*)wire, wlen, ptunnel->tx_key, ptunnel->tx_pn++);
+    }
+    if((wlen > (int32_t)ptunnel->pmtu) && (ptunnel->caps & RDT_CAP_PMTUD) &&
+       (ptunnel->state == RDT_STATE_READY)){
+        //Made before path mtu went down
+        ptunnel->ops[ptunnel->state]->send_frags(ptunnel, wire, wlen);
+    } else {
+#if defined(HAVE_SO_TXTIME)
+        session_write_txtime(ptunnel->sessionId, ptunnel->channelId, (void*)wire, wlen, send_ts * 1000);
+#else
+        (void)send_ts;
+        channel_write(ptunnel->channel, ptunnel, wire, wlen);
+#endif
+    }
+    ptunnel->tx_bytes += wlen;
+    vbucket_take(&ptunnel->bucket, wlen);
+    if(ptunnel->data_sending == 0){
+        ptunnel->data_sending = 1;
+        vtimer_restart(&ptunnel->timer, RDT_DATA_ACK_TIMEOUT, 0);
+    }
+    if(ptunnel->opts.fec_block && !pkt->resent){
+        fec_add(ptunnel, pkt);
+    }
+    return wlen;
+}
+
+/*
+ * Put a data pkt sent for the first time into the FEC block, sending the
+ * repairs once block is full.
+ */
+void fec_add(struct rdt_tunnel* ptunnel, data_encoded_pkt_t* pkt)
+{
+    struct rdt_fec_enc* enc = &ptunnel->fec_enc;
+    int n = 0;
+
+    n = fec_enc_add(enc, pkt->data + pkt->hoff, pkt->len - pkt->hoff, pkt->seq, pkt->plen);
+    if((n < 0) && (enc->n > 0)){
+        fec_flush(ptunnel);
+        n = fec_enc_add(enc, pkt->data + pkt->hoff, pkt->len - pkt->hoff, pkt->seq, pkt->plen);
+    }
+    if(n >= (int)ptunnel->opts.fec_block){
+        fec_flush(ptunnel);
+    }
+}
 
-        if(ptunnel->tx_dispatcher_run){
-            vlock_enter(&ptunnel->txq.tx_lock);
-            vcond_wait(&ptunnel->txq.tx_cond, &ptunnel->txq.tx_lock);
-            vlock_leave(&ptunnel->txq.tx_lock);
+void fec_flush(struct rdt_tunnel* ptunnel)
+{
+    uint32_t repairs = ptunnel->opts.fec_repair;
+    uint32_t i = 0;
+    int32_t len = 0;
+
+    if(ptunnel->state == RDT_STATE_READY){
+        for(i = 0; i < repairs; i++){
+            len = ptunnel->ops[ptunnel->state]->send_fec(ptunnel, &ptunnel->fec_enc, i);
+            if(len > 0){
+                ptunnel->tx_bytes += len;
+                vbucket_take(&ptunnel->bucket, len);
+            }
         }
     }
+    fec_enc_reset(&ptunnel->fec_enc);
+}
 
-    return 0;
+/*
+ * A burst of the tunnel went out.
+ */
+void tunnel_send_done(struct rdt_tunnel* ptunnel)
+{
+    vassert(ptunnel);
+
+    if(ptunnel->txq.srtt_us > 0){
+        arm_probe_timer(ptunnel, ptunnel->txq.srtt_us * 2 + ptunnel->txq.peer_ack_delay_us);
+    }
 }
 
 int rdt_set_cb(void (*cb)(int, void*, int))
@@ -19,6 +19,10 @@
 #include "vlist.h"
 #include "rxq.h"
 #include "txq.h"
+#include "channel.h"
+#include "fec.h"
+#include "ticket.h"
+#include "vaead.h"
 #include "ecRdt.h"
 
 #define RDT_VERSION 0x01
@@ -36,6 +40,21 @@
 
 #define MAX_TUNNEL_NUM_PER_CHANNEL 5
 
+#define RDT_MAX_WSCALE 14
+#define RDT_MAX_WEIGHT 64
+
+#define RDT_STREAM_BLOCKED_MS 100       //Ask peer for credit again if blocked this long
+
+#define RDT_IP_UDP_OVERHEAD 48          //IPv6 and UDP headers, the larger of the two ip versions
+#define RDT_BASE_MTU (1280 - RDT_IP_UDP_OVERHEAD) //Payload of a datagram taken to pass any path, as IPv6 links carry 1280
+#define RDT_MAX_MTU 65000
+#define RDT_PMTU_PROBES 3               //Probes of a size lost before it is taken as too big
+#define RDT_PMTU_RAISE_TIMEOUT 600      //Seconds before searching for a larger size again
+#define RDT_PMTU_BLACKHOLE_TIMEOUTS 3   //Data ack timeouts in a row that drop datagrams to base size
+
+#define RDT_MAX_ACK_DELAY_MS 100        //Longest an ack may be held back for data to carry it
+#define RDT_ACK_HOLD_PKTS 2             //In order pkts one held back ack covers at most
+
 enum {
     RDT_STATE_HANDSHAKE_REQ_SENT = 0,
     RDT_STATE_HANDSHAKE_RESP_SENT,
@@ -48,15 +67,57 @@ struct rdt_tunnel;
 
 typedef void (*upper_data_cb)(int, void*, int);
 
+struct rdt_options {
+    uint32_t rcvbuf_max;        //ECRDT_OPT_RCVBUF_MAX
+    uint32_t pacing_rate;       //ECRDT_OPT_PACING_RATE
+    uint32_t rate_limit;        //ECRDT_OPT_RATE_LIMIT
+    uint32_t rate_burst;        //ECRDT_OPT_RATE_BURST
+    uint32_t sndbuf;            //ECRDT_OPT_SNDBUF
+    uint32_t weight;            //ECRDT_OPT_WEIGHT
+    uint32_t unordered;         //ECRDT_OPT_UNORDERED
+    uint32_t fec_block;         //ECRDT_OPT_FEC_BLOCK
+    uint32_t fec_repair;        //ECRDT_OPT_FEC_REPAIR
+    uint32_t checksum;          //ECRDT_OPT_CHECKSUM
+    uint32_t compress;          //ECRDT_OPT_COMPRESS
+    uint32_t compact_hdr;       //ECRDT_OPT_COMPACT_HDR
+    uint32_t ack_delay;         //ECRDT_OPT_ACK_DELAY, in ms
+    uint32_t bundle;            //ECRDT_OPT_BUNDLE
+    uint32_t ack_aggregate;     //ECRDT_OPT_ACK_AGGREGATE
+    uint32_t pmtu_max;          //ECRDT_OPT_PMTU_MAX
+    uint32_t resume;            //ECRDT_OPT_RESUME
+    uint32_t psk_set;           //Has ECRDT_OPT_PSK, data must be sealed
+    uint8_t  psk[VAEAD_KEY_LEN];
+};
+
+/*
+ * Send side of a stream.
+ */
+struct rdt_stream {
+    struct vlist list;
+    uint16_t id;
+    uint8_t  fin;                   //Closed by application
+    uint8_t  busy;                  //A writer is queuing its reserved range
+    uint32_t off;                   //Offset of next byte written
+    uint32_t credit;                //Offset peer allows sending up to
+};
+
 struct rdt_proto_ops {
     int32_t (*handshake_req)(struct rdt_tunnel*);
     int32_t (*handshake_resp)(struct rdt_tunnel*);
     int32_t (*handshake_fin)(struct rdt_tunnel*);
     int32_t (*handshake_delayed_fin)(struct rdt_tunnel*);
 
-    int32_t (*send_data)(struct rdt_tunnel*, const void* data, int32_t length);
-    int32_t (*send_data_ack)(struct rdt_tunnel*, uint32_t ack_num);
+    int32_t (*send_data)(struct rdt_tunnel*, const void* data, int32_t length, const ecRdtWriteParams* params, struct rdt_stream* stream);
+    int32_t (*send_data_ack)(struct rdt_tunnel*, uint64_t ack_num, uint64_t recv_seq);
     int32_t (*send_data_fin)(struct rdt_tunnel*);
+    int32_t (*send_data_nack)(struct rdt_tunnel*, struct rdt_nack_range* ranges, int32_t nranges);
+    int32_t (*send_stream_ctrl)(struct rdt_tunnel*, uint16_t stream_id, uint8_t type, uint32_t value);
+    int32_t (*send_fwd_skip)(struct rdt_tunnel*, struct rdt_skip_range* ranges, int32_t nranges);
+    int32_t (*send_fec)(struct rdt_tunnel*, struct rdt_fec_enc* enc, int32_t index);
+    int32_t (*send_pmtu_probe)(struct rdt_tunnel*, uint32_t probe_id, uint32_t size);
+    int32_t (*send_pmtu_ack)(struct rdt_tunnel*, uint32_t probe_id, uint32_t size);
+    int32_t (*send_frags)(struct rdt_tunnel*, const void* buf, int32_t len);
+    int32_t (*send_ticket)(struct rdt_tunnel*, const uint8_t* ticket, int32_t len);
 
     int32_t (*shutdown)(struct rdt_tunnel*);
     int32_t (*shutdown_recv)(struct rdt_tunnel*);
@@ -70,8 +131,11 @@ typedef struct rdt_tunnel {
     struct vlock lock;
     struct vcond cond;
     struct vtimer timer;
+    struct vtimer probe_timer;          //Tail loss probe
+    struct vtimer ack_timer;            //Sends the ack held back if no data took it
+    struct vtimer pmtu_timer;           //Resends path mtu probe, or starts next search
+    struct vtimer nack_timer;           //Checks holes in rxq again when nothing arrives
     struct vthread rx_data_dispatcher;
-    struct vthread tx_data_dispatcher;
 
     int32_t state;
     int32_t teid;                        //Tunnel Endpoint Identifier
@@ -82,14 +146,63 @@ typedef struct rdt_tunnel {
     int32_t channelId;
     uint32_t seq_num;                   //The seq num which should be present in next pkt
     uint32_t ctrl_ack_num;          //The ack num in handshake period
-    uint32_t peer_window_sz;    //Peer available buffer size(pkt num)
+    uint32_t peer_window_sz;    //Peer available buffer size(bytes)
+    uint8_t wscale;                 //Shift of window advertised in data ack
+    uint8_t peer_wscale;            //Shift of window peer advertised in data ack
+    uint64_t handshake_ts;          //Time last handshake msg was sent, for rtt
+    uint32_t caps;                  //RDT_CAP_XXX both ends agreed on in handshake
+    uint16_t ack_delay;             //Longest ack is held back in ms, as told to peer
+    uint16_t peer_ack_delay;        //Same of peer, 0 unless compact headers are agreed on
+    uint8_t peer_order;             //RDT_ORDER_XXX peer delivers in, 0 if not told
+    const uint8_t* early_data;      //First write carried in handshake req, until peer takes it
+    uint16_t early_len;             //Its length, or what was taken on responding end
+    int8_t fast_open;               //Responding end went ready on req alone, rsp is resent on a dup req until fin
+    int8_t resumed;                 //Started from a resumption ticket
+    uint8_t ticket_len;             //Ticket presented in handshake req, opening end
+    struct rdt_ticket_state warm;   //State of this end kept with that ticket
+    int8_t issue_tickets;           //Responding end with RDT_CAP_RESUME agreed on
+    uint64_t ticket_ts;             //Time last ticket was sent
     int32_t timeout_counter;
+    uint8_t ack_held;               //Pkts whose ack is held back for piggybacking, under lock
+    uint64_t ack_seq;               //Ack held back, valid if ack_held
+    uint64_t ack_recv;
+    uint32_t peer_mtu;              //Largest datagram peer takes, from handshake
+    uint32_t pmtu;                  //Largest datagram known to reach peer, under lock
+    uint32_t pmtu_probe;            //Size being probed, 0 if none
+    uint32_t pmtu_probe_id;
+    uint8_t pmtu_tries;             //Probes of pmtu_probe sent so far
+    uint32_t frag_id;               //Last data msg sent in fragments
+    uint8_t* frag_buf;              //Data msg being put together from fragments
+    uint32_t frag_rx_id;
+    uint64_t frag_have;             //Fragments of frag_rx_id got so far, one bit each
+    int32_t frag_len;
     int8_t data_sending;           //Indicate tunnel is in data sending state or not
     int8_t rx_dispatcher_run;  //Thread running flag
-    int8_t tx_dispatcher_run;  //Thread running flag
+    int32_t readers;                //Readers in tunnel_read_data, under rx_lock
     int8_t fwd_data2upper;      //The flag which indicates if forward data to upper protocol stack (port-forwarding etc.)
     upper_data_cb on_upper_data;   //The on data callback function upper protocol set to rdt
     ecRdtHandler handler;
+    struct rdt_options opts;
+    struct vbucket bucket;          //Send rate limit of the tunnel
+    struct rdt_channel* channel;
+    struct vlist sched_list;        //Node in tunnel list of channel scheduler
+    int32_t deficit;                //Bytes left to send in this scheduling round
+
+    struct vlock stream_lock;
+    struct vcond stream_cond;       //Signaled on credit from peer
+    int32_t stream_writers;         //Writers in tunnel_send_data, under stream_lock
+    struct vlist stream_list;       //Streams opened by this end
+    struct rdt_stream stream0;      //Default stream
+    uint32_t next_stream_id;        //Odd on opening end, even on accepting end
+    int8_t streams_on;              //Streams used, stream 0 carries offsets too
+
+    struct rdt_fec_enc fec_enc;     //Only touched by the channel sending
+    struct rdt_fec_dec* fec_dec;    //Created when peer first sends repairs
+
+    uint8_t nonce[RDT_NONCE_LEN];   //Sent in handshake, keys derive from both ends' ones
+    uint8_t tx_key[VAEAD_KEY_LEN];  //Valid if caps has RDT_CAP_AEAD
+    uint8_t rx_key[VAEAD_KEY_LEN];
+    uint64_t tx_pn;                 //Number of next pkt sealed, only touched by the channel sending
 
     tx_pkt_mngr_t txq;
     rx_pkt_mngr_t rxq;
@@ -98,12 +211,34 @@ typedef struct rdt_tunnel {
     struct rdt_proto_dec_ops* dec_ops;
 } rdt_tunnel_t;
 
-int create_tunnel(int32_t sessionId, int32_t channelId, ecRdtHandler* handler, rdt_tunnel_t**);
+int create_tunnel(int32_t sessionId, int32_t channelId, ecRdtHandler* handler, const void* early, int32_t early_len, rdt_tunnel_t**);
 void destroy_tunnel(struct rdt_tunnel* prt, int send_shutdown);
 struct rdt_tunnel* get_tunnel(int32_t teid);
 void destroy_all_tunnel();
-int32_t tunnel_send_data(struct rdt_tunnel* ptunnel, const void* data, int32_t len);
+int32_t tunnel_send_data(struct rdt_tunnel* ptunnel, const void* data, int32_t len, const ecRdtWriteParams* params);
+int32_t tunnel_read_data(struct rdt_tunnel* ptunnel, const struct iovec* iov, int32_t iovcnt, int32_t timeout);
 int32_t check_peer_teid(int32_t sid, int32_t cid, int32_t teid);
+int32_t tunnel_set_option(struct rdt_tunnel* ptunnel, int32_t option, const void* value, int32_t length);
+uint32_t tunnel_local_caps(struct rdt_tunnel* ptunnel);
+uint32_t tunnel_agree_caps(struct rdt_tunnel* ptunnel, uint32_t peer_caps, uint32_t peer_dict_id, uint32_t peer_key_id);
+void tunnel_agree_params(struct rdt_tunnel* ptunnel, const struct rdt_handshake_tlv* tlv);
+void tunnel_early_acked(struct rdt_tunnel* ptunnel, uint16_t len);
+void tunnel_resume(struct rdt_tunnel* ptunnel, const struct rdt_handshake_tlv* tlv);
+void tunnel_ticket_refresh(struct rdt_tunnel* ptunnel);
+void tunnel_ticket_save(struct rdt_tunnel* ptunnel, const uint8_t* ticket, int32_t len);
+int32_t tunnel_derive_keys(struct rdt_tunnel* ptunnel, const uint8_t* peer_nonce);
+uint32_t tunnel_key_id(struct rdt_tunnel* ptunnel);
+uint64_t tunnel_next_send_ts(struct rdt_tunnel* ptunnel);
+int32_t tunnel_send_pkt(struct rdt_tunnel* ptunnel, uint64_t send_ts);
+void tunnel_ack_data(struct rdt_tunnel* ptunnel, uint64_t ack_seq, uint64_t recv_seq);
+void tunnel_nack_gaps(struct rdt_tunnel* ptunnel);
+void tunnel_pmtu_start(struct rdt_tunnel* ptunnel);
+void tunnel_pmtu_acked(struct rdt_tunnel* ptunnel, uint32_t probe_id, uint32_t size);
+int32_t tunnel_max_payload(struct rdt_tunnel* ptunnel);
+void tunnel_send_done(struct rdt_tunnel* ptunnel);
+int32_t tunnel_stream_open(struct rdt_tunnel* ptunnel);
+int32_t tunnel_stream_close(struct rdt_tunnel* ptunnel, int32_t stream_id);
+void tunnel_stream_credit(struct rdt_tunnel* ptunnel, uint16_t stream_id, uint32_t credit);
 
 #endif
 
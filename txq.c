@@ -17,8 +17,22 @@
 #include "vsys.h"
 #include "txq.h"
 
-static void update_q(tx_pkt_mngr_t* pkt_mngr, uint32_t ack);
-static int32_t ack2index(tx_pkt_mngr_t* pkt_mngr, uint32_t ack);
+static void update_q(tx_pkt_mngr_t* pkt_mngr, uint64_t ack);
+static int32_t ack2index(tx_pkt_mngr_t* pkt_mngr, uint64_t ack);
+static data_encoded_pkt_t* fetch_lost_pkt(tx_pkt_mngr_t* pkt_mngr);
+static void clear_lost_mark(tx_pkt_mngr_t* pkt_mngr, int32_t from);
+static void rack_update(tx_pkt_mngr_t* pkt_mngr, data_encoded_pkt_t* pkt, uint64_t now);
+static int32_t rack_detect_loss(tx_pkt_mngr_t* pkt_mngr, uint64_t now, uint64_t* wait_us);
+static int32_t rewind_send_index(tx_pkt_mngr_t* pkt_mngr);
+static void on_congestion(tx_pkt_mngr_t* pkt_mngr);
+static void grow_cwnd(tx_pkt_mngr_t* pkt_mngr, uint32_t acked);
+static void schedule_next_send(tx_pkt_mngr_t* pkt_mngr, data_encoded_pkt_t* pkt, uint64_t now);
+static void notify_ready(tx_pkt_mngr_t* pkt_mngr);
+static void free_pkts(struct varray* list);
+static int32_t abandon_pkt(tx_pkt_mngr_t* pkt_mngr, data_encoded_pkt_t* pkt, uint64_t now);
+static int32_t fits_window(tx_pkt_mngr_t* pkt_mngr, uint64_t seq, data_encoded_pkt_t* pkt);
+static void take_seq(tx_pkt_mngr_t* pkt_mngr, data_encoded_pkt_t* pkt);
+static int32_t skip_unsent_pkt(tx_pkt_mngr_t* pkt_mngr, int lane, data_encoded_pkt_t* pkt, uint64_t now);
 
 void init_txq(void* this)
 {
@@ -26,10 +40,10 @@ void init_txq(void* this)
 
     vassert(this != NULL);
     tx_pkt_mngr_t* pkt_mngr = (tx_pkt_mngr_t*) this;
+    int i = 0;
 
     vlock_init(&pkt_mngr->lock);
-    vlock_init(&pkt_mngr->tx_lock);
-    vcond_init(&pkt_mngr->tx_cond);
+    vcond_init(&pkt_mngr->push_cond);
 
     pkt_mngr->pkt_list = (struct varray*)malloc(sizeof(struct varray));
     if(pkt_mngr->pkt_list == NULL){
@@ -37,11 +51,44 @@ void init_txq(void* this)
     }
 
     varray_init(pkt_mngr->pkt_list, 0);
+    for(i = 0; i < TXQ_PRIO_NUM; i++){
+        pkt_mngr->lanes[i] = (struct varray*)malloc(sizeof(struct varray));
+        if(pkt_mngr->lanes[i] == NULL){
+            return;
+        }
+        varray_init(pkt_mngr->lanes[i], 0);
+    }
 
     pkt_mngr->max_pkt_num = MAX_TXQ_LEN;
+    pkt_mngr->sndbuf = TXQ_DEFAULT_SNDBUF;
+    pkt_mngr->queued_bytes = 0;
+    pkt_mngr->closed = 0;
     pkt_mngr->send_index = 0;
     pkt_mngr->last_ack = 1;
+    pkt_mngr->peer_window = (uint32_t)-1;
     pkt_mngr->ack_counter = 0;
+    pkt_mngr->lost_counter = 0;
+    pkt_mngr->snd_nxt = 1;
+
+    pkt_mngr->srtt_us = 0;
+    pkt_mngr->rttvar_us = 0;
+    pkt_mngr->min_rtt_us = 0;
+    pkt_mngr->peer_ack_delay_us = 0;
+    pkt_mngr->rack_xmit_ts = 0;
+    pkt_mngr->reo_wnd_mult = 1;
+    pkt_mngr->reo_wnd_persist = 0;
+    pkt_mngr->probe_seq = 0;
+
+    pkt_mngr->mss = TXQ_MSS;
+    pkt_mngr->cwnd = TXQ_INIT_CWND;
+    pkt_mngr->ssthresh = (uint32_t)-1;
+    pkt_mngr->recovery_seq = 0;
+    pkt_mngr->pacing_rate = 0;
+    pkt_mngr->next_send_ts = 0;
+    pkt_mngr->nskips = 0;
+
+    pkt_mngr->on_ready = NULL;
+    pkt_mngr->ready_cookie = NULL;
 }
 
 void deinit_txq(void* this)
@@ -49,15 +96,14 @@ void deinit_txq(void* this)
     vlogD("TXQ:Deinit txq");
     vassert(this != NULL);
     tx_pkt_mngr_t* pkt_mngr = (tx_pkt_mngr_t*) this;
+    int i = 0;
 
     vlock_deinit(&pkt_mngr->lock);
-    vlock_deinit(&pkt_mngr->tx_lock);
-    vcond_deinit(&pkt_mngr->tx_cond);
-    varray_deinit(pkt_mngr->pkt_list);
-    if(pkt_mngr->pkt_list != NULL){
-        free(pkt_mngr->pkt_list);
+    vcond_deinit(&pkt_mngr->push_cond);
+    free_pkts(pkt_mngr->pkt_list);
+    for(i = 0; i < TXQ_PRIO_NUM; i++){
+        free_pkts(pkt_mngr->lanes[i]);
     }
-
 }
 
 int32_t push_pkt(void* this, data_encoded_pkt_t* pkt)
@@ -70,42 +116,113 @@ int32_t push_pkt(void* this, data_encoded_pkt_t* pkt)
     tx_pkt_mngr_t* pkt_mngr = (tx_pkt_mngr_t*) this;
 
     vlock_enter(&pkt_mngr->lock);
-    varray_add_tail(pkt_mngr->pkt_list, pkt);
+    //Block writer until acks or the rate limit drain the queue. An empty
+    //queue always takes the pkt whatever its size.
+    while((pkt_mngr->queued_bytes > 0) &&
+          (pkt_mngr->queued_bytes + pkt->len > pkt_mngr->sndbuf) &&
+          (!pkt_mngr->closed)){
+        vcond_wait(&pkt_mngr->push_cond, &pkt_mngr->lock);
+    }
+    if(pkt_mngr->closed){
+        vcond_signal(&pkt_mngr->push_cond);//Pass on to next blocked writer
+        vlock_leave(&pkt_mngr->lock);
+        free(pkt->data);
+        free(pkt);
+        return -1;
+    }
+    if(pkt->prio >= TXQ_PRIO_NUM){
+        pkt->prio = TXQ_PRIO_NUM - 1;
+    }
+    varray_add_tail(pkt_mngr->lanes[pkt->prio], pkt);
+    pkt_mngr->queued_bytes += pkt->len;
     vlock_leave(&pkt_mngr->lock);
-    vcond_signal(&pkt_mngr->tx_cond);
+    notify_ready(pkt_mngr);
 
     //vlogE("TXQ: size(%d)", varray_size(pkt_mngr->pkt_list));
-    usleep(varray_size(pkt_mngr->pkt_list) * varray_size(pkt_mngr->pkt_list) * 10);
 
     return 0;
 }
 
-int32_t update_ack(void* this, int seq_ack)
+/*
+ * Wake up and fail writers blocked in push_pkt, tunnel is going away.
+ */
+void close_txq(void* this)
 {
     vassert(this != NULL);
 
     tx_pkt_mngr_t* pkt_mngr = (tx_pkt_mngr_t*) this;
 
     vlock_enter(&pkt_mngr->lock);
+    pkt_mngr->closed = 1;
+    vcond_signal(&pkt_mngr->push_cond);
+    vlock_leave(&pkt_mngr->lock);
+}
+
+int32_t update_ack(void* this, uint64_t seq_ack, uint64_t seq_recv)
+{
+    vassert(this != NULL);
 
-    if(pkt_mngr->last_ack > seq_ack) {
+    tx_pkt_mngr_t* pkt_mngr = (tx_pkt_mngr_t*) this;
+    data_encoded_pkt_t* pkt = NULL;
+    data_encoded_pkt_t* newest = NULL;
+    uint64_t now = vtime_us();
+    int32_t index = 0;
+    int32_t lost = 0;
+    int32_t resend = 0;
+    int advanced = 0;
+    int sz = 0;
+
+    vlock_enter(&pkt_mngr->lock);
+
+    if((pkt_mngr->last_ack > seq_ack) || (seq_ack > pkt_mngr->snd_nxt)) {
         vlock_leave(&pkt_mngr->lock);
         //vlogE("TXQ:new ack(%u) smaller than last ack(%u).Ignore it!!", pkt->ack, pkt_mngr->last_ack);
         return -1;
     }
 
+    //Take the latest sent one among the pkts this ack delivers
+    sz = varray_size(pkt_mngr->pkt_list);
+    for(index = 0; index < sz; index++){
+        pkt = (data_encoded_pkt_t*)varray_get(pkt_mngr->pkt_list, index);
+        if(pkt->seq >= seq_ack){
+            break;
+        }
+        if((pkt->xmit_ts != 0) && (!newest || pkt->xmit_ts > newest->xmit_ts)){
+            newest = pkt;
+        }
+    }
+    if(newest){
+        rack_update(pkt_mngr, newest, now);
+    }
+    if(seq_recv >= seq_ack){
+        index = ack2index(pkt_mngr, seq_recv);
+        pkt = (data_encoded_pkt_t*)varray_get(pkt_mngr->pkt_list, index);
+        if(pkt && !pkt->sacked && (pkt->xmit_ts != 0)){
+            pkt->sacked = 1;
+            rack_update(pkt_mngr, pkt, now);
+        }
+    }
+
     //Repeat the same ack
     if(pkt_mngr->last_ack == seq_ack) {
         pkt_mngr->ack_counter++;
-        if(pkt_mngr->ack_counter >= RESEND_TRIGGER_COUNT){
-            vlogD("TXQ:Resend pkt(seq:%d)", seq_ack);
+        //Counting duplicated acks is only a fallback before any rtt sample,
+        //time based detection below takes over once rtt is known.
+        if((pkt_mngr->srtt_us == 0) && (pkt_mngr->ack_counter >= RESEND_TRIGGER_COUNT)){
+            vlogD("TXQ:Resend pkt(seq:%llu)", (unsigned long long)seq_ack);
             //We assume that the pkt was lost
             pkt_mngr->ack_counter = 0;
-            trigger_resend((void*)pkt_mngr);
+            on_congestion(pkt_mngr);
+            if(rewind_send_index(pkt_mngr) == 0){
+                lost++;
+            }
         }
     } else {
+        grow_cwnd(pkt_mngr, (uint32_t)(seq_ack - pkt_mngr->last_ack));
+        advanced = 1;
         pkt_mngr->ack_counter = 0;
         pkt_mngr->last_ack = seq_ack;
+        pkt_mngr->probe_seq = 0;
         int32_t new_send_index = ack2index(pkt_mngr, seq_ack);
         if(new_send_index != -1) {
             if(pkt_mngr->send_index < new_send_index) {
@@ -118,8 +235,18 @@ int32_t update_ack(void* this, int seq_ack)
 
         update_q(pkt_mngr, seq_ack);
     }
+
+    resend = rack_detect_loss(pkt_mngr, now, NULL);
+    if(resend > 0){
+        on_congestion(pkt_mngr);
+        lost += resend;
+    }
     vlock_leave(&pkt_mngr->lock);
 
+    //Acked bytes open up cwnd as well
+    if((lost > 0) || advanced){
+        notify_ready(pkt_mngr);
+    }
     return 0;
 }
 
@@ -131,23 +258,103 @@ void* this, data_encoded_pkt_t** ppkt)
     vassert(this != NULL);
     vassert(ppkt != NULL);
     tx_pkt_mngr_t* pkt_mngr = (tx_pkt_mngr_t*) this;
+    data_encoded_pkt_t* pkt = NULL;
+    uint64_t now = vtime_us();
+    uint64_t seq = 0;
+    int sz = 0;
+    int i = 0;
 
     vlock_enter(&pkt_mngr->lock);
-    int sz = varray_size(pkt_mngr->pkt_list);
-    if(sz == 0) {
+
+    //Pkts reported lost go out before any new one, unless they expired.
+    while(pkt_mngr->lost_counter > 0){
+        pkt = fetch_lost_pkt(pkt_mngr);
+        if(pkt == NULL){
+            break;
+        }
+        if(abandon_pkt(pkt_mngr, pkt, now) == 0){
+            if(pkt->xmit_ts != 0){
+                pkt->resent = 1;
+                pkt->xmit_ts = now;
+            }
+            continue;
+        }
+        //One skipped before it was ever sent goes out as a new one
+        pkt->resent = (pkt->xmit_ts != 0);
+        pkt->xmit_ts = now;
+        schedule_next_send(pkt_mngr, pkt, pkt->xmit_ts);
         vlock_leave(&pkt_mngr->lock);
-        *ppkt = NULL;
-        return 0;
+        *ppkt = pkt;
+        return 1;
     }
 
-    if(pkt_mngr->send_index < sz){
-        *ppkt = (data_encoded_pkt_t*)varray_get(pkt_mngr->pkt_list, pkt_mngr->send_index);
-        //vlogD("TXQ:fetch_txq_pkt(seq:%d)", (*ppkt)->seq);
-    } else {
+    //Pkts being resent after a rewind go first, then new ones from the
+    //highest priority lane that has any.
+    while(1){
+        sz = varray_size(pkt_mngr->pkt_list);
+        pkt = NULL;
+        if(pkt_mngr->send_index < sz){
+            pkt = (data_encoded_pkt_t*)varray_get(pkt_mngr->pkt_list, pkt_mngr->send_index);
+            seq = pkt->seq;
+            //vlogD("TXQ:fetch_txq_pkt(seq:%d)", pkt->seq);
+            if(abandon_pkt(pkt_mngr, pkt, now) == 0){
+                if(pkt->xmit_ts != 0){
+                    pkt->resent = 1;
+                    pkt->xmit_ts = now;
+                }
+                pkt_mngr->send_index++;
+                continue;
+            }
+            break;
+        }
+
+        for(i = 0; i < TXQ_PRIO_NUM; i++){
+            pkt = (data_encoded_pkt_t*)varray_get(pkt_mngr->lanes[i], 0);
+            if(pkt != NULL){
+                break;
+            }
+        }
+        if(pkt == NULL){
+            vlock_leave(&pkt_mngr->lock);
+            *ppkt = NULL;
+            return 0;
+        }
+        if(pkt->deadline && (now >= pkt->deadline)){
+            if(!(pkt->flags & RDT_DATA_F_STREAM)){
+                //Never sent and took no seq, just drop it
+                varray_del(pkt_mngr->lanes[i], 0);
+                pkt_mngr->queued_bytes -= pkt->len;
+                vcond_signal(&pkt_mngr->push_cond);
+                free(pkt->data);
+                free(pkt);
+                continue;
+            }
+            //Peer waits at its stream offset, it has to be told to skip
+            if(fits_window(pkt_mngr, pkt_mngr->snd_nxt, pkt) &&
+               (skip_unsent_pkt(pkt_mngr, i, pkt, now) == 0)){
+                continue;
+            }
+        }
+        seq = pkt_mngr->snd_nxt;
+        break;
+    }
+
+    if(!fits_window(pkt_mngr, seq, pkt)){
         vlock_leave(&pkt_mngr->lock);
         *ppkt = NULL;
         return 0;
     }
+    if(pkt_mngr->send_index < sz){
+        //One skipped before it was ever sent goes out as a new one
+        pkt->resent = (pkt->xmit_ts != 0);
+    } else {
+        varray_del(pkt_mngr->lanes[i], 0);
+        take_seq(pkt_mngr, pkt);
+    }
+    pkt->xmit_ts = now;
+    schedule_next_send(pkt_mngr, pkt, pkt->xmit_ts);
+
+    *ppkt = pkt;
     pkt_mngr->send_index++;
 
     vlock_leave(&pkt_mngr->lock);
@@ -155,41 +362,41 @@ void* this, data_encoded_pkt_t** ppkt)
     return 1;
 }
 
-void update_q(tx_pkt_mngr_t* pkt_mngr, uint32_t ack)
+void update_q(tx_pkt_mngr_t* pkt_mngr, uint64_t ack)
 {
    // vlogD("TXQ:update_q(ack:%d)", ack);
 
     vassert(pkt_mngr != NULL);
 
-    int i = 0;
     data_encoded_pkt_t* pkt = NULL;
-    int sz = varray_size(pkt_mngr->pkt_list);
 
-    for (i = sz - 1; i >=  0; i--) {
-        pkt = (data_encoded_pkt_t*)varray_get(pkt_mngr->pkt_list, i);
-        if (pkt->seq < ack) {
-            varray_del(pkt_mngr->pkt_list, i);
-            if(pkt->data != NULL){
-                //vlogD("TXQ:remove pkt(seq:%d)", pkt->seq);
-                free(pkt->data);
-            }
+    //Pkts are kept in seq order, drop the acked ones from head.
+    while (varray_size(pkt_mngr->pkt_list) > 0) {
+        pkt = (data_encoded_pkt_t*)varray_get(pkt_mngr->pkt_list, 0);
+        if (pkt->seq >= ack) {
+            break;
+        }
 
-            if(pkt != NULL){
-                free(pkt);
-            }
+        varray_del(pkt_mngr->pkt_list, 0);
+        pkt_mngr->queued_bytes -= pkt->len;
+        vcond_signal(&pkt_mngr->push_cond);
+        if(pkt->lost){
+            pkt_mngr->lost_counter--;
+        }
+        if(pkt->data != NULL){
+            //vlogD("TXQ:remove pkt(seq:%d)", pkt->seq);
+            free(pkt->data);
+        }
+        free(pkt);
 
-            pkt_mngr->send_index--;//Cuz array size decreased
-            if(pkt_mngr->send_index < 0){
-                pkt_mngr->send_index = 0;
-            }
-        } else {
-            break;
+        pkt_mngr->send_index--;//Cuz array size decreased
+        if(pkt_mngr->send_index < 0){
+            pkt_mngr->send_index = 0;
         }
     }
-
 }
 
-int32_t ack2index(tx_pkt_mngr_t* pkt_mngr, uint32_t ack)
+int32_t ack2index(tx_pkt_mngr_t* pkt_mngr, uint64_t ack)
 {
     vassert(pkt_mngr != NULL);
 
@@ -215,19 +422,47 @@ int32_t trigger_resend(void* this)
     vlogD("TXQ: trigger_resend");
 
     tx_pkt_mngr_t* pkt_mngr = (tx_pkt_mngr_t*) this;
+    int32_t ret = 0;
 
+    vlock_enter(&pkt_mngr->lock);
     if(varray_size(pkt_mngr->pkt_list) == 0){
+        vlock_leave(&pkt_mngr->lock);
         vlogD("TXQ: empty Q");
         return -1;
     }
 
+    //Nothing acked for a whole timeout, restart from one segment
+    if(pkt_mngr->cwnd > 2 * pkt_mngr->mss){
+        pkt_mngr->ssthresh = pkt_mngr->cwnd / 2;
+        if(pkt_mngr->ssthresh < 2 * pkt_mngr->mss){
+            pkt_mngr->ssthresh = 2 * pkt_mngr->mss;
+        }
+    }
+    pkt_mngr->cwnd = pkt_mngr->mss;
+    pkt_mngr->recovery_seq = pkt_mngr->snd_nxt;
+
+    ret = rewind_send_index(pkt_mngr);
+    vlock_leave(&pkt_mngr->lock);
+
+    if(ret == 0){
+        notify_ready(pkt_mngr);
+    }
+    return ret;
+}
+
+/*
+ * Go back to the first unacked pkt and send everything again from there.
+ */
+int32_t rewind_send_index(tx_pkt_mngr_t* pkt_mngr)
+{
+    vassert(pkt_mngr != NULL);
+
     int32_t new_send_index = ack2index(pkt_mngr, pkt_mngr->last_ack);
 
-    vlogD("TXQ: Last ack(%u)-->index(%d)", pkt_mngr->last_ack, new_send_index);
+    vlogD("TXQ: Last ack(%llu)-->index(%d)", (unsigned long long)pkt_mngr->last_ack, new_send_index);
     if(new_send_index != -1) {
         pkt_mngr->send_index = new_send_index;
-
-        vcond_signal(&pkt_mngr->tx_cond);
+        clear_lost_mark(pkt_mngr, new_send_index);
 
         vlogD("!!!TXQ: Resend");
         return 0;
@@ -235,3 +470,521 @@ int32_t trigger_resend(void* this)
 
     return -1;
 }
+
+/*
+ * Segment size changed with path mtu. Window keeps room for two segments
+ * at least, or one large pkt would stall it.
+ */
+int32_t update_mss(void* this, uint32_t mss)
+{
+    vassert(this != NULL);
+
+    tx_pkt_mngr_t* pkt_mngr = (tx_pkt_mngr_t*) this;
+
+    vlock_enter(&pkt_mngr->lock);
+    pkt_mngr->mss = mss;
+    if(pkt_mngr->cwnd < 2 * mss){
+        pkt_mngr->cwnd = 2 * mss;
+    }
+    vlock_leave(&pkt_mngr->lock);
+    return 0;
+}
+
+int32_t update_window(void* this, uint32_t window)
+{
+    vassert(this != NULL);
+
+    tx_pkt_mngr_t* pkt_mngr = (tx_pkt_mngr_t*) this;
+
+    vlock_enter(&pkt_mngr->lock);
+    pkt_mngr->peer_window = window;
+    vlock_leave(&pkt_mngr->lock);
+
+    if(window > 0){
+        notify_ready(pkt_mngr);
+    }
+    return 0;
+}
+
+/*
+ * Mark the sent pkts overlapping the ranges peer reported missing, they are
+ * fetched ahead of new pkts.
+ */
+int32_t resend_ranges(void* this, struct rdt_nack_range* ranges, int nranges)
+{
+    vassert(this != NULL);
+    vassert(ranges != NULL);
+
+    tx_pkt_mngr_t* pkt_mngr = (tx_pkt_mngr_t*) this;
+    data_encoded_pkt_t* pkt = NULL;
+    int marked = 0;
+    int i = 0;
+    int j = 0;
+
+    vlock_enter(&pkt_mngr->lock);
+    for(i = 0; i < pkt_mngr->send_index; i++){
+        pkt = (data_encoded_pkt_t*)varray_get(pkt_mngr->pkt_list, i);
+        if(pkt->lost){
+            continue;
+        }
+        for(j = 0; j < nranges; j++){
+            if((pkt->seq < ranges[j].end) && (pkt->seq + pkt->plen > ranges[j].start)){
+                pkt->lost = 1;
+                pkt_mngr->lost_counter++;
+                marked++;
+                break;
+            }
+        }
+    }
+
+    if(marked > 0){
+        on_congestion(pkt_mngr);
+    }
+    vlock_leave(&pkt_mngr->lock);
+
+    if(marked > 0){
+        vlogD("TXQ:%d pkts nacked", marked);
+        notify_ready(pkt_mngr);
+    }
+    return marked;
+}
+
+data_encoded_pkt_t* fetch_lost_pkt(tx_pkt_mngr_t* pkt_mngr)
+{
+    vassert(pkt_mngr != NULL);
+
+    data_encoded_pkt_t* pkt = NULL;
+    int i = 0;
+
+    for(i = 0; i < pkt_mngr->send_index; i++){
+        pkt = (data_encoded_pkt_t*)varray_get(pkt_mngr->pkt_list, i);
+        if(pkt->lost){
+            pkt->lost = 0;
+            pkt_mngr->lost_counter--;
+            return pkt;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Pkts from index @from on are going to be resent in order anyway.
+ */
+void clear_lost_mark(tx_pkt_mngr_t* pkt_mngr, int32_t from)
+{
+    vassert(pkt_mngr != NULL);
+
+    data_encoded_pkt_t* pkt = NULL;
+    int sz = varray_size(pkt_mngr->pkt_list);
+    int i = 0;
+
+    for(i = from; (i < sz) && (pkt_mngr->lost_counter > 0); i++){
+        pkt = (data_encoded_pkt_t*)varray_get(pkt_mngr->pkt_list, i);
+        if(pkt->lost){
+            pkt->lost = 0;
+            pkt_mngr->lost_counter--;
+        }
+    }
+}
+
+/*
+ * Resend the last sent pkt when the tail of a burst gets no ack within
+ * the probe timeout, so that loss there is detected without waiting for
+ * the data ack timeout.
+ * Pkts waiting out the reorder window with no ack left to come are
+ * checked here as well.
+ * Return 0 if a resend is queued, the usecs left until the next check is
+ * due, or -1 if there is nothing to probe.
+ */
+int32_t probe_tail(void* this)
+{
+    vassert(this != NULL);
+
+    tx_pkt_mngr_t* pkt_mngr = (tx_pkt_mngr_t*) this;
+    data_encoded_pkt_t* pkt = NULL;
+    uint64_t now = vtime_us();
+    uint64_t reo_wait = 0;
+    uint64_t pto = 0;
+
+    vlock_enter(&pkt_mngr->lock);
+    if((pkt_mngr->srtt_us == 0) || (pkt_mngr->send_index <= 0)){
+        vlock_leave(&pkt_mngr->lock);
+        return -1;
+    }
+
+    if(rack_detect_loss(pkt_mngr, now, &reo_wait) > 0){
+        on_congestion(pkt_mngr);
+        vlock_leave(&pkt_mngr->lock);
+        notify_ready(pkt_mngr);
+        return 0;
+    }
+    if(pkt_mngr->probe_seq != 0){
+        vlock_leave(&pkt_mngr->lock);
+        return reo_wait > 0 ? (int32_t)reo_wait : -1;
+    }
+
+    //Ack of the tail may be held back by peer on top of a round trip
+    pto = (uint64_t)pkt_mngr->srtt_us * 2 + pkt_mngr->peer_ack_delay_us;
+    if(pto < TXQ_MIN_PROBE_TIMEOUT_US){
+        pto = TXQ_MIN_PROBE_TIMEOUT_US;
+    }
+
+    pkt = (data_encoded_pkt_t*)varray_get(pkt_mngr->pkt_list, pkt_mngr->send_index - 1);
+    if(now < pkt->xmit_ts + pto){
+        vlock_leave(&pkt_mngr->lock);
+        if((reo_wait > 0) && (reo_wait < pkt->xmit_ts + pto - now)){
+            return (int32_t)reo_wait;
+        }
+        return (int32_t)(pkt->xmit_ts + pto - now);
+    }
+
+    if(!pkt->lost){
+        pkt->lost = 1;
+        pkt_mngr->lost_counter++;
+    }
+    pkt_mngr->probe_seq = pkt->seq;
+    vlock_leave(&pkt_mngr->lock);
+
+    vlogD("TXQ:tail probe(seq:%llu)", (unsigned long long)pkt->seq);
+    notify_ready(pkt_mngr);
+    return 0;
+}
+
+/*
+ * Feed rtt estimation and the RACK state with a pkt peer just delivered.
+ */
+void rack_update(tx_pkt_mngr_t* pkt_mngr, data_encoded_pkt_t* pkt, uint64_t now)
+{
+    vassert(pkt_mngr != NULL);
+    vassert(pkt != NULL);
+
+    uint32_t rtt = (uint32_t)(now - pkt->xmit_ts);
+    uint32_t delta = 0;
+
+    if(pkt->resent){
+        //Ack of a resent pkt faster than any round trip is for the original
+        //one, so the resend was spurious. Tolerate more reordering.
+        if((pkt_mngr->min_rtt_us > 0) && (rtt < pkt_mngr->min_rtt_us / 2)){
+            if(pkt_mngr->reo_wnd_mult < TXQ_MAX_REO_WND_MULT){
+                pkt_mngr->reo_wnd_mult++;
+            }
+            pkt_mngr->reo_wnd_persist = TXQ_REO_WND_PERSIST;
+            vlogD("TXQ:spurious resend(seq:%llu), reorder window x%d", (unsigned long long)pkt->seq, pkt_mngr->reo_wnd_mult);
+            return;
+        }
+    } else {
+        if(pkt_mngr->srtt_us == 0){
+            pkt_mngr->srtt_us = rtt;
+            pkt_mngr->rttvar_us = rtt / 2;
+        } else {
+            delta = (rtt > pkt_mngr->srtt_us) ? rtt - pkt_mngr->srtt_us : pkt_mngr->srtt_us - rtt;
+            pkt_mngr->rttvar_us = (pkt_mngr->rttvar_us * 3 + delta) / 4;
+            pkt_mngr->srtt_us = (pkt_mngr->srtt_us * 7 + rtt) / 8;
+        }
+        if((pkt_mngr->min_rtt_us == 0) || (rtt < pkt_mngr->min_rtt_us)){
+            pkt_mngr->min_rtt_us = rtt;
+        }
+    }
+
+    if(pkt->xmit_ts > pkt_mngr->rack_xmit_ts){
+        pkt_mngr->rack_xmit_ts = pkt->xmit_ts;
+    }
+}
+
+/*
+ * A pkt is lost once a pkt sent after it was delivered and it has been out
+ * for longer than srtt plus the reorder window.
+ */
+int32_t rack_detect_loss(tx_pkt_mngr_t* pkt_mngr, uint64_t now, uint64_t* wait_us)
+{
+    vassert(pkt_mngr != NULL);
+
+    data_encoded_pkt_t* pkt = NULL;
+    uint32_t reo_wnd = 0;
+    uint64_t left = 0;
+    int32_t lost = 0;
+    int i = 0;
+
+    if(wait_us){
+        *wait_us = 0;
+    }
+    if(pkt_mngr->srtt_us == 0){
+        return 0;
+    }
+
+    reo_wnd = pkt_mngr->min_rtt_us / 4 * pkt_mngr->reo_wnd_mult;
+    if(reo_wnd > pkt_mngr->srtt_us){
+        reo_wnd = pkt_mngr->srtt_us;
+    }
+
+    for(i = 0; i < pkt_mngr->send_index; i++){
+        pkt = (data_encoded_pkt_t*)varray_get(pkt_mngr->pkt_list, i);
+        if(pkt->lost || pkt->sacked || (pkt->xmit_ts == 0) ||
+           (pkt->xmit_ts >= pkt_mngr->rack_xmit_ts)){
+            continue;
+        }
+        if(now - pkt->xmit_ts >= pkt_mngr->srtt_us + reo_wnd){
+            pkt->lost = 1;
+            pkt_mngr->lost_counter++;
+            lost++;
+        } else if(wait_us){
+            left = pkt->xmit_ts + pkt_mngr->srtt_us + reo_wnd - now;
+            if((*wait_us == 0) || (left < *wait_us)){
+                *wait_us = left;
+            }
+        }
+    }
+
+    if((lost > 0) && (pkt_mngr->reo_wnd_persist > 0)){
+        if(--pkt_mngr->reo_wnd_persist == 0){
+            pkt_mngr->reo_wnd_mult = 1;
+        }
+    }
+    return lost;
+}
+
+/*
+ * Usecs to wait before the next pkt may be sent, with the time it is
+ * scheduled for in @send_ts.
+ */
+int32_t pacing_delay(void* this, uint64_t* send_ts)
+{
+    vassert(this != NULL);
+    vassert(send_ts != NULL);
+
+    tx_pkt_mngr_t* pkt_mngr = (tx_pkt_mngr_t*) this;
+    uint64_t now = vtime_us();
+    int32_t delay = 0;
+
+    vlock_enter(&pkt_mngr->lock);
+    *send_ts = now;
+    if(pkt_mngr->next_send_ts > now){
+        *send_ts = pkt_mngr->next_send_ts;
+        delay = (int32_t)(pkt_mngr->next_send_ts - now);
+    }
+    vlock_leave(&pkt_mngr->lock);
+
+    return delay;
+}
+
+/*
+ * Loss seen, halve the window once per round trip.
+ */
+void on_congestion(tx_pkt_mngr_t* pkt_mngr)
+{
+    vassert(pkt_mngr != NULL);
+
+    if(pkt_mngr->last_ack < pkt_mngr->recovery_seq){
+        return;
+    }
+
+    pkt_mngr->ssthresh = pkt_mngr->cwnd / 2;
+    if(pkt_mngr->ssthresh < 2 * pkt_mngr->mss){
+        pkt_mngr->ssthresh = 2 * pkt_mngr->mss;
+    }
+    pkt_mngr->cwnd = pkt_mngr->ssthresh;
+    pkt_mngr->recovery_seq = pkt_mngr->snd_nxt;
+    vlogD("TXQ:congestion, cwnd(%u)", pkt_mngr->cwnd);
+}
+
+void grow_cwnd(tx_pkt_mngr_t* pkt_mngr, uint32_t acked)
+{
+    vassert(pkt_mngr != NULL);
+
+    //No growth while recovering from a loss
+    if(pkt_mngr->last_ack < pkt_mngr->recovery_seq){
+        return;
+    }
+
+    if(pkt_mngr->cwnd < pkt_mngr->ssthresh){
+        pkt_mngr->cwnd += acked;
+    } else {
+        pkt_mngr->cwnd += (uint32_t)((uint64_t)pkt_mngr->mss * acked / pkt_mngr->cwnd);
+    }
+}
+
+/*
+ * Space pkts out by the pacing rate, either the configured one or a
+ * multiple of cwnd/srtt. No pacing until rtt is known.
+ */
+void schedule_next_send(tx_pkt_mngr_t* pkt_mngr, data_encoded_pkt_t* pkt, uint64_t now)
+{
+    vassert(pkt_mngr != NULL);
+    vassert(pkt != NULL);
+
+    uint64_t rate = pkt_mngr->pacing_rate;
+    uint64_t gain = 0;
+
+    if(rate == 0){
+        if(pkt_mngr->srtt_us == 0){
+            pkt_mngr->next_send_ts = 0;
+            return;
+        }
+        gain = (pkt_mngr->cwnd < pkt_mngr->ssthresh) ? TXQ_PACING_GAIN_SS : TXQ_PACING_GAIN_CA;
+        rate = (uint64_t)pkt_mngr->cwnd * 1000000 / pkt_mngr->srtt_us * gain / 100;
+        if(rate == 0){
+            pkt_mngr->next_send_ts = 0;
+            return;
+        }
+    }
+
+    if(pkt_mngr->next_send_ts < now){
+        pkt_mngr->next_send_ts = now;
+    }
+    pkt_mngr->next_send_ts += (uint64_t)pkt->len * 1000000 / rate;
+}
+
+void notify_ready(tx_pkt_mngr_t* pkt_mngr)
+{
+    vassert(pkt_mngr != NULL);
+
+    if(pkt_mngr->on_ready){
+        pkt_mngr->on_ready(pkt_mngr->ready_cookie);
+    }
+}
+
+/*
+ * Give up a sent pkt past its deadline instead of resending it, peer is
+ * told to skip it by collect_skips. It stays in queue until acked, and is
+ * reported again if peer keeps asking for it.
+ * Return 0 if given up, -1 if it still has to be sent.
+ */
+int32_t abandon_pkt(tx_pkt_mngr_t* pkt_mngr, data_encoded_pkt_t* pkt, uint64_t now)
+{
+    vassert(pkt_mngr != NULL);
+    vassert(pkt != NULL);
+
+    struct rdt_skip_range* skip = NULL;
+
+    if(!pkt->deadline || (now < pkt->deadline) ||
+       (pkt_mngr->nskips >= RDT_SKIP_MAX_RANGES)){
+        return -1;
+    }
+
+    skip = &pkt_mngr->skips[pkt_mngr->nskips++];
+    skip->seq = pkt->seq;
+    skip->len = pkt->plen;
+    skip->flags = pkt->flags & RDT_DATA_F_STREAM;
+    skip->stream_id = pkt->stream_id;
+    skip->stream_off = pkt->stream_off;
+    return 0;
+}
+
+/*
+ * Respect the window of peer and the congestion window. One pkt is
+ * always allowed in flight to probe a zero window.
+ */
+int32_t fits_window(tx_pkt_mngr_t* pkt_mngr, uint64_t seq, data_encoded_pkt_t* pkt)
+{
+    vassert(pkt_mngr != NULL);
+    vassert(pkt != NULL);
+
+    if(pkt_mngr->send_index == 0){
+        return 1;
+    }
+    return (seq + pkt->plen - pkt_mngr->last_ack <= pkt_mngr->peer_window) &&
+           (seq + pkt->plen - pkt_mngr->last_ack <= pkt_mngr->cwnd);
+}
+
+/*
+ * Give a pkt taken off its lane the next seq and put it behind the pkts
+ * in flight. Seq is taken only now so that pkts of any lane fill seq
+ * space in the order they go out.
+ */
+void take_seq(tx_pkt_mngr_t* pkt_mngr, data_encoded_pkt_t* pkt)
+{
+    vassert(pkt_mngr != NULL);
+    vassert(pkt != NULL);
+
+    uint64_t seq = pkt_mngr->snd_nxt;
+    uint32_t span = 0;
+
+    pkt->seq = seq;
+    if(pkt->compact){
+        //Receiver expects seq beyond last ack, and within its window
+        span = (uint32_t)(seq + pkt->plen - pkt_mngr->last_ack);
+        span = (span > pkt_mngr->peer_window) ? span : pkt_mngr->peer_window;
+    }
+    //Header gets seq when tunnel sends it, with an ack riding along
+    pkt->span = span;
+    varray_add_tail(pkt_mngr->pkt_list, pkt);
+    pkt_mngr->snd_nxt = seq + pkt->plen;
+}
+
+/*
+ * Give up an expired pkt of a stream that was never sent. Peer only moves
+ * on in the stream once the range is filled, so the pkt takes a seq and is
+ * skipped like a sent one. It keeps xmit_ts 0, and goes out as a new pkt
+ * should it have to be sent after all.
+ * Return 0 if given up, -1 if there is no room to report the skip.
+ */
+int32_t skip_unsent_pkt(tx_pkt_mngr_t* pkt_mngr, int lane, data_encoded_pkt_t* pkt, uint64_t now)
+{
+    vassert(pkt_mngr != NULL);
+    vassert(pkt != NULL);
+
+    if(pkt_mngr->nskips >= RDT_SKIP_MAX_RANGES){
+        return -1;
+    }
+    varray_del(pkt_mngr->lanes[lane], 0);
+    take_seq(pkt_mngr, pkt);
+    pkt_mngr->send_index++;
+    return abandon_pkt(pkt_mngr, pkt, now);
+}
+
+/*
+ * Take the pkts given up since last call, to be sent in a forward skip.
+ */
+int32_t collect_skips(void* this, struct rdt_skip_range* skips, int max)
+{
+    vassert(this != NULL);
+    vassert(skips != NULL);
+
+    tx_pkt_mngr_t* pkt_mngr = (tx_pkt_mngr_t*) this;
+    int32_t n = 0;
+
+    vlock_enter(&pkt_mngr->lock);
+    n = (pkt_mngr->nskips < max) ? pkt_mngr->nskips : max;
+    memcpy(skips, pkt_mngr->skips, n * sizeof(*skips));
+    memmove(pkt_mngr->skips, pkt_mngr->skips + n, (pkt_mngr->nskips - n) * sizeof(*skips));
+    pkt_mngr->nskips -= n;
+    vlock_leave(&pkt_mngr->lock);
+
+    return n;
+}
+
+void free_pkts(struct varray* list)
+{
+    data_encoded_pkt_t* pkt = NULL;
+
+    if(list == NULL){
+        return;
+    }
+    while(varray_size(list) > 0){
+        pkt = (data_encoded_pkt_t*)varray_pop_tail(list);
+        free(pkt->data);
+        free(pkt);
+    }
+    varray_deinit(list);
+    free(list);
+}
+
+/*
+ * Number of pkts queued and never sent.
+ */
+int32_t unsent_pkts(void* this)
+{
+    vassert(this != NULL);
+
+    tx_pkt_mngr_t* pkt_mngr = (tx_pkt_mngr_t*) this;
+    int32_t n = 0;
+    int i = 0;
+
+    vlock_enter(&pkt_mngr->lock);
+    for(i = 0; i < TXQ_PRIO_NUM; i++){
+        n += varray_size(pkt_mngr->lanes[i]);
+    }
+    vlock_leave(&pkt_mngr->lock);
+
+    return n;
+}
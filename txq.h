@@ -20,31 +20,85 @@
 #include "vsys.h"
 
 #define MAX_TXQ_LEN 1024
+#define TXQ_DEFAULT_SNDBUF (1024*1024)
+#define TXQ_PRIO_NUM 4                  //Same as ECRDT_PRIO_BUTT
 #define RESEND_TRIGGER_COUNT 3
+#define TXQ_MAX_REO_WND_MULT 8
+#define TXQ_REO_WND_PERSIST 16
+#define TXQ_MIN_PROBE_TIMEOUT_US 10000
+
+#define TXQ_MSS 1400                    //Segment size cwnd is counted in, until path mtu is known
+#define TXQ_INIT_CWND (10 * TXQ_MSS)
+#define TXQ_PACING_GAIN_SS 200          //Percent of cwnd/srtt in slow start
+#define TXQ_PACING_GAIN_CA 120          //Percent of cwnd/srtt in congestion avoidance
 
 typedef struct tx_pkt_mngr{
     struct vlock lock;
-    struct vlock tx_lock;
-    struct vcond tx_cond;
-    struct varray* pkt_list;
+    struct vcond push_cond;         //Writers waiting for send buffer space
+    struct varray* pkt_list;        //Pkts sent and not acked yet, in seq order
+    struct varray* lanes[TXQ_PRIO_NUM]; //Pkts never sent, per priority
 
     int32_t max_pkt_num;
+    uint32_t sndbuf;                //Bytes allowed in queue before writers block
+    uint32_t queued_bytes;
+    int8_t closed;
     int32_t send_index;
-    uint32_t last_ack;
+    uint64_t last_ack;
+    uint32_t peer_window;           //Bytes peer is able to receive beyond last ack
     int32_t ack_counter;
+    int32_t lost_counter;           //Pkts marked lost and not resent yet
+    uint64_t snd_nxt;               //Seq of next pkt never sent
+
+    uint32_t srtt_us;               //Smoothed rtt, 0 before first sample
+    uint32_t rttvar_us;
+    uint32_t min_rtt_us;
+    uint64_t rack_xmit_ts;          //Send time of the latest sent pkt delivered
+    int32_t reo_wnd_mult;           //Reorder window in quarters of min rtt
+    int32_t reo_wnd_persist;        //Loss recoveries before reo_wnd_mult resets
+    uint64_t probe_seq;             //Seq of tail probe not answered yet, 0 if none
+    uint32_t peer_ack_delay_us;     //Longest peer holds back an ack, from handshake
+
+    uint32_t mss;                   //Segment size cwnd is counted in
+    uint32_t cwnd;                  //Congestion window in bytes
+    uint32_t ssthresh;
+    uint64_t recovery_seq;          //Window is cut once until acks pass it
+    uint64_t pacing_rate;           //Bytes per second, 0 to derive from cwnd/srtt
+    uint64_t next_send_ts;          //Earliest time next pkt may go out
+
+    struct rdt_skip_range skips[RDT_SKIP_MAX_RANGES]; //Expired pkts given up, peer not told yet
+    int32_t nskips;
     void (*init)(void* this);
     void (*deinit)(void* this);
     int32_t (*push_pkt)(void* this, data_encoded_pkt_t* pkt);
-    int32_t (*update_ack)(void* this, int seq_ack);
+    int32_t (*update_ack)(void* this, uint64_t seq_ack, uint64_t seq_recv);
     int32_t (*fetch_pkt)(void* this, data_encoded_pkt_t** ppkt);
     int32_t (*trigger_resend)(void* this);
+    int32_t (*update_window)(void* this, uint32_t window);
+    int32_t (*update_mss)(void* this, uint32_t mss);
+    int32_t (*resend_ranges)(void* this, struct rdt_nack_range* ranges, int nranges);
+    int32_t (*probe_tail)(void* this);
+    int32_t (*pacing_delay)(void* this, uint64_t* send_ts);
+    int32_t (*collect_skips)(void* this, struct rdt_skip_range* skips, int max);
+    int32_t (*unsent_pkts)(void* this);
+    void (*close)(void* this);
+
+    void (*on_ready)(void* cookie);    //Called when pkts may be ready to send
+    void* ready_cookie;
 } tx_pkt_mngr_t;
 
 void init_txq(void* this);
 void deinit_txq(void* this);
 int32_t push_pkt(void* this, data_encoded_pkt_t* pkt);
-int32_t update_ack(void* this, int seq_ack);
+int32_t update_ack(void* this, uint64_t seq_ack, uint64_t seq_recv);
 int32_t fetch_txq_pkt(void* this, data_encoded_pkt_t** ppkt);
 int32_t trigger_resend(void* this);
+int32_t update_window(void* this, uint32_t window);
+int32_t update_mss(void* this, uint32_t mss);
+int32_t resend_ranges(void* this, struct rdt_nack_range* ranges, int nranges);
+int32_t probe_tail(void* this);
+int32_t pacing_delay(void* this, uint64_t* send_ts);
+int32_t collect_skips(void* this, struct rdt_skip_range* skips, int max);
+int32_t unsent_pkts(void* this);
+void close_txq(void* this);
 
 #endif
@@ -0,0 +1,545 @@
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "vaead.h"
+#include "vassert.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define VAEAD_X86
+#include <immintrin.h>
+#endif
+
+#define U8TO32(p) \
+    (((uint32_t)(p)[0]) | ((uint32_t)(p)[1] << 8) | ((uint32_t)(p)[2] << 16) | ((uint32_t)(p)[3] << 24))
+
+#define U32TO8(p, v) do { \
+    (p)[0] = (uint8_t)(v); (p)[1] = (uint8_t)((v) >> 8); \
+    (p)[2] = (uint8_t)((v) >> 16); (p)[3] = (uint8_t)((v) >> 24); \
+} while (0)
+
+#define ROTL32(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+
+#define QROUND(a, b, c, d) do { \
+    a += b; d ^= a; d = ROTL32(d, 16); \
+    c += d; b ^= c; b = ROTL32(b, 12); \
+    a += b; d ^= a; d = ROTL32(d, 8);  \
+    c += d; b ^= c; b = ROTL32(b, 7);  \
+} while (0)
+
+/*
+ * xor len bytes of keystream from block counter ctr on. Full 64 byte
+ * blocks only except for the last one.
+ */
+static void (*chacha_xor)(const uint32_t*, uint32_t, const uint8_t*, uint8_t*, int) = NULL;
+
+static
+void _aux_chacha_init(uint32_t st[16], const uint8_t key[32], const uint8_t nonce[12])
+{
+    int i = 0;
+
+    st[0] = 0x61707865;
+    st[1] = 0x3320646e;
+    st[2] = 0x79622d32;
+    st[3] = 0x6b206574;
+    for (i = 0; i < 8; i++) {
+        st[4 + i] = U8TO32(key + 4 * i);
+    }
+    st[12] = 0;
+    st[13] = U8TO32(nonce);
+    st[14] = U8TO32(nonce + 4);
+    st[15] = U8TO32(nonce + 8);
+}
+
+static
+void _aux_chacha_rounds(uint32_t x[16])
+{
+    int i = 0;
+
+    for (i = 0; i < 10; i++) {
+        QROUND(x[0], x[4], x[8],  x[12]);
+        QROUND(x[1], x[5], x[9],  x[13]);
+        QROUND(x[2], x[6], x[10], x[14]);
+        QROUND(x[3], x[7], x[11], x[15]);
+        QROUND(x[0], x[5], x[10], x[15]);
+        QROUND(x[1], x[6], x[11], x[12]);
+        QROUND(x[2], x[7], x[8],  x[13]);
+        QROUND(x[3], x[4], x[9],  x[14]);
+    }
+}
+
+static
+void _aux_chacha_block(const uint32_t st[16], uint32_t ctr, uint8_t out[64])
+{
+    uint32_t x[16];
+    int i = 0;
+
+    memcpy(x, st, sizeof(x));
+    x[12] = ctr;
+    _aux_chacha_rounds(x);
+    for (i = 0; i < 16; i++) {
+        x[i] += (i == 12) ? ctr : st[i];
+        U32TO8(out + 4 * i, x[i]);
+    }
+}
+
+static
+void _aux_chacha_xor_c(const uint32_t* st, uint32_t ctr, const uint8_t* in, uint8_t* out, int len)
+{
+    uint8_t ks[64];
+    int n = 0;
+    int i = 0;
+
+    for (; len > 0; len -= n, in += n, out += n, ctr++) {
+        _aux_chacha_block(st, ctr, ks);
+        n = len < 64 ? len : 64;
+        for (i = 0; i < n; i++) {
+            out[i] = in[i] ^ ks[i];
+        }
+    }
+}
+
+#if defined(VAEAD_X86)
+#define VROTL(v, n) _mm256_or_si256(_mm256_slli_epi32(v, n), _mm256_srli_epi32(v, 32 - (n)))
+
+#define VQROUND(a, b, c, d) do { \
+    a = _mm256_add_epi32(a, b); d = _mm256_xor_si256(d, a); d = VROTL(d, 16); \
+    c = _mm256_add_epi32(c, d); b = _mm256_xor_si256(b, c); b = VROTL(b, 12); \
+    a = _mm256_add_epi32(a, b); d = _mm256_xor_si256(d, a); d = VROTL(d, 8);  \
+    c = _mm256_add_epi32(c, d); b = _mm256_xor_si256(b, c); b = VROTL(b, 7);  \
+} while (0)
+
+/*
+ * 8x8 transpose of 32 bit words: v[j] lane b becomes v[b] lane j.
+ */
+__attribute__((target("avx2")))
+static
+void _aux_transpose8(__m256i v[8])
+{
+    __m256i t[8];
+    __m256i u[8];
+    int i = 0;
+
+    for (i = 0; i < 8; i += 2) {
+        t[i]     = _mm256_unpacklo_epi32(v[i], v[i + 1]);
+        t[i + 1] = _mm256_unpackhi_epi32(v[i], v[i + 1]);
+    }
+    for (i = 0; i < 8; i += 4) {
+        u[i]     = _mm256_unpacklo_epi64(t[i],     t[i + 2]);
+        u[i + 1] = _mm256_unpackhi_epi64(t[i],     t[i + 2]);
+        u[i + 2] = _mm256_unpacklo_epi64(t[i + 1], t[i + 3]);
+        u[i + 3] = _mm256_unpackhi_epi64(t[i + 1], t[i + 3]);
+    }
+    for (i = 0; i < 4; i++) {
+        v[i]     = _mm256_permute2x128_si256(u[i], u[i + 4], 0x20);
+        v[i + 4] = _mm256_permute2x128_si256(u[i], u[i + 4], 0x31);
+    }
+}
+
+/*
+ * Eight blocks at once, one block per lane, over 512 bytes.
+ */
+__attribute__((target("avx2")))
+static inline
+void _aux_chacha8_avx2(__m256i s[16], uint32_t ctr, const uint8_t* in, uint8_t* out)
+{
+    __m256i x[16];
+    __m256i lo[8];
+    __m256i hi[8];
+    int b = 0;
+    int i = 0;
+
+    s[12] = _mm256_add_epi32(_mm256_set1_epi32((int)ctr), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+    memcpy(x, s, sizeof(x));
+    for (i = 0; i < 10; i++) {
+        VQROUND(x[0], x[4], x[8],  x[12]);
+        VQROUND(x[1], x[5], x[9],  x[13]);
+        VQROUND(x[2], x[6], x[10], x[14]);
+        VQROUND(x[3], x[7], x[11], x[15]);
+        VQROUND(x[0], x[5], x[10], x[15]);
+        VQROUND(x[1], x[6], x[11], x[12]);
+        VQROUND(x[2], x[7], x[8],  x[13]);
+        VQROUND(x[3], x[4], x[9],  x[14]);
+    }
+    for (i = 0; i < 8; i++) {
+        lo[i] = _mm256_add_epi32(x[i], s[i]);
+        hi[i] = _mm256_add_epi32(x[i + 8], s[i + 8]);
+    }
+    _aux_transpose8(lo);
+    _aux_transpose8(hi);
+    for (b = 0; b < 8; b++) {
+        _mm256_storeu_si256((__m256i*)(out + 64 * b),
+            _mm256_xor_si256(lo[b], _mm256_loadu_si256((const __m256i*)(in + 64 * b))));
+        _mm256_storeu_si256((__m256i*)(out + 64 * b + 32),
+            _mm256_xor_si256(hi[b], _mm256_loadu_si256((const __m256i*)(in + 64 * b + 32))));
+    }
+}
+
+__attribute__((target("avx2")))
+static
+void _aux_chacha_xor_avx2(const uint32_t* st, uint32_t ctr, const uint8_t* in, uint8_t* out, int len)
+{
+    __m256i s[16];
+    uint8_t tail[512];
+    int i = 0;
+
+    for (i = 0; i < 16; i++) {
+        s[i] = _mm256_set1_epi32((int)st[i]);
+    }
+    for (; len >= 512; len -= 512, in += 512, out += 512, ctr += 8) {
+        _aux_chacha8_avx2(s, ctr, in, out);
+    }
+    if (len > 64) {
+        //Tail of a pkt still beats one block at a time
+        memcpy(tail, in, len);
+        _aux_chacha8_avx2(s, ctr, tail, tail);
+        memcpy(out, tail, len);
+        return ;
+    }
+    _aux_chacha_xor_c(st, ctr, in, out, len);
+}
+#endif
+
+/*
+ * Poly1305, with 44 bit limbs where 128 bit products are there and 26 bit
+ * ones otherwise. Only whole blocks are fed, the AEAD pads to them.
+ */
+#if defined(__SIZEOF_INT128__)
+#define U8TO64(p) ((uint64_t)U8TO32(p) | ((uint64_t)U8TO32((p) + 4) << 32))
+#define M44 ((uint64_t)0xfffffffffff)
+#define M42 ((uint64_t)0x3ffffffffff)
+
+struct poly1305 {
+    uint64_t r[3];
+    uint64_t h[3];
+    uint64_t pad[2];
+};
+
+static
+void _aux_poly_init(struct poly1305* p, const uint8_t key[32])
+{
+    uint64_t t0 = U8TO64(key);
+    uint64_t t1 = U8TO64(key + 8);
+
+    p->r[0] = t0 & 0xffc0fffffff;
+    p->r[1] = ((t0 >> 44) | (t1 << 20)) & 0xfffffc0ffff;
+    p->r[2] = (t1 >> 24) & 0x00ffffffc0f;
+    memset(p->h, 0, sizeof(p->h));
+    p->pad[0] = U8TO64(key + 16);
+    p->pad[1] = U8TO64(key + 24);
+}
+
+static
+void _aux_poly_blocks(struct poly1305* p, const uint8_t* m, int len)
+{
+    const uint64_t r0 = p->r[0], r1 = p->r[1], r2 = p->r[2];
+    const uint64_t s1 = r1 * (5 << 2), s2 = r2 * (5 << 2);
+    uint64_t h0 = p->h[0], h1 = p->h[1], h2 = p->h[2];
+    unsigned __int128 d0, d1, d2;
+    uint64_t t0, t1, c;
+
+    for (; len >= 16; len -= 16, m += 16) {
+        t0 = U8TO64(m);
+        t1 = U8TO64(m + 8);
+        h0 += t0 & M44;
+        h1 += ((t0 >> 44) | (t1 << 20)) & M44;
+        h2 += ((t1 >> 24) & M42) | ((uint64_t)1 << 40);
+
+        d0 = (unsigned __int128)h0 * r0 + (unsigned __int128)h1 * s2 + (unsigned __int128)h2 * s1;
+        d1 = (unsigned __int128)h0 * r1 + (unsigned __int128)h1 * r0 + (unsigned __int128)h2 * s2;
+        d2 = (unsigned __int128)h0 * r2 + (unsigned __int128)h1 * r1 + (unsigned __int128)h2 * r0;
+
+        c = (uint64_t)(d0 >> 44); h0 = (uint64_t)d0 & M44;
+        d1 += c; c = (uint64_t)(d1 >> 44); h1 = (uint64_t)d1 & M44;
+        d2 += c; c = (uint64_t)(d2 >> 42); h2 = (uint64_t)d2 & M42;
+        h0 += c * 5; c = h0 >> 44; h0 &= M44;
+        h1 += c;
+    }
+    p->h[0] = h0; p->h[1] = h1; p->h[2] = h2;
+}
+
+static
+void _aux_poly_finish(struct poly1305* p, uint8_t mac[16])
+{
+    uint64_t h0 = p->h[0], h1 = p->h[1], h2 = p->h[2];
+    uint64_t g0, g1, g2, c, t0, t1;
+
+    c = h1 >> 44; h1 &= M44;
+    h2 += c; c = h2 >> 42; h2 &= M42;
+    h0 += c * 5; c = h0 >> 44; h0 &= M44;
+    h1 += c; c = h1 >> 44; h1 &= M44;
+    h2 += c; c = h2 >> 42; h2 &= M42;
+    h0 += c * 5; c = h0 >> 44; h0 &= M44;
+    h1 += c;
+
+    //h - p, kept if not negative
+    g0 = h0 + 5; c = g0 >> 44; g0 &= M44;
+    g1 = h1 + c; c = g1 >> 44; g1 &= M44;
+    g2 = h2 + c - ((uint64_t)1 << 42);
+
+    c = (g2 >> 63) - 1;
+    g0 &= c; g1 &= c; g2 &= c;
+    c = ~c;
+    h0 = (h0 & c) | g0;
+    h1 = (h1 & c) | g1;
+    h2 = (h2 & c) | g2;
+
+    t0 = p->pad[0];
+    t1 = p->pad[1];
+    h0 += t0 & M44; c = h0 >> 44; h0 &= M44;
+    h1 += (((t0 >> 44) | (t1 << 20)) & M44) + c; c = h1 >> 44; h1 &= M44;
+    h2 += ((t1 >> 24) & M42) + c; h2 &= M42;
+
+    h0 = h0 | (h1 << 44);
+    h1 = (h1 >> 20) | (h2 << 24);
+    U32TO8(mac + 0,  (uint32_t)h0);
+    U32TO8(mac + 4,  (uint32_t)(h0 >> 32));
+    U32TO8(mac + 8,  (uint32_t)h1);
+    U32TO8(mac + 12, (uint32_t)(h1 >> 32));
+}
+#else
+struct poly1305 {
+    uint32_t r[5];
+    uint32_t h[5];
+    uint32_t pad[4];
+};
+
+static
+void _aux_poly_init(struct poly1305* p, const uint8_t key[32])
+{
+    p->r[0] = (U8TO32(key + 0)) & 0x3ffffff;
+    p->r[1] = (U8TO32(key + 3) >> 2) & 0x3ffff03;
+    p->r[2] = (U8TO32(key + 6) >> 4) & 0x3ffc0ff;
+    p->r[3] = (U8TO32(key + 9) >> 6) & 0x3f03fff;
+    p->r[4] = (U8TO32(key + 12) >> 8) & 0x00fffff;
+    memset(p->h, 0, sizeof(p->h));
+    p->pad[0] = U8TO32(key + 16);
+    p->pad[1] = U8TO32(key + 20);
+    p->pad[2] = U8TO32(key + 24);
+    p->pad[3] = U8TO32(key + 28);
+}
+
+static
+void _aux_poly_blocks(struct poly1305* p, const uint8_t* m, int len)
+{
+    const uint32_t r0 = p->r[0], r1 = p->r[1], r2 = p->r[2], r3 = p->r[3], r4 = p->r[4];
+    const uint32_t s1 = r1 * 5, s2 = r2 * 5, s3 = r3 * 5, s4 = r4 * 5;
+    uint32_t h0 = p->h[0], h1 = p->h[1], h2 = p->h[2], h3 = p->h[3], h4 = p->h[4];
+    uint64_t d0, d1, d2, d3, d4;
+    uint32_t c = 0;
+
+    for (; len >= 16; len -= 16, m += 16) {
+        h0 += (U8TO32(m + 0)) & 0x3ffffff;
+        h1 += (U8TO32(m + 3) >> 2) & 0x3ffffff;
+        h2 += (U8TO32(m + 6) >> 4) & 0x3ffffff;
+        h3 += (U8TO32(m + 9) >> 6) & 0x3ffffff;
+        h4 += (U8TO32(m + 12) >> 8) | (1 << 24);
+
+        d0 = (uint64_t)h0 * r0 + (uint64_t)h1 * s4 + (uint64_t)h2 * s3 + (uint64_t)h3 * s2 + (uint64_t)h4 * s1;
+        d1 = (uint64_t)h0 * r1 + (uint64_t)h1 * r0 + (uint64_t)h2 * s4 + (uint64_t)h3 * s3 + (uint64_t)h4 * s2;
+        d2 = (uint64_t)h0 * r2 + (uint64_t)h1 * r1 + (uint64_t)h2 * r0 + (uint64_t)h3 * s4 + (uint64_t)h4 * s3;
+        d3 = (uint64_t)h0 * r3 + (uint64_t)h1 * r2 + (uint64_t)h2 * r1 + (uint64_t)h3 * r0 + (uint64_t)h4 * s4;
+        d4 = (uint64_t)h0 * r4 + (uint64_t)h1 * r3 + (uint64_t)h2 * r2 + (uint64_t)h3 * r1 + (uint64_t)h4 * r0;
+
+        c = (uint32_t)(d0 >> 26); h0 = (uint32_t)d0 & 0x3ffffff;
+        d1 += c; c = (uint32_t)(d1 >> 26); h1 = (uint32_t)d1 & 0x3ffffff;
+        d2 += c; c = (uint32_t)(d2 >> 26); h2 = (uint32_t)d2 & 0x3ffffff;
+        d3 += c; c = (uint32_t)(d3 >> 26); h3 = (uint32_t)d3 & 0x3ffffff;
+        d4 += c; c = (uint32_t)(d4 >> 26); h4 = (uint32_t)d4 & 0x3ffffff;
+        h0 += c * 5; c = h0 >> 26; h0 &= 0x3ffffff;
+        h1 += c;
+    }
+    p->h[0] = h0; p->h[1] = h1; p->h[2] = h2; p->h[3] = h3; p->h[4] = h4;
+}
+
+static
+void _aux_poly_finish(struct poly1305* p, uint8_t mac[16])
+{
+    uint32_t h0 = p->h[0], h1 = p->h[1], h2 = p->h[2], h3 = p->h[3], h4 = p->h[4];
+    uint32_t g0, g1, g2, g3, g4;
+    uint32_t c = 0;
+    uint32_t mask = 0;
+    uint64_t f = 0;
+
+    c = h1 >> 26; h1 &= 0x3ffffff;
+    h2 += c; c = h2 >> 26; h2 &= 0x3ffffff;
+    h3 += c; c = h3 >> 26; h3 &= 0x3ffffff;
+    h4 += c; c = h4 >> 26; h4 &= 0x3ffffff;
+    h0 += c * 5; c = h0 >> 26; h0 &= 0x3ffffff;
+    h1 += c;
+
+    //h - p, kept if not negative
+    g0 = h0 + 5; c = g0 >> 26; g0 &= 0x3ffffff;
+    g1 = h1 + c; c = g1 >> 26; g1 &= 0x3ffffff;
+    g2 = h2 + c; c = g2 >> 26; g2 &= 0x3ffffff;
+    g3 = h3 + c; c = g3 >> 26; g3 &= 0x3ffffff;
+    g4 = h4 + c - (1 << 26);
+
+    mask = (g4 >> 31) - 1;
+    g0 &= mask; g1 &= mask; g2 &= mask; g3 &= mask; g4 &= mask;
+    mask = ~mask;
+    h0 = (h0 & mask) | g0;
+    h1 = (h1 & mask) | g1;
+    h2 = (h2 & mask) | g2;
+    h3 = (h3 & mask) | g3;
+    h4 = (h4 & mask) | g4;
+
+    h0 = (h0 | (h1 << 26));
+    h1 = ((h1 >> 6) | (h2 << 20));
+    h2 = ((h2 >> 12) | (h3 << 14));
+    h3 = ((h3 >> 18) | (h4 << 8));
+
+    f = (uint64_t)h0 + p->pad[0];             h0 = (uint32_t)f;
+    f = (uint64_t)h1 + p->pad[1] + (f >> 32); h1 = (uint32_t)f;
+    f = (uint64_t)h2 + p->pad[2] + (f >> 32); h2 = (uint32_t)f;
+    f = (uint64_t)h3 + p->pad[3] + (f >> 32); h3 = (uint32_t)f;
+
+    U32TO8(mac + 0, h0);
+    U32TO8(mac + 4, h1);
+    U32TO8(mac + 8, h2);
+    U32TO8(mac + 12, h3);
+}
+#endif
+
+/*
+ * Absorb data zero padded to 16 bytes, as RFC 8439 lays out aad and
+ * ciphertext.
+ */
+static
+void _aux_poly_padded(struct poly1305* p, const uint8_t* m, int len)
+{
+    uint8_t last[16];
+    int n = len & ~15;
+
+    _aux_poly_blocks(p, m, n);
+    if (len > n) {
+        memset(last, 0, sizeof(last));
+        memcpy(last, m + n, len - n);
+        _aux_poly_blocks(p, last, 16);
+    }
+}
+
+static
+void _aux_aead_mac(const uint32_t st[16], const uint8_t* aad, int aadlen,
+                   const uint8_t* ct, int len, uint8_t tag[16])
+{
+    struct poly1305 p;
+    uint8_t otk[64];
+    uint8_t lens[16];
+
+    _aux_chacha_block(st, 0, otk);
+    _aux_poly_init(&p, otk);
+    _aux_poly_padded(&p, aad, aadlen);
+    _aux_poly_padded(&p, ct, len);
+    memset(lens, 0, sizeof(lens));
+    U32TO8(lens, (uint32_t)aadlen);
+    U32TO8(lens + 8, (uint32_t)len);
+    _aux_poly_blocks(&p, lens, 16);
+    _aux_poly_finish(&p, tag);
+}
+
+void vaead_init(void)
+{
+    if (chacha_xor) {
+        return ;
+    }
+
+    chacha_xor = _aux_chacha_xor_c;
+#if defined(VAEAD_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        chacha_xor = _aux_chacha_xor_avx2;
+    }
+#endif
+}
+
+/*
+ * HChaCha20, to derive keys from a long term one.
+ */
+void vaead_hchacha(uint8_t out[32], const uint8_t key[32], const uint8_t in[16])
+{
+    uint32_t x[16];
+    int i = 0;
+
+    vassert(out);
+    vassert(key);
+    vassert(in);
+
+    x[0] = 0x61707865;
+    x[1] = 0x3320646e;
+    x[2] = 0x79622d32;
+    x[3] = 0x6b206574;
+    for (i = 0; i < 8; i++) {
+        x[4 + i] = U8TO32(key + 4 * i);
+    }
+    for (i = 0; i < 4; i++) {
+        x[12 + i] = U8TO32(in + 4 * i);
+    }
+    _aux_chacha_rounds(x);
+    for (i = 0; i < 4; i++) {
+        U32TO8(out + 4 * i, x[i]);
+        U32TO8(out + 16 + 4 * i, x[12 + i]);
+    }
+}
+
+/*
+ * Encrypt len bytes from in to out, which may be the same, and make the
+ * tag over aad and the ciphertext.
+ */
+void vaead_seal(const uint8_t key[32], const uint8_t nonce[12], const uint8_t* aad, int aadlen,
+                const uint8_t* in, uint8_t* out, int len, uint8_t tag[16])
+{
+    uint32_t st[16];
+
+    vassert(chacha_xor);
+
+    _aux_chacha_init(st, key, nonce);
+    chacha_xor(st, 1, in, out, len);
+    _aux_aead_mac(st, aad, aadlen, out, len, tag);
+}
+
+/*
+ * Check the tag and decrypt len bytes from in to out, which may be the
+ * same. Returns -1 and leaves out untouched if the tag does not match.
+ */
+int vaead_open(const uint8_t key[32], const uint8_t nonce[12], const uint8_t* aad, int aadlen,
+               const uint8_t* in, uint8_t* out, int len, const uint8_t tag[16])
+{
+    uint32_t st[16];
+    uint8_t mac[16];
+    uint8_t diff = 0;
+    int i = 0;
+
+    vassert(chacha_xor);
+
+    _aux_chacha_init(st, key, nonce);
+    _aux_aead_mac(st, aad, aadlen, in, len, mac);
+    for (i = 0; i < VAEAD_TAG_LEN; i++) {
+        diff |= mac[i] ^ tag[i];
+    }
+    if (diff) {
+        return -1;
+    }
+    chacha_xor(st, 1, in, out, len);
+    return 0;
+}
+
+void vaead_nonce(uint8_t nonce[12], uint64_t pn)
+{
+    memset(nonce, 0, 4);
+    U32TO8(nonce + 4, (uint32_t)pn);
+    U32TO8(nonce + 8, (uint32_t)(pn >> 32));
+}
+
+int vaead_random(void* buf, int len)
+{
+    int fd = 0;
+    int n = 0;
+
+    fd = open("/dev/urandom", O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    n = (int)read(fd, buf, len);
+    close(fd);
+    return (n == len) ? 0 : -1;
+}
@@ -0,0 +1,23 @@
+#ifndef __VAEAD_H__
+#define __VAEAD_H__
+
+#include <stdint.h>
+
+/*
+ * ChaCha20-Poly1305 AEAD (RFC 8439) with 64 bit pkt numbers as nonce.
+ * vaead_init() must be called once before use, it picks the AVX2
+ * keystream routine when the cpu has it.
+ */
+#define VAEAD_KEY_LEN   32
+#define VAEAD_TAG_LEN   16
+
+void vaead_init    (void);
+void vaead_hchacha (uint8_t out[32], const uint8_t key[32], const uint8_t in[16]);
+void vaead_seal    (const uint8_t key[32], const uint8_t nonce[12], const uint8_t* aad, int aadlen,
+                    const uint8_t* in, uint8_t* out, int len, uint8_t tag[16]);
+int  vaead_open    (const uint8_t key[32], const uint8_t nonce[12], const uint8_t* aad, int aadlen,
+                    const uint8_t* in, uint8_t* out, int len, const uint8_t tag[16]);
+void vaead_nonce   (uint8_t nonce[12], uint64_t pn);
+int  vaead_random  (void* buf, int len);
+
+#endif
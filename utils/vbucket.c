@@ -0,0 +1,99 @@
+#include "vbucket.h"
+#include "vassert.h"
+
+static
+void _aux_refill(struct vbucket* bucket, uint64_t now)
+{
+    uint64_t add = 0;
+
+    add = (now - bucket->last_ts) * bucket->rate / 1000000;
+    if (!add) {
+        //keep the time so that fraction is not lost.
+        return ;
+    }
+    bucket->last_ts = now;
+    bucket->tokens += (int64_t)add;
+    if (bucket->tokens > (int64_t)bucket->burst) {
+        bucket->tokens = (int64_t)bucket->burst;
+    }
+    return ;
+}
+
+/*
+ * @bucket:
+ * @rate: bytes per second, 0 for unlimited.
+ * @burst: bytes.
+ */
+int vbucket_init(struct vbucket* bucket, uint64_t rate, uint64_t burst)
+{
+    vassert(bucket);
+
+    vlock_init(&bucket->lock);
+    if (!burst) {
+        burst = rate / 10;
+    }
+    bucket->rate    = rate;
+    bucket->burst   = burst;
+    bucket->tokens  = (int64_t)burst;
+    bucket->last_ts = vtime_us();
+    return 0;
+}
+
+void vbucket_deinit(struct vbucket* bucket)
+{
+    vassert(bucket);
+
+    vlock_deinit(&bucket->lock);
+    return ;
+}
+
+void vbucket_set(struct vbucket* bucket, uint64_t rate, uint64_t burst)
+{
+    vassert(bucket);
+
+    if (!burst) {
+        burst = rate / 10;
+    }
+    vlock_enter(&bucket->lock);
+    bucket->rate    = rate;
+    bucket->burst   = burst;
+    bucket->last_ts = vtime_us();
+    if (bucket->tokens > (int64_t)burst) {
+        bucket->tokens = (int64_t)burst;
+    }
+    vlock_leave(&bucket->lock);
+    return ;
+}
+
+/*
+ * usecs to wait before the bucket is out of debt.
+ */
+int64_t vbucket_delay(struct vbucket* bucket)
+{
+    int64_t delay = 0;
+    vassert(bucket);
+
+    vlock_enter(&bucket->lock);
+    if (bucket->rate) {
+        _aux_refill(bucket, vtime_us());
+        if (bucket->tokens < 0) {
+            delay = (-bucket->tokens * 1000000 + (int64_t)bucket->rate - 1) / (int64_t)bucket->rate;
+        }
+    }
+    vlock_leave(&bucket->lock);
+    return delay;
+}
+
+void vbucket_take(struct vbucket* bucket, int length)
+{
+    vassert(bucket);
+    vassert(length >= 0);
+
+    vlock_enter(&bucket->lock);
+    if (bucket->rate) {
+        _aux_refill(bucket, vtime_us());
+        bucket->tokens -= length;
+    }
+    vlock_leave(&bucket->lock);
+    return ;
+}
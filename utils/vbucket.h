@@ -0,0 +1,27 @@
+#ifndef __VBUCKET_H__
+#define __VBUCKET_H__
+
+#include <stdint.h>
+#include "vsys.h"
+
+/*
+ * token bucket.
+ * Tokens are bytes. Taking more than available is allowed and leaves the
+ * bucket in debt, the caller waits until the debt is paid off.
+ * Burst of 0 means 100ms worth of rate.
+ */
+struct vbucket {
+    struct vlock lock;
+    uint64_t rate;      /* bytes per second, 0 for unlimited */
+    uint64_t burst;     /* most tokens the bucket holds */
+    int64_t  tokens;
+    uint64_t last_ts;
+};
+
+int     vbucket_init  (struct vbucket*, uint64_t, uint64_t);
+void    vbucket_deinit(struct vbucket*);
+void    vbucket_set   (struct vbucket*, uint64_t, uint64_t);
+int64_t vbucket_delay (struct vbucket*);
+void    vbucket_take  (struct vbucket*, int);
+
+#endif
@@ -0,0 +1,130 @@
+#include <string.h>
+#include "vcrc.h"
+#include "vassert.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define VCRC_X86
+#include <immintrin.h>
+#endif
+
+#define CRC32C_POLY 0x82f63b78  /* reflected */
+
+static uint32_t crc_tbl[8][256];
+static uint32_t (*crc_copy)(uint32_t, uint8_t*, const uint8_t*, int) = NULL;
+
+/*
+ * Slicing-by-8, one table lookup per byte but eight independent ones
+ * per word. dst may be NULL for no copy.
+ */
+static
+uint32_t _aux_crc_copy_c(uint32_t crc, uint8_t* dst, const uint8_t* src, int len)
+{
+    uint64_t v = 0;
+
+    for (; len >= 8; len -= 8, src += 8) {
+        memcpy(&v, src, 8);
+        if (dst) {
+            memcpy(dst, &v, 8);
+            dst += 8;
+        }
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        v = __builtin_bswap64(v);
+#endif
+        v ^= crc;
+        crc = crc_tbl[7][v & 0xff] ^ crc_tbl[6][(v >> 8) & 0xff] ^
+              crc_tbl[5][(v >> 16) & 0xff] ^ crc_tbl[4][(v >> 24) & 0xff] ^
+              crc_tbl[3][(v >> 32) & 0xff] ^ crc_tbl[2][(v >> 40) & 0xff] ^
+              crc_tbl[1][(v >> 48) & 0xff] ^ crc_tbl[0][v >> 56];
+    }
+    for (; len > 0; len--, src++) {
+        if (dst) {
+            *dst++ = *src;
+        }
+        crc = crc_tbl[0][(crc ^ *src) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#if defined(VCRC_X86)
+__attribute__((target("sse4.2")))
+static
+uint32_t _aux_crc_copy_sse42(uint32_t crc, uint8_t* dst, const uint8_t* src, int len)
+{
+#if defined(__x86_64__)
+    uint64_t c = crc;
+    uint64_t v = 0;
+
+    for (; len >= 8; len -= 8, src += 8) {
+        memcpy(&v, src, 8);
+        if (dst) {
+            memcpy(dst, &v, 8);
+            dst += 8;
+        }
+        c = _mm_crc32_u64(c, v);
+    }
+    crc = (uint32_t)c;
+#endif
+    for (; len > 0; len--, src++) {
+        if (dst) {
+            *dst++ = *src;
+        }
+        crc = _mm_crc32_u8(crc, *src);
+    }
+    return crc;
+}
+#endif
+
+void vcrc_init(void)
+{
+    uint32_t c = 0;
+    int i = 0;
+    int j = 0;
+
+    if (crc_copy) {
+        return ;
+    }
+
+    for (i = 0; i < 256; i++) {
+        c = (uint32_t)i;
+        for (j = 0; j < 8; j++) {
+            c = (c & 1) ? (c >> 1) ^ CRC32C_POLY : (c >> 1);
+        }
+        crc_tbl[0][i] = c;
+    }
+    for (i = 0; i < 256; i++) {
+        c = crc_tbl[0][i];
+        for (j = 1; j < 8; j++) {
+            c = crc_tbl[0][c & 0xff] ^ (c >> 8);
+            crc_tbl[j][i] = c;
+        }
+    }
+
+    crc_copy = _aux_crc_copy_c;
+#if defined(VCRC_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2")) {
+        crc_copy = _aux_crc_copy_sse42;
+    }
+#endif
+    return ;
+}
+
+uint32_t vcrc32c(uint32_t crc, const void* buf, int len)
+{
+    vassert(buf);
+    vassert(crc_copy);
+
+    return ~crc_copy(~crc, NULL, (const uint8_t*)buf, len);
+}
+
+/*
+ * Copy len bytes from src to dst, and crc them on the way.
+ */
+uint32_t vcrc32c_copy(uint32_t crc, void* dst, const void* src, int len)
+{
+    vassert(dst);
+    vassert(src);
+    vassert(crc_copy);
+
+    return ~crc_copy(~crc, (uint8_t*)dst, (const uint8_t*)src, len);
+}
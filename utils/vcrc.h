@@ -0,0 +1,16 @@
+#ifndef __VCRC_H__
+#define __VCRC_H__
+
+#include <stdint.h>
+
+/*
+ * CRC32C (Castagnoli). Pass 0 to start, or the result over previous
+ * bytes to continue: vcrc32c(vcrc32c(0, a), b) is the crc of a then b.
+ * vcrc_init() must be called once before use, it picks the sse4.2 crc32
+ * instruction when the cpu has it.
+ */
+void     vcrc_init     (void);
+uint32_t vcrc32c       (uint32_t crc, const void* buf, int len);
+uint32_t vcrc32c_copy  (uint32_t crc, void* dst, const void* src, int len);
+
+#endif
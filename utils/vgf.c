@@ -0,0 +1,157 @@
+#include <string.h>
+#include "vgf.h"
+#include "vassert.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define VGF_X86
+#include <immintrin.h>
+#endif
+
+static uint8_t gf_exp[512];
+static uint8_t gf_log[256];
+static uint8_t gf_mul_tbl[256][256];
+
+/*
+ * Products of c with low and high nibbles of a byte. c*x is the xor of
+ * the two, which is what pshufb looks up 16 or 32 bytes at a time.
+ */
+static uint8_t gf_nib_lo[256][16];
+static uint8_t gf_nib_hi[256][16];
+
+static void (*gf_mul_add_region)(uint8_t*, const uint8_t*, uint8_t, int) = NULL;
+
+static
+void _aux_mul_add_c(uint8_t* dst, const uint8_t* src, uint8_t c, int len)
+{
+    const uint8_t* row = gf_mul_tbl[c];
+    int i = 0;
+
+    for (i = 0; i < len; i++) {
+        dst[i] ^= row[src[i]];
+    }
+    return ;
+}
+
+#if defined(VGF_X86)
+__attribute__((target("ssse3")))
+static
+void _aux_mul_add_ssse3(uint8_t* dst, const uint8_t* src, uint8_t c, int len)
+{
+    __m128i lo = _mm_loadu_si128((const __m128i*)gf_nib_lo[c]);
+    __m128i hi = _mm_loadu_si128((const __m128i*)gf_nib_hi[c]);
+    __m128i mask = _mm_set1_epi8(0x0f);
+    int i = 0;
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i s = _mm_loadu_si128((const __m128i*)(src + i));
+        __m128i d = _mm_loadu_si128((const __m128i*)(dst + i));
+        __m128i pl = _mm_shuffle_epi8(lo, _mm_and_si128(s, mask));
+        __m128i ph = _mm_shuffle_epi8(hi, _mm_and_si128(_mm_srli_epi64(s, 4), mask));
+        d = _mm_xor_si128(d, _mm_xor_si128(pl, ph));
+        _mm_storeu_si128((__m128i*)(dst + i), d);
+    }
+    _aux_mul_add_c(dst + i, src + i, c, len - i);
+    return ;
+}
+
+__attribute__((target("avx2")))
+static
+void _aux_mul_add_avx2(uint8_t* dst, const uint8_t* src, uint8_t c, int len)
+{
+    __m256i lo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)gf_nib_lo[c]));
+    __m256i hi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)gf_nib_hi[c]));
+    __m256i mask = _mm256_set1_epi8(0x0f);
+    int i = 0;
+
+    for (; i + 32 <= len; i += 32) {
+        __m256i s = _mm256_loadu_si256((const __m256i*)(src + i));
+        __m256i d = _mm256_loadu_si256((const __m256i*)(dst + i));
+        __m256i pl = _mm256_shuffle_epi8(lo, _mm256_and_si256(s, mask));
+        __m256i ph = _mm256_shuffle_epi8(hi, _mm256_and_si256(_mm256_srli_epi64(s, 4), mask));
+        d = _mm256_xor_si256(d, _mm256_xor_si256(pl, ph));
+        _mm256_storeu_si256((__m256i*)(dst + i), d);
+    }
+    _aux_mul_add_c(dst + i, src + i, c, len - i);
+    return ;
+}
+#endif
+
+static
+uint8_t _aux_mul_slow(uint8_t a, uint8_t b)
+{
+    if (!a || !b) {
+        return 0;
+    }
+    return gf_exp[gf_log[a] + gf_log[b]];
+}
+
+void vgf_init(void)
+{
+    int x = 1;
+    int i = 0;
+    int j = 0;
+
+    if (gf_mul_add_region) {
+        return ;
+    }
+
+    for (i = 0; i < 255; i++) {
+        gf_exp[i] = (uint8_t)x;
+        gf_log[x] = (uint8_t)i;
+        x <<= 1;
+        if (x & 0x100) {
+            x ^= 0x11d;
+        }
+    }
+    for (i = 255; i < 512; i++) {
+        gf_exp[i] = gf_exp[i - 255];
+    }
+
+    for (i = 0; i < 256; i++) {
+        for (j = 0; j < 256; j++) {
+            gf_mul_tbl[i][j] = _aux_mul_slow((uint8_t)i, (uint8_t)j);
+        }
+        for (j = 0; j < 16; j++) {
+            gf_nib_lo[i][j] = gf_mul_tbl[i][j];
+            gf_nib_hi[i][j] = gf_mul_tbl[i][j << 4];
+        }
+    }
+
+    gf_mul_add_region = _aux_mul_add_c;
+#if defined(VGF_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        gf_mul_add_region = _aux_mul_add_avx2;
+    } else if (__builtin_cpu_supports("ssse3")) {
+        gf_mul_add_region = _aux_mul_add_ssse3;
+    }
+#endif
+    return ;
+}
+
+uint8_t vgf_mul(uint8_t a, uint8_t b)
+{
+    return gf_mul_tbl[a][b];
+}
+
+uint8_t vgf_inv(uint8_t a)
+{
+    vassert(a);
+    return gf_exp[255 - gf_log[a]];
+}
+
+/*
+ * dst ^= c * src
+ */
+void vgf_mul_add(uint8_t* dst, const uint8_t* src, uint8_t c, int len)
+{
+    vassert(dst);
+    vassert(src);
+    vassert(gf_mul_add_region);
+
+    if (!c || len <= 0) {
+        return ;
+    }
+    gf_mul_add_region(dst, src, c, len);
+    return ;
+}
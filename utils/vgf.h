@@ -0,0 +1,16 @@
+#ifndef __VGF_H__
+#define __VGF_H__
+
+#include <stdint.h>
+
+/*
+ * GF(2^8) arithmetic over polynomial 0x11d, for erasure coding.
+ * vgf_init() must be called once before use, it builds the tables and
+ * picks the fastest region routine the cpu supports.
+ */
+void    vgf_init   (void);
+uint8_t vgf_mul    (uint8_t, uint8_t);
+uint8_t vgf_inv    (uint8_t);
+void    vgf_mul_add(uint8_t* dst, const uint8_t* src, uint8_t c, int len);
+
+#endif
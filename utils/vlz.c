@@ -0,0 +1,257 @@
+#include <stdlib.h>
+#include <string.h>
+#include "vlz.h"
+#include "vassert.h"
+
+#define VLZ_MIN_MATCH   4
+#define VLZ_MAX_DIST    65535
+
+static
+uint32_t _aux_hash4(const uint8_t* p)
+{
+    uint32_t v = 0;
+
+    memcpy(&v, p, sizeof(v));
+    return (v * 2654435761u) >> (32 - VLZ_HASH_BITS);
+}
+
+int vlz_dict_init(struct vlz_dict* dict, const void* data, int len)
+{
+    int i = 0;
+
+    vassert(dict);
+    vassert(data);
+
+    if (len <= 0 || len > VLZ_MAX_DICT) {
+        return -1;
+    }
+
+    dict->data = (uint8_t*)malloc(len);
+    if (!dict->data) {
+        return -1;
+    }
+    memcpy(dict->data, data, len);
+    dict->len = len;
+
+    memset(dict->tbl, 0, sizeof(dict->tbl));
+    for (i = 0; i + VLZ_MIN_MATCH <= len; i++) {
+        dict->tbl[_aux_hash4(dict->data + i)] = (uint32_t)i + 1;
+    }
+    return 0;
+}
+
+void vlz_dict_deinit(struct vlz_dict* dict)
+{
+    vassert(dict);
+
+    free(dict->data);
+    dict->data = NULL;
+    dict->len = 0;
+}
+
+static
+int _aux_put_len(uint8_t** op, uint8_t* oend, int n)
+{
+    for (; n >= 255; n -= 255) {
+        if (*op >= oend) {
+            return -1;
+        }
+        *(*op)++ = 255;
+    }
+    if (*op >= oend) {
+        return -1;
+    }
+    *(*op)++ = (uint8_t)n;
+    return 0;
+}
+
+/*
+ * Emit literals and, unless ml is 0, the match following them.
+ */
+static
+int _aux_put_seq(uint8_t** op, uint8_t* oend, const uint8_t* lit, int nlit, int dist, int ml)
+{
+    uint8_t* token = *op;
+    int mcode = ml ? ml - VLZ_MIN_MATCH : 0;
+
+    if (*op >= oend) {
+        return -1;
+    }
+    (*op)++;
+    *token = (uint8_t)(((nlit < 15 ? nlit : 15) << 4) | (mcode < 15 ? mcode : 15));
+    if (nlit >= 15 && _aux_put_len(op, oend, nlit - 15) < 0) {
+        return -1;
+    }
+    if (oend - *op < nlit) {
+        return -1;
+    }
+    memcpy(*op, lit, nlit);
+    *op += nlit;
+
+    if (!ml) {
+        return 0;
+    }
+    if (oend - *op < 2) {
+        return -1;
+    }
+    *(*op)++ = (uint8_t)(dist & 0xff);
+    *(*op)++ = (uint8_t)(dist >> 8);
+    if (mcode >= 15 && _aux_put_len(op, oend, mcode - 15) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Returns compressed length, or -1 if it does not fit in cap.
+ */
+int vlz_compress(void* dst, int cap, const void* src, int len, const struct vlz_dict* dict)
+{
+    uint32_t tbl[1 << VLZ_HASH_BITS];
+    const uint8_t* in = (const uint8_t*)src;
+    const uint8_t* m = NULL;
+    uint8_t* op = (uint8_t*)dst;
+    uint8_t* oend = op + cap;
+    uint32_t dlen = dict ? (uint32_t)dict->len : 0;
+    uint32_t cand = 0;
+    uint32_t h = 0;
+    int anchor = 0;
+    int limit = 0;
+    int dist = 0;
+    int ml = 0;
+    int i = 0;
+
+    vassert(dst);
+    vassert(src);
+
+    //Table holds position + 1 in dict followed by input, 0 for none
+    if (dict) {
+        memcpy(tbl, dict->tbl, sizeof(tbl));
+    } else {
+        memset(tbl, 0, sizeof(tbl));
+    }
+
+    while (i + VLZ_MIN_MATCH <= len) {
+        h = _aux_hash4(in + i);
+        cand = tbl[h];
+        tbl[h] = dlen + (uint32_t)i + 1;
+        if (!cand) {
+            i++;
+            continue;
+        }
+        cand--;
+        dist = (int)(dlen + (uint32_t)i - cand);
+        if (dist > VLZ_MAX_DIST) {
+            i++;
+            continue;
+        }
+
+        limit = len - i;
+        if (cand < dlen) {
+            m = dict->data + cand;
+            if (limit > (int)(dlen - cand)) {
+                limit = (int)(dlen - cand);
+            }
+        } else {
+            m = in + (cand - dlen);
+        }
+        for (ml = 0; (ml < limit) && (m[ml] == in[i + ml]); ml++);
+        if (ml < VLZ_MIN_MATCH) {
+            i++;
+            continue;
+        }
+
+        if (_aux_put_seq(&op, oend, in + anchor, i - anchor, dist, ml) < 0) {
+            return -1;
+        }
+        i += ml;
+        anchor = i;
+    }
+
+    if (_aux_put_seq(&op, oend, in + anchor, len - anchor, 0, 0) < 0) {
+        return -1;
+    }
+    return (int)(op - (uint8_t*)dst);
+}
+
+static
+int _aux_get_len(const uint8_t** ip, const uint8_t* iend, int* n)
+{
+    uint8_t b = 0;
+
+    do {
+        if (*ip >= iend) {
+            return -1;
+        }
+        b = *(*ip)++;
+        *n += b;
+    } while (b == 255);
+    return 0;
+}
+
+/*
+ * Returns decompressed length, or -1 on malformed input or if output
+ * exceeds cap.
+ */
+int vlz_decompress(void* dst, int cap, const void* src, int len, const struct vlz_dict* dict)
+{
+    const uint8_t* ip = (const uint8_t*)src;
+    const uint8_t* iend = ip + len;
+    uint8_t* out = (uint8_t*)dst;
+    int dlen = dict ? dict->len : 0;
+    int pos = 0;
+    int nlit = 0;
+    int dist = 0;
+    int ml = 0;
+    int n = 0;
+    uint8_t token = 0;
+
+    vassert(dst);
+    vassert(src);
+
+    while (ip < iend) {
+        token = *ip++;
+        nlit = token >> 4;
+        if (nlit == 15 && _aux_get_len(&ip, iend, &nlit) < 0) {
+            return -1;
+        }
+        if ((iend - ip < nlit) || (cap - pos < nlit)) {
+            return -1;
+        }
+        memcpy(out + pos, ip, nlit);
+        ip  += nlit;
+        pos += nlit;
+        if (ip == iend) {
+            break;
+        }
+
+        if (iend - ip < 2) {
+            return -1;
+        }
+        dist = ip[0] | (ip[1] << 8);
+        ip += 2;
+        ml = token & 0x0f;
+        if (ml == 15 && _aux_get_len(&ip, iend, &ml) < 0) {
+            return -1;
+        }
+        ml += VLZ_MIN_MATCH;
+        if ((dist == 0) || (dist > pos + dlen) || (cap - pos < ml)) {
+            return -1;
+        }
+
+        if (dist > pos) {
+            //Starts in dict, may run on into output
+            n = dist - pos;
+            if (n > ml) {
+                n = ml;
+            }
+            memcpy(out + pos, dict->data + dlen - (dist - pos), n);
+            pos += n;
+            ml  -= n;
+        }
+        for (; ml > 0; ml--, pos++) {
+            out[pos] = out[pos - dist];
+        }
+    }
+    return pos;
+}
@@ -0,0 +1,25 @@
+#ifndef __VLZ_H__
+#define __VLZ_H__
+
+#include <stdint.h>
+
+/*
+ * Byte oriented LZ77 in the style of LZ4 blocks, tuned for pkt sized
+ * inputs. Each block stands alone, optionally referring back into a
+ * preset dictionary both ends hold.
+ */
+#define VLZ_HASH_BITS   12
+#define VLZ_MAX_DICT    65535
+
+struct vlz_dict {
+    uint8_t* data;
+    int      len;
+    uint32_t tbl[1 << VLZ_HASH_BITS];   /* latest dict position + 1 of each hash */
+};
+
+int  vlz_dict_init  (struct vlz_dict*, const void* data, int len);
+void vlz_dict_deinit(struct vlz_dict*);
+int  vlz_compress   (void* dst, int cap, const void* src, int len, const struct vlz_dict*);
+int  vlz_decompress (void* dst, int cap, const void* src, int len, const struct vlz_dict*);
+
+#endif
@@ -1,4 +1,6 @@
 #include <string.h>
+#include <errno.h>
+#include <time.h>
 #include "vsys.h"
 #include "vassert.h"
 #if defined(__WIN32__)
@@ -6,6 +8,7 @@
 #else
 #include <pthread.h>
 #include <sys/time.h>
+#include <unistd.h>
 #endif
 
 /*
@@ -120,6 +123,39 @@ int vcond_timedwait(struct vcond* cond, struct vlock* lock, int secs)
 #endif
 }
 
+/*
+ * wait on condition for at most @msecs milliseconds, or forever if @msecs
+ * is negative. Unlike vcond_wait, pending signals are not counted, so the
+ * caller must check its own predicate around it.
+ */
+int vcond_mtimedwait(struct vcond* cond, struct vlock* lock, int msecs)
+{
+    vassert(cond);
+    vassert(lock);
+
+#if defined(__WIN32__)
+    //todo;
+    return 0;
+#else
+    struct timespec timeout;
+    struct timeval now;
+
+    if (msecs < 0) {
+        return pthread_cond_wait(&cond->cond, &lock->mutex);
+    }
+
+    gettimeofday(&now, NULL);
+    timeout.tv_sec  = now.tv_sec + msecs / 1000;
+    timeout.tv_nsec = now.tv_usec * 1000 + (msecs % 1000) * 1000000;
+    if (timeout.tv_nsec >= 1000000000) {
+        timeout.tv_sec++;
+        timeout.tv_nsec -= 1000000000;
+    }
+
+    return pthread_cond_timedwait(&cond->cond, &lock->mutex, &timeout);
+#endif
+}
+
 int vcond_signal(struct vcond* cond)
 {
 #if defined(__WIN32__)
@@ -141,6 +177,30 @@ int vcond_signal(struct vcond* cond)
     return 0;
 }
 
+/*
+ * wake all waiters, meant for those in vcond_mtimedwait checking their
+ * own predicate.
+ */
+int vcond_broadcast(struct vcond* cond)
+{
+#if defined(__WIN32__)
+    DWORD res = 0;
+#else
+    int res = 0;
+#endif
+
+    vassert(cond);
+
+#if defined(__WIN32__)
+    res = SetEvent(cond->event);
+    retE((res == 0), -1);
+#else
+    res = pthread_cond_broadcast(&cond->cond);
+    retE((res < 0), -1);
+#endif
+    return 0;
+}
+
 void vcond_deinit(struct vcond* cond)
 {
     vassert(cond);
@@ -523,3 +583,38 @@ void vtimer_deinit(struct vtimer* timer)
 #endif
 }
 
+
+/*
+ * monotonic time in microseconds.
+ */
+uint64_t vtime_us(void)
+{
+#if defined(__WIN32__)
+    return (uint64_t)GetTickCount64() * 1000;
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+/*
+ * sleep until monotonic time @ts (in microseconds) is reached.
+ */
+void vsleep_until_us(uint64_t ts)
+{
+#if defined(__WIN32__) || defined(__APPLE__)
+    uint64_t now = vtime_us();
+
+    if (ts > now) {
+        usleep((useconds_t)(ts - now));
+    }
+#else
+    struct timespec tmo;
+
+    tmo.tv_sec  = ts / 1000000;
+    tmo.tv_nsec = (ts % 1000000) * 1000;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &tmo, NULL) == EINTR);
+#endif
+}
@@ -61,7 +61,9 @@ struct vcond {
 extern int  vcond_init  (struct vcond*);
 extern int  vcond_wait  (struct vcond*, struct vlock*);
 extern int vcond_timedwait(struct vcond*, struct vlock*, int);
+extern int vcond_mtimedwait(struct vcond*, struct vlock*, int);
 extern int  vcond_signal(struct vcond*);
+extern int  vcond_broadcast(struct vcond*);
 extern void vcond_deinit(struct vcond*);
 
 /*
@@ -120,5 +122,12 @@ int  vtimer_restart(struct vtimer*, int, int);
 int  vtimer_stop   (struct vtimer*);
 void vtimer_deinit (struct vtimer*);
 
+/*
+ * vtime
+ */
+#include <stdint.h>
+uint64_t vtime_us(void);
+void vsleep_until_us(uint64_t ts);
+
 #endif
 